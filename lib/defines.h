@@ -97,6 +97,24 @@ static inline void show_stackframe(){}
 #define INPUT_TIMEOUT STATS_DELAY
 #endif
 
+/// The maximum amount of pages a VoD input buffers ahead of each viewer
+#ifndef INPUT_READAHEAD_MAX
+#define INPUT_READAHEAD_MAX 4
+#endif
+
+/// Inputs serving many VoD streams from one shared process: the socket new streams are handed over on,
+/// and the most streams one process hosts.
+#define INPUT_SHARED_SOCKET "MstIn%s.sock" //%s input name
+#define INPUT_SHARED_MAX 1024
+
+/// Header generation for VoD files: the most threads scanning parts of a file at once,
+/// the smallest part worth a thread of its own, and how much a thread reads from the file at a time.
+#ifndef INPUT_HEADER_THREADS
+#define INPUT_HEADER_THREADS 8
+#endif
+#define INPUT_HEADER_RANGE_MIN 32 * 1024 * 1024
+#define INPUT_HEADER_READ_SIZE 4 * 1024 * 1024
+
 /// The size used for stream headers for live streams
 #define DEFAULT_STRM_PAGE_SIZE 16 * 1024 * 1024
 
@@ -114,6 +132,19 @@ static inline void show_stackframe(){}
 /// Does not affect live streams.
 #define FLIP_MIN_DURATION 20000
 
+/// Bounds for data pages sized from the bit rate of a track.
+/// Tracks with a known bit rate get pages holding about FLIP_TARGET_DURATION of data, within these bounds.
+#define MIN_DATA_PAGE_SIZE 2 * 1024 * 1024
+#define MAX_DATA_PAGE_SIZE 64 * 1024 * 1024
+#define DATA_PAGE_CACHE_SIZE 16 ///< Amount of recently used data pages an output keeps mapped.
+
+/// Size classes of the per-process pool backing DTSC::Packet buffers: powers of two, starting at PACKET_POOL_MIN bytes.
+/// Larger packets are allocated and freed directly.
+#define PACKET_POOL_MIN 512
+#define PACKET_POOL_CLASSES 14
+/// The amount of memory each size class of the packet pool may keep around for reuse.
+#define PACKET_POOL_CLASS_BYTES 8 * 1024 * 1024
+
 #define SHM_STREAM_INDEX "MstSTRM%s" //%s stream name
 #define SHM_STREAM_STATE "MstSTATE%s" //%s stream name
 #define STRMSTAT_OFF 0
@@ -125,15 +156,23 @@ static inline void show_stackframe(){}
 #define STRMSTAT_INVALID 255
 #define SHM_TRACK_META "MstTRAK%s@%lu" //%s stream name, %lu track ID
 #define SHM_TRACK_INDEX "MstTRID%s@%lu" //%s stream name, %lu track ID
-#define SHM_TRACK_INDEX_SIZE 8192
+#define SHM_TRACK_INDEX_SIZE 512 * 1024
 #define SHM_TRACK_DATA "MstDATA%s@%lu_%lu" //%s stream name, %lu track ID, %lu page #
 #define SHM_STATISTICS "MstSTAT"
 #define SHM_USERS "MstUSER%s" //%s stream name
 #define SHM_TRIGGER "MstTRIG%s" //%s trigger name
-#define SEM_LIVE "/MstLIVE%s" //%s stream name
+#define SHM_STREAM_LOCK "MstLOCK%s" //%s stream name
 #define SEM_INPUT "/MstInpt%s" //%s stream name
 #define SEM_CONF "/MstConfLock"
 #define SHM_CONF "MstConf"
+#define SHM_CONF_INDEX "MstConfIdx"
+#define CONF_INDEX_BUCKETS 16384 ///< Hash table slots in the config index; must be a power of two.
+#define CONF_INDEX_STREAM 's' ///< Config index entry for streams.<name>
+#define CONF_INDEX_CONNECTOR 'c' ///< Config index entry for capabilities.connectors.<name>
+#define CONF_INDEX_PROTOCOL 'p' ///< Config index entry for the first config.protocols entry using connector <name>
+#define SHM_PAGE_ACCOUNTING "MstPageAcct"
+#define PAGE_ACCOUNTING_ENTRIES 8192 ///< Amount of data pages the server-wide page accounting can hold.
+#define PAGE_ACCOUNTING_IDLE 2000 ///< Milliseconds a VoD data page must go without viewers before it may be evicted.
 #define NAME_BUFFER_SIZE 200    //char buffer size for snprintf'ing shm filenames
 
 #define SIMUL_TRACKS 20
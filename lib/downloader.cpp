@@ -1,6 +1,7 @@
 #include "downloader.h"
 #include "defines.h"
 #include "timing.h"
+#include <poll.h>
 
 namespace HTTP{
 
@@ -300,5 +301,459 @@ namespace HTTP{
     return false;
   }
 
-}// namespace HTTP
+  DownloadPool::DownloadPool(uint32_t maxConnsPerHost, uint32_t maxPipeline){
+    maxConns = maxConnsPerHost ? maxConnsPerHost : 1;
+    maxPipe = maxPipeline ? maxPipeline : 1;
+    timeout = 5000;
+    idleTime = 30000;
+    nextId = 1;
+    proxied = false;
+    char *p = getenv("http_proxy");
+    if (p){
+      proxyUrl = HTTP::URL(p);
+      proxied = true;
+    }
+  }
+
+  /// Closes all pooled connections. Requests that have not completed are dropped silently.
+  DownloadPool::~DownloadPool(){
+    for (std::map<std::string, std::deque<PooledConnection> >::iterator it = connections.begin(); it != connections.end(); ++it){
+      for (std::deque<PooledConnection>::iterator cIt = it->second.begin(); cIt != it->second.end(); ++cIt){
+        closeConnection(*cIt);
+      }
+    }
+  }
+
+  /// Sets an extra (or overridden) header to be sent with all outgoing requests.
+  void DownloadPool::setHeader(const std::string &name, const std::string &val){
+    extraHeaders[name] = val;
+  }
+
+  /// Clears all extra/override headers for outgoing requests.
+  void DownloadPool::clearHeaders(){extraHeaders.clear();}
+
+  /// Queues a GET request for the given URL. Returns the request ID, or 0 if it cannot be requested.
+  uint64_t DownloadPool::get(const HTTP::URL &link, downloadCallback cb, void *userData){
+    return request(link, "GET", "", cb, userData);
+  }
+
+  /// Queues a POST request for the given URL. Returns the request ID, or 0 if it cannot be requested.
+  uint64_t DownloadPool::post(const HTTP::URL &link, const std::string &payload, downloadCallback cb, void *userData){
+    return request(link, "POST", payload, cb, userData);
+  }
+
+  /// Queues a request for the given URL, does no waiting.
+  /// The request is sent by the next call to poll() that has a connection available for it.
+  /// Returns the request ID, or 0 if the URL cannot be requested.
+  uint64_t DownloadPool::request(const HTTP::URL &link, const std::string &method, const std::string &body, downloadCallback cb, void *userData){
+    if (!link.host.size()){return 0;}
+    if (link.protocol != "http" && link.protocol != "https"){
+      FAIL_MSG("Protocol not supported: %s", link.protocol.c_str());
+      return 0;
+    }
+#ifndef SSL
+    if (link.protocol == "https"){
+      FAIL_MSG("Protocol not supported: %s", link.protocol.c_str());
+      return 0;
+    }
+#endif
+    uint64_t id = nextId++;
+    DownloadRequest &req = requests[id];
+    req.link = link;
+    req.method = method;
+    req.body = body;
+    req.callback = cb;
+    req.userData = userData;
+    queued[hostKey(link)].push_back(id);
+    return id;
+  }
+
+  /// Returns the amount of requests that have not completed yet.
+  size_t DownloadPool::pending() const{return requests.size();}
 
+  /// Returns the key under which connections for the given URL are pooled.
+  /// Plain HTTP through a proxy is pooled per proxy, everything else per protocol/host/port.
+  std::string DownloadPool::hostKey(const HTTP::URL &link) const{
+    std::stringstream key;
+    if (proxied && link.protocol != "https"){
+      key << "proxy://" << proxyUrl.host << ":" << proxyUrl.getPort();
+    }else{
+      key << link.protocol << "://" << link.host << ":" << link.getPort();
+    }
+    return key.str();
+  }
+
+  /// Starts connecting conn to the host of the given URL, or to the proxy for plain HTTP, without waiting for it.
+  /// Host names are resolved only once per host key. The connect and SSL handshake are finished by poll().
+  bool DownloadPool::connectTo(PooledConnection &conn, const HTTP::URL &link){
+    closeConnection(conn);
+    conn.H.Clean();
+    conn.inFlight.clear();
+    conn.sendBuf.clear();
+    conn.wantWrite = false;
+    conn.closeAfter = false;
+    conn.lastActive = Util::bootMS();
+    conn.sslHost.clear();
+    std::string key = hostKey(link);
+    std::deque<std::string> &addrs = addresses[key];
+    if (!addrs.size()){
+      bool viaProxy = (proxied && link.protocol != "https");
+      if (!Socket::resolveTCP(viaProxy ? proxyUrl.host : link.host, viaProxy ? proxyUrl.getPort() : link.getPort(), addrs)){
+        return false;
+      }
+    }
+    int s = Socket::connectStart(addrs.front());
+    if (s < 0){
+      //Try the next address next time
+      addrs.push_back(addrs.front());
+      addrs.pop_front();
+      return false;
+    }
+    conn.sock = new Socket::Connection(s);
+    conn.state = POOL_CONNECTING;
+#ifdef SSL
+    if (link.protocol == "https"){conn.sslHost = link.host;}
+#endif
+    return true;
+  }
+
+  /// Continues the connect and SSL handshake of conn as far as possible without blocking.
+  void DownloadPool::advanceConnect(const std::string &key, PooledConnection &conn){
+    if (conn.state == POOL_CONNECTING){
+      int err = Socket::connectResult(conn.sock->getSocket());
+      if (err == EINPROGRESS){return;}
+      if (err){
+        WARN_MSG("Could not connect to %s: %s", key.c_str(), strerror(err));
+        connectFailed(key, conn);
+        return;
+      }
+      conn.lastActive = Util::bootMS();
+      conn.state = POOL_READY;
+#ifdef SSL
+      if (conn.sslHost.size()){
+        //The SSL connection takes over the socket
+        int s = conn.sock->getSocket();
+        delete conn.sock;
+        conn.sock = new Socket::SSLConnection(s, conn.sslHost);
+        conn.state = POOL_HANDSHAKE;
+      }
+#endif
+    }
+#ifdef SSL
+    if (conn.state == POOL_HANDSHAKE){
+      int ret = ((Socket::SSLConnection *)conn.sock)->handshake();
+      if (ret < 0){
+        connectFailed(key, conn);
+        return;
+      }
+      conn.wantWrite = (ret == 2);
+      if (ret != 1){return;}
+      conn.lastActive = Util::bootMS();
+      conn.state = POOL_READY;
+    }
+#endif
+    if (conn.state == POOL_READY){MEDIUM_MSG("Opened pooled connection to %s", key.c_str());}
+  }
+
+  /// Closes a connection that could not be set up, so the next one tries the next address.
+  /// The first request waiting for the host is failed once it could not get a connection 5 times.
+  void DownloadPool::connectFailed(const std::string &key, PooledConnection &conn){
+    closeConnection(conn);
+    std::deque<std::string> &addrs = addresses[key];
+    if (addrs.size()){
+      addrs.push_back(addrs.front());
+      addrs.pop_front();
+    }
+    if (!queued[key].size()){return;}
+    uint64_t reqId = queued[key].front();
+    DownloadRequest &req = requests[reqId];
+    if (++req.attempts >= 5){
+      FAIL_MSG("Could not connect to %s", req.link.getUrl().c_str());
+      queued[key].pop_front();
+      Parser empty;
+      finishRequest(reqId, empty, false);
+    }
+  }
+
+  /// Closes and frees the socket of the given connection, if any.
+  void DownloadPool::closeConnection(PooledConnection &conn){
+    if (!conn.sock){return;}
+    conn.sock->close();
+    delete conn.sock;
+    conn.sock = 0;
+    conn.state = POOL_CONNECTING;
+    conn.wantWrite = false;
+    conn.sendBuf.clear();
+  }
+
+  /// Queues the request with the given ID on the given connection, writes what the socket takes right away,
+  /// and registers the request as in flight. The rest is written by poll() as the socket accepts it.
+  bool DownloadPool::sendRequest(PooledConnection &conn, uint64_t reqId){
+    DownloadRequest &req = requests[reqId];
+    Parser P;
+    P.Clean();
+    P.method = req.method;
+    if (proxied && req.link.protocol != "https"){
+      P.url = req.link.getProxyUrl();
+    }else{
+      P.url = "/" + req.link.path;
+      if (req.link.args.size()){P.url += "?" + req.link.args;}
+    }
+    if (req.link.port.size()){
+      P.SetHeader("Host", req.link.host + ":" + req.link.port);
+    }else{
+      P.SetHeader("Host", req.link.host);
+    }
+    P.SetHeader("User-Agent", "MistServer " PACKAGE_VERSION);
+    P.SetHeader("X-Version", PACKAGE_VERSION);
+    P.SetHeader("Accept", "*/*");
+    std::string key = hostKey(req.link);
+    if (authStrs.count(key) && (req.link.user.size() || req.link.pass.size())){
+      P.auth(req.link.user, req.link.pass, authStrs[key]);
+    }
+    for (std::map<std::string, std::string>::iterator it = extraHeaders.begin(); it != extraHeaders.end(); ++it){
+      P.SetHeader(it->first, it->second);
+    }
+    ++req.attempts;
+    VERYHIGH_MSG("Requesting %s (attempt %u)", req.link.getUrl().c_str(), req.attempts);
+    if (req.body.size()){P.SetHeader("Content-Length", req.body.size());}
+    P.body = req.body;
+    conn.sendBuf += P.BuildRequest();
+    conn.inFlight.push_back(reqId);
+    conn.lastActive = Util::bootMS();
+    if (!flushSend(conn)){
+      conn.inFlight.pop_back();
+      return false;
+    }
+    return true;
+  }
+
+  /// Writes as much of the queued request data of the connection as the socket takes without blocking.
+  /// Returns false if the connection died.
+  bool DownloadPool::flushSend(PooledConnection &conn){
+    while (conn.sendBuf.size() && *conn.sock){
+      unsigned int sent = conn.sock->SendSome(conn.sendBuf.data(), conn.sendBuf.size());
+      if (!sent){break;}
+      conn.sendBuf.erase(0, sent);
+      conn.lastActive = Util::bootMS();
+    }
+    return *conn.sock;
+  }
+
+  /// Sends as many queued requests as the connection and pipelining limits allow.
+  /// Only GET and HEAD requests are pipelined; other methods wait for an idle connection.
+  /// New connections are started while there are more waiting requests than connections being set up.
+  void DownloadPool::dispatch(){
+    for (std::map<std::string, std::deque<uint64_t> >::iterator it = queued.begin(); it != queued.end(); ++it){
+      std::deque<PooledConnection> &conns = connections[it->first];
+      size_t connecting = 0;
+      for (std::deque<PooledConnection>::iterator cIt = conns.begin(); cIt != conns.end(); ++cIt){
+        if (cIt->sock && cIt->state != POOL_READY){++connecting;}
+      }
+      while (it->second.size()){
+        uint64_t reqId = it->second.front();
+        DownloadRequest &req = requests[reqId];
+        bool pipelinable = (req.method == "GET" || req.method == "HEAD");
+        PooledConnection *target = 0;
+        for (std::deque<PooledConnection>::iterator cIt = conns.begin(); cIt != conns.end(); ++cIt){
+          if (!cIt->sock || cIt->state != POOL_READY || !*(cIt->sock) || cIt->closeAfter){continue;}
+          if (!cIt->inFlight.size()){
+            target = &*cIt;
+            break;
+          }
+          if (!pipelinable || cIt->inFlight.size() >= maxPipe){continue;}
+          const std::string &lastMethod = requests[cIt->inFlight.back()].method;
+          if (lastMethod != "GET" && lastMethod != "HEAD"){continue;}
+          if (!target || cIt->inFlight.size() < target->inFlight.size()){target = &*cIt;}
+        }
+        //Prefer opening another connection over deepening a pipeline
+        if ((!target || target->inFlight.size()) && conns.size() < maxConns && connecting < it->second.size()){
+          conns.push_back(PooledConnection());
+          if (connectTo(conns.back(), req.link)){
+            ++connecting;
+          }else{
+            conns.pop_back();
+            if (++req.attempts >= 5){
+              FAIL_MSG("Could not connect to %s", req.link.getUrl().c_str());
+              it->second.pop_front();
+              Parser empty;
+              finishRequest(reqId, empty, false);
+              continue;
+            }
+          }
+        }
+        //Wait for a connection to become available
+        if (!target){break;}
+        it->second.pop_front();
+        if (!sendRequest(*target, reqId)){
+          //The connection died under us; retry everything that was on it
+          target->inFlight.push_back(reqId);
+          closeConnection(*target);
+          retryRequests(*target);
+          break;
+        }
+      }
+    }
+  }
+
+  /// Only requests that may safely be sent twice are retried when their connection drops.
+  static bool isRetryable(const std::string &method){
+    return method == "GET" || method == "HEAD" || method == "OPTIONS";
+  }
+
+  /// Puts all requests in flight on the given connection back in the queue, in their original order.
+  /// Requests that were attempted too often, or that are not retryable because the server may
+  /// already have acted on them, are failed instead.
+  void DownloadPool::retryRequests(PooledConnection &conn){
+    while (conn.inFlight.size()){
+      uint64_t reqId = conn.inFlight.back();
+      conn.inFlight.pop_back();
+      DownloadRequest &req = requests[reqId];
+      if (!isRetryable(req.method)){
+        FAIL_MSG("Connection lost during %s request to %s; not retrying", req.method.c_str(), req.link.getUrl().c_str());
+        Parser empty;
+        finishRequest(reqId, empty, false);
+        continue;
+      }
+      if (req.attempts >= 5){
+        FAIL_MSG("Could not retrieve %s", req.link.getUrl().c_str());
+        Parser empty;
+        finishRequest(reqId, empty, false);
+        continue;
+      }
+      queued[hostKey(req.link)].push_front(reqId);
+    }
+    conn.H.Clean();
+  }
+
+  /// Removes the given request from the pool, then calls its callback.
+  void DownloadPool::finishRequest(uint64_t reqId, Parser &response, bool success){
+    if (!requests.count(reqId)){return;}
+    DownloadRequest req = requests[reqId];
+    requests.erase(reqId);
+    if (req.callback){req.callback(req.link, response, success, req.userData);}
+  }
+
+  /// Reads any available data from the given connection, and completes every fully received
+  /// response. Follows redirects and authentication requests by re-queueing the request.
+  void DownloadPool::readFrom(const std::string &key, PooledConnection &conn){
+    if (!conn.sock){return;}
+    flushSend(conn);
+    if (conn.sock->spool()){conn.lastActive = Util::bootMS();}
+    while (conn.inFlight.size() && conn.H.Read(*conn.sock)){
+      uint64_t reqId = conn.inFlight.front();
+      conn.inFlight.pop_front();
+      conn.lastActive = Util::bootMS();
+      if (conn.H.GetHeader("Connection") == "close"){conn.closeAfter = true;}
+      DownloadRequest &req = requests[reqId];
+      uint32_t sCode = atoi(conn.H.url.c_str());
+      if (sCode == 401 && req.redirects && (req.link.user.size() || req.link.pass.size())){
+        std::string authStr = conn.H.GetHeader("WWW-Authenticate");
+        if (!authStr.size()){authStr = conn.H.GetHeader("Www-Authenticate");}
+        if (authStr.size()){
+          INFO_MSG("Authenticating %s...", req.link.getUrl().c_str());
+          authStrs[key] = authStr;
+          --req.redirects;
+          req.attempts = 0;
+          queued[key].push_front(reqId);
+          conn.H.Clean();
+          continue;
+        }
+      }
+      if (sCode >= 300 && sCode < 400 && req.redirects && conn.H.GetHeader("Location").size()){
+        req.link = req.link.link(conn.H.GetHeader("Location"));
+        INFO_MSG("Following redirect to %s", req.link.getUrl().c_str());
+        --req.redirects;
+        req.attempts = 0;
+        if (sCode == 303){
+          req.method = "GET";
+          req.body.clear();
+        }
+        queued[hostKey(req.link)].push_back(reqId);
+        conn.H.Clean();
+        continue;
+      }
+      if (conn.H.hasHeader("Set-Cookie")){
+        std::string cookie = conn.H.GetHeader("Set-Cookie");
+        extraHeaders["Cookie"] = cookie.substr(0, cookie.find(';'));
+      }
+      finishRequest(reqId, conn.H, true);
+      conn.H.Clean();
+    }
+    if (!*conn.sock || (conn.closeAfter && !conn.inFlight.size())){
+      closeConnection(conn);
+      retryRequests(conn);
+    }
+  }
+
+  /// Runs a single iteration of the download engine: sends queued requests, waits at most
+  /// timeoutMs for data on any connection and handles all received responses.
+  /// Returns true while there are requests that have not completed yet.
+  bool DownloadPool::poll(uint32_t timeoutMs){
+    dispatch();
+    std::vector<struct pollfd> fds;
+    for (std::map<std::string, std::deque<PooledConnection> >::iterator it = connections.begin(); it != connections.end(); ++it){
+      for (std::deque<PooledConnection>::iterator cIt = it->second.begin(); cIt != it->second.end(); ++cIt){
+        if (!cIt->sock || (cIt->state == POOL_READY && !cIt->inFlight.size())){continue;}
+        struct pollfd pfd;
+        pfd.fd = cIt->sock->getSocket();
+        //Wait for whatever the connect, the handshake or the queued request data needs
+        if (cIt->state == POOL_CONNECTING){
+          pfd.events = POLLOUT;
+        }else if (cIt->state == POOL_HANDSHAKE){
+          pfd.events = cIt->wantWrite ? POLLOUT : POLLIN;
+        }else{
+          pfd.events = cIt->sendBuf.size() ? (POLLIN | POLLOUT) : POLLIN;
+        }
+        pfd.revents = 0;
+        fds.push_back(pfd);
+      }
+    }
+    if (fds.size() || requests.size()){
+      ::poll(fds.size() ? &fds[0] : 0, fds.size(), timeoutMs);
+    }
+    uint64_t now = Util::bootMS();
+    for (std::map<std::string, std::deque<PooledConnection> >::iterator it = connections.begin(); it != connections.end(); ++it){
+      for (std::deque<PooledConnection>::iterator cIt = it->second.begin(); cIt != it->second.end(); ++cIt){
+        if (!cIt->sock){continue;}
+        if (cIt->state != POOL_READY){
+          advanceConnect(it->first, *cIt);
+          if (cIt->sock && cIt->state != POOL_READY && now > cIt->lastActive + timeout){
+            WARN_MSG("Timeout connecting to %s", it->first.c_str());
+            connectFailed(it->first, *cIt);
+          }
+        }else if (cIt->inFlight.size()){
+          readFrom(it->first, *cIt);
+          if (cIt->sock && cIt->inFlight.size() && now > cIt->lastActive + timeout){
+            WARN_MSG("Timeout on connection to %s, %lu request(s) in flight", it->first.c_str(), (unsigned long)cIt->inFlight.size());
+            closeConnection(*cIt);
+            retryRequests(*cIt);
+          }
+        }else if (now > cIt->lastActive + idleTime){
+          closeConnection(*cIt);
+        }
+      }
+      //Clean up closed connections
+      std::deque<PooledConnection>::iterator cIt = it->second.begin();
+      while (cIt != it->second.end()){
+        if (!cIt->sock){
+          cIt = it->second.erase(cIt);
+        }else{
+          ++cIt;
+        }
+      }
+    }
+    return requests.size();
+  }
+
+  /// Calls poll() until all requests have completed, or maxWaitMs has passed (if non-zero).
+  /// Returns true if all requests completed.
+  bool DownloadPool::run(uint32_t maxWaitMs){
+    uint64_t stopTime = Util::bootMS() + maxWaitMs;
+    while (poll()){
+      if (maxWaitMs && Util::bootMS() > stopTime){return false;}
+    }
+    return true;
+  }
+
+}// namespace HTTP
@@ -1,5 +1,8 @@
+#pragma once
 #include "http_parser.h"
 #include "socket.h"
+#include <deque>
+#include <map>
 
 namespace HTTP{
   class Downloader{
@@ -38,5 +41,91 @@ namespace HTTP{
     bool proxied;             ///< True if proxy server is configured.
     HTTP::URL proxyUrl;       ///< Set to the URL of the configured proxy.
   };
+
+  /// Callback type for DownloadPool requests.
+  /// Called exactly once per request, with the final (post-redirect) URL, the parsed response and
+  /// whether the request succeeded. The response reference is only valid during the call.
+  typedef void (*downloadCallback)(const HTTP::URL &link, Parser &response, bool success, void *userData);
+
+  /// Holds the state of a single request queued in or handled by a DownloadPool.
+  struct DownloadRequest{
+    DownloadRequest() : callback(0), userData(0), attempts(0), redirects(6){}
+    HTTP::URL link;           ///< Current URL of the request, updated on redirects.
+    std::string method;       ///< HTTP method to use.
+    std::string body;         ///< Request body, if any.
+    downloadCallback callback;///< Called upon completion or failure.
+    void *userData;           ///< Passed as-is to the callback.
+    uint8_t attempts;         ///< Amount of times this request was (re)sent.
+    uint8_t redirects;        ///< Amount of redirects/authentications we may still follow.
+  };
+
+  /// Connection states of a PooledConnection.
+  enum poolConnState{
+    POOL_CONNECTING, ///< TCP connect in progress.
+    POOL_HANDSHAKE,  ///< SSL handshake in progress.
+    POOL_READY       ///< Requests may be sent.
+  };
+
+  /// A single keep-alive connection owned by a DownloadPool.
+  /// Requests sent over it are answered in order, so they are kept in a queue.
+  struct PooledConnection{
+    PooledConnection() : sock(0), state(POOL_CONNECTING), wantWrite(false), lastActive(0), closeAfter(false){}
+    Socket::Connection *sock;      ///< The actual (SSL or plain) socket.
+    poolConnState state;           ///< Whether the connection is still being set up.
+    bool wantWrite;                ///< Set while the SSL handshake waits for the socket to accept data.
+    std::string sendBuf;           ///< Request bytes not yet written to the socket.
+    std::string sslHost;           ///< Host name to do the SSL handshake for, if any.
+    Parser H;                      ///< Parser for the response currently coming in.
+    std::deque<uint64_t> inFlight; ///< IDs of requests sent but not yet answered, in order.
+    uint64_t lastActive;           ///< Last time (ms) anything was sent or received.
+    bool closeAfter;               ///< Set when the server indicated it will close after this response.
+  };
+
+  /// Non-blocking downloader engine with a per-host pool of keep-alive connections.
+  /// Any amount of requests may be queued at once; they are spread over at most maxConnsPerHost
+  /// connections per host, with up to maxPipeline GET requests in flight on each connection.
+  /// All sockets are driven from a single poll loop by calling poll() (or run()) repeatedly.
+  /// Connects and SSL handshakes never block; host names are resolved once per host.
+  /// Requests other than GET, HEAD and OPTIONS are failed instead of retried when their connection drops.
+  class DownloadPool{
+  public:
+    DownloadPool(uint32_t maxConnsPerHost = 4, uint32_t maxPipeline = 4);
+    ~DownloadPool();
+    uint64_t get(const HTTP::URL &link, downloadCallback cb, void *userData = 0);
+    uint64_t post(const HTTP::URL &link, const std::string &payload, downloadCallback cb, void *userData = 0);
+    uint64_t request(const HTTP::URL &link, const std::string &method, const std::string &body, downloadCallback cb, void *userData = 0);
+    bool poll(uint32_t timeoutMs = 250);
+    bool run(uint32_t maxWaitMs = 0);
+    size_t pending() const;
+    void setHeader(const std::string &name, const std::string &val);
+    void clearHeaders();
+    uint32_t timeout; ///< Milliseconds without data before an in-flight request is considered failed.
+    uint32_t idleTime;///< Milliseconds an idle keep-alive connection is kept open for reuse.
+
+  private:
+    std::string hostKey(const HTTP::URL &link) const;
+    bool connectTo(PooledConnection &conn, const HTTP::URL &link);
+    void advanceConnect(const std::string &key, PooledConnection &conn);
+    void connectFailed(const std::string &key, PooledConnection &conn);
+    bool sendRequest(PooledConnection &conn, uint64_t reqId);
+    bool flushSend(PooledConnection &conn);
+    void dispatch();
+    void readFrom(const std::string &key, PooledConnection &conn);
+    void finishRequest(uint64_t reqId, Parser &response, bool success);
+    void retryRequests(PooledConnection &conn);
+    void closeConnection(PooledConnection &conn);
+    std::map<std::string, std::string> extraHeaders;                ///< Extra headers sent with every request.
+    std::map<uint64_t, DownloadRequest> requests;                   ///< All requests that have not completed yet.
+    std::map<std::string, std::deque<uint64_t> > queued;            ///< Per host key, requests waiting to be sent.
+    std::map<std::string, std::deque<PooledConnection> > connections;///< Per host key, the pooled connections.
+    std::map<std::string, std::string> authStrs;                    ///< Per host key, last seen WWW-Authenticate.
+    std::map<std::string, std::deque<std::string> > addresses;      ///< Per host key, resolved addresses, next one to try first.
+    uint64_t nextId;        ///< ID given to the next queued request.
+    uint32_t maxConns;      ///< Maximum amount of connections per host.
+    uint32_t maxPipe;       ///< Maximum amount of pipelined requests per connection.
+    bool proxied;           ///< True if proxy server is configured.
+    HTTP::URL proxyUrl;     ///< Set to the URL of the configured proxy.
+  };
+
 }// namespace HTTP
 
@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <string.h> //for memcmp
 #include <arpa/inet.h> //for htonl/ntohl
+#include <sys/mman.h>
+#include <unistd.h>
 char DTSC::Magic_Header[] = "DTSC";
 char DTSC::Magic_Packet[] = "DTPD";
 char DTSC::Magic_Packet2[] = "DTP2";
@@ -13,22 +15,31 @@ char DTSC::Magic_Command[] = "DTCM";
 
 DTSC::File::File() {
   F = 0;
+  mapped = 0;
+  mappedLen = 0;
+  readPos = 0;
   buffer = malloc(4);
   endPos = 0;
 }
 
 DTSC::File::File(const File & rhs) {
   buffer = malloc(4);
+  mapped = 0;
+  mappedLen = 0;
   *this = rhs;
 }
 
 DTSC::File & DTSC::File::operator =(const File & rhs) {
+  unmapFile();
   created = rhs.created;
   if (rhs.F) {
     F = fdopen(dup(fileno(rhs.F)), (created ? "w+b" : "r+b"));
   } else {
     F = 0;
   }
+  if (F && rhs.mapped) {
+    mapFile();
+  }
   endPos = rhs.endPos;
   if (rhs.myPack) {
     myPack = rhs.myPack;
@@ -36,6 +47,7 @@ DTSC::File & DTSC::File::operator =(const File & rhs) {
   metadata = rhs.metadata;
   currtime = rhs.currtime;
   lastreadpos = rhs.lastreadpos;
+  readPos = rhs.readPos;
   headerSize = rhs.headerSize;
   trackMapping = rhs.trackMapping;
   memcpy(buffer, rhs.buffer, 4);
@@ -50,6 +62,9 @@ DTSC::File::operator bool() const {
 /// If create is true and file does not exist, attempt to create.
 DTSC::File::File(std::string filename, bool create) {
   buffer = malloc(8);
+  mapped = 0;
+  mappedLen = 0;
+  readPos = 0;
   if (create) {
     F = fopen(filename.c_str(), "w+b");
     if (!F) {
@@ -72,6 +87,9 @@ DTSC::File::File(std::string filename, bool create) {
   }
   fseek(F, 0, SEEK_END);
   endPos = ftell(F);
+  if (!create) {
+    mapFile();
+  }
 
   bool sepHeader = false;
   if (!create) {
@@ -105,6 +123,9 @@ DTSC::File::File(std::string filename, bool create) {
   if (metadata.moreheader != -1) {
     if (!sepHeader) {
       readHeader(0);
+      if (mapped && !metadata.moreheader && 8 + (long long int)headerSize < mappedLen) {
+        metadata.applyDeltas(mapped + 8 + headerSize, mappedLen - 8 - headerSize);
+      }
       fseek(F, 8 + headerSize, SEEK_SET);
     } else {
       fseek(F, 0, SEEK_SET);
@@ -116,10 +137,94 @@ DTSC::File::File(std::string filename, bool create) {
       metadata = Fhead.metadata;
     }
   }
+  readPos = ftell(F);
   currframe = 0;
 }
 
 
+/// Maps the file as it currently is into memory, for reading packets without copying them.
+/// Data appended later is read through the FILE pointer instead.
+void DTSC::File::mapFile() {
+  fseek(F, 0, SEEK_END);
+  long long int fileLen = ftell(F);
+  if (fileLen <= 0) {
+    return;
+  }
+  void * tmp = mmap(0, fileLen, PROT_READ, MAP_SHARED, fileno(F), 0);
+  if (tmp == MAP_FAILED) {
+    DEBUG_MSG(DLVL_WARN, "Could not map file, falling back to regular reads: %s", strerror(errno));
+    return;
+  }
+  mapped = (char *)tmp;
+  mappedLen = fileLen;
+}
+
+void DTSC::File::unmapFile() {
+  if (mapped) {
+    munmap(mapped, mappedLen);
+    mapped = 0;
+    mappedLen = 0;
+  }
+}
+
+/// If the file mapping holds a complete data packet at pos, points myPack straight at it,
+/// moves the read position past it and returns true. Otherwise, returns false and changes nothing.
+bool DTSC::File::viewPacket(long long int pos) {
+  if (!mapped || pos < 0 || pos + 8 > mappedLen) {
+    return false;
+  }
+  if (memcmp(mapped + pos, DTSC::Magic_Packet2, 4) != 0 && memcmp(mapped + pos, DTSC::Magic_Packet, 4) != 0) {
+    return false;
+  }
+  uint32_t packSize;
+  memcpy(&packSize, mapped + pos + 4, 4);
+  long long int fullSize = (long long int)ntohl(packSize) + 8;
+  if (pos + fullSize > mappedLen) {
+    return false;
+  }
+  myPack.reInit(mapped + pos, fullSize, true);
+  readPos = pos + fullSize;
+  return true;
+}
+
+/// Copies len bytes at pos into dst, from the mapping if it holds them, through F otherwise.
+/// Does not change the read position.
+bool DTSC::File::readAt(long long int pos, char * dst, unsigned int len) {
+  if (mapped && pos >= 0 && pos + len <= mappedLen) {
+    memcpy(dst, mapped + pos, len);
+    return true;
+  }
+  return fseek(F, pos, SEEK_SET) == 0 && fread(dst, len, 1, F) == 1;
+}
+
+/// Adds pos to the positions seekNext reads from, unless an identical one is already there.
+void DTSC::File::addPosition(const seekPos & pos) {
+  for (std::vector<seekPos>::iterator it = currentPositions.begin(); it != currentPositions.end(); ++it) {
+    if (it->seekTime == pos.seekTime && it->trackID == pos.trackID) {
+      return;
+    }
+  }
+  currentPositions.push_back(pos);
+}
+
+/// Returns the number of the last key in trackRef at or before ms, or keys.size() if there is none.
+static unsigned int lastKeyAtOrBefore(DTSC::Track & trackRef, unsigned long long ms) {
+  unsigned int keyCount = trackRef.keys.size();
+  if (!keyCount || trackRef.keys[0].getTime() > ms) {
+    return keyCount;
+  }
+  unsigned int lo = 0, hi = keyCount - 1;
+  while (lo < hi) {
+    unsigned int mid = lo + (hi - lo + 1) / 2;
+    if (trackRef.keys[mid].getTime() <= ms) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
 /// Returns the header metadata for this file as JSON::Value.
 DTSC::Meta & DTSC::File::getMeta() {
   return metadata;
@@ -222,10 +327,13 @@ long int DTSC::File::getBytePosEOF() {
 }
 
 long int DTSC::File::getBytePos() {
-  return ftell(F);
+  return readPos;
 }
 
 bool DTSC::File::reachedEOF() {
+  if (mapped && readPos < mappedLen) {
+    return false;
+  }
   return feof(F);
 }
 
@@ -238,67 +346,75 @@ void DTSC::File::seekNext() {
     myPack.null();
     return;
   }
-  seekPos thisPos = *currentPositions.begin();
-  fseek(F, thisPos.bytePos, SEEK_SET);
-  if (reachedEOF()) {
-    myPack.null();
-    return;
+  //There is about one position per selected track, so finding the first one is a short scan
+  unsigned int nextPos = 0;
+  for (unsigned int i = 1; i < currentPositions.size(); ++i) {
+    if (currentPositions[i] < currentPositions[nextPos]) {
+      nextPos = i;
+    }
   }
-  clearerr(F);
-  currentPositions.erase(currentPositions.begin());
-  lastreadpos = ftell(F);
-  if (fread(buffer, 4, 1, F) != 1) {
-    if (feof(F)) {
-      DEBUG_MSG(DLVL_DEVEL, "End of file reached while seeking @ %i", (int)lastreadpos);
+  seekPos thisPos = currentPositions[nextPos];
+  currentPositions[nextPos] = currentPositions.back();
+  currentPositions.pop_back();
+  seek_bpos(thisPos.bytePos);
+  lastreadpos = readPos;
+  //Point straight into the file mapping when possible, read and copy otherwise
+  if (!viewPacket(lastreadpos)) {
+    fseek(F, lastreadpos, SEEK_SET);
+    if (fread(buffer, 4, 1, F) != 1) {
+      if (feof(F)) {
+        DEBUG_MSG(DLVL_DEVEL, "End of file reached while seeking @ %i", (int)lastreadpos);
+      } else {
+        DEBUG_MSG(DLVL_ERROR, "Could not seek to next @ %i", (int)lastreadpos);
+      }
+      myPack.null();
+      return;
+    }
+    if (memcmp(buffer, DTSC::Magic_Header, 4) == 0) {
+      seek_time(myPack.getTime(), myPack.getTrackId(), true);
+      return seekNext();
+    }
+    long long unsigned int version = 0;
+    if (memcmp(buffer, DTSC::Magic_Packet, 4) == 0) {
+      version = 1;
+    }
+    if (memcmp(buffer, DTSC::Magic_Packet2, 4) == 0) {
+      version = 2;
+    }
+    if (version == 0) {
+      DEBUG_MSG(DLVL_ERROR, "Invalid packet header @ %#x - %.4s != %.4s @ %d", (unsigned int)lastreadpos, (char *)buffer, DTSC::Magic_Packet2, (int)lastreadpos);
+      myPack.null();
+      return;
+    }
+    if (fread(buffer, 4, 1, F) != 1) {
+      DEBUG_MSG(DLVL_ERROR, "Could not read packet size @ %d", (int)lastreadpos);
+      myPack.null();
+      return;
+    }
+    long packSize = ntohl(((unsigned long *)buffer)[0]);
+    char * packBuffer = (char *)malloc(packSize + 8);
+    if (version == 1) {
+      memcpy(packBuffer, "DTPD", 4);
     } else {
-      DEBUG_MSG(DLVL_ERROR, "Could not seek to next @ %i", (int)lastreadpos);
+      memcpy(packBuffer, "DTP2", 4);
     }
-    myPack.null();
-    return;
-  }
-  if (memcmp(buffer, DTSC::Magic_Header, 4) == 0) {
-    seek_time(myPack.getTime(), myPack.getTrackId(), true);
-    return seekNext();
-  }
-  long long unsigned int version = 0;
-  if (memcmp(buffer, DTSC::Magic_Packet, 4) == 0) {
-    version = 1;
-  }
-  if (memcmp(buffer, DTSC::Magic_Packet2, 4) == 0) {
-    version = 2;
-  }
-  if (version == 0) {
-    DEBUG_MSG(DLVL_ERROR, "Invalid packet header @ %#x - %.4s != %.4s @ %d", (unsigned int)lastreadpos, (char *)buffer, DTSC::Magic_Packet2, (int)lastreadpos);
-    myPack.null();
-    return;
-  }
-  if (fread(buffer, 4, 1, F) != 1) {
-    DEBUG_MSG(DLVL_ERROR, "Could not read packet size @ %d", (int)lastreadpos);
-    myPack.null();
-    return;
-  }
-  long packSize = ntohl(((unsigned long *)buffer)[0]);
-  char * packBuffer = (char *)malloc(packSize + 8);
-  if (version == 1) {
-    memcpy(packBuffer, "DTPD", 4);
-  } else {
-    memcpy(packBuffer, "DTP2", 4);
-  }
-  memcpy(packBuffer + 4, buffer, 4);
-  if (fread((void *)(packBuffer + 8), packSize, 1, F) != 1) {
-    DEBUG_MSG(DLVL_ERROR, "Could not read packet @ %d", (int)lastreadpos);
-    myPack.null();
+    memcpy(packBuffer + 4, buffer, 4);
+    if (fread((void *)(packBuffer + 8), packSize, 1, F) != 1) {
+      DEBUG_MSG(DLVL_ERROR, "Could not read packet @ %d", (int)lastreadpos);
+      myPack.null();
+      free(packBuffer);
+      return;
+    }
+    myPack.reInit(packBuffer, packSize + 8);
     free(packBuffer);
-    return;
+    readPos = ftell(F);
   }
-  myPack.reInit(packBuffer, packSize + 8);
-  free(packBuffer);
   if (metadata.merged) {
-    int tempLoc = getBytePos();
+    long long int tempLoc = readPos;
     char newHeader[20];
     bool insert = false;
     seekPos tmpPos;
-    if (fread((void *)newHeader, 20, 1, F) == 1) {
+    if (readAt(tempLoc, newHeader, 20)) {
       if (memcmp(newHeader, DTSC::Magic_Packet2, 4) == 0) {
         tmpPos.bytePos = tempLoc;
         tmpPos.trackID = ntohl(((int *)newHeader)[2]);
@@ -309,22 +425,20 @@ void DTSC::File::seekNext() {
           insert = true;
         } else {
           long tid = myPack.getTrackId();
-          for (unsigned int i = 0; i != metadata.tracks[tid].keys.size(); i++) {
-            if ((unsigned long long)metadata.tracks[tid].keys[i].getTime() > myPack.getTime()) {
-              tmpPos.seekTime = metadata.tracks[tid].keys[i].getTime();
-              tmpPos.bytePos = metadata.tracks[tid].keys[i].getBpos();
-              tmpPos.trackID = tid;
-              insert = true;
-              break;
-            }
+          DTSC::Track & trackRef = metadata.tracks[tid];
+          unsigned int keyNum = lastKeyAtOrBefore(trackRef, myPack.getTime());
+          keyNum = (keyNum == trackRef.keys.size() ? 0 : keyNum + 1);
+          if (keyNum < trackRef.keys.size()) {
+            tmpPos.seekTime = trackRef.keys[keyNum].getTime();
+            tmpPos.bytePos = trackRef.keys[keyNum].getBpos();
+            tmpPos.trackID = tid;
+            insert = true;
           }
         }
-        if (currentPositions.size()) {
-          for (std::set<seekPos>::iterator curPosIter = currentPositions.begin(); curPosIter != currentPositions.end(); curPosIter++) {
-            if ((*curPosIter).trackID == tmpPos.trackID && (*curPosIter).seekTime >= tmpPos.seekTime) {
-              insert = false;
-              break;
-            }
+        for (std::vector<seekPos>::iterator curPosIter = currentPositions.begin(); curPosIter != currentPositions.end(); curPosIter++) {
+          if ((*curPosIter).trackID == tmpPos.trackID && (*curPosIter).seekTime >= tmpPos.seekTime) {
+            insert = false;
+            break;
           }
         }
       }
@@ -333,20 +447,24 @@ void DTSC::File::seekNext() {
       if (tmpPos.seekTime > 0xffffffffffffff00ll){
         tmpPos.seekTime = 0;
       }
-      currentPositions.insert(tmpPos);
+      addPosition(tmpPos);
     } else {
       seek_time(myPack.getTime(), myPack.getTrackId(), true);
     }
     seek_bpos(tempLoc);
   }else{
     seek_time(thisPos.seekTime, thisPos.trackID);
-    fseek(F, thisPos.bytePos, SEEK_SET);
+    seek_bpos(thisPos.bytePos);
   }
 }
 
 void DTSC::File::parseNext(){
   char header_buffer[4] = {0, 0, 0, 0};
-  lastreadpos = ftell(F);
+  lastreadpos = readPos;
+  if (viewPacket(lastreadpos)) {
+    return;
+  }
+  fseek(F, lastreadpos, SEEK_SET);
   if (fread(header_buffer, 4, 1, F) != 1) {
     if (feof(F)) {
       DEBUG_MSG(DLVL_DEVEL, "End of file reached @ %d", (int)lastreadpos);
@@ -385,6 +503,7 @@ void DTSC::File::parseNext(){
   }
   myPack.reInit(packBuffer, packSize + 8);
   free(packBuffer);
+  readPos = ftell(F);
 }
 
 /// Returns the byte positon of the start of the last packet that was read.
@@ -403,11 +522,6 @@ bool DTSC::File::seek_time(unsigned int ms, unsigned int trackNo, bool forceSeek
   if (!forceSeek && myPack && ms >= myPack.getTime() && trackNo >= myPack.getTrackId()) {
     tmpPos.seekTime = myPack.getTime();
     tmpPos.bytePos = getBytePos();
-    /*
-    if (trackNo == myPack.getTrackId()){
-      tmpPos.bytePos += myPack.getDataLen();
-    }
-    */
   } else {
     tmpPos.seekTime = 0;
     tmpPos.bytePos = 0;
@@ -418,30 +532,30 @@ bool DTSC::File::seek_time(unsigned int ms, unsigned int trackNo, bool forceSeek
     tmpPos.bytePos = 0;
     tmpPos.seekTime = 0;
   }
+  //Start from the last key at or before ms; when it is at ms exactly, its packet is the one we want
   DTSC::Track & trackRef = metadata.tracks[trackNo];
-  for (unsigned int i = 0; i < trackRef.keys.size(); i++) {
-    long keyTime = trackRef.keys[i].getTime();
-    if (keyTime > ms) {
-      break;
-    }
-    if ((long long unsigned int)keyTime > tmpPos.seekTime) {
-      tmpPos.seekTime = keyTime;
-      tmpPos.bytePos = trackRef.keys[i].getBpos();
+  unsigned int keyNum = lastKeyAtOrBefore(trackRef, ms);
+  if (keyNum < trackRef.keys.size() && trackRef.keys[keyNum].getTime() > tmpPos.seekTime) {
+    tmpPos.seekTime = trackRef.keys[keyNum].getTime();
+    tmpPos.bytePos = trackRef.keys[keyNum].getBpos();
+    if (tmpPos.seekTime == ms) {
+      addPosition(tmpPos);
+      return true;
     }
   }
-  bool foundPacket = false;
-  while (!foundPacket) {
-    lastreadpos = ftell(F);
-    if (reachedEOF()) {
-      DEBUG_MSG(DLVL_WARN, "Reached EOF during seek to %u in track %d - aborting @ %lld", ms, trackNo, lastreadpos);
+  //Otherwise, walk the packet headers from there to the first packet of this track at or after ms
+  while (true) {
+    char header[20];
+    if (mapped && tmpPos.bytePos >= endPos) {
+      //Nothing left to seek through
       return false;
     }
-    //Seek to first packet after ms.
-    seek_bpos(tmpPos.bytePos);
-    //read the header
-    char header[20];
-    if (fread((void *)header, 20, 1, F) != 1){
-      DEBUG_MSG(DLVL_WARN, "Could not read header from file. Much sadface.");
+    if (!readAt(tmpPos.bytePos, header, 20)) {
+      if (!mapped && feof(F)) {
+        DEBUG_MSG(DLVL_WARN, "Reached EOF during seek to %u in track %d - aborting @ %llu", ms, trackNo, tmpPos.bytePos);
+      } else {
+        DEBUG_MSG(DLVL_WARN, "Could not read header from file. Much sadface.");
+      }
       return false;
     }
     //check if packetID matches, if not, skip size + 8 bytes.
@@ -449,7 +563,7 @@ bool DTSC::File::seek_time(unsigned int ms, unsigned int trackNo, bool forceSeek
     unsigned int packID = ntohl(((int *)header)[2]);
     if (memcmp(header, Magic_Packet2, 4) != 0 || packID != trackNo) {
       if (memcmp(header, "DT", 2) != 0) {
-        DEBUG_MSG(DLVL_WARN, "Invalid header during seek to %u in track %d @ %lld - resetting bytePos from %lld to zero", ms, trackNo, lastreadpos, tmpPos.bytePos);
+        DEBUG_MSG(DLVL_WARN, "Invalid header during seek to %u in track %d - resetting bytePos from %llu to zero", ms, trackNo, tmpPos.bytePos);
         tmpPos.bytePos = 0;
         continue;
       }
@@ -461,17 +575,14 @@ bool DTSC::File::seek_time(unsigned int ms, unsigned int trackNo, bool forceSeek
     myTime += ntohl(((int *)header)[4]);
     tmpPos.seekTime = myTime;
     if (myTime >= ms) {
-      foundPacket = true;
-    } else {
-      tmpPos.bytePos += 8 + packSize;
-      continue;
+      break;
     }
+    tmpPos.bytePos += 8 + packSize;
   }
-  //DEBUG_MSG(DLVL_HIGH, "Seek to %u:%d resulted in %lli", trackNo, ms, tmpPos.seekTime);
   if (tmpPos.seekTime > 0xffffffffffffff00ll){
     tmpPos.seekTime = 0;
   }
-  currentPositions.insert(tmpPos);
+  addPosition(tmpPos);
   return true;
 }
 
@@ -487,11 +598,14 @@ bool DTSC::File::seek_time(unsigned int ms) {
   return true;
 }
 
+/// Moves the read position to bpos; F itself is only moved when a read falls outside the mapping.
 bool DTSC::File::seek_bpos(int bpos) {
-  if (fseek(F, bpos, SEEK_SET) == 0) {
-    return true;
+  if (bpos < 0) {
+    return false;
   }
-  return false;
+  readPos = bpos;
+  clearerr(F);
+  return true;
 }
 
 void DTSC::File::rewritePacket(std::string & newPacket, int bytePos) {
@@ -536,6 +650,7 @@ void DTSC::File::selectTracks(std::set<unsigned long> & tracks) {
 
 /// Close the file if open
 DTSC::File::~File() {
+  unmapFile();
   if (F) {
     fclose(F);
     F = 0;
@@ -7,6 +7,7 @@
 #include <stdint.h> //for uint64_t
 #include <string>
 #include <deque>
+#include <iterator>
 #include <set>
 #include <stdio.h> //for FILE
 #include "json.h"
@@ -88,7 +89,9 @@ namespace DTSC {
       Scan getMember(const char * indice, const unsigned int ind_len);
       Scan getIndice(unsigned int num);
       std::string getIndiceName(unsigned int num);
+      void getMembers(std::map<std::string, Scan> & members);
       unsigned int getSize();
+      char * getPointer();
 
       char getType();
       bool asBool();
@@ -106,6 +109,8 @@ namespace DTSC {
   /// DTSC_V1 packets are "DTPD", followed by 4 bytes len and packed content.
   /// DTSC_V2 packets are "DTP2", followed by 4 bytes len, 4 bytes trackID, 8 bytes time, and packed content.
   /// The len is always without the first 8 bytes counted.
+  /// Packets that own their data keep it in a reference counted buffer from a per-process pool.
+  /// Copies of such packets share the buffer; it is only duplicated when one of them is modified.
   class Packet {
     public:
       Packet();
@@ -142,7 +147,7 @@ namespace DTSC {
     protected:
       bool master;
       packType version;
-      void resize(unsigned int size);
+      void resize(unsigned int size, bool keepData = true);
       char * data;
       unsigned int bufferLen;
       unsigned int dataLen;
@@ -185,6 +190,156 @@ namespace DTSC {
   };
 
 
+  ///\brief A private, writable memory mapping of a header file, shared by all PackedLists viewing it.
+  ///Changes to the mapped data stay private to this process. Unmapped once the last PackedList lets go of it.
+  class PackedMapping {
+    public:
+      static PackedMapping * open(const std::string & fileName);
+      void hold();
+      void release();
+      char * data;
+      size_t len;
+    private:
+      PackedMapping(char * mapped, size_t mappedLen);
+      ~PackedMapping();
+      volatile int refs;
+  };
+
+  ///\brief A list of packed entries (Part, Key, KeySize or Fragment) with the interface of the std::deque it replaces.
+  ///
+  ///The entries are either owned in a std::deque, or viewed in place as a contiguous array inside a PackedMapping,
+  ///so a header file can be used without decoding its entries first. Entries of a view may be read and changed in place;
+  ///removing entries at either end moves the view. Only adding entries copies the view into a deque first.
+  ///Copies of a view share it, including any changes made in place.
+  template <typename T> class PackedList {
+    public:
+      ///\brief Random access iterator over a PackedList, following the invalidation rules of std::deque.
+      class iterator {
+        public:
+          typedef std::random_access_iterator_tag iterator_category;
+          typedef T value_type;
+          typedef ptrdiff_t difference_type;
+          typedef T * pointer;
+          typedef T & reference;
+          iterator() : ptr(0){}
+          iterator(T * p) : ptr(p){}
+          iterator(typename std::deque<T>::iterator i) : ptr(0), dIt(i){}
+          T & operator*() const{return ptr ? *ptr : *dIt;}
+          T * operator->() const{return &**this;}
+          T & operator[](difference_type n) const{return *(*this + n);}
+          iterator & operator+=(difference_type n){
+            if (ptr){ptr += n;}else{dIt += n;}
+            return *this;
+          }
+          iterator & operator-=(difference_type n){return *this += -n;}
+          iterator & operator++(){return *this += 1;}
+          iterator & operator--(){return *this += -1;}
+          iterator operator++(int){iterator r = *this; *this += 1; return r;}
+          iterator operator--(int){iterator r = *this; *this += -1; return r;}
+          iterator operator+(difference_type n) const{iterator r = *this; return r += n;}
+          iterator operator-(difference_type n) const{iterator r = *this; return r += -n;}
+          difference_type operator-(const iterator & rhs) const{return ptr ? ptr - rhs.ptr : dIt - rhs.dIt;}
+          bool operator==(const iterator & rhs) const{return ptr ? ptr == rhs.ptr : dIt == rhs.dIt;}
+          bool operator!=(const iterator & rhs) const{return !(*this == rhs);}
+          bool operator<(const iterator & rhs) const{return (*this - rhs) < 0;}
+          bool operator>(const iterator & rhs) const{return (*this - rhs) > 0;}
+          bool operator<=(const iterator & rhs) const{return (*this - rhs) <= 0;}
+          bool operator>=(const iterator & rhs) const{return (*this - rhs) >= 0;}
+        private:
+          T * ptr;///< Position in the view, or 0 when iterating the deque.
+          typename std::deque<T>::iterator dIt;
+      };
+      typedef std::reverse_iterator<iterator> reverse_iterator;
+
+      PackedList() : view(0), viewLen(0), backing(0){}
+      PackedList(const PackedList & rhs) : owned(rhs.owned), view(rhs.view), viewLen(rhs.viewLen), backing(rhs.backing){
+        if (backing){backing->hold();}
+      }
+      ~PackedList(){
+        if (backing){backing->release();}
+      }
+      PackedList & operator=(const PackedList & rhs){
+        if (rhs.backing){rhs.backing->hold();}
+        if (backing){backing->release();}
+        owned = rhs.owned;
+        view = rhs.view;
+        viewLen = rhs.viewLen;
+        backing = rhs.backing;
+        return *this;
+      }
+      ///\brief Replaces the contents by a view of count entries at data, which lies inside mapping.
+      void setView(char * data, size_t count, PackedMapping * mapping){
+        clear();
+        if (!count){return;}
+        mapping->hold();
+        backing = mapping;
+        view = (T *)data;
+        viewLen = count;
+      }
+      ///\brief Replaces the contents by copies of count entries at data.
+      void assign(const char * data, size_t count){
+        clear();
+        owned.assign((const T *)data, ((const T *)data) + count);
+      }
+      ///\brief Returns the entries as one packed array if they are a view, or 0 if they are owned.
+      const char * packed() const{return (const char *)view;}
+      size_t size() const{return view ? viewLen : owned.size();}
+      bool empty() const{return !size();}
+      T & operator[](size_t i){return view ? view[i] : owned[i];}
+      const T & operator[](size_t i) const{return view ? view[i] : owned[i];}
+      T & front(){return (*this)[0];}
+      T & back(){return (*this)[size() - 1];}
+      iterator begin(){return view ? iterator(view) : iterator(owned.begin());}
+      iterator end(){return view ? iterator(view + viewLen) : iterator(owned.end());}
+      reverse_iterator rbegin(){return reverse_iterator(end());}
+      reverse_iterator rend(){return reverse_iterator(begin());}
+      void push_back(const T & entry){
+        own();
+        owned.push_back(entry);
+      }
+      void insert(iterator pos, const T * first, const T * last){
+        size_t at = pos - begin();
+        own();
+        owned.insert(owned.begin() + at, first, last);
+      }
+      void pop_front(){
+        if (!view){
+          owned.pop_front();
+          return;
+        }
+        ++view;
+        if (!--viewLen){clear();}
+      }
+      void pop_back(){
+        if (!view){
+          owned.pop_back();
+          return;
+        }
+        if (!--viewLen){clear();}
+      }
+      void clear(){
+        owned.clear();
+        view = 0;
+        viewLen = 0;
+        if (backing){
+          backing->release();
+          backing = 0;
+        }
+      }
+    private:
+      ///\brief Copies the viewed entries into the deque, and lets go of the mapping.
+      void own(){
+        if (!view){return;}
+        std::deque<T> copy(view, view + viewLen);
+        clear();
+        owned.swap(copy);
+      }
+      std::deque<T> owned;
+      T * view;
+      size_t viewLen;
+      PackedMapping * backing;
+  };
+
   ///\brief Basic class for storage of data associated with single DTSC packets, a.k.a. parts.
   class Part {
     public:
@@ -235,6 +390,19 @@ namespace DTSC {
       char data[PACKED_KEY_SIZE];
   };
 
+  ///\brief Size in bytes of a keyframe as sent over DTSC, stored as packed in headers.
+  class KeySize {
+    public:
+      KeySize(unsigned long newSize = 0);
+      operator unsigned long() const;
+      KeySize & operator+=(unsigned long add);
+      char * getData();
+    private:
+#define PACKED_KEYSIZE_SIZE 4
+      ///\brief 4 bytes: MSB storage of the size.
+      char data[PACKED_KEYSIZE_SIZE];
+  };
+
   ///\brief Basic class for storage of data associated with fragments.
   class Fragment {
     public:
@@ -264,7 +432,7 @@ namespace DTSC {
     public:
       Track();      
       Track(JSON::Value & trackRef);
-      Track(Scan & trackRef);
+      Track(Scan & trackRef, PackedMapping * mapping = 0);
             
       inline operator bool() const {
         return (parts.size() && keySizes.size() && (keySizes.size() == keys.size()));
@@ -274,10 +442,12 @@ namespace DTSC {
       void send(Socket::Connection & conn, bool skipDynamic = false);
       void writeTo(char *& p);
       JSON::Value toJSON(bool skipDynamic = false);
-      std::deque<Fragment> fragments;
-      std::deque<Key> keys;
-      std::deque<unsigned long> keySizes;
-      std::deque<Part> parts;
+      JSON::Value toDeltaJSON(unsigned long fromKey, unsigned long fromFrag);
+      void applyDelta(Scan & delta);
+      PackedList<Fragment> fragments;
+      PackedList<Key> keys;
+      PackedList<KeySize> keySizes;
+      PackedList<Part> parts;
       Key & getKey(unsigned int keyNum);
       Fragment & getFrag(unsigned int fragNum);
       unsigned int timeToKeynum(unsigned int timestamp);
@@ -326,7 +496,7 @@ namespace DTSC {
       inline operator bool() const { //returns if the object contains valid meta data BY LOOKING AT vod/live FLAGS
         return vod || live;
       }
-      void reinit(const DTSC::Packet & source);
+      void reinit(const DTSC::Packet & source, PackedMapping * mapping = 0);
       void update(const DTSC::Packet & pack, unsigned long segment_size = 5000);
       void updatePosOverride(DTSC::Packet & pack, uint64_t bpos);
       void update(JSON::Value & pack, unsigned long segment_size = 5000);
@@ -337,6 +507,9 @@ namespace DTSC {
       JSON::Value toJSON();
       void reset();
       bool toFile(const std::string & fileName);
+      bool fromFile(const std::string & fileName);
+      bool applyDelta(const DTSC::Packet & source);
+      void applyDeltas(const char * data, unsigned long long len);
       void toPrettyString(std::ostream & str, int indent = 0, int verbosity = 0);
       //members:
       std::map<unsigned int, Track> tracks;
@@ -351,6 +524,23 @@ namespace DTSC {
       std::string sourceURI;
   };
 
+  ///\brief Sends metadata updates over a connection as deltas against what was sent before.
+  ///
+  ///The first send, and any send after tracks were added or removed, is a full DTSC header.
+  ///All other sends are a "meta_delta" DTCM command holding, per track, only the keys, parts and
+  ///fragments added since the previous send, and the number of the new first key. See Meta::applyDelta.
+  ///Recordings append the same commands to their header file while recording; see Meta::applyDeltas.
+  class MetaSync {
+    public:
+      void send(Meta & M, Socket::Connection & conn);
+      bool needsFull(Meta & M);
+      std::string delta(Meta & M);
+      void sent(Meta & M);
+      void reset();
+    private:
+      std::map<unsigned int, std::pair<unsigned long, unsigned long> > sentUntil;///< Per track, the number of the last key and fragment sent.
+  };
+
   /// An iterator helper for easily iterating over the parts in a Fragment.
   class PartIter {
     public:
@@ -363,8 +553,8 @@ namespace DTSC {
       uint32_t lastKey;
       uint32_t currInKey;
       Track * tRef;
-      std::deque<Part>::iterator pIt;
-      std::deque<Key>::iterator kIt;
+      PackedList<Part>::iterator pIt;
+      PackedList<Key>::iterator kIt;
   };
 
   /// A simple wrapper class that will open a file and allow easy reading/writing of DTSC data from/to it.
@@ -397,6 +587,11 @@ namespace DTSC {
     private:
       long int endPos;
       void readHeader(int pos);
+      void mapFile();
+      void unmapFile();
+      bool viewPacket(long long int pos);
+      bool readAt(long long int pos, char * dst, unsigned int len);
+      void addPosition(const seekPos & pos);
       DTSC::Packet myPack;
       Meta metadata;
       std::map<unsigned int, std::string> trackMapping;
@@ -404,10 +599,13 @@ namespace DTSC {
       long long int lastreadpos;
       int currframe;
       FILE * F;
+      char * mapped;///< Read-only mapping of the file as it was when opened, or null.
+      long long int mappedLen;///< Length of mapped.
+      long long int readPos;///< Current read position; F is only moved there when reading outside the mapping.
       unsigned long headerSize;
       void * buffer;
       bool created;
-      std::set<seekPos> currentPositions;
+      std::vector<seekPos> currentPositions;///< Next read position per selected track, unsorted.
       std::set<unsigned long> selectedTracks;
   };
   //FileWriter
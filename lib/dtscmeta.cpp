@@ -5,10 +5,83 @@
 #include <cstring>
 #include <iomanip>
 #include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #define AUDIO_KEY_INTERVAL 5000 ///< This define controls the keyframe interval for non-video tracks, such as audio and metadata tracks.
 
 namespace DTSC {
+  /// Header in front of every pooled packet buffer.
+  struct packetBuffer {
+    volatile int refs;///< Amount of packets using this buffer.
+    unsigned int sizeClass;///< Pool size class, or PACKET_POOL_CLASSES if allocated directly.
+    packetBuffer * next;///< Next free buffer of the same size class, while in the pool.
+  };
+
+  /// Free buffers per size class, and their amounts.
+  /// Plain statics without destructors, so packets destroyed during exit can still use them.
+  static packetBuffer * poolFree[PACKET_POOL_CLASSES];
+  static unsigned int poolCount[PACKET_POOL_CLASSES];
+  static volatile int poolLock = 0;
+
+  static packetBuffer * bufferHeader(char * buffer){
+    return ((packetBuffer *)buffer) - 1;
+  }
+
+  /// Returns a buffer of at least len bytes, with a reference count of one.
+  /// The usable size is written to capacity. Returns a null pointer when out of memory.
+  static char * bufferGet(unsigned int len, unsigned int & capacity){
+    unsigned int sizeClass = 0;
+    while (sizeClass < PACKET_POOL_CLASSES && (unsigned int)(PACKET_POOL_MIN << sizeClass) < len){
+      ++sizeClass;
+    }
+    capacity = (sizeClass < PACKET_POOL_CLASSES) ? (PACKET_POOL_MIN << sizeClass) : len;
+    packetBuffer * buf = 0;
+    if (sizeClass < PACKET_POOL_CLASSES){
+      while (__sync_lock_test_and_set(&poolLock, 1)){}
+      buf = poolFree[sizeClass];
+      if (buf){
+        poolFree[sizeClass] = buf->next;
+        --poolCount[sizeClass];
+      }
+      __sync_lock_release(&poolLock);
+    }
+    if (!buf){
+      buf = (packetBuffer *)malloc(sizeof(packetBuffer) + capacity);
+      if (!buf){return 0;}
+    }
+    buf->refs = 1;
+    buf->sizeClass = sizeClass;
+    buf->next = 0;
+    return (char *)(buf + 1);
+  }
+
+  /// Adds a reference to a buffer.
+  static void bufferRetain(char * buffer){
+    __sync_add_and_fetch(&(bufferHeader(buffer)->refs), 1);
+  }
+
+  /// Drops a reference to a buffer, returning it to the pool or freeing it when this was the last one.
+  static void bufferRelease(char * buffer){
+    packetBuffer * buf = bufferHeader(buffer);
+    if (__sync_sub_and_fetch(&(buf->refs), 1)){return;}
+    if (buf->sizeClass < PACKET_POOL_CLASSES){
+      bool pooled = false;
+      while (__sync_lock_test_and_set(&poolLock, 1)){}
+      if (poolCount[buf->sizeClass] < (PACKET_POOL_CLASS_BYTES) / (PACKET_POOL_MIN << buf->sizeClass)){
+        buf->next = poolFree[buf->sizeClass];
+        poolFree[buf->sizeClass] = buf;
+        ++poolCount[buf->sizeClass];
+        pooled = true;
+      }
+      __sync_lock_release(&poolLock);
+      if (pooled){return;}
+    }
+    free(buf);
+  }
+
   /// Default constructor for packets - sets a null pointer and invalid packet.
   Packet::Packet() {
     data = NULL;
@@ -19,12 +92,23 @@ namespace DTSC {
   }
 
   /// Copy constructor for packets, copies an existing packet with same noCopy flag as original.
+  /// Packets owning their data share the buffer instead of copying it.
   Packet::Packet(const Packet & rhs) {
     master = false;
     bufferLen = 0;
     data = NULL;
     if (rhs.data && rhs.dataLen){
-      reInit(rhs.data, rhs.dataLen, !rhs.master);
+      if (rhs.master){
+        bufferRetain(rhs.data);
+        master = true;
+        data = rhs.data;
+        bufferLen = rhs.bufferLen;
+        dataLen = rhs.dataLen;
+        version = rhs.version;
+        prevNalSize = rhs.prevNalSize;
+      }else{
+        reInit(rhs.data, rhs.dataLen, true);
+      }
     }else{
       null();
     }
@@ -38,21 +122,30 @@ namespace DTSC {
     reInit(data_, len, noCopy);
   }
 
-  /// This destructor clears frees the data pointer if the packet was not a reference.
+  /// This destructor releases the data buffer if the packet was not a reference.
   Packet::~Packet() {
     if (master && data) {
-      free(data);
+      bufferRelease(data);
     }
   }
 
   /// Copier for packets, copies an existing packet with same noCopy flag as original.
-  /// If going from copy to noCopy, this will free the data pointer first.
+  /// Packets owning their data share the buffer instead of copying it.
   void Packet::operator = (const Packet & rhs) {
-    if (master && !rhs.master) {
-      null();
-    }
+    if (this == &rhs){return;}
     if (rhs && rhs.data && rhs.dataLen) {
-      reInit(rhs.data, rhs.dataLen, !rhs.master);
+      if (rhs.master){
+        bufferRetain(rhs.data);
+        null();
+        master = true;
+        data = rhs.data;
+        bufferLen = rhs.bufferLen;
+        dataLen = rhs.dataLen;
+        version = rhs.version;
+        prevNalSize = rhs.prevNalSize;
+      }else{
+        reInit(rhs.data, rhs.dataLen, true);
+      }
     } else {
       null();
     }
@@ -90,7 +183,7 @@ namespace DTSC {
   /// If needed, this frees the data pointer.
   void Packet::null() {
     if (master && data) {
-      free(data);
+      bufferRelease(data);
     }
     master = false;
     data = NULL;
@@ -100,18 +193,26 @@ namespace DTSC {
   }
 
   /// Internally used resize function for when operating in copy mode and the internal buffer is too small.
-  /// It will only resize up, never down.
+  /// It will only resize up, never down, and also gives this packet its own buffer if it shares one.
   ///\param len The length th scale the buffer up to if necessary
-  void Packet::resize(unsigned int len) {
-    if (master && len > bufferLen) {
-      char * tmp = (char *)realloc(data, len);
-      if (tmp) {
-        data = tmp;
-        bufferLen = len;
-      } else {
-        DEBUG_MSG(DLVL_FAIL, "Out of memory on parsing a packet");
+  ///\param keepData Whether the current contents need to be kept
+  void Packet::resize(unsigned int len, bool keepData) {
+    if (!master){return;}
+    if (data && len <= bufferLen && bufferHeader(data)->refs == 1){return;}
+    unsigned int newLen = 0;
+    char * tmp = bufferGet(len > bufferLen ? len : bufferLen, newLen);
+    if (!tmp) {
+      DEBUG_MSG(DLVL_FAIL, "Out of memory on parsing a packet");
+      return;
+    }
+    if (data){
+      if (keepData){
+        memcpy(tmp, data, dataLen < newLen ? dataLen : newLen);
       }
+      bufferRelease(data);
     }
+    data = tmp;
+    bufferLen = newLen;
   }
 
   void Packet::reInit(Socket::Connection & src) {
@@ -169,13 +270,18 @@ namespace DTSC {
     if (master && noCopy) {
       null();
     }
+    //a reference is never turned into a buffer of our own
+    if (!master && !noCopy) {
+      data = NULL;
+      bufferLen = 0;
+    }
     //set control flag to !noCopy
     master = !noCopy;
     //either copy the data, or only the pointer, depending on flag
     if (noCopy) {
       data = (char *)data_;
     } else {
-      resize(len);
+      resize(len, false);
       memcpy(data, data_, len);
     }
     //check header type and store packet length
@@ -273,6 +379,7 @@ namespace DTSC {
 
   ///sets the keyframe byte.
   void Packet::setKeyFrame(bool kf){
+    resize(dataLen);//never modify a buffer shared with other packets
     uint32_t offset = 23;
     while (data[offset] != 'd' && data[offset] != 'k' && data[offset] != 'K'){
       switch (data[offset]){
@@ -708,6 +815,33 @@ namespace DTSC {
     return "";
   }
   
+  /// Fills the given map with all members of this object in a single pass.
+  /// Does nothing on error or when not an object.
+  void Scan::getMembers(std::map<std::string, Scan> & members) {
+    if (getType() != DTSC_OBJ && getType() != DTSC_CON) {
+      return;
+    }
+    char * i = p + 1;
+    //object, scan contents
+    while (i[0] + i[1] != 0 && i < p + len) { //while not encountering 0x0000 (we assume 0x0000EE)
+      if (i + 2 >= p + len) {
+        return;//out of packet!
+      }
+      unsigned int strlen = Bit::btohs(i);
+      i += 2;
+      members[std::string(i, strlen)] = Scan(i + strlen, len - (i - p));
+      i = skipDTSC(i + strlen, p + len);
+      if (!i) {
+        return;
+      }
+    }
+  }
+
+  /// Returns a pointer to the first byte of this DTSC value, or null when invalid.
+  char * Scan::getPointer() {
+    return p;
+  }
+
   /// Returns the first byte of this DTSC value, or 0 on error.
   char Scan::getType() {
     if (!p) {
@@ -1092,6 +1226,66 @@ namespace DTSC {
     str << std::string(indent, ' ') << "Fragment " << getNumber() << ": Dur(" << getDuration() << "), Len(" << (int)getLength() << "), Size(" << getSize() << ")" << std::endl;
   }
 
+  KeySize::KeySize(unsigned long newSize) {
+    Bit::htobl(data, newSize);
+  }
+
+  ///\brief Returns the size of this keyframe
+  KeySize::operator unsigned long() const {
+    return Bit::btohl((char *)data);
+  }
+
+  ///\brief Increases the size of this keyframe
+  KeySize & KeySize::operator+=(unsigned long add) {
+    Bit::htobl(data, Bit::btohl(data) + add);
+    return *this;
+  }
+
+  ///\brief Returns the data of this keysize structure
+  char * KeySize::getData() {
+    return data;
+  }
+
+  ///\brief Maps fileName privately into memory.
+  ///\returns The mapping, held once by the caller, or 0 if the file could not be mapped.
+  PackedMapping * PackedMapping::open(const std::string & fileName) {
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd == -1){return 0;}
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) || !fileStat.st_size){
+      ::close(fd);
+      return 0;
+    }
+    char * mapped = (char *)mmap(0, fileStat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED){
+      ERROR_MSG("Could not map %s: %s", fileName.c_str(), strerror(errno));
+      return 0;
+    }
+    return new PackedMapping(mapped, fileStat.st_size);
+  }
+
+  PackedMapping::PackedMapping(char * mapped, size_t mappedLen) {
+    data = mapped;
+    len = mappedLen;
+    refs = 1;
+  }
+
+  PackedMapping::~PackedMapping() {
+    munmap(data, len);
+  }
+
+  void PackedMapping::hold() {
+    __sync_add_and_fetch(&refs, 1);
+  }
+
+  ///\brief Lets go of the mapping, unmapping it when nothing holds it anymore.
+  void PackedMapping::release() {
+    if (!__sync_sub_and_fetch(&refs, 1)){
+      delete this;
+    }
+  }
+
   ///\brief Constructs an empty track
   Track::Track() {
     trackID = 0;
@@ -1112,16 +1306,13 @@ namespace DTSC {
   ///\brief Constructs a track from a JSON::Value
   Track::Track(JSON::Value & trackRef) {
     if (trackRef.isMember("fragments") && trackRef["fragments"].isString()) {
-      Fragment * tmp = (Fragment *)trackRef["fragments"].asStringRef().data();
-      fragments = std::deque<Fragment>(tmp, tmp + (trackRef["fragments"].asStringRef().size() / PACKED_FRAGMENT_SIZE));
+      fragments.assign(trackRef["fragments"].asStringRef().data(), trackRef["fragments"].asStringRef().size() / PACKED_FRAGMENT_SIZE);
     }
     if (trackRef.isMember("keys") && trackRef["keys"].isString()) {
-      Key * tmp = (Key *)trackRef["keys"].asStringRef().data();
-      keys = std::deque<Key>(tmp, tmp + (trackRef["keys"].asStringRef().size() / PACKED_KEY_SIZE));
+      keys.assign(trackRef["keys"].asStringRef().data(), trackRef["keys"].asStringRef().size() / PACKED_KEY_SIZE);
     }
     if (trackRef.isMember("parts") && trackRef["parts"].isString()) {
-      Part * tmp = (Part *)trackRef["parts"].asStringRef().data();
-      parts = std::deque<Part>(tmp, tmp + (trackRef["parts"].asStringRef().size() / 9));
+      parts.assign(trackRef["parts"].asStringRef().data(), trackRef["parts"].asStringRef().size() / PACKED_PART_SIZE);
     }
     trackID = trackRef["trackid"].asInt();
     firstms = trackRef["firstms"].asInt();
@@ -1146,10 +1337,7 @@ namespace DTSC {
       fpks = trackRef["fpks"].asInt();
     }
     if (trackRef.isMember("keysizes") && trackRef["keysizes"].isString()) {
-      std::string tmp = trackRef["keysizes"].asStringRef();
-      for (unsigned int i = 0; i < tmp.size(); i += 4){
-        keySizes.push_back((((long unsigned)tmp[i]) << 24) | (((long unsigned)tmp[i+1]) << 16) | (((long unsigned int)tmp[i+2]) << 8) | tmp[i+3]);
-      }
+      keySizes.assign(trackRef["keysizes"].asStringRef().data(), trackRef["keysizes"].asStringRef().size() / PACKED_KEYSIZE_SIZE);
     }
     if (trackRef.isMember("keepaway") && trackRef["keepaway"].isInt()){
       minKeepAway = trackRef["keepaway"].asInt();
@@ -1158,26 +1346,27 @@ namespace DTSC {
     }
   }
 
-  ///\brief Constructs a track from a JSON::Value
-  Track::Track(Scan & trackRef) {
-    if (trackRef.getMember("fragments").getType() == DTSC_STR) {
-      char * tmp = 0;
-      unsigned int tmplen = 0;
-      trackRef.getMember("fragments").getString(tmp, tmplen);
-      fragments = std::deque<Fragment>((Fragment *)tmp, ((Fragment *)tmp) + (tmplen / PACKED_FRAGMENT_SIZE));
-    }
-    if (trackRef.getMember("keys").getType() == DTSC_STR) {
-      char * tmp = 0;
-      unsigned int tmplen = 0;
-      trackRef.getMember("keys").getString(tmp, tmplen);
-      keys = std::deque<Key>((Key *)tmp, ((Key *)tmp) + (tmplen / PACKED_KEY_SIZE));
-    }
-    if (trackRef.getMember("parts").getType() == DTSC_STR) {
-      char * tmp = 0;
-      unsigned int tmplen = 0;
-      trackRef.getMember("parts").getString(tmp, tmplen);
-      parts = std::deque<Part>((Part *)tmp, ((Part *)tmp) + (tmplen / 9));
+  ///\brief Fills a PackedList from a packed string member of a DTSC::Scan.
+  ///Views the string in place if it lies inside mapping, copies it otherwise.
+  template <typename T> static void readPacked(Scan & trackRef, const char * member, size_t entrySize, PackedList<T> & list, PackedMapping * mapping){
+    if (trackRef.getMember(member).getType() != DTSC_STR){return;}
+    char * tmp = 0;
+    unsigned int tmplen = 0;
+    trackRef.getMember(member).getString(tmp, tmplen);
+    if (mapping){
+      list.setView(tmp, tmplen / entrySize, mapping);
+    }else{
+      list.assign(tmp, tmplen / entrySize);
     }
+  }
+
+  ///\brief Constructs a track from a DTSC::Scan
+  ///\param mapping If set, the mapping trackRef lies in. The keys, parts, fragments and keysizes are then
+  ///used in place instead of being copied.
+  Track::Track(Scan & trackRef, PackedMapping * mapping) {
+    readPacked(trackRef, "fragments", PACKED_FRAGMENT_SIZE, fragments, mapping);
+    readPacked(trackRef, "keys", PACKED_KEY_SIZE, keys, mapping);
+    readPacked(trackRef, "parts", PACKED_PART_SIZE, parts, mapping);
     trackID = trackRef.getMember("trackid").asInt();
     firstms = trackRef.getMember("firstms").asInt();
     lastms = trackRef.getMember("lastms").asInt();
@@ -1200,14 +1389,7 @@ namespace DTSC {
       height = trackRef.getMember("height").asInt();
       fpks = trackRef.getMember("fpks").asInt();
     }
-    if (trackRef.getMember("keysizes").getType() == DTSC_STR) {
-      char * tmp = 0;
-      unsigned int tmplen = 0;
-      trackRef.getMember("keysizes").getString(tmp, tmplen);
-      for (unsigned int i = 0; i < tmplen; i += 4){
-        keySizes.push_back((((long unsigned)tmp[i]) << 24) | (((long unsigned)tmp[i+1]) << 16) | (((long unsigned int)tmp[i+2]) << 8) | tmp[i+3]);
-      }
-    }
+    readPacked(trackRef, "keysizes", PACKED_KEYSIZE_SIZE, keySizes, mapping);
     if (trackRef.getMember("keepaway").getType() == DTSC_INT){
       minKeepAway = trackRef.getMember("keepaway").asInt();
     }else{
@@ -1268,7 +1450,7 @@ namespace DTSC {
           fragments[fragments.size() - 1].setDuration(packTime - getKey(fragments[fragments.size() - 1].getNumber()).getTime());
           uint64_t totalBytes = 0;
           uint64_t totalDuration = 0;
-          for (std::deque<DTSC::Fragment>::iterator it = fragments.begin(); it != fragments.end(); it++){
+          for (PackedList<Fragment>::iterator it = fragments.begin(); it != fragments.end(); it++){
             totalBytes += it->getSize();
             totalDuration += it->getDuration();
           }
@@ -1355,7 +1537,7 @@ namespace DTSC {
   /// Returns the number of the key containing timestamp, or last key if nowhere.
   unsigned int Track::timeToKeynum(unsigned int timestamp){
     unsigned int result = 0;
-    for (std::deque<Key>::iterator it = keys.begin(); it != keys.end(); it++){
+    for (PackedList<Key>::iterator it = keys.begin(); it != keys.end(); it++){
       if (it->getTime() > timestamp){
         break;
       }
@@ -1367,7 +1549,7 @@ namespace DTSC {
   /// Gets indice of the fragment containing timestamp, or last fragment if nowhere.
   uint32_t Track::timeToFragnum(uint64_t timestamp){
     uint32_t i = 0;
-    for (std::deque<Fragment>::iterator it = fragments.begin(); it != fragments.end(); ++it){
+    for (PackedList<Fragment>::iterator it = fragments.begin(); it != fragments.end(); ++it){
       if (timestamp < getKey(it->getNumber()).getTime() + it->getDuration()){
         return i;
       }
@@ -1403,7 +1585,9 @@ namespace DTSC {
     reinit(source);
   }
 
-  void Meta::reinit(const DTSC::Packet & source) {
+  ///\brief Replaces the contents by the header in source.
+  ///\param mapping If set, the mapping source lies in; the tracks then view their packed entries in place.
+  void Meta::reinit(const DTSC::Packet & source, PackedMapping * mapping) {
     tracks.clear();
     vod = source.getFlag("vod");
     live = source.getFlag("live");
@@ -1420,13 +1604,103 @@ namespace DTSC {
       if (tmpTrack.asBool()) {
         unsigned int trackId = tmpTrack.getMember("trackid").asInt();
         if (trackId) {
-          tracks[trackId] = Track(tmpTrack);
+          tracks[trackId] = Track(tmpTrack, mapping);
         }
         num++;
       }
     } while (tmpTrack.asBool());
   }
 
+  ///\brief Applies a "meta_delta" DTCM packet, as sent by DTSC::MetaSync, to this object.
+  ///\returns False, without changing anything, if the delta is for tracks this object does not have.
+  ///In that case the sender and receiver are out of sync, and a full header is needed.
+  bool Meta::applyDelta(const DTSC::Packet & source) {
+    Scan tmpTracks = source.getScan().getMember("tracks");
+    unsigned int num = 0;
+    Scan tmpTrack;
+    while ((tmpTrack = tmpTracks.getIndice(num)).asBool()) {
+      if (!tracks.count(tmpTrack.getMember("trackid").asInt())) {
+        return false;
+      }
+      num++;
+    }
+    num = 0;
+    while ((tmpTrack = tmpTracks.getIndice(num)).asBool()) {
+      tracks[tmpTrack.getMember("trackid").asInt()].applyDelta(tmpTrack);
+      num++;
+    }
+    return true;
+  }
+
+  ///\brief Applies the "meta_delta" commands following a header in a header file, as appended while recording (see MetaSync).
+  ///Stops at anything else, including a command that was not completely written yet.
+  void Meta::applyDeltas(const char * data, unsigned long long len) {
+    while (len >= 8 && !memcmp(data, DTSC::Magic_Command, 4)) {
+      unsigned long long packLen = Bit::btohl(data + 4) + 8;
+      if (packLen > len) {
+        return;
+      }
+      DTSC::Packet delta(data, packLen, true);
+      std::string cmd;
+      delta.getString("cmd", cmd);
+      if (cmd != "meta_delta" || !applyDelta(delta)) {
+        return;
+      }
+      data += packLen;
+      len -= packLen;
+    }
+  }
+
+  ///\brief Sends the given metadata, as a delta if the tracks are the same as on the previous send.
+  void MetaSync::send(Meta & M, Socket::Connection & conn) {
+    if (needsFull(M)) {
+      M.send(conn);
+    } else {
+      conn.SendNow(delta(M));
+    }
+    sent(M);
+  }
+
+  ///\brief Returns true if the tracks changed since the previous send, so the next one must be a full header.
+  bool MetaSync::needsFull(Meta & M) {
+    if (sentUntil.size() != M.tracks.size()) {
+      return true;
+    }
+    for (std::map<unsigned int, Track>::iterator it = M.tracks.begin(); it != M.tracks.end(); it++) {
+      if (!sentUntil.count(it->first)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  ///\brief Returns the "meta_delta" DTCM packet holding the changes since the previous send. Only valid if needsFull is false.
+  std::string MetaSync::delta(Meta & M) {
+    JSON::Value delta;
+    delta["cmd"] = "meta_delta";
+    for (std::map<unsigned int, Track>::iterator it = M.tracks.begin(); it != M.tracks.end(); it++) {
+      delta["tracks"][JSON::Value((long long)it->first).asString()] = it->second.toDeltaJSON(sentUntil[it->first].first, sentUntil[it->first].second);
+    }
+    std::string packed = delta.toPacked();
+    char sSize[4];
+    Bit::htobl(sSize, packed.size());
+    return std::string(DTSC::Magic_Command, 4) + std::string(sSize, 4) + packed;
+  }
+
+  ///\brief Marks the given metadata as sent, either in full or as a delta.
+  void MetaSync::sent(Meta & M) {
+    sentUntil.clear();
+    for (std::map<unsigned int, Track>::iterator it = M.tracks.begin(); it != M.tracks.end(); it++) {
+      sentUntil[it->first].first = it->second.keys.size() ? it->second.keys.rbegin()->getNumber() : 0;
+      sentUntil[it->first].second = it->second.fragments.size() ? it->second.fragments.rbegin()->getNumber() : 0;
+    }
+  }
+
+  ///\brief Forgets what was sent, so the next send is a full header. Use after reconnecting.
+  void MetaSync::reset() {
+    sentUntil.clear();
+  }
+
   ///\brief Creates a meta object from a JSON::Value
   Meta::Meta(JSON::Value & meta) {
     vod = meta.isMember("vod") && meta["vod"];
@@ -1646,9 +1920,9 @@ namespace DTSC {
       result += fragments.size() * PACKED_FRAGMENT_SIZE + 16;
       result += keys.size() * PACKED_KEY_SIZE + 11;
     if (keySizes.size()){
-        result += (keySizes.size() * 4) + 15;
+        result += (keySizes.size() * PACKED_KEYSIZE_SIZE) + 15;
     }
-      result += parts.size() * 9 + 12;
+      result += parts.size() * PACKED_PART_SIZE + 12;
     }
     if (lang.size() && lang != "und"){
       result += 11 + lang.size();
@@ -1682,9 +1956,44 @@ namespace DTSC {
     writePointer(p, src.data(), src.size());
   }
 
+  ///\brief Writes all entries of a PackedList to a pointer, in one go if they are a view
+  template <typename T> static void writePacked(char *& p, PackedList<T> & list, size_t entrySize) {
+    if (list.packed()){
+      writePointer(p, list.packed(), list.size() * entrySize);
+      return;
+    }
+    for (typename PackedList<T>::iterator it = list.begin(); it != list.end(); ++it){
+      writePointer(p, it->getData(), entrySize);
+    }
+  }
+
+  ///\brief Sends all entries of a PackedList over a connection, in one go if they are a view
+  template <typename T> static void sendPacked(Socket::Connection & conn, PackedList<T> & list, size_t entrySize) {
+    if (list.packed()){
+      conn.SendNow(list.packed(), list.size() * entrySize);
+      return;
+    }
+    for (typename PackedList<T>::iterator it = list.begin(); it != list.end(); ++it){
+      conn.SendNow(it->getData(), entrySize);
+    }
+  }
+
+  ///\brief Returns all entries of a PackedList as one packed string
+  template <typename T> static std::string packedString(PackedList<T> & list, size_t entrySize) {
+    if (list.packed()){
+      return std::string(list.packed(), list.size() * entrySize);
+    }
+    std::string tmp;
+    tmp.reserve(list.size() * entrySize);
+    for (typename PackedList<T>::iterator it = list.begin(); it != list.end(); ++it){
+      tmp.append(it->getData(), entrySize);
+    }
+    return tmp;
+  }
+
   ///\brief Writes a track to a pointer
   void Track::writeTo(char *& p) {
-    std::deque<Fragment>::iterator firstFrag = fragments.begin(); 
+    PackedList<Fragment>::iterator firstFrag = fragments.begin(); 
     if (fragments.size() && (&firstFrag) == 0){
       return;
     }
@@ -1694,30 +2003,16 @@ namespace DTSC {
     writePointer(p, "\340", 1);//Begin track object
     writePointer(p, "\000\011fragments\002", 12);
     writePointer(p, convertInt(fragments.size() * PACKED_FRAGMENT_SIZE), 4);
-    for (; firstFrag != fragments.end(); ++firstFrag) {
-      writePointer(p, firstFrag->getData(), PACKED_FRAGMENT_SIZE);
-    }
+    writePacked(p, fragments, PACKED_FRAGMENT_SIZE);
     writePointer(p, "\000\004keys\002", 7);
     writePointer(p, convertInt(keys.size() * PACKED_KEY_SIZE), 4);
-    for (std::deque<Key>::iterator it = keys.begin(); it != keys.end(); it++) {
-      writePointer(p, it->getData(), PACKED_KEY_SIZE);
-    }
+    writePacked(p, keys, PACKED_KEY_SIZE);
     writePointer(p, "\000\010keysizes\002,", 11);
-    writePointer(p, convertInt(keySizes.size() * 4), 4);
-    std::string tmp;
-    tmp.reserve(keySizes.size() * 4);
-    for (unsigned int i = 0; i < keySizes.size(); i++){
-      tmp += (char)(keySizes[i] >> 24);
-      tmp += (char)(keySizes[i] >> 16);
-      tmp += (char)(keySizes[i] >> 8);
-      tmp += (char)(keySizes[i]);
-    }
-    writePointer(p, tmp.data(), tmp.size());
+    writePointer(p, convertInt(keySizes.size() * PACKED_KEYSIZE_SIZE), 4);
+    writePacked(p, keySizes, PACKED_KEYSIZE_SIZE);
     writePointer(p, "\000\005parts\002", 8);
-    writePointer(p, convertInt(parts.size() * 9), 4);
-    for (std::deque<Part>::iterator it = parts.begin(); it != parts.end(); it++) {
-      writePointer(p, it->getData(), 9);
-    }
+    writePointer(p, convertInt(parts.size() * PACKED_PART_SIZE), 4);
+    writePacked(p, parts, PACKED_PART_SIZE);
     writePointer(p, "\000\007trackid\001", 10);
     writePointer(p, convertLongLong(trackID), 8);
     if (missedFrags) {
@@ -1776,30 +2071,16 @@ namespace DTSC {
     if (!skipDynamic){
     conn.SendNow("\000\011fragments\002", 12);
       conn.SendNow(convertInt(fragments.size() * PACKED_FRAGMENT_SIZE), 4);
-    for (std::deque<Fragment>::iterator it = fragments.begin(); it != fragments.end(); it++) {
-        conn.SendNow(it->getData(), PACKED_FRAGMENT_SIZE);
-    }
+    sendPacked(conn, fragments, PACKED_FRAGMENT_SIZE);
     conn.SendNow("\000\004keys\002", 7);
       conn.SendNow(convertInt(keys.size() * PACKED_KEY_SIZE), 4);
-    for (std::deque<Key>::iterator it = keys.begin(); it != keys.end(); it++) {
-        conn.SendNow(it->getData(), PACKED_KEY_SIZE);
-    }
+    sendPacked(conn, keys, PACKED_KEY_SIZE);
     conn.SendNow("\000\010keysizes\002,", 11);
-    conn.SendNow(convertInt(keySizes.size() * 4), 4);
-    std::string tmp;
-    tmp.reserve(keySizes.size() * 4);
-    for (unsigned int i = 0; i < keySizes.size(); i++){
-      tmp += (char)(keySizes[i] >> 24);
-      tmp += (char)(keySizes[i] >> 16);
-      tmp += (char)(keySizes[i] >> 8);
-      tmp += (char)(keySizes[i]);
-    }
-    conn.SendNow(tmp.data(), tmp.size());
+    conn.SendNow(convertInt(keySizes.size() * PACKED_KEYSIZE_SIZE), 4);
+    sendPacked(conn, keySizes, PACKED_KEYSIZE_SIZE);
     conn.SendNow("\000\005parts\002", 8);
-    conn.SendNow(convertInt(parts.size() * 9), 4);
-    for (std::deque<Part>::iterator it = parts.begin(); it != parts.end(); it++) {
-      conn.SendNow(it->getData(), 9);
-    }
+    conn.SendNow(convertInt(parts.size() * PACKED_PART_SIZE), 4);
+    sendPacked(conn, parts, PACKED_PART_SIZE);
     }
     conn.SendNow("\000\007trackid\001", 10);
     conn.SendNow(convertLongLong(trackID), 8);
@@ -1946,37 +2227,127 @@ namespace DTSC {
     conn.SendNow("\000\000\356", 3);//End global object
   }
 
+  ///\brief Converts the changes to this track since the given key and fragment to a delta object.
+  ///\param fromKey The number of the last key the receiving end has. It and later keys are (re)sent.
+  ///\param fromFrag The number of the last fragment the receiving end has. It and later fragments are (re)sent.
+  JSON::Value Track::toDeltaJSON(unsigned long fromKey, unsigned long fromFrag) {
+    JSON::Value result;
+    result["trackid"] = trackID;
+    result["firstkey"] = (long long)(keys.size() ? keys[0].getNumber() : 0);
+    result["fromkey"] = (long long)fromKey;
+    result["fromfrag"] = (long long)fromFrag;
+    unsigned int keyStart = keys.size();
+    unsigned long partCount = 0;
+    while (keyStart && keys[keyStart - 1].getNumber() >= fromKey) {
+      --keyStart;
+      partCount += keys[keyStart].getParts();
+    }
+    if (partCount > parts.size()) {
+      partCount = parts.size();
+    }
+    std::string tmp;
+    tmp.reserve((keys.size() - keyStart) * PACKED_KEY_SIZE);
+    for (unsigned int i = keyStart; i < keys.size(); i++) {
+      tmp.append(keys[i].getData(), PACKED_KEY_SIZE);
+    }
+    result["keys"] = tmp;
+    tmp = "";
+    for (unsigned int i = keyStart; i < keySizes.size(); i++) {
+      tmp += (char)((keySizes[i] >> 24));
+      tmp += (char)((keySizes[i] >> 16));
+      tmp += (char)((keySizes[i] >> 8));
+      tmp += (char)(keySizes[i]);
+    }
+    result["keysizes"] = tmp;
+    tmp = "";
+    tmp.reserve(partCount * PACKED_PART_SIZE);
+    for (unsigned long i = parts.size() - partCount; i < parts.size(); i++) {
+      tmp.append(parts[i].getData(), PACKED_PART_SIZE);
+    }
+    result["parts"] = tmp;
+    tmp = "";
+    unsigned int fragStart = fragments.size();
+    while (fragStart && fragments[fragStart - 1].getNumber() >= fromFrag) {
+      --fragStart;
+    }
+    for (unsigned int i = fragStart; i < fragments.size(); i++) {
+      tmp.append(fragments[i].getData(), PACKED_FRAGMENT_SIZE);
+    }
+    result["fragments"] = tmp;
+    result["firstms"] = (long long)firstms;
+    result["lastms"] = (long long)lastms;
+    result["bps"] = bps;
+    result["maxbps"] = max_bps;
+    result["missed_frags"] = missedFrags;
+    return result;
+  }
+
+  ///\brief Applies a delta object as created by toDeltaJSON to this track.
+  ///Removes the keys the sender no longer has, replaces the resent tail and appends the new data.
+  void Track::applyDelta(Scan & delta) {
+    unsigned long firstKey = delta.getMember("firstkey").asInt();
+    unsigned long fromKey = delta.getMember("fromkey").asInt();
+    unsigned long fromFrag = delta.getMember("fromfrag").asInt();
+    //removeFirstKey expects these to be aligned with the keys and fragments
+    while (keySizes.size() < keys.size()) {
+      keySizes.push_back(0);
+    }
+    while (fragInsertTime.size() < fragments.size()) {
+      fragInsertTime.push_front(Util::bootSecs());
+    }
+    while (keys.size() > 1 && keys[0].getNumber() < firstKey) {
+      removeFirstKey();
+    }
+    //Drop everything that is resent
+    while (keys.size() && keys.rbegin()->getNumber() >= fromKey) {
+      for (unsigned int i = 0; i < keys.rbegin()->getParts() && parts.size(); i++) {
+        parts.pop_back();
+      }
+      keys.pop_back();
+      keySizes.pop_back();
+    }
+    while (fragments.size() && fragments.rbegin()->getNumber() >= fromFrag) {
+      fragments.pop_back();
+      fragInsertTime.pop_back();
+    }
+    char * tmp = 0;
+    unsigned int tmplen = 0;
+    delta.getMember("keys").getString(tmp, tmplen);
+    keys.insert(keys.end(), (Key *)tmp, ((Key *)tmp) + (tmplen / PACKED_KEY_SIZE));
+    delta.getMember("keysizes").getString(tmp, tmplen);
+    for (unsigned int i = 0; i + 3 < tmplen; i += 4) {
+      keySizes.push_back((((long unsigned)tmp[i]) << 24) | (((long unsigned)tmp[i+1]) << 16) | (((long unsigned int)tmp[i+2]) << 8) | tmp[i+3]);
+    }
+    while (keySizes.size() < keys.size()) {
+      keySizes.push_back(0);
+    }
+    delta.getMember("parts").getString(tmp, tmplen);
+    parts.insert(parts.end(), (Part *)tmp, ((Part *)tmp) + (tmplen / PACKED_PART_SIZE));
+    delta.getMember("fragments").getString(tmp, tmplen);
+    for (unsigned int i = 0; i + PACKED_FRAGMENT_SIZE <= tmplen; i += PACKED_FRAGMENT_SIZE) {
+      fragments.push_back(*(Fragment *)(tmp + i));
+      fragInsertTime.push_back(Util::bootSecs());
+    }
+    //Fragments starting before the first key are no longer complete
+    while (fragments.size() && keys.size() && fragments[0].getNumber() < keys[0].getNumber()) {
+      fragments.pop_front();
+      fragInsertTime.pop_front();
+    }
+    firstms = delta.getMember("firstms").asInt();
+    lastms = delta.getMember("lastms").asInt();
+    bps = delta.getMember("bps").asInt();
+    max_bps = delta.getMember("maxbps").asInt();
+    missedFrags = delta.getMember("missed_frags").asInt();
+  }
+
   ///\brief Converts a track to a JSON::Value
   JSON::Value Track::toJSON(bool skipDynamic) {
     JSON::Value result;
-    std::string tmp;
     if (!skipDynamic) {
-      tmp.reserve(fragments.size() * PACKED_FRAGMENT_SIZE);
-      for (std::deque<Fragment>::iterator it = fragments.begin(); it != fragments.end(); it++) {
-        tmp.append(it->getData(), PACKED_FRAGMENT_SIZE);
-      }
-      result["fragments"] = tmp;
-      tmp = "";
-      tmp.reserve(keys.size() * PACKED_KEY_SIZE);
-      for (std::deque<Key>::iterator it = keys.begin(); it != keys.end(); it++) {
-        tmp.append(it->getData(), PACKED_KEY_SIZE);
-      }
-      result["keys"] = tmp;
-      tmp = "";
-      tmp.reserve(keySizes.size() * 4);
-      for (unsigned int i = 0; i < keySizes.size(); i++){
-        tmp += (char)((keySizes[i] >> 24));
-        tmp += (char)((keySizes[i] >> 16));
-        tmp += (char)((keySizes[i] >> 8));
-        tmp += (char)(keySizes[i]);
-      }
-      result["keysizes"] = tmp;
-      tmp = "";
-      tmp.reserve(parts.size() * 9);
-      for (std::deque<Part>::iterator it = parts.begin(); it != parts.end(); it++) {
-        tmp.append(it->getData(), 9);
-      }
-      result["parts"] = tmp;
+      result["fragments"] = packedString(fragments, PACKED_FRAGMENT_SIZE);
+      result["keys"] = packedString(keys, PACKED_KEY_SIZE);
+      result["keysizes"] = packedString(keySizes, PACKED_KEYSIZE_SIZE);
+      result["parts"] = packedString(parts, PACKED_PART_SIZE);
     }
     result["init"] = init;
     if (lang.size() && lang != "und"){
@@ -2038,14 +2409,45 @@ namespace DTSC {
   }
 
   ///\brief Writes metadata to a filename. Wipes existing contents, if any.
+  ///The metadata is written to a temporary file first, which then replaces the file,
+  ///so that processes reading the file at the same time never see a partially written header.
   bool Meta::toFile(const std::string & fileName){
-    std::ofstream oFile(fileName.c_str());
+    char suffix[24];
+    snprintf(suffix, 24, ".tmp%d", (int)getpid());
+    std::string tmpName = fileName + suffix;
+    std::ofstream oFile(tmpName.c_str());
     oFile << toJSON().toNetPacked();
-    if (!oFile.good()){return false;}
     oFile.close();
+    if (!oFile.good() || rename(tmpName.c_str(), fileName.c_str())){
+      unlink(tmpName.c_str());
+      return false;
+    }
     return true;
   }
 
+  ///\brief Reads a header file as written by toFile, replacing the current contents.
+  ///The file is memory-mapped and the tracks keep viewing their packed key, part, keysize and fragment
+  ///arrays inside the mapping: entries are only decoded when accessed. The mapping is released once no track uses it.
+  ///\returns True if the file could be read and contained a valid header.
+  bool Meta::fromFile(const std::string & fileName){
+    PackedMapping * mapping = PackedMapping::open(fileName);
+    if (!mapping){return false;}
+    bool ret = false;
+    if (mapping->len >= 8 && !memcmp(mapping->data, DTSC::Magic_Header, 4) && Bit::btohl(mapping->data + 4) + 8 <= (unsigned long long)mapping->len){
+      DTSC::Packet headerPack(mapping->data, Bit::btohl(mapping->data + 4) + 8, true);
+      if (headerPack){
+        reinit(headerPack, mapping);
+        applyDeltas(mapping->data + headerPack.getDataLen(), mapping->len - headerPack.getDataLen());
+        if (!live){vod = true;}
+        ret = true;
+      }
+    }else{
+      ERROR_MSG("Header file %s is not a valid DTSC header", fileName.c_str());
+    }
+    mapping->release();
+    return ret;
+  }
+
   ///\brief Converts a meta object to a human readable string
   ///\param str The stringstream to append to
   ///\param indent the amount of indentation needed
@@ -4,6 +4,11 @@
 #include <cstdlib>
 #include <cstring>
 #include <math.h>//for log
+#include <vector>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NAL_SIMD 1
+#include <immintrin.h>
+#endif
 
 #include "nal.h"
 #include "bitstream.h"
@@ -54,16 +59,23 @@ namespace nalu {
     if (!result){
       result = (char *)malloc(dataSize);
     }
-    int offset = 0;
-    while (offset < dataSize){
-      //Read unit size
+    if (result != data){
+      memcpy(result, data, dataSize);
+    }
+    return toAnnexB(result, dataSize);
+  }
+
+  /// Converts 4-byte size prefixed NAL units to Annex B in place, by overwriting every size with a 4-byte start code.
+  /// Stops at a size running past the end of the data. Returns dataSize, as the size does not change.
+  unsigned long toAnnexB(char * data, unsigned long dataSize){
+    unsigned long offset = 0;
+    while (offset + 4 <= dataSize){
       unsigned long unitSize = Bit::btohl(data + offset);
-      //Write annex b header
-      memset(result + offset, 0x00, 3);
-      result[offset + 3] = 0x01;
-      //Copy the nal unit
-      memcpy(result + offset + 4, data + offset + 4, unitSize);
-      //Update the offset
+      if (unitSize > dataSize - offset - 4){
+        WARN_MSG("NAL unit of %lu bytes @ %lu runs past the end of %lu bytes of data", unitSize, offset, dataSize);
+        break;
+      }
+      memcpy(data + offset, "\000\000\000\001", 4);
       offset += 4 + unitSize;
     }
     return dataSize;
@@ -78,7 +90,8 @@ namespace nalu {
   }
 
   ///Scan data for Annex B start code. Returns pointer to it when found, null otherwise.
-  const char * scanAnnexB(const char * data, uint32_t dataSize){
+  ///Plain C++ version, used on CPUs without SIMD support and for the last bytes of the data.
+  static const char * scanAnnexBScalar(const char * data, uint32_t dataSize){
     char * offset = (char*)data;
     const char * maxData = data + dataSize - 2;
     while(offset < maxData){
@@ -101,42 +114,128 @@ namespace nalu {
     return 0;
   }
 
+#ifdef NAL_SIMD
+  ///SSE2 version of scanAnnexB: compares 16 possible start code positions at once.
+  __attribute__((target("sse2"))) static const char * scanAnnexBSSE2(const char * data, uint32_t dataSize){
+    const char * end = data + dataSize;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    while (end - data >= 18){
+      __m128i first = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)data), zero);
+      __m128i second = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + 1)), zero);
+      __m128i third = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + 2)), one);
+      unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(first, second), third));
+      if (mask){return data + __builtin_ctz(mask);}
+      data += 16;
+    }
+    return scanAnnexBScalar(data, end - data);
+  }
+
+  ///AVX2 version of scanAnnexB: compares 32 possible start code positions at once.
+  __attribute__((target("avx2"))) static const char * scanAnnexBAVX2(const char * data, uint32_t dataSize){
+    const char * end = data + dataSize;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    while (end - data >= 34){
+      __m256i first = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)data), zero);
+      __m256i second = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + 1)), zero);
+      __m256i third = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + 2)), one);
+      unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(first, second), third));
+      if (mask){return data + __builtin_ctz(mask);}
+      data += 32;
+    }
+    return scanAnnexBScalar(data, end - data);
+  }
+#endif
+
+  /// Returns the start code scanner with the given name: "scalar", "sse2" or "avx2".
+  /// An empty name selects the fastest one the CPU supports. Returns null if the CPU does not support the requested one.
+  annexBScanner getAnnexBScanner(const std::string & name){
+#ifdef NAL_SIMD
+    __builtin_cpu_init();
+    if ((name == "" || name == "avx2") && __builtin_cpu_supports("avx2")){return scanAnnexBAVX2;}
+    if ((name == "" || name == "sse2") && __builtin_cpu_supports("sse2")){return scanAnnexBSSE2;}
+#endif
+    if (name == "" || name == "scalar"){return scanAnnexBScalar;}
+    return 0;
+  }
+
+  ///Scan data for Annex B start code. Returns pointer to it when found, null otherwise.
+  ///Uses the fastest scanner the CPU supports, selected on first use.
+  const char * scanAnnexB(const char * data, uint32_t dataSize){
+    static annexBScanner scanner = getAnnexBScanner("");
+    return scanner(data, dataSize);
+  }
+
+  /// Converts Annex B data to 4-byte size prefixed NAL units in result, which must have room for dataSize + dataSize / 3 bytes.
+  /// Data before the first start code is dropped; a zero byte right before a start code counts as part of it.
   unsigned long fromAnnexB(const char * data, unsigned long dataSize, char *& result){
-    const char * lastCheck = data + dataSize - 3;
     if (!result){
       FAIL_MSG("No output buffer given to FromAnnexB");
       return 0;
     }
-    int offset = 0;
-    int newOffset = 0;
-    while (offset < dataSize){
-      const char * begin = data + offset;
-      while ( begin < lastCheck && !(!begin[0] && !begin[1] && begin[2] == 0x01)){
-        begin++;
-        if (begin < lastCheck && begin[0]){
-          begin++;
-        }
+    const char * end = data + dataSize;
+    unsigned long newOffset = 0;
+    const char * nal = scanAnnexB(data, dataSize);
+    while (nal){
+      nal += 3;
+      const char * next = scanAnnexB(nal, end - nal);
+      const char * nalEnd = next ? next : end;
+      if (next && nalEnd > nal && !nalEnd[-1]){--nalEnd;}
+      if (nalEnd > nal){
+        Bit::htobl(result + newOffset, nalEnd - nal);
+        memcpy(result + newOffset + 4, nal, nalEnd - nal);
+        newOffset += 4 + (nalEnd - nal);
       }
-      begin += 3;//Initialize begin after the first 0x000001 pattern.
-      if (begin > data + dataSize){
-        offset = dataSize;
-        continue;
+      nal = next;
+    }
+    return newOffset;
+  }
+
+  /// Converts Annex B data to 4-byte size prefixed NAL units in place, the same way as fromAnnexB above. Returns the new size.
+  /// Units only move as far as the start codes before them change in size, instead of being copied to another buffer.
+  unsigned long fromAnnexB(std::string & data){
+    const char * begin = data.data();
+    const char * end = begin + data.size();
+    std::vector<unsigned long> offsets;//position of every unit in data
+    std::vector<unsigned long> sizes;
+    std::vector<unsigned long> newOffsets;//position of the size prefix of every unit once converted
+    unsigned long newSize = 0;
+    const char * nal = scanAnnexB(begin, data.size());
+    while (nal){
+      nal += 3;
+      const char * next = scanAnnexB(nal, end - nal);
+      const char * nalEnd = next ? next : end;
+      if (next && nalEnd > nal && !nalEnd[-1]){--nalEnd;}
+      if (nalEnd > nal){
+        offsets.push_back(nal - begin);
+        sizes.push_back(nalEnd - nal);
+        newOffsets.push_back(newSize);
+        newSize += 4 + (nalEnd - nal);
       }
-      const char * end = (const char*)memmem(begin, dataSize - (begin - data), "\000\000\001", 3);
-      if (!end) {
-        end = data + dataSize;
+      nal = next;
+    }
+    if (newSize > data.size()){data.resize(newSize);}
+    char * buf = &data[0];
+    //Units moving backwards are moved first to last, units moving forwards last to first,
+    //so that no unit is overwritten before it moved.
+    unsigned long i = 0;
+    while (i < offsets.size()){
+      unsigned long runEnd = i;
+      while (runEnd < offsets.size() && newOffsets[runEnd] + 4 > offsets[runEnd]){++runEnd;}
+      if (runEnd == i){
+        memmove(buf + newOffsets[i] + 4, buf + offsets[i], sizes[i]);
+        Bit::htobl(buf + newOffsets[i], sizes[i]);
+        ++i;
+        continue;
       }
-      //Check for 4-byte lead in's. Yes, we access -1 here
-      if (end > begin && (end - data) != dataSize && end[-1] == 0x00){
-        end--;
+      for (unsigned long j = runEnd; j > i; --j){
+        memmove(buf + newOffsets[j - 1] + 4, buf + offsets[j - 1], sizes[j - 1]);
+        Bit::htobl(buf + newOffsets[j - 1], sizes[j - 1]);
       }
-      unsigned int nalSize = end - begin;
-      Bit::htobl(result + newOffset, nalSize);
-      memcpy(result + newOffset + 4, begin, nalSize);
-
-      newOffset += 4 + nalSize;
-      offset = end - data;
+      i = runEnd;
     }
-    return newOffset;
+    data.resize(newSize);
+    return newSize;
   }
 }
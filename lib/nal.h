@@ -15,7 +15,12 @@ namespace nalu {
   std::string removeEmulationPrevention(const std::string & data);
 
   unsigned long toAnnexB(const char * data, unsigned long dataSize, char *& result);
+  unsigned long toAnnexB(char * data, unsigned long dataSize);
   unsigned long fromAnnexB(const char * data, unsigned long dataSize, char *& result);
+  unsigned long fromAnnexB(std::string & data);
+
+  typedef const char * (*annexBScanner)(const char * data, uint32_t dataSize);
+  annexBScanner getAnnexBScanner(const std::string & name);
   const char* scanAnnexB(const char * data, uint32_t dataSize);
   const char* nalEndPosition(const char * data, uint32_t dataSize);
 }
@@ -8,6 +8,11 @@
 #include <cstdio>
 #include <unistd.h>
 #include <iostream>
+#include <algorithm>
+#include <map>
+#ifdef __linux__
+#include <pthread.h>
+#endif
 #include "defines.h"
 #include "shared_memory.h"
 #include "stream.h"
@@ -392,6 +397,15 @@ namespace IPC {
     rhs.master = false;//Make sure the memory does not get unlinked
   }
 
+  ///\brief Exchanges the mappings of two shared pages, without remapping either.
+  void sharedPage::swap(sharedPage & rhs) {
+    std::swap(handle, rhs.handle);
+    std::swap(name, rhs.name);
+    std::swap(len, rhs.len);
+    std::swap(master, rhs.master);
+    std::swap(mapped, rhs.mapped);
+  }
+
 
   ///\brief Initialize a page, de-initialize before if needed
   ///\param name_ The name of the page to be created
@@ -524,6 +538,15 @@ namespace IPC {
     rhs.master = false;//Make sure the memory does not get unlinked
   }
 
+  ///\brief Exchanges the mappings of two shared files, without remapping either.
+  void sharedFile::swap(sharedFile & rhs) {
+    std::swap(handle, rhs.handle);
+    std::swap(name, rhs.name);
+    std::swap(len, rhs.len);
+    std::swap(master, rhs.master);
+    std::swap(mapped, rhs.mapped);
+  }
+
   ///\brief Unmaps a shared file if allowed
   void sharedFile::unmap() {
     if (mapped && len) {
@@ -740,6 +763,194 @@ namespace IPC {
     mySemaphore->post();
   }
 
+  ///\brief Value stored in front of a sharedMutex once it is ready for use.
+  #define SHARED_MUTEX_READY 0x4D4C434Bu
+
+  ///\brief Amount of bytes a sharedMutex takes in its shared page.
+  ///Holds a 4-byte ready marker and 4-byte owner PID, followed by the pthread mutex where available.
+  unsigned int sharedMutex::size(){
+#ifdef __linux__
+    return 8 + sizeof(pthread_mutex_t);
+#else
+    return 8;
+#endif
+  }
+
+  ///\brief Creates a sharedMutex at the given location. See init().
+  sharedMutex::sharedMutex(char * location, bool create) : myData(0) {
+    if (location){
+      init(location, create);
+    }
+  }
+
+  ///\brief Attaches to the lock at the given location.
+  ///\param location Where in the (mapped) shared page the lock lives.
+  ///\param create Whether to initialize a fresh lock at this location; only one process should do this.
+  void sharedMutex::init(char * location, bool create) {
+    myData = location;
+    if (!myData || !create) {
+      return;
+    }
+    *((volatile uint32_t *)myData) = 0;
+    *((volatile uint32_t *)(myData + 4)) = 0;
+#ifdef __linux__
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init((pthread_mutex_t *)(myData + 8), &attr)) {
+      FAIL_MSG("Could not initialize shared mutex: %s", strerror(errno));
+      pthread_mutexattr_destroy(&attr);
+      return;
+    }
+    pthread_mutexattr_destroy(&attr);
+#endif
+    __sync_synchronize();
+    *((volatile uint32_t *)myData) = SHARED_MUTEX_READY;
+  }
+
+  ///\brief Returns whether the lock is attached and initialized.
+  sharedMutex::operator bool() const {
+    return myData && *((volatile uint32_t *)myData) == SHARED_MUTEX_READY;
+  }
+
+  ///\brief Locks the mutex, waiting as long as needed.
+  ///\return True if the lock was obtained, false if the lock is not usable.
+  bool sharedMutex::lock() {
+    if (!*this) {
+      return false;
+    }
+#ifdef __linux__
+    int result;
+    do {
+      result = pthread_mutex_lock((pthread_mutex_t *)(myData + 8));
+    } while (result == EINTR);
+    if (result == EOWNERDEAD) {
+      WARN_MSG("Recovered shared lock left behind by a crashed process");
+      pthread_mutex_consistent((pthread_mutex_t *)(myData + 8));
+      result = 0;
+    }
+    return result == 0;
+#else
+    while (!tryLock()) {
+      Util::sleep(1);
+    }
+    return true;
+#endif
+  }
+
+  ///\brief Tries to lock the mutex without waiting.
+  ///\return True if the lock was obtained, false otherwise.
+  bool sharedMutex::tryLock() {
+    if (!*this) {
+      return false;
+    }
+#ifdef __linux__
+    int result = pthread_mutex_trylock((pthread_mutex_t *)(myData + 8));
+    if (result == EOWNERDEAD) {
+      WARN_MSG("Recovered shared lock left behind by a crashed process");
+      pthread_mutex_consistent((pthread_mutex_t *)(myData + 8));
+      result = 0;
+    }
+    return result == 0;
+#else
+    volatile uint32_t * owner = (volatile uint32_t *)(myData + 4);
+    uint32_t myPid = getpid();
+    if (__sync_bool_compare_and_swap(owner, 0, myPid)) {
+      return true;
+    }
+    uint32_t oldPid = *owner;
+    if (oldPid && !Util::Procs::isRunning(oldPid) && __sync_bool_compare_and_swap(owner, oldPid, myPid)) {
+      WARN_MSG("Recovered shared lock left behind by crashed process %lu", (unsigned long)oldPid);
+      return true;
+    }
+    return false;
+#endif
+  }
+
+  ///\brief Unlocks the mutex. Should only be called after a successful lock() or tryLock().
+  void sharedMutex::unlock() {
+    if (!*this) {
+      return;
+    }
+#ifdef __linux__
+    pthread_mutex_unlock((pthread_mutex_t *)(myData + 8));
+#else
+    __sync_lock_release((volatile uint32_t *)(myData + 4));
+#endif
+  }
+
+  ///\brief Creates a sharedMutex guard, locks the mutex on call
+  sharedMutexGuard::sharedMutexGuard(sharedMutex & thisMutex) : myMutex(thisMutex) {
+    locked = myMutex.lock();
+  }
+
+  ///\brief Destructs a sharedMutex guard, unlocks the mutex on call
+  sharedMutexGuard::~sharedMutexGuard() {
+    if (locked) {
+      myMutex.unlock();
+    }
+  }
+
+  ///\brief Size of the header in front of every sharedServer page.
+  ///Holds the amount of claimed slots (4 bytes), a word index to start searching for free slots (4 bytes),
+  ///page flags (4 bytes), 4 reserved bytes and the sharedMutex guarding disconnects.
+  ///It is followed by a bitmap with one bit per slot, then the slots.
+  #define SLOT_PAGE_HEADER (16 + ((sharedMutex::size() + 7) / 8) * 8)
+  ///\brief Page flag set by the server while it is about to remove the page.
+  #define SLOT_PAGE_CLOSING 1
+  ///\brief Amount of parseEach calls a slot may stay claimed without its counter filled in, before it is freed.
+  #define SLOT_CLAIM_TIMEOUT 10
+
+  ///\brief Returns the amount of slots of slotLen bytes fitting on a page of len bytes, next to the header and bitmap.
+  static unsigned int slotsOnPage(long long len, unsigned int slotLen){
+    if (!slotLen || len <= SLOT_PAGE_HEADER + 8){return 0;}
+    unsigned int slots = ((len - SLOT_PAGE_HEADER) * 8) / (slotLen * 8 + 1);
+    while (slots && SLOT_PAGE_HEADER + ((slots + 63) / 64) * 8 + (long long)slots * slotLen > len){--slots;}
+    return slots;
+  }
+
+  ///\brief Returns the offset of the given slot on a page holding the given amount of slots.
+  static unsigned int slotOffset(unsigned int slots, unsigned int slotLen, unsigned int slot){
+    return SLOT_PAGE_HEADER + ((slots + 63) / 64) * 8 + slot * slotLen;
+  }
+
+  static volatile uint32_t * slotActive(char * mapped){return (volatile uint32_t *)mapped;}
+  static volatile uint32_t * slotHint(char * mapped){return (volatile uint32_t *)(mapped + 4);}
+  static volatile uint32_t * slotFlags(char * mapped){return (volatile uint32_t *)(mapped + 8);}
+  static char * slotLock(char * mapped){return mapped + 16;}
+  static volatile uint64_t * slotBitmap(char * mapped){return (volatile uint64_t *)(mapped + SLOT_PAGE_HEADER);}
+
+  ///\brief Atomically claims a free slot on the given page.
+  ///\return The claimed slot number, or -1 if the page is full or being removed.
+  static int claimSlot(char * mapped, unsigned int slots){
+    if (!slots || (*slotFlags(mapped) & SLOT_PAGE_CLOSING) || *slotActive(mapped) >= slots){return -1;}
+    volatile uint64_t * bitmap = slotBitmap(mapped);
+    unsigned int words = (slots + 63) / 64;
+    unsigned int start = *slotHint(mapped);
+    if (start >= words){start = 0;}
+    for (unsigned int i = 0; i < words; ++i){
+      unsigned int w = (start + i) % words;
+      uint64_t cur = bitmap[w];
+      while (~cur){
+        unsigned int bit = __builtin_ctzll(~cur);
+        if (w * 64 + bit >= slots){break;}
+        if (__sync_bool_compare_and_swap(bitmap + w, cur, cur | (1ull << bit))){
+          __sync_fetch_and_add(slotActive(mapped), 1);
+          //The server may be removing this page; if so, give the slot back and look elsewhere.
+          if (__sync_fetch_and_or(slotFlags(mapped), 0) & SLOT_PAGE_CLOSING){
+            __sync_fetch_and_and(bitmap + w, ~(1ull << bit));
+            __sync_fetch_and_sub(slotActive(mapped), 1);
+            return -1;
+          }
+          *slotHint(mapped) = w;
+          return w * 64 + bit;
+        }
+        cur = bitmap[w];
+      }
+    }
+    return -1;
+  }
   ///\brief Default constructor, erases all the values
   sharedServer::sharedServer() {
     payLen = 0;
@@ -761,39 +972,14 @@ namespace IPC {
   ///\param len The lenght of the payload
   ///\param withCounter Whether the content should have a counter
   void sharedServer::init(std::string name, int len, bool withCounter) {
-    if (mySemaphore) {
-      mySemaphore.close();
-    }
-    if (baseName != "") {
-      mySemaphore.unlink();
-    }
     myPages.clear();
     baseName = "/" + name;
     payLen = len;
     hasCounter = withCounter;
-    mySemaphore.open(baseName.c_str(), O_CREAT | O_EXCL | O_RDWR, ACCESSPERMS, 1);
-    if (!mySemaphore) {
-      mySemaphore.open(baseName.c_str(), O_CREAT | O_RDWR, ACCESSPERMS, 1);
-    }
-    if (!mySemaphore) {
-      DEBUG_MSG(DLVL_FAIL, "Creating semaphore failed: %s", strerror(errno));
-      return;
-    }
-    if (!mySemaphore.tryWaitOneSecond()){
-      WARN_MSG("Force unlocking sharedServer semaphore to prevent deadlock");
-    }
-    mySemaphore.post();
-    semGuard tmpGuard(&mySemaphore);
     amount = 0;
     newPage();
   }
 
-  ///\brief The deconstructor
-  sharedServer::~sharedServer() {
-    mySemaphore.close();
-    mySemaphore.unlink();
-  }
-
   ///\brief Determines whether a sharedServer is valid
   sharedServer::operator bool() const {
     return myPages.size();
@@ -815,50 +1001,41 @@ namespace IPC {
     if (!tmp.mapped){
       tmp.init(std::string(baseName.substr(1) + (char)(myPages.size() + (int)'A')), std::min(((8192 * 2) << myPages.size()), (32 * 1024 * 1024)), true);
       tmp.master = false;
+      sharedMutex(slotLock(tmp.mapped), true);
+    }else{
+      //Re-using a page left behind; make sure it is not marked as closing anymore.
+      __sync_fetch_and_and(slotFlags(tmp.mapped), ~SLOT_PAGE_CLOSING);
+      if (!sharedMutex(slotLock(tmp.mapped))){
+        sharedMutex(slotLock(tmp.mapped), true);
+      }
     }
     myPages.push_back(tmp);
     myPages.back().master = true;
     VERYHIGH_MSG("Created a new page: %s", tmp.name.c_str());
-    amount += (32 * 1024 * 1024)*myPages.size();//assume maximum load - we don't want to miss any entries
   }
 
-  ///\brief Deletes the highest allocated page
+  ///\brief Deletes the highest allocated page, if no client claimed a slot on it.
   void sharedServer::deletePage() {
     if (myPages.size() == 1) {
       DEBUG_MSG(DLVL_WARN, "Can't remove last page for %s", baseName.c_str());
       return;
     }
+    char * mapped = myPages.back().mapped;
+    if (mapped){
+      //Mark the page closing first, then check it is still empty.
+      //Clients do the reverse after claiming, so at least one of us notices the other.
+      __sync_fetch_and_or(slotFlags(mapped), SLOT_PAGE_CLOSING);
+      if (__sync_fetch_and_add(slotActive(mapped), 0)){
+        __sync_fetch_and_and(slotFlags(mapped), ~SLOT_PAGE_CLOSING);
+        return;
+      }
+    }
     myPages.pop_back();
   }
 
   ///\brief Determines whether an id is currently in use or not
   bool sharedServer::isInUse(unsigned int id) {
-    unsigned int i = 0;
-    for (std::deque<sharedPage>::iterator it = myPages.begin(); it != myPages.end(); it++) {
-      //return if we reached the end
-      if (!it->mapped || !it->len) {
-        return false;
-      }
-      //not on this page? skip to next.
-      if (it->len < (id - i)*payLen) {
-        i += it->len / payLen;
-        continue;
-      }
-      if (hasCounter) {
-        //counter? return true if it is non-zero.
-        return (it->mapped[(id - i) * payLen] != 0);
-      } else {
-        //no counter - check the entire size for being all zeroes.
-        for (unsigned int j = 0; j < payLen; ++j) {
-          if (it->mapped[(id - i)*payLen + j]) {
-            return true;
-          }
-        }
-        return false;
-      }
-    }
-    //only happens if we run out of pages
-    return false;
+    return getIndex(id) != 0;
   }
 
   ///Disconnect all connected users, waits at most 2.5 seconds until completed
@@ -876,52 +1053,53 @@ namespace IPC {
   ///Returns a pointer to the data for the given index.
   ///Returns null on error or if index is empty.
   char * sharedServer::getIndex(unsigned int requestId){
-    char * empty = 0;
-    if (!hasCounter) {
-      empty = (char *)malloc(payLen * sizeof(char));
-      memset(empty, 0, payLen);
-    }
+    unsigned int slotLen = payLen + (hasCounter ? 1 : 0);
     unsigned int id = 0;
     for (std::deque<sharedPage>::iterator it = myPages.begin(); it != myPages.end(); it++) {
       if (!it->mapped || !it->len) {
         DEBUG_MSG(DLVL_FAIL, "Something went terribly wrong?");
         return 0;
       }
-      unsigned int offset = 0;
-      while (offset + payLen + (hasCounter ? 1 : 0) <= it->len) {
-        if (id == requestId){
-          if (hasCounter) {
-            if (it->mapped[offset] != 0) {
-              return it->mapped + offset + 1;
-            }else{
-              return 0;
-            }
-          } else {
-            if (memcmp(empty, it->mapped + offset, payLen)) {
-              return it->mapped + offset;
-            }else{
-              return 0;
-            }
-          }
-        }
-        offset += payLen + (hasCounter ? 1 : 0);
-        id ++;
+      unsigned int slots = slotsOnPage(it->len, slotLen);
+      if (requestId >= id + slots){
+        id += slots;
+        continue;
+      }
+      unsigned int slot = requestId - id;
+      if (!(slotBitmap(it->mapped)[slot / 64] & (1ull << (slot % 64)))){
+        return 0;
       }
+      char * data = it->mapped + slotOffset(slots, slotLen, slot);
+      if (hasCounter){
+        return (*data != 0) ? data + 1 : 0;
+      }
+      return data;
     }
     return 0;
   }
 
+  ///\brief Frees a slot so it may be claimed again: clears it, then releases its bit in the page bitmap.
+  void sharedServer::releaseSlot(char * mapped, unsigned int slots, unsigned int slot){
+    unsigned int slotLen = payLen + (hasCounter ? 1 : 0);
+    memset(mapped + slotOffset(slots, slotLen, slot), 0, slotLen);
+    __sync_fetch_and_and(slotBitmap(mapped) + slot / 64, ~(1ull << (slot % 64)));
+    __sync_fetch_and_sub(slotActive(mapped), 1);
+    if (*slotHint(mapped) > slot / 64){
+      *slotHint(mapped) = slot / 64;
+    }
+  }
+
   ///\brief Parse each of the possible payload pieces, and runs a callback on it if in use.
+  ///Only the slots marked as claimed in each page's bitmap are visited.
+  ///A slot claimed by a client that died before filling in its counter is freed once that client is gone,
+  ///or after SLOT_CLAIM_TIMEOUT calls if it did not write its PID either.
   void sharedServer::parseEach(void (*activeCallback)(char * data, size_t len, unsigned int id), void (*disconCallback)(char * data, size_t len, unsigned int id)) {
-    char * empty = 0;
-    if (!hasCounter) {
-      empty = (char *)malloc(payLen * sizeof(char));
-      memset(empty, 0, payLen);
-    }
+    unsigned int slotLen = payLen + (hasCounter ? 1 : 0);
+    std::map<unsigned int, unsigned int> stillUnfilled;
     unsigned int id = 0;
     unsigned int userCount = 0;
     unsigned int emptyCount = 0;
-    unsigned int lastFilled = 0;
+    unsigned int highest = 0;
     connectedUsers = 0;
     for (std::deque<sharedPage>::iterator it = myPages.begin(); it != myPages.end(); it++) {
       if (!it->mapped || !it->len) {
@@ -929,34 +1107,58 @@ namespace IPC {
         break;
       }
       userCount = 0;
-      unsigned int offset = 0;
-      while (offset + payLen + (hasCounter ? 1 : 0) <= it->len) {
-        if (hasCounter) {
-          if (it->mapped[offset] != 0) {
-            char * counter = it->mapped + offset;
-            //increase the count if needed
+      unsigned int slots = slotsOnPage(it->len, slotLen);
+      if (*slotActive(it->mapped)){
+        volatile uint64_t * bitmap = slotBitmap(it->mapped);
+        unsigned int words = (slots + 63) / 64;
+        for (unsigned int w = 0; w < words; ++w){
+          uint64_t claimed = bitmap[w];
+          while (claimed){
+            unsigned int slot = w * 64 + __builtin_ctzll(claimed);
+            claimed &= claimed - 1;
+            if (slot >= slots){break;}
+            char * counter = it->mapped + slotOffset(slots, slotLen, slot);
+            unsigned int slotId = id + slot;
+            if (!hasCounter){
+              ++userCount;
+              highest = slotId + 1;
+              activeCallback(counter, payLen, slotId);
+              continue;
+            }
+            //Claimed, but the client did not fill in its counter yet
+            if (*counter == 0){
+              uint32_t claimPID = *((uint32_t *)(counter + 1 + payLen - 4));
+              unsigned int seen = unfilled.count(slotId) ? unfilled[slotId] + 1 : 1;
+              bool gone = claimPID > 1 ? !Util::Procs::isRunning(claimPID) : seen >= SLOT_CLAIM_TIMEOUT;
+              if (it->master && gone){
+                WARN_MSG("Freeing slot %u of %s, claimed by a client that never used it", slotId, baseName.c_str());
+                sharedMutex pageLock(slotLock(it->mapped));
+                sharedMutexGuard tmpGuard(pageLock);
+                releaseSlot(it->mapped, slots, slot);
+                continue;
+              }
+              stillUnfilled[slotId] = seen;
+              ++userCount;
+              continue;
+            }
             ++userCount;
             if (*counter & 0x80){
               connectedUsers++;
             }
             char countNum = (*counter) & 0x7F;
-            lastFilled = id;
-            if (id >= amount) {
-              amount = id + 1;
-              VERYHIGH_MSG("Shared memory %s is now at count %u", baseName.c_str(), amount);
-            }
-            uint32_t tmpPID = *((uint32_t *)(it->mapped + 1 + offset + payLen - 4));
+            highest = slotId + 1;
+            uint32_t tmpPID = *((uint32_t *)(counter + 1 + payLen - 4));
             if (tmpPID > 1 && it->master && !Util::Procs::isRunning(tmpPID) && !(countNum == 126 || countNum == 127)){
               WARN_MSG("process disappeared, timing out. (pid %lu)", tmpPID);
               *counter = 125 | (0x80 & (*counter)); //if process is already dead, instant timeout.
             }
-            activeCallback(it->mapped + offset + 1, payLen, id);
+            activeCallback(counter + 1, payLen, slotId);
             switch (countNum) {
               case 127:
-                HIGH_MSG("Client %u requested disconnect", id);
+                HIGH_MSG("Client %u requested disconnect", slotId);
                 break;
               case 126:
-                HIGH_MSG("Client %u timed out", id);
+                HIGH_MSG("Client %u timed out", slotId);
                 break;
               default:
 #ifndef NOCRASHCHECK
@@ -988,56 +1190,20 @@ namespace IPC {
                 break;
             }
             if (countNum == 127 || countNum == 126){
-              semGuard tmpGuard(&mySemaphore);
+              sharedMutex pageLock(slotLock(it->mapped));
+              sharedMutexGuard tmpGuard(pageLock);
               if (disconCallback){
-                disconCallback(counter + 1, payLen, id);
+                disconCallback(counter + 1, payLen, slotId);
               }
-              memset(counter + 1, 0, payLen);
-              *counter = 0;
+              releaseSlot(it->mapped, slots, slot);
+              --userCount;
             } else {
               ++(*counter);
             }
-          } else {
-            //stop if we're past the amount counted and we're empty
-            if (id >= amount) {
-              //bring the counter down if this was the last element
-              if (lastFilled+1 < amount) {
-                amount = lastFilled+1;
-                VERYHIGH_MSG("Shared memory %s is now at count %u", baseName.c_str(), amount);
-              }
-              //stop, we're guaranteed no more pages are full at this point
-              break;
-            }
-          }
-        } else {
-          if (memcmp(empty, it->mapped + offset, payLen)) {
-            ++userCount;
-            //increase the count if needed
-            lastFilled = id;
-            if (id >= amount) {
-              amount = id + 1;
-              VERYHIGH_MSG("Shared memory %s is now at count %u", baseName.c_str(), amount);
-            }
-            activeCallback(it->mapped + offset, payLen, id);
-          } else {
-            //stop if we're past the amount counted and we're empty
-            if (id >= amount) {
-              //bring the counter down if this was the last element
-              if (lastFilled+1 < amount) {
-                amount = lastFilled+1;
-                VERYHIGH_MSG("Shared memory %s is now at count %u", baseName.c_str(), amount);
-              }
-              //stop, we're guaranteed no more pages are full at this point
-              if (empty) {
-                free(empty);
-              }
-              break;
-            }
           }
         }
-        offset += payLen + (hasCounter ? 1 : 0);
-        id ++;
       }
+      id += slots;
       if (userCount == 0) {
         ++emptyCount;
       } else {
@@ -1045,7 +1211,6 @@ namespace IPC {
         std::deque<sharedPage>::iterator tIt = it;
         if (++tIt == myPages.end()){
           bool unsetMaster = !(it->master);
-          semGuard tmpGuard(&mySemaphore);
           newPage();
           if (unsetMaster){
             (myPages.end()-1)->master = false;
@@ -1054,15 +1219,15 @@ namespace IPC {
         }
       }
     }
+    unfilled.swap(stillUnfilled);
+    if (amount != highest){
+      amount = highest;
+      VERYHIGH_MSG("Shared memory %s is now at count %u", baseName.c_str(), amount);
+    }
 
     if (emptyCount > 1) {
-      semGuard tmpGuard(&mySemaphore);
       deletePage();
     }
-
-    if (empty) {
-      free(empty);
-    }
   }
 
   ///\brief Creates an empty shared client
@@ -1081,16 +1246,6 @@ namespace IPC {
     baseName = rhs.baseName;
     payLen = rhs.payLen;
     hasCounter = rhs.hasCounter;
-#ifdef __APPLE__
-    //note: O_CREAT is only needed for mac, probably
-    mySemaphore.open(baseName.c_str(), O_RDWR | O_CREAT, 0);
-#else
-    mySemaphore.open(baseName.c_str(), O_RDWR);
-#endif
-    if (!mySemaphore) {
-      DEBUG_MSG(DLVL_FAIL, "Creating semaphore failed: %s", strerror(errno));
-      return;
-    }
     myPage.init(rhs.myPage.name, rhs.myPage.len, rhs.myPage.master);
     offsetOnPage = rhs.offsetOnPage;
   }
@@ -1101,88 +1256,52 @@ namespace IPC {
     baseName = rhs.baseName;
     payLen = rhs.payLen;
     hasCounter = rhs.hasCounter;
-#ifdef __APPLE__
-    //note: O_CREAT is only needed for mac, probably
-    mySemaphore.open(baseName.c_str(), O_RDWR | O_CREAT, 0);
-#else
-    mySemaphore.open(baseName.c_str(), O_RDWR);
-#endif
-    if (!mySemaphore) {
-      DEBUG_MSG(DLVL_FAIL, "Creating copy of semaphore %s failed: %s", baseName.c_str(), strerror(errno));
-      return;
-    }
     myPage.init(rhs.myPage.name, rhs.myPage.len, rhs.myPage.master);
     offsetOnPage = rhs.offsetOnPage;
   }
 
   ///\brief SharedClient Constructor, allocates space on the correct page.
+  ///Slots are claimed lock-free through the bitmap in the page header.
   ///\param name The basename of the server to connect to
   ///\param len The size of the payload to allocate
   ///\param withCounter Whether or not this payload has a counter
   sharedClient::sharedClient(std::string name, int len, bool withCounter) : baseName("/" + name), payLen(len), offsetOnPage(-1), hasCounter(withCounter) {
     countAsViewer = true;
-#ifdef __APPLE__
-    //note: O_CREAT is only needed for mac, probably
-    mySemaphore.open(baseName.c_str(), O_RDWR | O_CREAT, 0);
-#else
-    mySemaphore.open(baseName.c_str(), O_RDWR);
-#endif
-    if (!mySemaphore) {
-      DEBUG_MSG(DLVL_FAIL, "Creating semaphore %s failed: %s", baseName.c_str(), strerror(errno));
-      return;
-    }
-    //Empty is used to compare for emptyness. This is not needed when the page uses a counter
-    char * empty = 0;
-    if (!hasCounter) {
-      empty = (char *)malloc(payLen * sizeof(char));
-      if (!empty) {
-        DEBUG_MSG(DLVL_FAIL, "Failed to allocate %u bytes for empty payload!", payLen);
-        return;
-      }
-      memset(empty, 0, payLen);
-    }
+    unsigned int slotLen = payLen + (hasCounter ? 1 : 0);
+    unsigned int noServer = 0;
     while (offsetOnPage == -1) {
-      {
-        for (char i = 'A'; i <= 'Z'; i++) {
-          myPage.init(baseName.substr(1) + i, (4096 << (i - 'A')), false, false);
-          if (!myPage.mapped) {
-            break;
+      unsigned int id = 0;
+      for (char i = 'A'; i <= 'Z'; i++) {
+        myPage.init(baseName.substr(1) + i, (4096 << (i - 'A')), false, false);
+        if (!myPage.mapped) {
+          //Without a first page, there is no server to connect to (yet)
+          if (i == 'A' && ++noServer >= 10) {
+            DEBUG_MSG(DLVL_FAIL, "Could not open page %sA: %s", baseName.c_str() + 1, strerror(errno));
+            return;
           }
-          int offset = 0;
-          while (offset + payLen + (hasCounter ? 1 : 0) <= myPage.len) {
-            if ((hasCounter && myPage.mapped[offset] == 0) || (!hasCounter && !memcmp(myPage.mapped + offset, empty, payLen))) {
-              semGuard tmpGuard(&mySemaphore);
-              if ((hasCounter && myPage.mapped[offset] == 0) || (!hasCounter && !memcmp(myPage.mapped + offset, empty, payLen))) {
-                offsetOnPage = offset;
-                if (hasCounter) {
-                  myPage.mapped[offset] = 1;
-                  *((uint32_t *)(myPage.mapped + 1 + offset + len - 4)) = getpid();
-                  HIGH_MSG("sharedClient received ID %d", offsetOnPage/(payLen+1));
-                }
-                break;
-              }
-            }
-            offset += payLen + (hasCounter ? 1 : 0);
-          }
-          if (offsetOnPage != -1) {
-            break;
+          break;
+        }
+        unsigned int slots = slotsOnPage(myPage.len, slotLen);
+        int slot = claimSlot(myPage.mapped, slots);
+        if (slot != -1) {
+          offsetOnPage = slotOffset(slots, slotLen, slot);
+          if (hasCounter) {
+            *((uint32_t *)(myPage.mapped + 1 + offsetOnPage + len - 4)) = getpid();
+            myPage.mapped[offsetOnPage] = 1;
+            HIGH_MSG("sharedClient received ID %u", id + slot);
           }
+          break;
         }
+        id += slots;
       }
       if (offsetOnPage == -1) {
         Util::wait(500);
       }
     }
-    if (empty) {
-      free(empty);
-    }
   }
 
   ///\brief The deconstructor
   sharedClient::~sharedClient() {
-    mySemaphore.close();
-
-
   }
 
   ///\brief Writes data to the shared data
@@ -1203,9 +1322,12 @@ namespace IPC {
       myPage.close();
       return;
     }
-    semGuard tmpGuard(&mySemaphore);
-    myPage.mapped[offsetOnPage] = 126 | (countAsViewer?0x80:0);
-    HIGH_MSG("sharedClient finished ID %d", offsetOnPage/(payLen+1));
+    {
+      sharedMutex pageLock(slotLock(myPage.mapped));
+      sharedMutexGuard tmpGuard(pageLock);
+      myPage.mapped[offsetOnPage] = 126 | (countAsViewer?0x80:0);
+    }
+    HIGH_MSG("sharedClient finished slot at offset %d of %s", offsetOnPage, myPage.name.c_str());
     myPage.close();
   }
 
@@ -1290,3 +1412,296 @@ namespace IPC {
   }
 }
 
+
+namespace IPC {
+  //Layout of the page accounting page: a header of 64-bit counters, a sharedMutex, then PAGE_ACCOUNTING_ENTRIES entries.
+  #define PAGE_ACCT_BUDGET 0
+  #define PAGE_ACCT_USED 8
+  #define PAGE_ACCT_COUNT 16
+  #define PAGE_ACCT_EVICTIONS 24
+  #define PAGE_ACCT_HITS 32
+  #define PAGE_ACCT_MISSES 40
+  #define PAGE_ACCT_EVICT_GEN 48
+  #define PAGE_ACCT_LOCK 64
+  //Each entry holds flags (4 bytes), the PID of the owner (4), the page size (8), its last use in bootMS (8) and the page name.
+  //Entries are placed by a hash of the page name, with linear probing.
+  #define PAGE_ACCT_ENTRY_SIZE 256
+  #define PAGE_ACCT_NAME 24
+  #define PAGE_ACCT_FLAG_USED 1
+  #define PAGE_ACCT_FLAG_EVICTABLE 2
+  #define PAGE_ACCT_FLAG_EVICT 4
+  #define PAGE_ACCT_FLAG_INUSE 8
+
+  ///Offset of the first entry on the page accounting page.
+  static unsigned int pageAcctStart(){
+    return PAGE_ACCT_LOCK + ((sharedMutex::size() + 7) / 8) * 8;
+  }
+
+  ///Opens the page accounting page, or (re)creates it empty when master is true.
+  pageAccounting::pageAccounting(bool master){
+    isMaster = master;
+    if (isMaster){
+      page.init(SHM_PAGE_ACCOUNTING, pageAcctStart() + PAGE_ACCOUNTING_ENTRIES * PAGE_ACCT_ENTRY_SIZE, true);
+      if (page.mapped){
+        memset(page.mapped, 0, page.len);
+        sharedMutex(page.mapped + PAGE_ACCT_LOCK, true);
+      }
+    }
+  }
+
+  ///Returns true if the page accounting page is available, (re)opening it first if needed.
+  pageAccounting::operator bool(){
+    if (isMaster){
+      return page.mapped;
+    }
+    bool stale = !page.mapped;
+#if !defined(__CYGWIN__) && !defined(_WIN32)
+    //The controller may have restarted and recreated the page under the same name
+    struct stat pageStat;
+    if (!stale && (fstat(page.handle, &pageStat) || !pageStat.st_nlink)){
+      stale = true;
+    }
+#endif
+    if (stale){
+      page.init(SHM_PAGE_ACCOUNTING, 0, false, false);
+    }
+    return page.mapped && page.len >= pageAcctStart() + PAGE_ACCOUNTING_ENTRIES * PAGE_ACCT_ENTRY_SIZE;
+  }
+
+  ///Returns a pointer to the given entry.
+  char * pageAccounting::entry(unsigned int num){
+    return page.mapped + pageAcctStart() + num * PAGE_ACCT_ENTRY_SIZE;
+  }
+
+  ///Returns the entry number a page name hashes to (FNV-1a).
+  static unsigned int pageAcctHash(const char * pageName){
+    uint32_t hash = 2166136261u;
+    for (const char * c = pageName; *c; ++c){
+      hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash % PAGE_ACCOUNTING_ENTRIES;
+  }
+
+  ///Returns the entry for the given page, or 0 if it is not accounted for. The lock must be held.
+  ///\param freeEntry If set, filled with the free entry the page would be placed in, or 0 if the accounting is full.
+  char * pageAccounting::find(const std::string & pageName, char ** freeEntry){
+    unsigned int num = pageAcctHash(pageName.c_str());
+    for (unsigned int i = 0; i < PAGE_ACCOUNTING_ENTRIES; ++i){
+      char * e = entry((num + i) % PAGE_ACCOUNTING_ENTRIES);
+      if (!(Bit::btohl(e) & PAGE_ACCT_FLAG_USED)){
+        if (freeEntry){*freeEntry = e;}
+        return 0;
+      }
+      if (pageName == e + PAGE_ACCT_NAME){
+        return e;
+      }
+    }
+    if (freeEntry){*freeEntry = 0;}
+    return 0;
+  }
+
+  ///Removes the given entry, moving later entries of the same probe sequence back so lookups keep finding them.
+  ///Subtracts the page from the used bytes and page count. The lock must be held.
+  void pageAccounting::erase(char * e){
+    Bit::htobll(page.mapped + PAGE_ACCT_USED, Bit::btohll(page.mapped + PAGE_ACCT_USED) - Bit::btohll(e + 8));
+    Bit::htobll(page.mapped + PAGE_ACCT_COUNT, Bit::btohll(page.mapped + PAGE_ACCT_COUNT) - 1);
+    unsigned int start = (e - entry(0)) / PAGE_ACCT_ENTRY_SIZE;
+    unsigned int hole = start;
+    for (unsigned int i = 1; i < PAGE_ACCOUNTING_ENTRIES; ++i){
+      unsigned int num = (start + i) % PAGE_ACCOUNTING_ENTRIES;
+      char * next = entry(num);
+      if (!(Bit::btohl(next) & PAGE_ACCT_FLAG_USED)){break;}
+      //An entry may only move back if the hole lies between its hash position and where it is now
+      unsigned int home = pageAcctHash(next + PAGE_ACCT_NAME);
+      if ((num + PAGE_ACCOUNTING_ENTRIES - home) % PAGE_ACCOUNTING_ENTRIES >= (num + PAGE_ACCOUNTING_ENTRIES - hole) % PAGE_ACCOUNTING_ENTRIES){
+        memcpy(entry(hole), next, PAGE_ACCT_ENTRY_SIZE);
+        hole = num;
+      }
+    }
+    memset(entry(hole), 0, PAGE_ACCT_ENTRY_SIZE);
+  }
+
+  ///Sets the byte budget for all data pages together. Zero means no budget.
+  void pageAccounting::setBudget(uint64_t bytes){
+    if (!*this){return;}
+    Bit::htobll(page.mapped + PAGE_ACCT_BUDGET, bytes);
+  }
+
+  ///Registers a newly created data page, owned by the calling process.
+  ///If this takes the total over budget, idle evictable pages are marked for eviction.
+  ///\param evictable Whether the owner can reload the page when needed again, which is the case for VoD pages.
+  void pageAccounting::add(const std::string & pageName, uint64_t size, bool evictable){
+    if (!*this || pageName.size() >= PAGE_ACCT_ENTRY_SIZE - PAGE_ACCT_NAME){return;}
+    sharedMutex lock(page.mapped + PAGE_ACCT_LOCK);
+    sharedMutexGuard guard(lock);
+    uint64_t used = Bit::btohll(page.mapped + PAGE_ACCT_USED);
+    char * freeEntry = 0;
+    char * e = find(pageName, &freeEntry);
+    if (e){
+      used -= Bit::btohll(e + 8);
+    }else{
+      e = freeEntry;
+      if (!e){
+        WARN_MSG("Page accounting is full, not accounting for page %s", pageName.c_str());
+        return;
+      }
+      memcpy(e + PAGE_ACCT_NAME, pageName.c_str(), pageName.size() + 1);
+      Bit::htobll(page.mapped + PAGE_ACCT_COUNT, Bit::btohll(page.mapped + PAGE_ACCT_COUNT) + 1);
+    }
+    Bit::htobl(e, PAGE_ACCT_FLAG_USED | (evictable ? PAGE_ACCT_FLAG_EVICTABLE : 0));
+    Bit::htobl(e + 4, getpid());
+    Bit::htobll(e + 8, size);
+    Bit::htobll(e + 16, Util::bootMS());
+    used += size;
+    Bit::htobll(page.mapped + PAGE_ACCT_USED, used);
+    uint64_t budget = Bit::btohll(page.mapped + PAGE_ACCT_BUDGET);
+    if (budget && used > budget){
+      evict(used - budget);
+    }
+  }
+
+  ///Marks the least recently used idle evictable pages for eviction, until at least size bytes will be freed.
+  ///Pages that were marked before count towards this amount. The lock must be held.
+  ///Only runs while over budget, so it is the one call that looks at all entries.
+  void pageAccounting::evict(uint64_t size){
+    uint64_t now = Util::bootMS();
+    uint64_t pending = 0;
+    uint64_t marked = 0;
+    std::multimap<uint64_t, char *> candidates;
+    for (unsigned int i = 0; i < PAGE_ACCOUNTING_ENTRIES; ++i){
+      char * e = entry(i);
+      uint32_t flags = Bit::btohl(e);
+      if (!(flags & PAGE_ACCT_FLAG_USED)){continue;}
+      if (flags & PAGE_ACCT_FLAG_EVICT){
+        pending += Bit::btohll(e + 8);
+        continue;
+      }
+      if ((flags & PAGE_ACCT_FLAG_EVICTABLE) && !(flags & PAGE_ACCT_FLAG_INUSE) && Bit::btohll(e + 16) + PAGE_ACCOUNTING_IDLE < now){
+        candidates.insert(std::pair<uint64_t, char *>(Bit::btohll(e + 16), e));
+      }
+    }
+    for (std::multimap<uint64_t, char *>::iterator it = candidates.begin(); it != candidates.end() && pending < size; ++it){
+      //Nobody is left to release pages of a process that is gone
+      if (!Util::Procs::isRunning(Bit::btohl(it->second + 4))){continue;}
+      Bit::htobl(it->second, Bit::btohl(it->second) | PAGE_ACCT_FLAG_EVICT);
+      pending += Bit::btohll(it->second + 8);
+      ++marked;
+      MEDIUM_MSG("Evicting page %s to stay within the shared memory budget", it->second + PAGE_ACCT_NAME);
+    }
+    if (marked){
+      Bit::htobll(page.mapped + PAGE_ACCT_EVICT_GEN, Bit::btohll(page.mapped + PAGE_ACCT_EVICT_GEN) + 1);
+    }
+    if (pending < size){
+      static uint64_t lastWarn = 0;
+      if (!lastWarn || now - lastWarn > 10000){
+        WARN_MSG("Shared memory use is %llu bytes over budget, and no idle VoD pages are left to evict", (unsigned long long)(size - pending));
+        lastWarn = now;
+      }
+    }
+  }
+
+  ///Removes a data page from the accounting, as it is being deleted.
+  void pageAccounting::remove(const std::string & pageName){
+    if (!*this){return;}
+    sharedMutex lock(page.mapped + PAGE_ACCT_LOCK);
+    sharedMutexGuard guard(lock);
+    char * e = find(pageName);
+    if (!e){return;}
+    if (Bit::btohl(e) & PAGE_ACCT_FLAG_EVICT){
+      Bit::htobll(page.mapped + PAGE_ACCT_EVICTIONS, Bit::btohll(page.mapped + PAGE_ACCT_EVICTIONS) + 1);
+    }
+    erase(e);
+  }
+
+  ///Marks a page as in use by viewers or not, as its use changes. Pages in use are never evicted.
+  ///A page that goes out of use counts as last used now.
+  void pageAccounting::setInUse(const std::string & pageName, bool inUse){
+    if (!*this){return;}
+    sharedMutex lock(page.mapped + PAGE_ACCT_LOCK);
+    sharedMutexGuard guard(lock);
+    char * e = find(pageName);
+    if (!e){return;}
+    if (inUse){
+      Bit::htobl(e, (Bit::btohl(e) | PAGE_ACCT_FLAG_INUSE) & ~PAGE_ACCT_FLAG_EVICT);
+    }else{
+      Bit::htobl(e, Bit::btohl(e) & ~PAGE_ACCT_FLAG_INUSE);
+      Bit::htobll(e + 16, Util::bootMS());
+    }
+  }
+
+  ///Adds viewer requests that found their page loaded (hits) or needed it loaded first (misses) to the counters.
+  void pageAccounting::addStats(uint64_t hits, uint64_t misses){
+    if ((!hits && !misses) || !*this){return;}
+    sharedMutex lock(page.mapped + PAGE_ACCT_LOCK);
+    sharedMutexGuard guard(lock);
+    Bit::htobll(page.mapped + PAGE_ACCT_HITS, Bit::btohll(page.mapped + PAGE_ACCT_HITS) + hits);
+    Bit::htobll(page.mapped + PAGE_ACCT_MISSES, Bit::btohll(page.mapped + PAGE_ACCT_MISSES) + misses);
+  }
+
+  ///Returns true if pages were marked for eviction since the last call that returned true with the same seen value.
+  ///Cheap enough to call every serve loop iteration: it takes no lock.
+  bool pageAccounting::evictionsChanged(uint64_t & seen){
+    if (!*this){return false;}
+    uint64_t gen = Bit::btohll(page.mapped + PAGE_ACCT_EVICT_GEN);
+    if (gen == seen){return false;}
+    seen = gen;
+    return true;
+  }
+
+  ///Fills evictPages with those of pageNames that are marked for eviction.
+  void pageAccounting::getEvictions(const std::set<std::string> & pageNames, std::set<std::string> & evictPages){
+    evictPages.clear();
+    if (!pageNames.size() || !*this){return;}
+    sharedMutex lock(page.mapped + PAGE_ACCT_LOCK);
+    sharedMutexGuard guard(lock);
+    for (std::set<std::string>::const_iterator it = pageNames.begin(); it != pageNames.end(); ++it){
+      char * e = find(*it);
+      if (e && (Bit::btohl(e) & PAGE_ACCT_FLAG_EVICT)){
+        evictPages.insert(*it);
+      }
+    }
+  }
+
+  ///Removes entries for pages that no longer exist, e.g. because their owner crashed or deleted them without telling.
+  void pageAccounting::reap(){
+#if !defined(__CYGWIN__) && !defined(_WIN32)
+    if (!*this){return;}
+    sharedMutex lock(page.mapped + PAGE_ACCT_LOCK);
+    sharedMutexGuard guard(lock);
+    for (unsigned int i = 0; i < PAGE_ACCOUNTING_ENTRIES;){
+      char * e = entry(i);
+      if (!(Bit::btohl(e) & PAGE_ACCT_FLAG_USED)){
+        ++i;
+        continue;
+      }
+      int fd = shm_open(e + PAGE_ACCT_NAME, O_RDONLY, 0);
+      if (fd != -1){
+        ::close(fd);
+        ++i;
+        continue;
+      }
+      if (errno != ENOENT){
+        ++i;
+        continue;
+      }
+      HIGH_MSG("Page %s is gone, removing it from the page accounting", e + PAGE_ACCT_NAME);
+      //Erasing may move another entry into this one, so check it again
+      erase(e);
+    }
+#endif
+  }
+
+  ///Reads the budget, the total size and amount of accounted pages, and the eviction, hit and miss counters.
+  void pageAccounting::getStats(uint64_t & budget, uint64_t & used, uint64_t & pages, uint64_t & evictions, uint64_t & hits, uint64_t & misses){
+    budget = used = pages = evictions = hits = misses = 0;
+    if (!*this){return;}
+    sharedMutex lock(page.mapped + PAGE_ACCT_LOCK);
+    sharedMutexGuard guard(lock);
+    budget = Bit::btohll(page.mapped + PAGE_ACCT_BUDGET);
+    used = Bit::btohll(page.mapped + PAGE_ACCT_USED);
+    pages = Bit::btohll(page.mapped + PAGE_ACCT_COUNT);
+    evictions = Bit::btohll(page.mapped + PAGE_ACCT_EVICTIONS);
+    hits = Bit::btohll(page.mapped + PAGE_ACCT_HITS);
+    misses = Bit::btohll(page.mapped + PAGE_ACCT_MISSES);
+  }
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include <string>
 #include <set>
+#include <map>
 
 #include "timing.h"
 #include "defines.h"
@@ -97,6 +98,38 @@ namespace IPC {
       semaphore * mySemaphore;
   };
 
+  ///\brief A lock that lives inside a shared memory page, usable from multiple processes.
+  ///
+  ///On Linux this is a robust, process-shared pthread mutex: locking and unlocking are plain atomics when
+  ///uncontended, and a lock held by a process that crashed is recovered by the next process locking it.
+  ///Elsewhere it falls back to a spinlock storing the PID of its owner, which is taken over once that process is gone.
+  ///The lock takes size() bytes at the given location, which should be 8-byte aligned.
+  class sharedMutex {
+    public:
+      sharedMutex(char * location = 0, bool create = false);
+      void init(char * location, bool create = false);
+      operator bool() const;
+      bool lock();
+      bool tryLock();
+      void unlock();
+      static unsigned int size();
+    private:
+      ///\brief Location of the lock in the shared page.
+      char * myData;
+  };
+
+  ///\brief A class used as a sharedMutex guard
+  class sharedMutexGuard {
+    public:
+      sharedMutexGuard(sharedMutex & thisMutex);
+      ~sharedMutexGuard();
+    private:
+      ///\brief The mutex to guard.
+      sharedMutex & myMutex;
+      ///\brief Whether the lock was actually obtained.
+      bool locked;
+  };
+
   ///\brief A class for managing shared files.
   class sharedFile {
     public:
@@ -109,6 +142,7 @@ namespace IPC {
       bool operator < (const sharedFile & rhs) const {
         return name < rhs.name;
       }
+      void swap(sharedFile & rhs);
       void close();
       void unmap();
       ///\brief The fd handle of the opened shared file
@@ -141,6 +175,7 @@ namespace IPC {
     bool operator < (const sharedPage & rhs) const {
       return name < rhs.name;
     }
+    void swap(sharedPage & rhs);
     void unmap();
     void close();
     #if defined(__CYGWIN__) || defined(_WIN32)
@@ -179,12 +214,15 @@ namespace IPC {
   ///
   ///Clients should allocate payLen bytes at a time, possibly with the addition of a counter.
   ///If no such length can be allocated, the next page should be tried, and so on.
+  ///
+  ///Every page starts with a small header holding a sharedMutex and a bitmap of claimed slots.
+  ///Clients claim slots by atomically setting a bit, and the server only visits claimed slots.
+  ///The mutex is only taken when a slot is disconnected.
   class sharedServer {
     public:
       sharedServer();
       sharedServer(std::string name, int len, bool withCounter = false);
       void init(std::string name, int len, bool withCounter = false);
-      ~sharedServer();
       void parseEach(void (*activeCallback)(char * data, size_t len, unsigned int id), void (*disconCallback)(char * data, size_t len, unsigned int id) = 0);
       char * getIndex(unsigned int id);
       operator bool() const;
@@ -197,16 +235,17 @@ namespace IPC {
       bool isInUse(unsigned int id);
       void newPage();
       void deletePage();
+      void releaseSlot(char * mapped, unsigned int slots, unsigned int slot);
       ///\brief The basename of the shared pages.
       std::string baseName;
       ///\brief The length of each consecutive piece of payload
       unsigned int payLen;
       ///\brief The set of sharedPage structures to manage the actual memory
       std::deque<sharedPage> myPages;
-      ///\brief A semaphore that is locked upon creation and deletion of the page, to ensure no new data is allocated during this step.
-      semaphore mySemaphore;
       ///\brief Whether the payload has a counter, if so, it is added in front of the payload
       bool hasCounter;
+      ///\brief Per slot ID, the amount of parseEach calls it was seen claimed without a counter
+      std::map<unsigned int, unsigned int> unfilled;
   };
 
   ///\brief The client part of a server/client model for shared memory.
@@ -237,8 +276,6 @@ namespace IPC {
       std::string baseName;
       ///\brief The shared page this client has reserved a space on.
       sharedPage myPage;
-      ///\brief A semaphore that is locked upon trying to allocate space on a page
-      semaphore mySemaphore;
       ///\brief The size in bytes of the opened page
       int payLen;
       ///\brief The offset of the payload reserved for this client within the opened page
@@ -257,4 +294,36 @@ namespace IPC {
     private:
       char * data;
   };
+
+  ///\brief Server-wide accounting of the stream data pages in shared memory, kept on the SHM_PAGE_ACCOUNTING page.
+  ///
+  ///The controller creates the page and sets the byte budget; processes register the data pages they create and remove,
+  ///and inputs report when viewers start or stop using a page. Entries are found by a hash of the page name.
+  ///When a new page takes the total over the budget, the least recently used evictable (VoD) pages that no viewer
+  ///used for PAGE_ACCOUNTING_IDLE ms are marked for eviction, and the input owning them releases them on its next
+  ///serve loop iteration. The budget is soft: the new page is created regardless.
+  ///All calls do nothing while the page does not exist, e.g. when no controller is running.
+  class pageAccounting {
+    public:
+      pageAccounting(bool master = false);
+      operator bool();
+      void setBudget(uint64_t bytes);
+      void add(const std::string & pageName, uint64_t size, bool evictable);
+      void remove(const std::string & pageName);
+      void setInUse(const std::string & pageName, bool inUse);
+      void addStats(uint64_t hits, uint64_t misses);
+      bool evictionsChanged(uint64_t & seen);
+      void getEvictions(const std::set<std::string> & pageNames, std::set<std::string> & evictPages);
+      void reap();
+      void getStats(uint64_t & budget, uint64_t & used, uint64_t & pages, uint64_t & evictions, uint64_t & hits, uint64_t & misses);
+    private:
+      char * entry(unsigned int num);
+      char * find(const std::string & pageName, char ** freeEntry = 0);
+      void erase(char * e);
+      void evict(uint64_t size);
+      ///\brief The accounting page itself.
+      sharedPage page;
+      ///\brief Whether this instance created the page.
+      bool isMaster;
+  };
 }
@@ -10,6 +10,7 @@
 #include <netinet/in.h>
 #include <poll.h>
 #include <sstream>
+#include <vector>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <ifaddrs.h>
@@ -134,6 +135,63 @@ std::string Socket::getBinForms(std::string addr){
   return ret;
 }
 
+/// Resolves host to the addresses a TCP connection to port may be made to, as raw sockaddr structures for connectStart.
+/// Blocks while resolving; returns false if nothing was found.
+bool Socket::resolveTCP(const std::string &host, int port, std::deque<std::string> &addrs){
+  addrs.clear();
+  struct addrinfo *result, *rp, hints;
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG;
+  std::stringstream ss;
+  ss << port;
+  int s = getaddrinfo(host.c_str(), ss.str().c_str(), &hints, &result);
+  if (s != 0){
+    FAIL_MSG("Could not resolve %s: %s", host.c_str(), gai_strerror(s));
+    return false;
+  }
+  for (rp = result; rp != NULL; rp = rp->ai_next){
+    addrs.push_back(std::string((const char *)rp->ai_addr, rp->ai_addrlen));
+  }
+  freeaddrinfo(result);
+  return addrs.size();
+}
+
+/// Starts a TCP connect to an address from resolveTCP without waiting for it.
+/// Returns the nonblocking socket, or -1 if the connect failed right away. connectResult tells when it is done.
+int Socket::connectStart(const std::string &addr){
+  struct sockaddr_storage sa;
+  if (addr.size() > sizeof(sa)){return -1;}
+  memcpy(&sa, addr.data(), addr.size());
+  int s = socket(sa.ss_family, SOCK_STREAM, 0);
+  if (s < 0){return -1;}
+  fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+  if (connect(s, (struct sockaddr *)&sa, addr.size()) && errno != EINPROGRESS){
+    ::close(s);
+    return -1;
+  }
+  int optval = 1;
+  setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
+  return s;
+}
+
+/// Checks on a connect started by connectStart, without blocking.
+/// Returns 0 once connected, EINPROGRESS while still connecting, or the error the connect failed with.
+int Socket::connectResult(int sock){
+  struct pollfd pfd;
+  pfd.fd = sock;
+  pfd.events = POLLOUT;
+  pfd.revents = 0;
+  int r = poll(&pfd, 1, 0);
+  if (r < 0){return (errno == EINTR) ? EINPROGRESS : errno;}
+  if (!r){return EINPROGRESS;}
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len)){return errno;}
+  return err;
+}
+
 /// Checks bytes (length len) containing a binary-encoded IPv4 or IPv6 IP address, and writes it in human-readable notation to target.
 /// Writes "unknown" if it cannot decode to a sensible value.
 void Socket::hostBytesToStr(const char *bytes, size_t len, std::string &target){
@@ -629,6 +687,12 @@ void Socket::Connection::SendNow(const std::string &data){
   SendNow(data.data(), data.size());
 }
 
+/// Sends as much of the data as the socket accepts right away, which on a nonblocking socket may be nothing.
+/// \returns The amount of bytes actually sent.
+unsigned int Socket::Connection::SendSome(const char *data, size_t len){
+  return iwrite(data, std::min((long unsigned int)len, SOCKETSIZE));
+}
+
 /// Incremental write call. This function tries to write len bytes to the socket from the buffer,
 /// returning the amount of bytes it actually wrote.
 /// \param buffer Location of the buffer to write from.
@@ -827,7 +891,8 @@ static void my_debug(void *ctx, int level, const char *file, int line, const cha
   fflush((FILE *)ctx);
 }
 
-Socket::SSLConnection::SSLConnection(std::string hostname, int port, bool nonblock) : Socket::Connection(){
+/// Allocates and initializes the mbedtls contexts.
+void Socket::SSLConnection::initSSL(){
   mbedtls_debug_set_threshold(0);
   isConnected = true;
   server_fd = new mbedtls_net_context;
@@ -840,24 +905,23 @@ Socket::SSLConnection::SSLConnection(std::string hostname, int port, bool nonblo
   mbedtls_ssl_config_init(conf);
   mbedtls_ctr_drbg_init(ctr_drbg);
   mbedtls_entropy_init(entropy);
+}
+
+/// Configures the SSL client for the given hostname, on top of server_fd.
+/// Closes the connection and returns false on failure.
+bool Socket::SSLConnection::setupSSL(const std::string &hostname){
   DONTEVEN_MSG("SSL init");
-  if (mbedtls_ctr_drbg_seed(ctr_drbg, mbedtls_entropy_func, entropy, (const unsigned char*)"meow", 4) != 0){
-    FAIL_MSG("SSL socket init failed");
-    close();
-    return;
-  }
-  DONTEVEN_MSG("SSL connect");
   int ret = 0;
-  if ((ret = mbedtls_net_connect(server_fd, hostname.c_str(), JSON::Value((long long)port).asString().c_str(), MBEDTLS_NET_PROTO_TCP)) != 0){
-    FAIL_MSG(" failed\n  ! mbedtls_net_connect returned %d\n\n", ret);
+  if ((ret = mbedtls_ctr_drbg_seed(ctr_drbg, mbedtls_entropy_func, entropy, (const unsigned char*)"meow", 4)) != 0){
+    FAIL_MSG("SSL socket init failed");
     close();
-    return;
+    return false;
   }
   if ((ret = mbedtls_ssl_config_defaults(conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
                                          MBEDTLS_SSL_PRESET_DEFAULT)) != 0){
     FAIL_MSG(" failed\n  ! mbedtls_ssl_config_defaults returned %d\n\n", ret);
     close();
-    return;
+    return false;
   }
   mbedtls_ssl_conf_authmode(conf, MBEDTLS_SSL_VERIFY_NONE);
   mbedtls_ssl_conf_rng(conf, mbedtls_ctr_drbg_random, ctr_drbg);
@@ -867,14 +931,27 @@ Socket::SSLConnection::SSLConnection(std::string hostname, int port, bool nonblo
       mbedtls_strerror(ret, estr, 200);
       FAIL_MSG("SSL setup error %d: %s", ret, estr);
       close();
-      return;
+      return false;
   }
   if ((ret = mbedtls_ssl_set_hostname(ssl, hostname.c_str())) != 0){
     FAIL_MSG(" failed\n  ! mbedtls_ssl_set_hostname returned %d\n\n", ret);
     close();
-    return;
+    return false;
   }
   mbedtls_ssl_set_bio(ssl, server_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+  return true;
+}
+
+Socket::SSLConnection::SSLConnection(std::string hostname, int port, bool nonblock) : Socket::Connection(){
+  initSSL();
+  DONTEVEN_MSG("SSL connect");
+  int ret = 0;
+  if ((ret = mbedtls_net_connect(server_fd, hostname.c_str(), JSON::Value((long long)port).asString().c_str(), MBEDTLS_NET_PROTO_TCP)) != 0){
+    FAIL_MSG(" failed\n  ! mbedtls_net_connect returned %d\n\n", ret);
+    close();
+    return;
+  }
+  if (!setupSSL(hostname)){return;}
   while ((ret = mbedtls_ssl_handshake(ssl)) != 0){
     if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE){
       char estr[200];
@@ -890,12 +967,39 @@ Socket::SSLConnection::SSLConnection(std::string hostname, int port, bool nonblo
   }
 }
 
+/// Takes over an already connected nonblocking TCP socket, such as one made with connectStart.
+/// The handshake is not done yet: call handshake() until it returns 1 before sending or receiving.
+Socket::SSLConnection::SSLConnection(int sockNo, const std::string &hostname) : Socket::Connection(){
+  initSSL();
+  server_fd->fd = sockNo;
+  sock = sockNo;
+  Blocking = false;
+  setupSSL(hostname);
+}
+
+/// Continues the handshake as far as possible without blocking.
+/// Returns 1 when it completed, 0 when it waits for data to read, 2 when it waits to be able to write,
+/// and -1 when it failed, closing the connection.
+int Socket::SSLConnection::handshake(){
+  if (!ssl){return -1;}
+  int ret = mbedtls_ssl_handshake(ssl);
+  if (!ret){return 1;}
+  if (ret == MBEDTLS_ERR_SSL_WANT_READ){return 0;}
+  if (ret == MBEDTLS_ERR_SSL_WANT_WRITE){return 2;}
+  char estr[200];
+  mbedtls_strerror(ret, estr, 200);
+  FAIL_MSG("SSL handshake error %d: %s", ret, estr);
+  close();
+  return -1;
+}
+
 void Socket::SSLConnection::close(){
   DONTEVEN_MSG("SSL close");
   if (server_fd){
     mbedtls_net_free(server_fd);
     delete server_fd;
     server_fd = 0;
+    sock = -1;
   }
   if (ssl){
     mbedtls_ssl_free(ssl);
@@ -969,6 +1073,8 @@ unsigned int Socket::SSLConnection::iwrite(const void *buffer, int len){
   if (!connected() || len < 1){return 0;}
   int r;
   r = mbedtls_ssl_write(ssl, (const unsigned char*)buffer, len);
+  //Nothing could be written without blocking; the same data must be passed again later
+  if (r == MBEDTLS_ERR_SSL_WANT_WRITE || r == MBEDTLS_ERR_SSL_WANT_READ){return 0;}
   if (r < 0){
     char estr[200];
     mbedtls_strerror(r, estr, 200);
@@ -1464,6 +1570,36 @@ void Socket::UDPConnection::SendNow(const char *sdata, size_t len){
   }
 }
 
+/// Sends count datagrams of len bytes each, using a single system call where the platform allows it.
+void Socket::UDPConnection::SendBatch(const char *const *datagrams, size_t len, size_t count){
+#ifdef __linux__
+  std::vector<struct mmsghdr> msgs(count);
+  std::vector<struct iovec> iovs(count);
+  for (size_t i = 0; i < count; ++i){
+    iovs[i].iov_base = (void *)datagrams[i];
+    iovs[i].iov_len = len;
+    memset(&(msgs[i].msg_hdr), 0, sizeof(msgs[i].msg_hdr));
+    msgs[i].msg_hdr.msg_name = destAddr;
+    msgs[i].msg_hdr.msg_namelen = destAddr_size;
+    msgs[i].msg_hdr.msg_iov = &(iovs[i]);
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  size_t sent = 0;
+  while (sent < count){
+    int r = sendmmsg(sock, &(msgs[sent]), count - sent, 0);
+    if (r < 0){
+      if (errno == EINTR){continue;}
+      DEBUG_MSG(DLVL_FAIL, "Could not send UDP data through %d: %s", sock, strerror(errno));
+      return;
+    }
+    up += r * len;
+    sent += r;
+  }
+#else
+  for (size_t i = 0; i < count; ++i){SendNow(datagrams[i], len);}
+#endif
+}
+
 /// Bind to a port number, returning the bound port.
 /// If that fails, returns zero.
 /// \arg port Port to bind to, required.
@@ -37,6 +37,9 @@ namespace Socket{
   bool isBinAddress(const std::string &binAddr, std::string matchTo);
   bool matchIPv6Addr(const std::string &A, const std::string &B, uint8_t prefix);
   std::string getBinForms(std::string addr);
+  bool resolveTCP(const std::string &host, int port, std::deque<std::string> &addrs);
+  int connectStart(const std::string &addr);
+  int connectResult(int sock);
 
   /// A buffer made out of std::string objects that can be efficiently read from and written to.
   class Buffer{
@@ -85,6 +88,7 @@ namespace Socket{
     Connection(std::string hostname, int port, bool nonblock); ///< Create a new TCP socket.
     Connection(std::string adres, bool nonblock = false);      ///< Create a new Unix Socket.
     Connection(int write, int read);                           ///< Simulate a socket using two file descriptors.
+    virtual ~Connection(){}                                    ///< Does not close; subclasses may be deleted through a base pointer.
     // generic methods
     virtual void close();                    ///< Close connection.
     void drop();                     ///< Close connection without shutdown.
@@ -106,6 +110,7 @@ namespace Socket{
     void SendNow(const std::string &data);      ///< Will not buffer anything but always send right away. Blocks.
     void SendNow(const char *data);             ///< Will not buffer anything but always send right away. Blocks.
     void SendNow(const char *data, size_t len); ///< Will not buffer anything but always send right away. Blocks.
+    unsigned int SendSome(const char *data, size_t len); ///< Sends what can be sent right away, without blocking if nonblocking.
     // stats related methods
     unsigned int connTime();             ///< Returns the time this socket has been connected.
     uint64_t dataUp();                   ///< Returns total amount of bytes sent.
@@ -129,11 +134,15 @@ namespace Socket{
     public:
       SSLConnection();
       SSLConnection(std::string hostname, int port, bool nonblock); ///< Create a new TCP socket.
+      SSLConnection(int sockNo, const std::string &hostname); ///< Wrap a connected nonblocking TCP socket.
+      int handshake();                 ///< Continue the handshake of a wrapped socket without blocking.
       void close();                    ///< Close connection.
       bool connected() const;         ///< Returns the connected-state for this socket.
       void setBlocking(bool blocking); ///< Set this socket to be blocking (true) or nonblocking (false).
     protected:
       bool isConnected;
+      void initSSL();
+      bool setupSSL(const std::string &hostname);
       int iread(void *buffer, int len, int flags = 0);  ///< Incremental read call.
       unsigned int iwrite(const void *buffer, int len); ///< Incremental write call.
       mbedtls_net_context * server_fd;
@@ -191,6 +200,7 @@ namespace Socket{
     void SendNow(const std::string &data);
     void SendNow(const char *data);
     void SendNow(const char *data, size_t len);
+    void SendBatch(const char *const *datagrams, size_t len, size_t count);
   };
 }
 
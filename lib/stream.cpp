@@ -14,6 +14,7 @@
 #include "defines.h"
 #include "shared_memory.h"
 #include "dtsc.h"
+#include "bitfields.h"
 
 std::string Util::getTmpFolder() {
   std::string dir;
@@ -79,24 +80,222 @@ JSON::Value Util::getStreamConfig(std::string streamname){
     FAIL_MSG("Stream opening denied: %s is longer than 100 characters (%lu).", streamname.c_str(), streamname.size());
     return result;
   }
-  IPC::sharedPage mistConfOut(SHM_CONF, DEFAULT_CONF_PAGE_SIZE, false, false);
-  IPC::semaphore configLock(SEM_CONF, O_CREAT | O_RDWR, ACCESSPERMS, 1);
-  configLock.wait();
-  DTSC::Scan config = DTSC::Scan(mistConfOut.mapped, mistConfOut.len);
-
   sanitizeName(streamname);
   std::string smp = streamname.substr(0, streamname.find_first_of("+ "));
   //check if smp (everything before + or space) exists
-  DTSC::Scan stream_cfg = config.getMember("streams").getMember(smp);
-  if (!stream_cfg){
+  result = getConfigEntry(CONF_INDEX_STREAM, smp);
+  if (result.isNull()){
     DEBUG_MSG(DLVL_MEDIUM, "Stream %s not configured", streamname.c_str());
+  }
+  return result;
+}
+
+/// Layout of the SHM_CONF_INDEX page:
+/// A header of four 32-bit host-order values: generation, active half, data length of half 0 and of half 1.
+/// Followed by two halves, each holding a hash table of CONF_INDEX_BUCKETS entries and a copy of the packed config.
+/// A table entry is a 32-bit hash (0 = empty) and a 32-bit offset into the config copy, both big-endian.
+#define CONF_INDEX_HEAD 16
+#define CONF_INDEX_TABLE (CONF_INDEX_BUCKETS * 8)
+#define CONF_INDEX_HALF (CONF_INDEX_TABLE + DEFAULT_CONF_PAGE_SIZE)
+#define CONF_INDEX_PAGE_SIZE (CONF_INDEX_HEAD + 2 * (CONF_INDEX_HALF))
+
+/// FNV-1a hash over the entry type and name. Never returns 0, which marks empty slots.
+static uint32_t confIndexHash(char type, const std::string & name){
+  uint32_t hash = 2166136261u;
+  hash = (hash ^ (uint8_t)type) * 16777619u;
+  for (size_t i = 0; i < name.size(); ++i){
+    hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+  }
+  return hash ? hash : 1;
+}
+
+/// Checks whether the value at offset in the packed config is the entry of the given type and name.
+/// For streams and connectors this compares the member name preceding the value, for protocols the connector member.
+static bool confIndexMatch(char type, const std::string & name, char * data, uint32_t dataLen, uint32_t offset){
+  if (offset >= dataLen){return false;}
+  if (type == CONF_INDEX_PROTOCOL){
+    return DTSC::Scan(data + offset, dataLen - offset).getMember("connector").asString() == name;
+  }
+  if (offset < name.size() + 2){return false;}
+  char * key = data + offset - name.size();
+  return Bit::btohs(key - 2) == name.size() && memcmp(key, name.data(), name.size()) == 0;
+}
+
+/// Adds an entry to the table, unless an entry for this type and name already exists.
+/// Returns false if the table is too full to take it.
+static bool confIndexInsert(char * table, unsigned int & entries, char type, const std::string & name, char * data, uint32_t dataLen, uint32_t offset){
+  uint32_t hash = confIndexHash(type, name);
+  for (uint32_t i = 0; i < CONF_INDEX_BUCKETS; ++i){
+    char * slot = table + ((hash + i) & (CONF_INDEX_BUCKETS - 1)) * 8;
+    uint32_t slotHash = Bit::btohl(slot);
+    if (!slotHash){
+      //keep the table at most 3/4 full, so misses stay cheap
+      if (entries >= CONF_INDEX_BUCKETS / 4 * 3){return false;}
+      Bit::htobl(slot, hash);
+      Bit::htobl(slot + 4, offset);
+      ++entries;
+      return true;
+    }
+    if (slotHash == hash && confIndexMatch(type, name, data, dataLen, Bit::btohl(slot + 4))){
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Publishes the packed server config together with a hashed index of its streams, connectors and protocols.
+/// Only to be called by the controller, while holding the SEM_CONF semaphore.
+/// The inactive half of the index page is rewritten, then made active, then the generation is increased.
+/// Readers thus never block, and retry if the generation changed while they were looking something up.
+void Util::writeConfigIndex(const std::string & packedConf){
+  static IPC::sharedPage confIndex(SHM_CONF_INDEX, CONF_INDEX_PAGE_SIZE, true);
+  if (!confIndex.mapped){
+    FAIL_MSG("Could not open config index shared memory storage for writing! Is shared memory enabled on your system?");
+    return;
+  }
+  volatile uint32_t * head = (volatile uint32_t *)confIndex.mapped;
+  uint32_t half = head[1] ? 0 : 1;
+  char * table = confIndex.mapped + CONF_INDEX_HEAD + half * CONF_INDEX_HALF;
+  char * data = table + CONF_INDEX_TABLE;
+  uint32_t dataLen = 0;
+  memset(table, 0, CONF_INDEX_TABLE);
+  if (packedConf.size() <= DEFAULT_CONF_PAGE_SIZE){
+    memcpy(data, packedConf.data(), packedConf.size());
+    dataLen = packedConf.size();
+    DTSC::Scan config(data, dataLen);
+    unsigned int entries = 0;
+    bool complete = true;
+    std::map<std::string, DTSC::Scan> members;
+    config.getMember("streams").getMembers(members);
+    for (std::map<std::string, DTSC::Scan>::iterator it = members.begin(); it != members.end() && complete; ++it){
+      complete = confIndexInsert(table, entries, CONF_INDEX_STREAM, it->first, data, dataLen, it->second.getPointer() - data);
+    }
+    members.clear();
+    config.getMember("capabilities").getMember("connectors").getMembers(members);
+    for (std::map<std::string, DTSC::Scan>::iterator it = members.begin(); it != members.end() && complete; ++it){
+      complete = confIndexInsert(table, entries, CONF_INDEX_CONNECTOR, it->first, data, dataLen, it->second.getPointer() - data);
+    }
+    DTSC::Scan prots = config.getMember("config").getMember("protocols");
+    unsigned int prots_ctr = prots.getSize();
+    for (unsigned int i = 0; i < prots_ctr && complete; ++i){
+      DTSC::Scan prot = prots.getIndice(i);
+      complete = confIndexInsert(table, entries, CONF_INDEX_PROTOCOL, prot.getMember("connector").asString(), data, dataLen, prot.getPointer() - data);
+    }
+    if (!complete){
+      WARN_MSG("Config index is full; lookups will fall back to scanning the configuration");
+      dataLen = 0;
+    }
   }else{
-    result = stream_cfg.asJSON();
+    WARN_MSG("Config of %lu bytes is too big to index; lookups will fall back to scanning the configuration", packedConf.size());
+  }
+  head[2 + half] = dataLen;
+  __sync_synchronize();
+  head[1] = half;
+  __sync_synchronize();
+  head[0] = head[0] + 1;
+}
+
+/// Looks up a single entry in the configuration page under the SEM_CONF semaphore, with linear member scans.
+static JSON::Value getConfigEntryLocked(char type, const std::string & name){
+  JSON::Value result;
+  IPC::sharedPage mistConfOut(SHM_CONF, DEFAULT_CONF_PAGE_SIZE, false, false);
+  IPC::semaphore configLock(SEM_CONF, O_CREAT | O_RDWR, ACCESSPERMS, 1);
+  configLock.wait();
+  DTSC::Scan config = DTSC::Scan(mistConfOut.mapped, mistConfOut.len);
+  if (type == CONF_INDEX_STREAM){
+    DTSC::Scan entry = config.getMember("streams").getMember(name);
+    if (entry){result = entry.asJSON();}
+  }
+  if (type == CONF_INDEX_CONNECTOR){
+    DTSC::Scan entry = config.getMember("capabilities").getMember("connectors").getMember(name);
+    if (entry){result = entry.asJSON();}
+  }
+  if (type == CONF_INDEX_PROTOCOL){
+    DTSC::Scan prots = config.getMember("config").getMember("protocols");
+    unsigned int prots_ctr = prots.getSize();
+    for (unsigned int i = 0; i < prots_ctr; ++i){
+      if (prots.getIndice(i).getMember("connector").asString() == name){
+        result = prots.getIndice(i).asJSON();
+        break;
+      }
+    }
   }
   configLock.post();//unlock the config semaphore
   return result;
 }
 
+/// Returns a copy of a single configuration entry, or a null value if it does not exist.
+/// Type is one of CONF_INDEX_STREAM, CONF_INDEX_CONNECTOR or CONF_INDEX_PROTOCOL.
+/// Uses the hashed index published by the controller when available, without taking the config semaphore.
+/// Falls back to scanning the configuration page under the semaphore otherwise.
+JSON::Value Util::getConfigEntry(char type, const std::string & name){
+  static IPC::sharedPage confIndex;
+  bool stale = !confIndex.mapped;
+#if !defined(__CYGWIN__) && !defined(_WIN32)
+  //The controller may have restarted and recreated the page under the same name
+  struct stat pageStat;
+  if (!stale && (fstat(confIndex.handle, &pageStat) || !pageStat.st_nlink)){
+    stale = true;
+  }
+#endif
+  if (stale){
+    confIndex.init(SHM_CONF_INDEX, CONF_INDEX_PAGE_SIZE, false, false);
+  }
+  if (confIndex.mapped){
+    volatile uint32_t * head = (volatile uint32_t *)confIndex.mapped;
+    uint32_t hash = confIndexHash(type, name);
+    for (unsigned int attempt = 0; attempt < 10; ++attempt){
+      uint32_t gen = head[0];
+      __sync_synchronize();
+      uint32_t half = head[1];
+      if (half > 1){break;}
+      uint32_t dataLen = head[2 + half];
+      if (!dataLen || dataLen > DEFAULT_CONF_PAGE_SIZE){break;}
+      char * table = confIndex.mapped + CONF_INDEX_HEAD + half * CONF_INDEX_HALF;
+      char * data = table + CONF_INDEX_TABLE;
+      JSON::Value result;
+      for (uint32_t i = 0; i < CONF_INDEX_BUCKETS; ++i){
+        char * slot = table + ((hash + i) & (CONF_INDEX_BUCKETS - 1)) * 8;
+        uint32_t slotHash = Bit::btohl(slot);
+        if (!slotHash){break;}
+        uint32_t offset = Bit::btohl(slot + 4);
+        if (slotHash == hash && confIndexMatch(type, name, data, dataLen, offset)){
+          result = DTSC::Scan(data + offset, dataLen - offset).asJSON();
+          break;
+        }
+      }
+      __sync_synchronize();
+      if (head[0] == gen){return result;}
+    }
+  }
+  return getConfigEntryLocked(type, name);
+}
+
+/// Hands a stream over to a running shared input process of the given input type.
+/// The arguments are sent as a JSON array on a single line; the process answers OK or NO.
+/// Returns true if the stream was accepted, false if there is no such process or it refused.
+static bool handOverInput(const std::string & inputName, char ** argv){
+  char sockName[NAME_BUFFER_SIZE];
+  snprintf(sockName, NAME_BUFFER_SIZE, INPUT_SHARED_SOCKET, inputName.c_str());
+  std::string sockPath = Util::getTmpFolder() + sockName;
+  struct stat sockStat;
+  if (stat(sockPath.c_str(), &sockStat)){return false;}
+  Socket::Connection shared(sockPath);
+  if (!shared.connected()){return false;}
+  JSON::Value args;
+  for (unsigned int i = 0; argv[i]; ++i){
+    args.append(argv[i]);
+  }
+  shared.SendNow(args.toString() + "\n");
+  uint64_t start = Util::bootMS();
+  while (shared.connected() && !shared.Received().available(3) && Util::bootMS() - start < 10000){
+    if (!shared.spool()){Util::sleep(50);}
+  }
+  bool accepted = shared.Received().available(3) && shared.Received().copy(3) == "OK\n";
+  shared.close();
+  return accepted;
+}
+
 /// Checks if the given streamname has an active input serving it. Returns true if this is the case.
 /// Assumes the streamname has already been through sanitizeName()!
 bool Util::streamAlive(std::string & streamname){
@@ -252,6 +451,7 @@ bool Util::startInput(std::string streamname, std::string filename, bool forkFir
     }
   }
   
+  std::string inputName = input.getMember("name").asString();
   //finally, unlock the config semaphore
   configLock.post();
 
@@ -270,6 +470,16 @@ bool Util::startInput(std::string streamname, std::string filename, bool forkFir
     INFO_MSG("  Option %s = %s", it->first.c_str(), it->second.c_str());
   }
   argv[++argNum] = (char *)0;
+
+  //Streams set to use a shared process are handed over to a running one for this input type, if there is one
+  if (str_args.count("--shared") && str_args["--shared"] == "1" && handOverInput(inputName, argv)){
+    INFO_MSG("Stream %s handed over to the shared %s input process", streamname.c_str(), inputName.c_str());
+    unsigned int waiting = 0;
+    while (!streamAlive(streamname) && ++waiting < 40){
+      Util::wait(250);
+    }
+    return streamAlive(streamname);
+  }
   
   int pid = 0;
   if (forkFirst){
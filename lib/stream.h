@@ -12,6 +12,8 @@ namespace Util {
   bool streamAlive(std::string & streamname);
   bool startInput(std::string streamname, std::string filename = "", bool forkFirst = true, bool isProvider = false);
   JSON::Value getStreamConfig(std::string streamname);
+  void writeConfigIndex(const std::string & packedConf);
+  JSON::Value getConfigEntry(char type, const std::string & name);
   uint8_t getStreamStatus(const std::string & streamname);
 }
 
@@ -204,7 +204,7 @@ namespace TS {
     if (!(strBuf[5] & 0x10)) {
       return -1;
     }
-    int64_t Result = (((strBuf[6] << 24) | (strBuf[7] << 16) | (strBuf[8] << 8) | strBuf[9]) << 1) | (strBuf[10] >> 7);
+    int64_t Result = (((int64_t)strBuf[6] << 25) | (strBuf[7] << 17) | (strBuf[8] << 9) | (strBuf[9] << 1)) | (strBuf[10] >> 7);
     Result *= 300;
     Result |= (((strBuf[10] & 0x01) << 8) + strBuf[11]);
     return Result;
@@ -0,0 +1,450 @@
+/// \file ts_stream.cpp
+/// Holds all code for the TS::Stream demultiplexer.
+
+#include <string.h>
+#include "ts_stream.h"
+#include "ts_packet.h"
+#include "defines.h"
+#include "bitfields.h"
+#include "nal.h"
+#include "h264.h"
+#include "mp4_generic.h"
+
+/// Sample rates as indexed by the sampling frequency index of an ADTS header.
+static const uint32_t aacRates[16] = {96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350, 0, 0, 0};
+
+/// Sample rates of MPEG-1 audio, indexed by the sample rate index of a frame header.
+/// MPEG-2 audio uses half of these rates, MPEG-2.5 a quarter.
+static const uint32_t mp3Rates[3] = {44100, 48000, 32000};
+
+/// Reads a 33-bit PES timestamp (PTS or DTS) from the given 5 bytes.
+static uint64_t readPESTime(const char * p){
+  return ((uint64_t)((p[0] >> 1) & 0x07) << 30) | ((uint64_t)(p[1] & 0xFF) << 22) | ((uint64_t)((p[2] >> 1) & 0x7F) << 15) | ((uint64_t)(p[3] & 0xFF) << 7) | ((p[4] >> 1) & 0x7F);
+}
+
+namespace TS {
+  Stream::pesStream::pesStream(){
+    streamType = 0;
+    pesBpos = 0;
+    pesLength = 0;
+    lastCC = -1;
+    lastRaw = 0;
+    rollover = 0;
+    rate = 0;
+    channels = 0;
+    width = 0;
+    height = 0;
+    fpks = 0;
+  }
+
+  Stream::Stream(){}
+
+  /// Parses a single 188-byte TS packet, read from byte position bytePos of the source.
+  /// Packets that fail the sync byte check or have the transport error indicator set are ignored.
+  void Stream::parse(const char * newPack, uint64_t bytePos){
+    if (newPack[0] != 0x47 || (newPack[1] & 0x80)){return;}
+    unsigned long pid = ((newPack[1] & 0x1F) << 8) | (newPack[2] & 0xFF);
+    bool unitStart = newPack[1] & 0x40;
+    char adaptation = (newPack[3] >> 4) & 0x03;
+    if (!(adaptation & 0x01)){return;}//no payload
+    unsigned int payOffset = 4;
+    if (adaptation & 0x02){payOffset += 1 + (newPack[4] & 0xFF);}
+    if (payOffset >= 188){return;}
+    if (pid == 0){
+      if (unitStart){parsePAT(newPack);}
+      return;
+    }
+    if (pmtPids.count(pid)){
+      if (unitStart){parsePMT(newPack);}
+      return;
+    }
+    std::map<unsigned long, pesStream>::iterator it = pidStreams.find(pid);
+    if (it == pidStreams.end() || (trackFilter.size() && !trackFilter.count(pid))){return;}
+    pesStream & pes = it->second;
+
+    int cc = newPack[3] & 0x0F;
+    if (cc == pes.lastCC){return;}//duplicate packet
+    bool lost = (pes.lastCC != -1 && cc != ((pes.lastCC + 1) & 0x0F));
+    pes.lastCC = cc;
+
+    const char * payload = newPack + payOffset;
+    unsigned int payLen = 188 - payOffset;
+    if (unitStart){
+      if (pes.pesData.size()){finishPES(pid, pes);}
+      if (payLen < 9 || payload[0] || payload[1] || payload[2] != 1){
+        pes.pesData.clear();
+        return;
+      }
+      pes.pesData.assign(payload, payLen);
+      pes.pesBpos = bytePos;
+      pes.pesLength = Bit::btohs(payload + 4);
+      if (pes.pesLength){pes.pesLength += 6;}
+    }else{
+      if (!pes.pesData.size()){return;}
+      if (lost){
+        HIGH_MSG("TS packets lost on PID %lu, dropping incomplete PES packet", pid);
+        pes.pesData.clear();
+        return;
+      }
+      pes.pesData.append(payload, payLen);
+    }
+    if (pes.pesLength && pes.pesData.size() >= pes.pesLength){finishPES(pid, pes);}
+  }
+
+  /// Parses all complete TS packets in the given block, which starts at byte position bytePos of the source.
+  /// Resynchronizes on the next sync byte if the data is not aligned to TS packets.
+  /// \return The amount of bytes consumed; any remainder is a partial TS packet that should be passed again with more data.
+  uint64_t Stream::parseBlock(const char * data, uint64_t len, uint64_t bytePos){
+    return parsePackets(data, len, bytePos, true);
+  }
+
+  /// Parses all complete TS packets in the given block of a live source, such as a pipe or socket.
+  /// The resulting packets carry no byte position, as there is no file to seek in.
+  /// \return The amount of bytes consumed, as for the positioned version.
+  uint64_t Stream::parseBlock(const char * data, uint64_t len){
+    return parsePackets(data, len, 0, false);
+  }
+
+  /// Parses all complete TS packets in the given block, giving them byte positions from bytePos on if positioned is set.
+  uint64_t Stream::parsePackets(const char * data, uint64_t len, uint64_t bytePos, bool positioned){
+    uint64_t pos = 0;
+    while (pos + 188 <= len){
+      if (data[pos] != 0x47){
+        const char * sync = (const char *)memchr(data + pos + 1, 0x47, len - pos - 1);
+        if (!sync){return len;}
+        pos = sync - data;
+        continue;
+      }
+      parse(data + pos, positioned ? bytePos + pos : 0);
+      pos += 188;
+    }
+    return pos;
+  }
+
+  /// Completes all PES packets that are still being collected, for use at the end of the source.
+  void Stream::finish(){
+    for (std::map<unsigned long, pesStream>::iterator it = pidStreams.begin(); it != pidStreams.end(); ++it){
+      if (it->second.pesData.size()){finishPES(it->first, it->second);}
+    }
+  }
+
+  /// Drops all partially collected PES packets and all packets not yet taken out, for use after seeking.
+  /// Everything learned from the PAT, PMT and codec headers is kept.
+  /// \param time The time in milliseconds near which the data after the seek starts. Timestamp rollover detection
+  /// restarts from there, so timestamps after a 33-bit rollover keep their offset.
+  void Stream::clear(uint64_t time){
+    for (std::map<unsigned long, pesStream>::iterator it = pidStreams.begin(); it != pidStreams.end(); ++it){
+      it->second.pesData.clear();
+      it->second.lastCC = -1;
+      it->second.packets.clear();
+      it->second.lastRaw = (time * 90) % 0x200000000ull;
+      it->second.rollover = (time * 90) - it->second.lastRaw;
+    }
+  }
+
+  /// Limits demultiplexing to the given tracks, skipping the PES data of all others. An empty set selects all tracks.
+  void Stream::setTrackFilter(const std::set<unsigned long> & tracks){
+    trackFilter = tracks;
+  }
+
+  /// Returns true if a packet is ready on any track.
+  bool Stream::hasPacket() const{
+    for (std::map<unsigned long, pesStream>::const_iterator it = pidStreams.begin(); it != pidStreams.end(); ++it){
+      if (it->second.packets.size()){return true;}
+    }
+    return false;
+  }
+
+  /// Returns true if a packet is ready on the given track.
+  bool Stream::hasPacket(unsigned long tid) const{
+    std::map<unsigned long, pesStream>::const_iterator it = pidStreams.find(tid);
+    return it != pidStreams.end() && it->second.packets.size();
+  }
+
+  /// Returns true if at least one packet is ready and every demultiplexed track with known codec data has a packet ready.
+  bool Stream::hasPacketOnEachTrack() const{
+    bool any = false;
+    for (std::map<unsigned long, pesStream>::const_iterator it = pidStreams.begin(); it != pidStreams.end(); ++it){
+      if (trackFilter.size() && !trackFilter.count(it->first)){continue;}
+      if (it->second.packets.size()){
+        any = true;
+      }else{
+        if (isReady(it->first)){return false;}
+      }
+    }
+    return any;
+  }
+
+  /// Returns the amount of packets ready on the given track.
+  unsigned int Stream::packetCount(unsigned long tid) const{
+    std::map<unsigned long, pesStream>::const_iterator it = pidStreams.find(tid);
+    if (it == pidStreams.end()){return 0;}
+    return it->second.packets.size();
+  }
+
+  /// Takes the next packet for the given track out of the demultiplexer, or nulls pack if there is none.
+  void Stream::getPacket(unsigned long tid, DTSC::Packet & pack){
+    std::map<unsigned long, pesStream>::iterator it = pidStreams.find(tid);
+    if (it == pidStreams.end() || !it->second.packets.size()){
+      pack.null();
+      return;
+    }
+    pack = it->second.packets.front();
+    it->second.packets.pop_front();
+  }
+
+  /// Takes the packet with the lowest timestamp out of the demultiplexer, or nulls pack if there is none.
+  void Stream::getEarliestPacket(DTSC::Packet & pack){
+    std::map<unsigned long, pesStream>::iterator earliest = pidStreams.end();
+    for (std::map<unsigned long, pesStream>::iterator it = pidStreams.begin(); it != pidStreams.end(); ++it){
+      if (!it->second.packets.size()){continue;}
+      if (earliest == pidStreams.end() || it->second.packets.front().getTime() < earliest->second.packets.front().getTime()){
+        earliest = it;
+      }
+    }
+    if (earliest == pidStreams.end()){
+      pack.null();
+      return;
+    }
+    pack = earliest->second.packets.front();
+    earliest->second.packets.pop_front();
+  }
+
+  /// Returns true if enough of the given track was seen to fill its metadata.
+  bool Stream::isReady(unsigned long tid) const{
+    std::map<unsigned long, pesStream>::const_iterator it = pidStreams.find(tid);
+    if (it == pidStreams.end()){return false;}
+    if (it->second.streamType == 0x03 || it->second.streamType == 0x04){return it->second.rate;}
+    return it->second.init.size();
+  }
+
+  /// Returns true if the PMT was seen and all tracks in it are ready.
+  bool Stream::isReady() const{
+    if (!pidStreams.size()){return false;}
+    for (std::map<unsigned long, pesStream>::const_iterator it = pidStreams.begin(); it != pidStreams.end(); ++it){
+      if (!isReady(it->first)){return false;}
+    }
+    return true;
+  }
+
+  /// Returns the track IDs (PIDs) of all supported elementary streams in the PMT.
+  std::set<unsigned long> Stream::getActiveTracks() const{
+    std::set<unsigned long> result;
+    for (std::map<unsigned long, pesStream>::const_iterator it = pidStreams.begin(); it != pidStreams.end(); ++it){
+      result.insert(it->first);
+    }
+    return result;
+  }
+
+  /// Adds all ready tracks that meta does not have yet to meta.
+  void Stream::initializeMetadata(DTSC::Meta & meta){
+    for (std::map<unsigned long, pesStream>::iterator it = pidStreams.begin(); it != pidStreams.end(); ++it){
+      if (!isReady(it->first) || (meta.tracks.count(it->first) && meta.tracks[it->first].codec.size())){continue;}
+      pesStream & pes = it->second;
+      DTSC::Track & trk = meta.tracks[it->first];
+      trk.trackID = it->first;
+      trk.init = pes.init;
+      switch (pes.streamType){
+        case 0x1B:
+          trk.type = "video";
+          trk.codec = "H264";
+          trk.width = pes.width;
+          trk.height = pes.height;
+          trk.fpks = pes.fpks;
+          break;
+        case 0x0F:
+          trk.type = "audio";
+          trk.codec = "AAC";
+          trk.rate = pes.rate;
+          trk.channels = pes.channels;
+          trk.size = 16;
+          break;
+        case 0x03:
+        case 0x04:
+          trk.type = "audio";
+          trk.codec = "MP3";
+          trk.rate = pes.rate;
+          trk.channels = pes.channels;
+          trk.size = 16;
+          break;
+      }
+      INFO_MSG("Initialized track %lu: %s %s", it->first, trk.type.c_str(), trk.codec.c_str());
+    }
+  }
+
+  /// Reads the PMT PIDs from a PAT.
+  void Stream::parsePAT(const char * newPack){
+    ProgramAssociationTable pat;
+    pat.FromPointer(newPack);
+    if (pat.getTableId() != 0){return;}
+    short progCount = pat.getProgramCount();
+    for (short i = 0; i < progCount; ++i){
+      //program number 0 points to the network information table, not a PMT
+      if (pat.getProgramNumber(i)){pmtPids.insert(pat.getProgramPID(i));}
+    }
+  }
+
+  /// Reads the elementary streams from a PMT, starting to collect PES data for the supported ones.
+  void Stream::parsePMT(const char * newPack){
+    ProgramMappingTable pmt;
+    pmt.FromPointer(newPack);
+    if (pmt.getTableId() != 2){return;}
+    ProgramMappingEntry entry = pmt.getEntry(0);
+    while (entry){
+      unsigned long pid = entry.getElementaryPid();
+      unsigned int type = entry.getStreamType() & 0xFF;
+      switch (type){
+        case 0x1B:
+        case 0x0F:
+        case 0x03:
+        case 0x04:
+          if (!pidStreams.count(pid) || pidStreams[pid].streamType != type){
+            if (pidStreams.count(pid)){INFO_MSG("Stream type of PID %lu changed to 0x%.2X", pid, type);}
+            pidStreams[pid] = pesStream();
+            pidStreams[pid].streamType = type;
+          }
+          break;
+        default:
+          break;
+      }
+      entry.advance();
+    }
+  }
+
+  /// Converts a raw 33-bit 90kHz timestamp to milliseconds, compensating for rollovers.
+  /// A large step back is a rollover; a large step forward after one is a late timestamp from before it.
+  uint64_t Stream::adjustTime(pesStream & pes, uint64_t rawTime){
+    if (rawTime < pes.lastRaw && pes.lastRaw - rawTime > 0x100000000ull){pes.rollover += 0x200000000ull;}
+    if (rawTime > pes.lastRaw && rawTime - pes.lastRaw > 0x100000000ull && pes.rollover){pes.rollover -= 0x200000000ull;}
+    pes.lastRaw = rawTime;
+    return (rawTime + pes.rollover) / 90;
+  }
+
+  /// Parses the PES header of a completed PES packet and hands its payload to the codec-specific parser.
+  void Stream::finishPES(unsigned long tid, pesStream & pes){
+    const char * data = pes.pesData.data();
+    uint32_t len = pes.pesData.size();
+    if (pes.pesLength && len > pes.pesLength){len = pes.pesLength;}
+    if (len < 9 || (unsigned int)(9 + (data[8] & 0xFF)) > len){
+      pes.pesData.clear();
+      return;
+    }
+    char timeFlags = (data[7] >> 6) & 0x03;
+    uint64_t pts = pes.lastRaw;
+    uint64_t dts = pes.lastRaw;
+    if ((timeFlags & 0x02) && len >= 14){pts = dts = readPESTime(data + 9);}
+    if (timeFlags == 0x03 && len >= 19){dts = readPESTime(data + 14);}
+    uint64_t offset = ((pts + 0x200000000ull - dts) & 0x1FFFFFFFFull) / 90;
+    if (offset > 10000){offset = 0;}//not a sane composition offset
+    uint64_t time = adjustTime(pes, dts);
+    uint32_t headLen = 9 + (data[8] & 0xFF);
+    switch (pes.streamType){
+      case 0x1B: parseH264(tid, pes, data + headLen, len - headLen, time, offset); break;
+      case 0x0F: parseADTS(tid, pes, data + headLen, len - headLen, time); break;
+      case 0x03:
+      case 0x04: parseMP3(tid, pes, data + headLen, len - headLen, time); break;
+    }
+    pes.pesData.clear();
+  }
+
+  /// Converts an Annex B access unit to a size-prefixed DTSC packet.
+  /// Parameter sets are kept out of the packet and used for the track init data; access unit delimiters are dropped.
+  void Stream::parseH264(unsigned long tid, pesStream & pes, const char * data, uint32_t len, uint64_t time, uint64_t offset){
+    const char * end = data + len;
+    const char * nal = nalu::scanAnnexB(data, len);
+    bool isKey = false;
+    pes.frameData.clear();
+    while (nal){
+      nal += 3;
+      const char * next = nalu::scanAnnexB(nal, end - nal);
+      const char * nalEnd = nalu::nalEndPosition(nal, (next ? next : end) - nal);
+      uint32_t nalSize = nalEnd - nal;
+      if (nalSize){
+        char nalType = nal[0] & 0x1F;
+        if (nalType == 7){
+          pes.sps.assign(nal, nalSize);
+        }else if (nalType == 8){
+          pes.pps.assign(nal, nalSize);
+        }else if (nalType != 9){
+          if (nalType == 5){isKey = true;}
+          char sizeBytes[4];
+          Bit::htobl(sizeBytes, nalSize);
+          pes.frameData.append(sizeBytes, 4);
+          pes.frameData.append(nal, nalSize);
+        }
+      }
+      nal = next;
+    }
+    if (!pes.init.size() && pes.sps.size() && pes.pps.size()){
+      h264::sequenceParameterSet sps(pes.sps.data(), pes.sps.size());
+      h264::SPSMeta spsChar = sps.getCharacteristics();
+      pes.width = spsChar.width;
+      pes.height = spsChar.height;
+      pes.fpks = spsChar.fps * 1000;
+      if (pes.fpks < 100 || pes.fpks > 1000000){pes.fpks = 0;}
+      MP4::AVCC avccBox;
+      avccBox.setVersion(1);
+      avccBox.setProfile(pes.sps[1]);
+      avccBox.setCompatibleProfiles(pes.sps[2]);
+      avccBox.setLevel(pes.sps[3]);
+      avccBox.setSPSNumber(1);
+      avccBox.setSPS(pes.sps);
+      avccBox.setPPSNumber(1);
+      avccBox.setPPS(pes.pps);
+      pes.init = std::string(avccBox.payload(), avccBox.payloadSize());
+    }
+    if (!pes.frameData.size()){return;}
+    pes.packets.push_back(DTSC::Packet());
+    pes.packets.back().genericFill(time, offset, tid, pes.frameData.data(), pes.frameData.size(), pes.pesBpos, isKey);
+  }
+
+  /// Splits a PES payload of ADTS frames into one DTSC packet per frame.
+  /// Frames after the first are timed by their sample count, as the PES only carries the timestamp of the first.
+  void Stream::parseADTS(unsigned long tid, pesStream & pes, const char * data, uint32_t len, uint64_t time){
+    uint32_t pos = 0;
+    uint64_t samples = 0;
+    while (pos + 7 <= len){
+      const char * frame = data + pos;
+      if ((frame[0] & 0xFF) != 0xFF || (frame[1] & 0xF0) != 0xF0){
+        ++pos;
+        continue;
+      }
+      uint32_t headLen = (frame[1] & 0x01) ? 7 : 9;
+      uint32_t frameLen = ((frame[3] & 0x03) << 11) | ((frame[4] & 0xFF) << 3) | ((frame[5] >> 5) & 0x07);
+      if (frameLen <= headLen || pos + frameLen > len){break;}
+      if (!pes.init.size()){
+        char objType = ((frame[2] >> 6) & 0x03) + 1;
+        char rateIndex = (frame[2] >> 2) & 0x0F;
+        char chanConfig = ((frame[2] & 0x01) << 2) | ((frame[3] >> 6) & 0x03);
+        pes.rate = aacRates[(int)rateIndex];
+        pes.channels = chanConfig;
+        char audioConfig[2];
+        audioConfig[0] = (objType << 3) | (rateIndex >> 1);
+        audioConfig[1] = ((rateIndex & 0x01) << 7) | (chanConfig << 3);
+        pes.init.assign(audioConfig, 2);
+      }
+      uint64_t frameTime = time;
+      if (pes.rate){frameTime += samples * 1000 / pes.rate;}
+      pes.packets.push_back(DTSC::Packet());
+      pes.packets.back().genericFill(frameTime, 0, tid, frame + headLen, frameLen - headLen, pes.pesBpos, false);
+      samples += 1024 * ((frame[6] & 0x03) + 1);
+      pos += frameLen;
+    }
+  }
+
+  /// Turns a PES payload of MP3 frames into a single DTSC packet.
+  void Stream::parseMP3(unsigned long tid, pesStream & pes, const char * data, uint32_t len, uint64_t time){
+    if (!len){return;}
+    if (!pes.rate && len >= 4 && (data[0] & 0xFF) == 0xFF && (data[1] & 0xE0) == 0xE0){
+      char version = (data[1] >> 3) & 0x03;//3 = MPEG-1, 2 = MPEG-2, 0 = MPEG-2.5
+      char rateIndex = (data[2] >> 2) & 0x03;
+      if (version != 1 && rateIndex != 3){
+        pes.rate = mp3Rates[(int)rateIndex] / (version == 3 ? 1 : (version == 2 ? 2 : 4));
+        pes.channels = (((data[3] >> 6) & 0x03) == 3) ? 1 : 2;
+      }
+    }
+    pes.packets.push_back(DTSC::Packet());
+    pes.packets.back().genericFill(time, 0, tid, data, len, pes.pesBpos, false);
+  }
+}
+
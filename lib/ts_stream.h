@@ -0,0 +1,76 @@
+/// \file ts_stream.h
+/// Holds all headers for the TS::Stream demultiplexer.
+
+#pragma once
+#include <string>
+#include <map>
+#include <set>
+#include <deque>
+#include <stdint.h>
+#include "dtsc.h"
+
+namespace TS {
+
+  /// Demultiplexes a transport stream into DTSC packets.
+  /// Feed it 188-byte TS packets through parse() or whole blocks of them through parseBlock(),
+  /// then take the resulting packets out through getPacket() or getEarliestPacket().
+  /// The PAT and PMT are followed automatically; elementary streams are identified by their PID, which is also used as track ID.
+  /// H264, AAC (ADTS) and MP3 elementary streams are supported, other stream types are ignored.
+  /// The raw TS packets are parsed in place: PES payloads are collected in per-PID buffers that are reused,
+  /// so a steady stream does not allocate memory per TS packet.
+  class Stream{
+    public:
+      Stream();
+      void parse(const char * newPack, uint64_t bytePos);
+      uint64_t parseBlock(const char * data, uint64_t len, uint64_t bytePos);
+      uint64_t parseBlock(const char * data, uint64_t len);
+      void finish();
+      void clear(uint64_t time = 0);
+      void setTrackFilter(const std::set<unsigned long> & tracks);
+      bool hasPacket() const;
+      bool hasPacket(unsigned long tid) const;
+      bool hasPacketOnEachTrack() const;
+      unsigned int packetCount(unsigned long tid) const;
+      void getPacket(unsigned long tid, DTSC::Packet & pack);
+      void getEarliestPacket(DTSC::Packet & pack);
+      bool isReady(unsigned long tid) const;
+      bool isReady() const;
+      std::set<unsigned long> getActiveTracks() const;
+      void initializeMetadata(DTSC::Meta & meta);
+    private:
+      /// Parse state of a single elementary stream PID.
+      struct pesStream{
+        pesStream();
+        unsigned int streamType;///< Stream type from the PMT.
+        std::string pesData;///< The PES packet being collected, including its header.
+        uint64_t pesBpos;///< Byte position of the TS packet the current PES packet started in.
+        uint32_t pesLength;///< Expected size of the current PES packet, or zero if unbounded.
+        int lastCC;///< Continuity counter of the last TS packet with payload, or -1.
+        uint64_t lastRaw;///< Last raw 33-bit timestamp, for rollover detection.
+        uint64_t rollover;///< Amount of 90kHz ticks to add to raw timestamps because of rollovers.
+        std::string frameData;///< Scratch buffer for building packet payloads.
+        std::string sps;///< Last H264 sequence parameter set seen.
+        std::string pps;///< Last H264 picture parameter set seen.
+        std::string init;///< Codec init data, once known.
+        uint32_t rate;
+        uint32_t channels;
+        uint32_t width;
+        uint32_t height;
+        uint32_t fpks;
+        std::deque<DTSC::Packet> packets;///< Packets ready to be taken out.
+      };
+      std::map<unsigned long, pesStream> pidStreams;
+      std::set<unsigned long> pmtPids;
+      std::set<unsigned long> trackFilter;///< If not empty, only these tracks are demultiplexed.
+      void parsePAT(const char * newPack);
+      void parsePMT(const char * newPack);
+      uint64_t parsePackets(const char * data, uint64_t len, uint64_t bytePos, bool positioned);
+      void finishPES(unsigned long tid, pesStream & pes);
+      uint64_t adjustTime(pesStream & pes, uint64_t rawTime);
+      void parseH264(unsigned long tid, pesStream & pes, const char * data, uint32_t len, uint64_t time, uint64_t offset);
+      void parseADTS(unsigned long tid, pesStream & pes, const char * data, uint32_t len, uint64_t time);
+      void parseMP3(unsigned long tid, pesStream & pes, const char * data, uint32_t len, uint64_t time);
+  };
+
+}
+
@@ -69,7 +69,7 @@ bool AnalyserDTSC::parsePacket(){
         uint32_t longest_prt = 0;
         uint32_t shrtest_cnt = 0xFFFFFFFFul;
         uint32_t longest_cnt = 0;
-        for (std::deque<DTSC::Key>::iterator k = it->second.keys.begin();
+        for (DTSC::PackedList<DTSC::Key>::iterator k = it->second.keys.begin();
              k != it->second.keys.end(); k++){
           if (!k->getLength()){continue;}
           if (k->getLength() > longest_key){longest_key = k->getLength();}
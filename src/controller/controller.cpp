@@ -4,6 +4,7 @@
 #include "controller_api.h"
 #include "controller_capabilities.h"
 #include "controller_connectors.h"
+#include "controller_indexer.h"
 #include "controller_statistics.h"
 #include "controller_storage.h"
 #include "controller_streams.h"
@@ -88,6 +89,8 @@ void statusMonitor(void *np){
         Controller::configChanged = false;
       }
     }
+    // forget data pages that were deleted without being removed from the page accounting
+    IPC::pageAccounting().reap();
     Util::sleep(5000); // wait at least 5 seconds
   }
   if (Controller::restarting){
@@ -346,6 +349,8 @@ int main_loop(int argc, char **argv){
   tthread::thread statsThread(Controller::SharedMemStats, &Controller::conf);
   // start monitoring thread
   tthread::thread monitorThread(statusMonitor, 0);
+  // start media folder indexing thread
+  tthread::thread indexerThread(Controller::indexerLoop, 0);
 
   // start main loop
   while (Controller::conf.is_active){
@@ -366,6 +371,8 @@ int main_loop(int argc, char **argv){
   statsThread.join();
   HIGH_MSG("Joining monitor thread...");
   monitorThread.join();
+  HIGH_MSG("Joining indexer thread...");
+  indexerThread.join();
   // write config
   tthread::lock_guard<tthread::mutex> guard(Controller::logMutex);
   Controller::writeConfigToDisk();
@@ -11,6 +11,7 @@
 #include "controller_connectors.h"
 #include "controller_capabilities.h"
 #include "controller_statistics.h"
+#include "controller_indexer.h"
 
 ///\brief Checks an authorization request for a given user.
 ///\param Request The request to be parsed.
@@ -211,6 +212,12 @@ void Controller::handleAPICommands(JSON::Value & Request, JSON::Value & Response
     if (in.isMember("serverid")){
       out["serverid"] = in["serverid"];
     }
+    if (in.isMember("shmbudget")){
+      out["shmbudget"] = in["shmbudget"];
+    }
+    if (in.isMember("indexer")){
+      out["indexer"] = in["indexer"];
+    }
   }
   if (Request.isMember("streams")){
     Controller::CheckStreams(Request["streams"], Controller::Storage["streams"]);
@@ -397,6 +404,12 @@ void Controller::handleAPICommands(JSON::Value & Request, JSON::Value & Response
       Controller::fillClients(Request["clients"], Response["clients"]);
     }
   }
+  if (Request.isMember("shm")){
+    Controller::fillPageAccounting(Response["shm"]);
+  }
+  if (Request.isMember("indexer")){
+    Controller::fillIndexer(Response["indexer"]);
+  }
   if (Request.isMember("totals")){
     if (Request["totals"].isArray()){
       for (unsigned int i = 0; i < Request["totals"].size(); ++i){
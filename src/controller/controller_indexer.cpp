@@ -0,0 +1,379 @@
+/// \file controller_indexer.cpp
+/// Generates the DTSH headers of the media files in the configured folders in the background,
+/// so that the first viewer of a VoD file does not have to wait for its header to be generated.
+/// Folders are watched through inotify where possible, and scanned in full periodically.
+
+#include "controller_indexer.h"
+#include "controller_capabilities.h"
+#include "controller_storage.h"
+#include <deque>
+#include <dirent.h>
+#include <errno.h>
+#include <map>
+#include <mist/config.h>
+#include <mist/defines.h>
+#include <mist/procs.h>
+#include <mist/timing.h>
+#include <mist/tinythread.h>
+#include <set>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace Controller {
+  /// A header generation process.
+  struct indexJob{
+    pid_t pid;
+    std::string file;
+    std::string input;
+    uint64_t size;
+    uint64_t start;
+    time_t mtime;///< Modification time of the file when the process started.
+  };
+
+  /// A source_match pattern of an input that reads local files.
+  struct fileMatcher{
+    std::string front;
+    std::string back;
+    std::string input;
+    long long priority;
+  };
+
+  static tthread::mutex indexerMutex;///< Guards everything below, which the API reports on.
+  static std::deque<std::string> indexQueue;///< Files that need their header generated, in order of discovery.
+  static std::map<std::string, uint64_t> waitingFiles;///< Files that were changed too recently to index, with the time they may be indexed at.
+  static std::set<std::string> knownFiles;///< All files that are waiting, queued or being indexed.
+  static std::vector<indexJob> indexJobs;
+  static std::map<std::string, time_t> handledFiles;///< Modification time of every file that was indexed or failed to, so it is only retried once changed.
+  static uint64_t indexedCount = 0;
+  static uint64_t failedCount = 0;
+  static uint64_t lastScan = 0;
+  static uint64_t watchCount = 0;
+
+  /// Collects the source_match patterns of all inputs that read local files.
+  /// DTSC files are skipped, as they hold their own header.
+  static void getMatchers(std::vector<fileMatcher> & matchers){
+    matchers.clear();
+    jsonForEach(capabilities["inputs"], it){
+      if (it->isMember("non-provider") || !it->isMember("source_match") || (*it)["name"].asStringRef() == "DTSC"){continue;}
+      std::vector<std::string> sources;
+      if ((*it)["source_match"].isArray()){
+        jsonForEach((*it)["source_match"], src){sources.push_back(src->asString());}
+      }else{
+        sources.push_back((*it)["source_match"].asString());
+      }
+      for (std::vector<std::string>::iterator src = sources.begin(); src != sources.end(); ++src){
+        size_t star = src->find('*');
+        if (star == std::string::npos || (*src)[0] != '/'){continue;}
+        fileMatcher match;
+        match.front = src->substr(0, star);
+        match.back = src->substr(star + 1);
+        match.input = (*it)["name"].asString();
+        match.priority = (*it)["priority"].asInt();
+        matchers.push_back(match);
+      }
+    }
+  }
+
+  /// Returns the name of the input that would be started for this file, or an empty string if there is none.
+  /// Picks the same input as Util::startInput does.
+  static std::string matchInput(const std::string & file, const std::vector<fileMatcher> & matchers){
+    std::string input;
+    long long curPrio = -1;
+    for (std::vector<fileMatcher>::const_iterator it = matchers.begin(); it != matchers.end(); ++it){
+      if (it->priority <= curPrio || file.size() < it->front.size() + it->back.size()){continue;}
+      if (file.compare(0, it->front.size(), it->front) == 0 && file.compare(file.size() - it->back.size(), it->back.size(), it->back) == 0){
+        input = it->input;
+        curPrio = it->priority;
+      }
+    }
+    return input;
+  }
+
+  /// Returns true if the header of the file is missing, or would be considered outdated by the input.
+  static bool headerOutdated(const std::string & file, const struct stat & fileStat){
+    struct stat headerStat;
+    if (stat((file + ".dtsh").c_str(), &headerStat)){return true;}
+    return headerStat.st_mtime < fileStat.st_mtime + 15;
+  }
+
+  /// Queues a file if an input can read it and its header is missing or outdated.
+  /// Inputs consider headers written within 15 seconds of a change to the file outdated,
+  /// so recently changed files wait until the header written for them will be kept.
+  static void considerFile(const std::string & file, const std::vector<fileMatcher> & matchers){
+    if (!matchInput(file, matchers).size()){return;}
+    struct stat fileStat;
+    if (stat(file.c_str(), &fileStat) || !S_ISREG(fileStat.st_mode)){return;}
+    tthread::lock_guard<tthread::mutex> guard(indexerMutex);
+    if (knownFiles.count(file) || (handledFiles.count(file) && handledFiles[file] == fileStat.st_mtime)){return;}
+    if (!headerOutdated(file, fileStat)){return;}
+    knownFiles.insert(file);
+    if ((uint64_t)fileStat.st_mtime + 16 > Util::epoch()){
+      waitingFiles[file] = fileStat.st_mtime + 16;
+    }else{
+      indexQueue.push_back(file);
+    }
+  }
+
+  /// Considers all files in a folder and its subfolders, watching each folder for changes if inotifyFd is valid.
+  /// Symbolic links to files are followed, those to folders are not.
+  static void scanFolder(const std::string & dir, int inotifyFd, std::map<int, std::string> & watches, const std::vector<fileMatcher> & matchers){
+    if (inotifyFd != -1){
+      int wd = inotify_add_watch(inotifyFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+      if (wd == -1){
+        WARN_MSG("Cannot watch %s for changes, relying on periodic scans: %s", dir.c_str(), strerror(errno));
+      }else{
+        watches[wd] = dir;
+      }
+    }
+    DIR * folder = opendir(dir.c_str());
+    if (!folder){
+      WARN_MSG("Cannot read media folder %s: %s", dir.c_str(), strerror(errno));
+      return;
+    }
+    struct dirent * entry;
+    while ((entry = readdir(folder))){
+      if (entry->d_name[0] == '.'){continue;}
+      std::string path = dir + "/" + entry->d_name;
+      struct stat pathStat;
+      if (lstat(path.c_str(), &pathStat)){continue;}
+      if (S_ISDIR(pathStat.st_mode)){
+        scanFolder(path, inotifyFd, watches, matchers);
+      }else{
+        considerFile(path, matchers);
+      }
+    }
+    closedir(folder);
+  }
+
+  /// Handles all pending inotify events. Returns false if events were lost, and a full scan is needed.
+  static bool readEvents(int inotifyFd, std::map<int, std::string> & watches, const std::vector<fileMatcher> & matchers){
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool complete = true;
+    ssize_t len;
+    while ((len = read(inotifyFd, buffer, sizeof(buffer))) > 0){
+      const struct inotify_event * event;
+      for (char * ptr = buffer; ptr < buffer + len; ptr += sizeof(struct inotify_event) + event->len){
+        event = (const struct inotify_event *)ptr;
+        if (event->mask & IN_Q_OVERFLOW){
+          complete = false;
+          continue;
+        }
+        if (event->mask & IN_IGNORED){
+          watches.erase(event->wd);
+          continue;
+        }
+        if (!event->len || event->name[0] == '.' || !watches.count(event->wd)){continue;}
+        std::string path = watches[event->wd] + "/" + event->name;
+        if (event->mask & IN_ISDIR){
+          if (event->mask & (IN_CREATE | IN_MOVED_TO)){scanFolder(path, inotifyFd, watches, matchers);}
+        }else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)){
+          considerFile(path, matchers);
+        }
+      }
+    }
+    return complete;
+  }
+
+  /// Counts header generation processes that exited as indexed or failed, and removes them.
+  static void reapJobs(){
+    tthread::lock_guard<tthread::mutex> guard(indexerMutex);
+    for (std::vector<indexJob>::iterator it = indexJobs.begin(); it != indexJobs.end();){
+      if (Util::Procs::childRunning(it->pid)){
+        ++it;
+        continue;
+      }
+      struct stat fileStat;
+      if (!stat(it->file.c_str(), &fileStat) && !headerOutdated(it->file, fileStat)){
+        ++indexedCount;
+        INFO_MSG("Indexed %s in %llus", it->file.c_str(), (unsigned long long)(Util::epoch() - it->start));
+      }else{
+        ++failedCount;
+        WARN_MSG("Could not generate the header of %s using the %s input", it->file.c_str(), it->input.c_str());
+      }
+      handledFiles[it->file] = it->mtime;
+      knownFiles.erase(it->file);
+      it = indexJobs.erase(it);
+    }
+  }
+
+  /// Starts header generation processes for queued files, as long as fewer than workers are running
+  /// and fewer than rate were started in the last minute. A rate of 0 does not limit the amount started.
+  static void startJobs(unsigned int workers, unsigned int rate, std::deque<uint64_t> & starts, const std::vector<fileMatcher> & matchers){
+    uint64_t now = Util::epoch();
+    while (starts.size() && starts.front() + 60 <= now){starts.pop_front();}
+    tthread::lock_guard<tthread::mutex> guard(indexerMutex);
+    for (std::map<std::string, uint64_t>::iterator it = waitingFiles.begin(); it != waitingFiles.end();){
+      if (it->second <= now){
+        indexQueue.push_back(it->first);
+        waitingFiles.erase(it++);
+      }else{
+        ++it;
+      }
+    }
+    while (indexQueue.size() && indexJobs.size() < workers && (!rate || starts.size() < rate)){
+      std::string file = indexQueue.front();
+      indexQueue.pop_front();
+      //The file may have changed or been indexed by a viewer since it was queued
+      struct stat fileStat;
+      std::string input = matchInput(file, matchers);
+      if (stat(file.c_str(), &fileStat) || !input.size() || !headerOutdated(file, fileStat)){
+        knownFiles.erase(file);
+        continue;
+      }
+      if ((uint64_t)fileStat.st_mtime + 16 > now){
+        waitingFiles[file] = fileStat.st_mtime + 16;
+        continue;
+      }
+      std::deque<std::string> args;
+      args.push_back(Util::getMyPath() + "MistIn" + input);
+      args.push_back("--headeronly");
+      args.push_back(file);
+      int zero = 0;
+      int out = fileno(stdout);
+      int err = fileno(stderr);
+      indexJob job;
+      job.pid = Util::Procs::StartPiped(args, &zero, &out, &err);
+      job.file = file;
+      job.input = input;
+      job.size = fileStat.st_size;
+      job.start = now;
+      job.mtime = fileStat.st_mtime;
+      if (!job.pid){
+        ++failedCount;
+        FAIL_MSG("Could not start the %s input to index %s", input.c_str(), file.c_str());
+        handledFiles[file] = fileStat.st_mtime;
+        knownFiles.erase(file);
+        continue;
+      }
+      starts.push_back(now);
+      indexJobs.push_back(job);
+    }
+  }
+
+  /// Forgets all files that are waiting or queued, but not those being indexed.
+  static void clearQueue(){
+    tthread::lock_guard<tthread::mutex> guard(indexerMutex);
+    indexQueue.clear();
+    waitingFiles.clear();
+    knownFiles.clear();
+    for (std::vector<indexJob>::iterator it = indexJobs.begin(); it != indexJobs.end(); ++it){
+      knownFiles.insert(it->file);
+    }
+  }
+
+  /// Runs as a thread, generating the headers of media files in the folders set through the "indexer" config field.
+  /// Does nothing while no folders are set.
+  void indexerLoop(void * np){
+    int inotifyFd = -1;
+    std::map<int, std::string> watches;
+    std::vector<fileMatcher> matchers;
+    std::deque<uint64_t> starts;///< Start times of the processes started in the last minute.
+    JSON::Value folders;
+    uint64_t nextScan = 0;
+    while (conf.is_active){
+      JSON::Value indexConf;
+      {
+        tthread::lock_guard<tthread::mutex> guard(configMutex);
+        indexConf = Storage["config"]["indexer"];
+        if (!matchers.size()){getMatchers(matchers);}
+      }
+      unsigned int workers = indexConf.isMember("workers") ? indexConf["workers"].asInt() : INDEXER_WORKERS;
+      if (workers > INDEXER_WORKERS_MAX){workers = INDEXER_WORKERS_MAX;}
+      unsigned int rate = indexConf.isMember("rate") ? indexConf["rate"].asInt() : INDEXER_RATE;
+      uint64_t interval = indexConf.isMember("interval") ? indexConf["interval"].asInt() : INDEXER_INTERVAL;
+      if (interval < 10){interval = 10;}
+
+      if (indexConf["folders"] != folders){
+        folders = indexConf["folders"];
+        if (inotifyFd != -1){close(inotifyFd);}
+        inotifyFd = -1;
+        watches.clear();
+        clearQueue();
+        if (folders.size()){
+          inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+          if (inotifyFd == -1){
+            WARN_MSG("Cannot watch media folders for changes, relying on periodic scans: %s", strerror(errno));
+          }
+        }
+        nextScan = 0;
+      }
+
+      uint64_t now = Util::epoch();
+      if (inotifyFd != -1 && !readEvents(inotifyFd, watches, matchers)){
+        WARN_MSG("Missed changes to media folders; scanning them again");
+        nextScan = 0;
+      }
+      if (folders.size() && now >= nextScan){
+        jsonForEach(folders, it){
+          std::string dir = it->asString();
+          while (dir.size() > 1 && dir[dir.size() - 1] == '/'){dir.erase(dir.size() - 1);}
+          if (dir.size()){scanFolder(dir, inotifyFd, watches, matchers);}
+        }
+        nextScan = now + interval;
+        tthread::lock_guard<tthread::mutex> guard(indexerMutex);
+        lastScan = now;
+        watchCount = watches.size();
+        MEDIUM_MSG("Scanned media folders: %lu files queued", (unsigned long)knownFiles.size());
+      }
+
+      reapJobs();
+      startJobs(workers, rate, starts, matchers);
+      Util::sleep(1000);
+    }
+    {
+      tthread::lock_guard<tthread::mutex> guard(indexerMutex);
+      for (std::vector<indexJob>::iterator it = indexJobs.begin(); it != indexJobs.end(); ++it){
+        Util::Procs::Stop(it->pid);
+      }
+    }
+    if (inotifyFd != -1){close(inotifyFd);}
+  }
+
+}
+
+/// \api
+/// `"indexer"` requests take no arguments, and are responded to with the state of the background indexer.
+/// The indexer generates the DTSH headers of media files in the folders set through the `"indexer"` config field,
+/// `{"folders": ["/media"], "workers": 1, "rate": 30, "interval": 300}`: at most `workers` processes at once (0 pauses indexing),
+/// at most `rate` started per minute (0 for no limit), with a full scan of the folders every `interval` seconds.
+/// ~~~~~~~~~~~~~~~{.js}
+/// {
+///   //files that need their header generated, and how many of those changed too recently to be indexed yet
+///   "queued": 12,
+///   "waiting": 1,
+///   //header generation processes running, if any: file, input used, file size in bytes and seconds since it started
+///   "running": [{"file": "/media/movie.mp4", "input": "MP4", "size": 1234567890, "time": 12}],
+///   //headers generated and files that could not be indexed, since the controller started
+///   "indexed": 1234,
+///   "failed": 2,
+///   //percentage of the files found since the controller started that were handled
+///   "progress": 99,
+///   //unix time of the last full scan, and the amount of folders watched for changes
+///   "lastscan": 1234567890,
+///   "watches": 12
+/// }
+/// ~~~~~~~~~~~~~~~
+void Controller::fillIndexer(JSON::Value & rep){
+  tthread::lock_guard<tthread::mutex> guard(indexerMutex);
+  rep["queued"] = (long long)(indexQueue.size() + waitingFiles.size());
+  rep["waiting"] = (long long)waitingFiles.size();
+  uint64_t now = Util::epoch();
+  for (std::vector<indexJob>::iterator it = indexJobs.begin(); it != indexJobs.end(); ++it){
+    JSON::Value job;
+    job["file"] = it->file;
+    job["input"] = it->input;
+    job["size"] = (long long)it->size;
+    job["time"] = (long long)(now - it->start);
+    rep["running"].append(job);
+  }
+  rep["indexed"] = (long long)indexedCount;
+  rep["failed"] = (long long)failedCount;
+  uint64_t done = indexedCount + failedCount;
+  uint64_t total = done + knownFiles.size();
+  rep["progress"] = (long long)(total ? done * 100 / total : 100);
+  rep["lastscan"] = (long long)lastScan;
+  rep["watches"] = (long long)watchCount;
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <mist/json.h>
+
+/// Defaults for the background indexer, used when the "indexer" config field does not set them:
+/// the most header generation processes running at once, the most started per minute,
+/// and the seconds between full scans of the media folders.
+#define INDEXER_WORKERS 1
+#define INDEXER_RATE 30
+#define INDEXER_INTERVAL 300
+/// The most header generation processes the "workers" config field may ask for.
+#define INDEXER_WORKERS_MAX 16
+
+namespace Controller {
+  void indexerLoop(void * np);
+  void fillIndexer(JSON::Value & rep);
+}
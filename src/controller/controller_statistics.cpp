@@ -770,3 +770,32 @@ void Controller::fillTotals(JSON::Value & req, JSON::Value & rep){
   }
   //all done! return is by reference, so no need to return anything here.
 }
+
+/// \api
+/// `"shm"` requests take no arguments, and are responded to with the server-wide accounting of stream data pages in shared memory:
+/// ~~~~~~~~~~~~~~~{.js}
+/// {
+///   //byte budget for all data pages together, as set through the "shmbudget" config field. 0 means no budget.
+///   "budget": 4294967296,
+///   //total size in bytes of all data pages currently in shared memory, and the amount of pages
+///   "used": 1234567890,
+///   "pages": 123,
+///   //amount of VoD pages evicted to stay within the budget
+///   "evictions": 12,
+///   //viewer requests that found their page loaded (hits) or needed it loaded first (misses), and the percentage of hits
+///   "hits": 123456,
+///   "misses": 1234,
+///   "hitrate": 99
+/// }
+/// ~~~~~~~~~~~~~~~
+void Controller::fillPageAccounting(JSON::Value & rep){
+  uint64_t budget, used, pages, evictions, hits, misses;
+  IPC::pageAccounting().getStats(budget, used, pages, evictions, hits, misses);
+  rep["budget"] = (long long)budget;
+  rep["used"] = (long long)used;
+  rep["pages"] = (long long)pages;
+  rep["evictions"] = (long long)evictions;
+  rep["hits"] = (long long)hits;
+  rep["misses"] = (long long)misses;
+  rep["hitrate"] = (long long)((hits + misses) ? hits * 100 / (hits + misses) : 100);
+}
@@ -88,6 +88,7 @@ namespace Controller {
   void parseStatistics(char * data, size_t len, unsigned int id);
   void fillClients(JSON::Value & req, JSON::Value & rep);
   void fillTotals(JSON::Value & req, JSON::Value & rep);
+  void fillPageAccounting(JSON::Value & rep);
   void SharedMemStats(void * config);
   bool hasViewers(std::string streamName);
 }
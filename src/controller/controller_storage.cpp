@@ -4,6 +4,7 @@
 #include <algorithm>
 #include <mist/timing.h>
 #include <mist/shared_memory.h>
+#include <mist/stream.h>
 #include <mist/defines.h>
 #include "controller_storage.h"
 #include "controller_capabilities.h"
@@ -144,8 +145,13 @@ namespace Controller {
     //write config
     std::string temp = writeConf.toPacked();
     memcpy(mistConfOut.mapped, temp.data(), std::min(temp.size(), (size_t)mistConfOut.len));
+    //publish the hashed index for lookups that do not need the semaphore
+    Util::writeConfigIndex(temp);
     //unlock semaphore
     configLock.post();
+    //the data page budget lives with the page accounting, which is created here as well
+    static IPC::pageAccounting pageAccount(true);
+    pageAccount.setBudget(Storage["config"]["shmbudget"].asInt());
   }
   
 }
@@ -1,24 +1,85 @@
 #include <semaphore.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <getopt.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include <mist/stream.h>
 #include <mist/defines.h>
 #include <mist/procs.h>
+#include <mist/tinythread.h>
 #include <sys/wait.h>
 #include "input.h"
 #include <sstream>
 #include <fstream>
 #include <iterator>
+#include <algorithm>
 
 namespace Mist {
   Input * Input::singleton = NULL;
+  Input::factory Input::create = NULL;
+
+  /// Releases the SEM_INPUT lock and state page of a stream hosted by a shared process.
+  /// This is what the angel process does for its own stream when the input exits.
+  static void releaseStream(const char * name){
+    char semName[NAME_BUFFER_SIZE];
+    snprintf(semName, NAME_BUFFER_SIZE, SEM_INPUT, name);
+    IPC::semaphore playerLock(semName, O_RDWR, ACCESSPERMS, 1, true);
+    if (playerLock){
+      playerLock.post();
+      playerLock.unlink();
+      playerLock.close();
+    }
+    char pageName[NAME_BUFFER_SIZE];
+    snprintf(pageName, NAME_BUFFER_SIZE, SHM_STREAM_STATE, name);
+    IPC::sharedPage streamStatus(pageName, 1, false, false);
+    streamStatus.master = true;
+  }
+
+  /// Releases all streams still listed as hosted, and removes the socket other streams are handed over on.
+  static void releaseHosted(char * hostedNames, const std::string & inputName){
+    for (unsigned int i = 0; i < INPUT_SHARED_MAX; ++i){
+      char * slot = hostedNames + i * NAME_BUFFER_SIZE;
+      if (slot[0]){
+        WARN_MSG("Releasing stream %s, hosted by the exited input process", slot);
+        releaseStream(slot);
+        slot[0] = 0;
+      }
+    }
+    char sockName[NAME_BUFFER_SIZE];
+    snprintf(sockName, NAME_BUFFER_SIZE, INPUT_SHARED_SOCKET, inputName.c_str());
+    unlink((Util::getTmpFolder() + sockName).c_str());
+  }
 
   void Input::userCallback(char * data, size_t len, unsigned int id) {
     for (int i = 0; i < SIMUL_TRACKS; i++) {
       unsigned long tid = ((unsigned long)(data[i * 6]) << 24) | ((unsigned long)(data[i * 6 + 1]) << 16) | ((unsigned long)(data[i * 6 + 2]) << 8) | ((unsigned long)(data[i * 6 + 3]));
       if (tid) {
         unsigned long keyNum = ((unsigned long)(data[i * 6 + 4]) << 8) | ((unsigned long)(data[i * 6 + 5]));
+        if (loadPages(tid)){
+          viewerKeys[tid].insert(keyNum + 1);
+          if (nProxy.isBuffered(tid, keyNum + 1)){
+            ++pageHits;
+          }else{
+            ++pageMisses;
+          }
+          //If a viewer played into a page we had not buffered yet, it caught up with the read-ahead: look further ahead.
+          std::map<unsigned long, DTSCPageData>::iterator pIt = nProxy.pagesByTrack[tid].upper_bound(keyNum + 1);
+          if (pIt != nProxy.pagesByTrack[tid].begin() && --pIt != nProxy.pagesByTrack[tid].begin() && !nProxy.isBuffered(tid, keyNum + 1)){
+            std::map<unsigned long, DTSCPageData>::iterator prevIt = pIt;
+            --prevIt;
+            if (nProxy.isBuffered(tid, prevIt->first) && pagesAhead[tid] < INPUT_READAHEAD_MAX){
+              if (!pagesAhead[tid]){pagesAhead[tid] = 1;}
+              ++pagesAhead[tid];
+              MEDIUM_MSG("Viewer caught up with read-ahead on track %lu, now buffering %u pages ahead", tid, pagesAhead[tid]);
+            }
+          }
+        }
         bufferFrame(tid, keyNum + 1);//Try buffer next frame
       }
     }
@@ -56,7 +117,29 @@ namespace Mist {
     option["long"] = "stream";
     option["help"] = "The name of the stream that this connector will provide in player mode";
     config->addOption("streamname", option);
+    option.null();
+    option["arg"] = "integer";
+    option["short"] = "S";
+    option["long"] = "shared";
+    option["help"] = "Also serve other streams of this input type from this process (1), or only this stream (0, default)";
+    option["value"].append(0LL);
+    config->addOption("shared", option);
+    option.null();
+    option["long"] = "headeronly";
+    option["help"] = "Generate the header file of the input at low priority if it is missing or outdated, then exit";
+    option["value"].append(0ll);
+    config->addOption("headeronly", option);
     
+    capa["optional"]["shared"]["name"] = "Shared process";
+    capa["optional"]["shared"]["help"] = "If enabled, this stream is served by one process together with the other streams of this input type that have this enabled, instead of by a process of its own. Saves resources on large VoD libraries, at the cost of isolation.";
+    capa["optional"]["shared"]["option"] = "--shared";
+    capa["optional"]["shared"]["type"] = "select";
+    capa["optional"]["shared"]["select"][0u][0u] = "0";
+    capa["optional"]["shared"]["select"][0u][1u] = "Disabled";
+    capa["optional"]["shared"]["select"][1u][0u] = "1";
+    capa["optional"]["shared"]["select"][1u][1u] = "Enabled";
+    capa["optional"]["shared"]["default"] = 0LL;
+
     capa["optional"]["debug"]["name"] = "debug";
     capa["optional"]["debug"]["help"] = "The debug level at which messages need to be printed.";
     capa["optional"]["debug"]["option"] = "--debug";
@@ -69,6 +152,11 @@ namespace Mist {
     
     singleton = this;
     isBuffer = false;
+    instanceConfig = cfg;
+    hostedNames = 0;
+    pageHits = 0;
+    pageMisses = 0;
+    evictGen = 0;
   }
 
   void Input::checkHeaderTimes(std::string streamFile) {
@@ -100,6 +188,10 @@ namespace Mist {
       return 0;
     }
 
+    if (config->getBool("headeronly")){
+      return headerOnly() ? 0 : 1;
+    }
+
     if (!checkArguments()) {
       FAIL_MSG("Setup failed - exiting");
       return 0;
@@ -122,6 +214,16 @@ namespace Mist {
       streamStatus.close();
     }
     config->activate();
+    if (config->getInteger("shared") && needsLock() && streamName.size()){
+      //Shared with the input process, so streams it hosted can be released when it exits
+      hostedNames = (char *)mmap(0, INPUT_SHARED_MAX * NAME_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+      if (hostedNames == MAP_FAILED){
+        WARN_MSG("Could not allocate the hosted stream list; not hosting other streams: %s", strerror(errno));
+        hostedNames = 0;
+      }else{
+        memset(hostedNames, 0, INPUT_SHARED_MAX * NAME_BUFFER_SIZE);
+      }
+    }
     uint64_t reTimer = 0;
     while (config->is_active){
       pid_t pid = fork();
@@ -150,6 +252,7 @@ namespace Mist {
         }
         continue;
       }
+      if (hostedNames){releaseHosted(hostedNames, capa["name"].asStringRef());}
       //if the exit was clean, don't restart it
       if (WIFEXITED(status) && (WEXITSTATUS(status) == 0)){
         MEDIUM_MSG("Input for stream %s shut down cleanly", streamName.c_str());
@@ -183,7 +286,9 @@ namespace Mist {
     return 0;
   }
 
-  int Input::run() {
+  /// Reads the header of the input, generating it if needed, and parses it for VoD.
+  /// Returns false if the header could not be read.
+  bool Input::loadHeader(){
     myMeta.sourceURI = config->getString("input");
     if (streamStatus){streamStatus.mapped[0] = STRMSTAT_BOOT;}
     checkHeaderTimes(config->getString("input"));
@@ -192,7 +297,7 @@ namespace Mist {
       bool headerSuccess = readHeader();
       if (!headerSuccess) {
         std::cerr << "Reading header for " << config->getString("input") << " failed." << std::endl;
-        return 0;
+        return false;
       }else{
         timer = Util::bootMS() - timer;
         DEBUG_MSG(DLVL_DEVEL, "Read header for '%s' in %llums", streamName.c_str(), timer);
@@ -202,6 +307,46 @@ namespace Mist {
       parseHeader();
       MEDIUM_MSG("Header parsed, %lu tracks", myMeta.tracks.size());
     }
+    return true;
+  }
+
+  /// Generates the header file of the input if it is missing or outdated, at the lowest CPU and disk priority.
+  /// Used by the controller to index media folders in the background, ahead of the first viewer.
+  /// Returns false if the input is not a regular file or its header could not be generated.
+  bool Input::headerOnly(){
+    std::string file = config->getString("input");
+    struct stat fileStat;
+    if (file == "-" || stat(file.c_str(), &fileStat) || !S_ISREG(fileStat.st_mode)){
+      FAIL_MSG("Cannot generate a header for %s: not a regular file", file.c_str());
+      return false;
+    }
+    if (setpriority(PRIO_PROCESS, 0, 19)){
+      WARN_MSG("Could not lower the CPU priority: %s", strerror(errno));
+    }
+#ifdef SYS_ioprio_set
+    //IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE; threads started while reading the header inherit both priorities
+    if (syscall(SYS_ioprio_set, 1, 0, 3 << 13)){
+      WARN_MSG("Could not lower the disk priority: %s", strerror(errno));
+    }
+#endif
+    if (!preRun()){return false;}
+    myMeta.sourceURI = file;
+    checkHeaderTimes(file);
+    if (!needHeader()){
+      MEDIUM_MSG("Header for %s is up to date", file.c_str());
+      return true;
+    }
+    uint64_t timer = Util::bootMS();
+    if (!readHeader()){
+      FAIL_MSG("Generating the header for %s failed", file.c_str());
+      return false;
+    }
+    INFO_MSG("Generated header for %s in %llums", file.c_str(), (unsigned long long)(Util::bootMS() - timer));
+    return true;
+  }
+
+  int Input::run() {
+    if (!loadHeader()){return 0;}
 
     if (!streamName.size()) {
       MEDIUM_MSG("Starting convert");
@@ -262,22 +407,35 @@ namespace Mist {
   /// Returns true if it is, or if the stream could not be found in the configuration.
   bool Input::isAlwaysOn(){
     bool ret = true;
-    std::string strName = streamName.substr(0, (streamName.find_first_of("+ ")));
-    IPC::sharedPage serverCfg(SHM_CONF, DEFAULT_CONF_PAGE_SIZE, false, false); ///< Contains server configuration and capabilities
-    IPC::semaphore configLock(SEM_CONF, O_CREAT | O_RDWR, ACCESSPERMS, 1);
-    configLock.wait();
-    DTSC::Scan streamCfg = DTSC::Scan(serverCfg.mapped, serverCfg.len).getMember("streams").getMember(strName);
-    if (streamCfg){
-      if (!streamCfg.getMember("always_on") || !streamCfg.getMember("always_on").asBool()){
+    JSON::Value streamCfg = Util::getStreamConfig(streamName);
+    if (!streamCfg.isNull()){
+      if (!streamCfg.isMember("always_on") || !streamCfg["always_on"].asBool()){
         ret = false;
       }
     }
-    configLock.post();
     return ret;
   }
 
   /// The main loop for inputs in stream serving mode.
   void Input::serve(){
+    serveStart();
+    if (hostedNames && create && config->getInteger("shared")){
+      serveShared();
+    }else{
+      while (keepRunning()) {
+        serveStep();
+        //if not shutting down, wait 1 second before looping
+        if (config->is_active){
+          Util::wait(1000);
+        }
+      }
+    }
+    config->is_active = false;
+    serveStop();
+  }
+
+  /// Buffers the first pages and opens the user page, after which viewers can connect.
+  void Input::serveStart(){
     if (!isBuffer){
       for (std::map<unsigned int,DTSC::Track>::iterator it = myMeta.tracks.begin(); it != myMeta.tracks.end(); it++){
         bufferFrame(it->first, 1);
@@ -290,34 +448,214 @@ namespace Mist {
 
     DEBUG_MSG(DLVL_DEVEL, "Input for stream %s started", streamName.c_str());
     activityCounter = Util::bootSecs();
-    //main serve loop
-    while (keepRunning()) {
-      //load pages for connected clients on request
-      //through the callbackWrapper function
-      userPage.parseEach(callbackWrapper);
-      //unload pages that haven't been used for a while
-      removeUnused();
-      //If users are connected and tracks exist, reset the activity counter
-      //Also reset periodically if the stream is configured as Always on
-      if (userPage.connectedUsers || ((Util::bootSecs() - activityCounter) > INPUT_TIMEOUT/2 && isAlwaysOn())) {
-        if (myMeta.tracks.size()){
-        activityCounter = Util::bootSecs();
-        }
-      }
-      INSANE_MSG("Connected: %d users, %d total", userPage.connectedUsers, userPage.amount);
-      //if not shutting down, wait 1 second before looping
-      if (config->is_active){
-        Util::wait(1000);
+  }
+
+  /// A single iteration of the serve loop: handles viewer requests and (un)loads pages.
+  void Input::serveStep(){
+    stepPages.clear();
+    //load pages for connected clients on request
+    //through the callbackWrapper function
+    userPage.parseEach(callbackWrapper);
+    //buffer the pages viewers will need next, before they request them
+    bufferAhead();
+    //unload pages that haven't been used for a while
+    removeUnused();
+    //If users are connected and tracks exist, reset the activity counter
+    //Also reset periodically if the stream is configured as Always on
+    if (userPage.connectedUsers || ((Util::bootSecs() - activityCounter) > INPUT_TIMEOUT/2 && isAlwaysOn())) {
+      if (myMeta.tracks.size()){
+      activityCounter = Util::bootSecs();
       }
     }
+    INSANE_MSG("Connected: %d users, %d total", userPage.connectedUsers, userPage.amount);
+  }
+
+  /// Unloads all pages and disconnects all viewers.
+  void Input::serveStop(){
     if (streamStatus){streamStatus.mapped[0] = STRMSTAT_SHUTDOWN;}
-    config->is_active = false;
     finish();
     DEBUG_MSG(DLVL_DEVEL, "Input for stream %s closing clean", streamName.c_str());
     userPage.finishEach();
     //end player functionality
   }
 
+  /// Points InOutBase::config and the user page callback at this instance.
+  /// Needed before using an instance when a shared process hosts several streams.
+  void Input::makeCurrent(){
+    config = instanceConfig;
+    singleton = this;
+  }
+
+  /// Unloads a data page of this input right away.
+  void Input::unloadPage(unsigned int track, unsigned int page){
+    //Also removes the page from the track index
+    bufferRemove(track, page);
+    pageCounter[track].erase(page);
+    if (acctInUse.count(track)){acctInUse[track].erase(page);}
+  }
+
+  /// Returns true if the process on the other end of the given unix socket runs as the same user as this one.
+  /// Where the peer cannot be checked, only the permissions of the socket file protect it.
+  static bool peerIsUs(int sock){
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t credLen = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &credLen)){return false;}
+    return cred.uid == geteuid();
+#else
+    return true;
+#endif
+  }
+
+  /// Sets up this instance to serve a stream handed over to a shared process by Util::startInput.
+  /// The arguments are the ones the stream would otherwise have been started with.
+  /// Returns false if the stream could not be set up, in which case nothing needs to be released.
+  bool Input::hostStream(JSON::Value & args){
+    char * argv[64];
+    int argc = 0;
+    jsonForEach(args, it){
+      if (argc < 63){argv[argc++] = (char *)it->asStringRef().c_str();}
+    }
+    argv[argc] = 0;
+    char ** argvPtr = argv;
+    optind = 0;//restart option parsing from scratch
+    if (!config->parseArgs(argc, argvPtr)){return false;}
+    streamName = nProxy.streamName = config->getString("streamname");
+    if (!streamName.size() || !checkArguments()){return false;}
+
+    char semName[NAME_BUFFER_SIZE];
+    snprintf(semName, NAME_BUFFER_SIZE, SEM_INPUT, streamName.c_str());
+    IPC::semaphore playerLock(semName, O_CREAT | O_RDWR, ACCESSPERMS, 1);
+    if (!playerLock.tryWait()){
+      DEBUG_MSG(DLVL_DEVEL, "A player for stream %s is already running", streamName.c_str());
+      playerLock.close();
+      return false;
+    }
+    playerLock.close();
+    char pageName[NAME_BUFFER_SIZE];
+    snprintf(pageName, NAME_BUFFER_SIZE, SHM_STREAM_STATE, streamName.c_str());
+    streamStatus.init(pageName, 1, true, false);
+    streamStatus.master = false;
+    if (streamStatus){streamStatus.mapped[0] = STRMSTAT_INIT;}
+    if (!preRun() || !loadHeader()){
+      streamStatus.close();
+      releaseStream(streamName.c_str());
+      return false;
+    }
+    serveStart();
+    return true;
+  }
+
+  /// Serve loop for a shared input process.
+  /// Serves this stream, plus the streams Util::startInput hands over on the INPUT_SHARED_SOCKET of this input type.
+  /// Each hosted stream gets its own instance, stepped in turn from this loop; the process lives while any of them does.
+  /// Memory is bounded by the server-wide page accounting, whose evictions every instance handles in removeUnused.
+  /// The socket is only usable by the user this process runs as, as requests name arbitrary inputs to open.
+  void Input::serveShared(){
+    char sockName[NAME_BUFFER_SIZE];
+    snprintf(sockName, NAME_BUFFER_SIZE, INPUT_SHARED_SOCKET, capa["name"].asStringRef().c_str());
+    std::string sockPath = Util::getTmpFolder() + sockName;
+    mode_t oldMask = umask(0077);
+    Socket::Server sharedSock(sockPath, true);
+    umask(oldMask);
+    if (!sharedSock.connected()){
+      WARN_MSG("Could not open %s; not hosting other streams", sockPath.c_str());
+    }
+    std::map<std::string, Input *> hosted;
+    while (config->is_active && (keepRunning() || hosted.size())){
+      serveStep();
+      for (std::map<std::string, Input *>::iterator it = hosted.begin(); it != hosted.end() && config->is_active;){
+        Input * inst = it->second;
+        inst->makeCurrent();
+        if (inst->keepRunning()){
+          inst->serveStep();
+          ++it;
+          continue;
+        }
+        inst->serveStop();
+        Util::Config * instConfig = inst->instanceConfig;
+        delete inst;
+        delete instConfig;
+        makeCurrent();
+        releaseStream(it->first.c_str());
+        for (unsigned int i = 0; i < INPUT_SHARED_MAX; ++i){
+          if (it->first == hostedNames + i * NAME_BUFFER_SIZE){hostedNames[i * NAME_BUFFER_SIZE] = 0;}
+        }
+        hosted.erase(it++);
+      }
+      makeCurrent();
+
+      if (!sharedSock.connected()){
+        if (config->is_active){Util::wait(1000);}
+        continue;
+      }
+      //wait up to a second for streams being handed over
+      struct pollfd sockPoll;
+      sockPoll.fd = sharedSock.getSocket();
+      sockPoll.events = POLLIN;
+      poll(&sockPoll, 1, 1000);
+      Socket::Connection req = sharedSock.accept(true);
+      while (req.connected()){
+        if (!peerIsUs(req.getSocket())){
+          WARN_MSG("Refusing stream hand-over from another user");
+          req.close();
+          req = sharedSock.accept(true);
+          continue;
+        }
+        //requests are a single line: a JSON array with the arguments the input would have been started with
+        uint64_t reqStart = Util::bootMS();
+        while (req.connected() && !req.Received().bytesToSplit() && Util::bootMS() - reqStart < 5000){
+          if (!req.spool()){Util::sleep(10);}
+        }
+        bool accepted = false;
+        if (req.Received().bytesToSplit()){
+          JSON::Value args = JSON::fromString(req.Received().remove(req.Received().bytesToSplit()));
+          unsigned int slot = INPUT_SHARED_MAX;
+          for (unsigned int i = 0; i < INPUT_SHARED_MAX; ++i){
+            if (!hostedNames[i * NAME_BUFFER_SIZE]){
+              slot = i;
+              break;
+            }
+          }
+          if (slot < INPUT_SHARED_MAX && args.isArray()){
+            Util::Config * instConfig = new Util::Config(args[0u].asStringRef());
+            Input * inst = create(instConfig);
+            inst->makeCurrent();
+            if (inst->hostStream(args)){
+              strncpy(hostedNames + slot * NAME_BUFFER_SIZE, inst->streamName.c_str(), NAME_BUFFER_SIZE - 1);
+              hosted[inst->streamName] = inst;
+              accepted = true;
+              INFO_MSG("Now hosting stream %s (%lu streams besides %s)", inst->streamName.c_str(), hosted.size(), streamName.c_str());
+            }else{
+              delete inst;
+              delete instConfig;
+            }
+            makeCurrent();
+          }
+        }
+        req.SendNow(accepted ? "OK\n" : "NO\n");
+        req.close();
+        req = sharedSock.accept(true);
+      }
+    }
+    sharedSock.close();
+    unlink(sockPath.c_str());
+    //on shutdown, stop all hosted streams
+    for (std::map<std::string, Input *>::iterator it = hosted.begin(); it != hosted.end(); ++it){
+      it->second->makeCurrent();
+      it->second->serveStop();
+      Util::Config * instConfig = it->second->instanceConfig;
+      delete it->second;
+      delete instConfig;
+      makeCurrent();
+      releaseStream(it->first.c_str());
+      for (unsigned int i = 0; i < INPUT_SHARED_MAX; ++i){
+        if (it->first == hostedNames + i * NAME_BUFFER_SIZE){hostedNames[i * NAME_BUFFER_SIZE] = 0;}
+      }
+    }
+    makeCurrent();
+  }
+
   /// This function checks if an input in serve mode should keep running or not.
   /// The default implementation checks for interruption by signals and otherwise waits until a
   /// save amount of time has passed before shutting down.
@@ -438,9 +776,53 @@ namespace Mist {
     }
   }
 
+  /// Returns the name of a data page of this input.
+  std::string Input::dataPageName(unsigned int track, unsigned int page){
+    char pageName[NAME_BUFFER_SIZE];
+    snprintf(pageName, NAME_BUFFER_SIZE, SHM_TRACK_DATA, streamName.c_str(), nProxy.trackMap[track], (unsigned long)page);
+    return pageName;
+  }
+
   void Input::removeUnused(){
+    //Tell the server-wide page accounting which pages viewers started or stopped using during this iteration
+    for (std::map<unsigned int, std::set<unsigned int> >::iterator it = stepPages.begin(); it != stepPages.end(); ++it){
+      for (std::set<unsigned int>::iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2){
+        if (pageCounter[it->first].count(*it2) && acctInUse[it->first].insert(*it2).second){
+          pageAccount().setInUse(dataPageName(it->first, *it2), true);
+        }
+      }
+    }
+    for (std::map<unsigned int, std::set<unsigned int> >::iterator it = acctInUse.begin(); it != acctInUse.end(); ++it){
+      for (std::set<unsigned int>::iterator it2 = it->second.begin(); it2 != it->second.end();){
+        if (stepPages.count(it->first) && stepPages[it->first].count(*it2)){
+          ++it2;
+          continue;
+        }
+        pageAccount().setInUse(dataPageName(it->first, *it2), false);
+        it->second.erase(it2++);
+      }
+    }
+    pageAccount().addStats(pageHits, pageMisses);
+    pageHits = 0;
+    pageMisses = 0;
+    //Have the idle pages the page accounting marked for eviction unloaded below
+    std::set<std::string> evictPages;
+    if (pageAccount().evictionsChanged(evictGen)){
+      std::set<std::string> idlePages;
+      for (std::map<unsigned int, std::map<unsigned int, unsigned int> >::iterator it = pageCounter.begin(); it != pageCounter.end(); it++){
+        for (std::map<unsigned int, unsigned int>::iterator it2 = it->second.begin(); it2 != it->second.end(); it2++){
+          if (!acctInUse.count(it->first) || !acctInUse[it->first].count(it2->first)){
+            idlePages.insert(dataPageName(it->first, it2->first));
+          }
+        }
+      }
+      pageAccount().getEvictions(idlePages, evictPages);
+    }
     for (std::map<unsigned int, std::map<unsigned int, unsigned int> >::iterator it = pageCounter.begin(); it != pageCounter.end(); it++){
       for (std::map<unsigned int, unsigned int>::iterator it2 = it->second.begin(); it2 != it->second.end(); it2++){
+        if (evictPages.size() && evictPages.count(dataPageName(it->first, it2->first))){
+          it2->second = 1;
+        }
         it2->second--;
       }
       bool change = true;
@@ -448,14 +830,7 @@ namespace Mist {
         change = false;
         for (std::map<unsigned int, unsigned int>::iterator it2 = it->second.begin(); it2 != it->second.end(); it2++){
           if (!it2->second){
-            bufferRemove(it->first, it2->first);
-            pageCounter[it->first].erase(it2->first);
-            for (int i = 0; i < 8192; i += 8){
-              unsigned int thisKeyNum = ntohl(((((long long int *)(nProxy.metaPages[it->first].mapped + i))[0]) >> 32) & 0xFFFFFFFF);
-              if (thisKeyNum == it2->first){
-                (((long long int *)(nProxy.metaPages[it->first].mapped + i))[0]) = 0;
-              }
-            }
+            unloadPage(it->first, it2->first);
             change = true;
             break;
           }
@@ -464,6 +839,115 @@ namespace Mist {
     }
   }
   
+  headerRange::headerRange(int fd, uint64_t start, uint64_t end, bool exact){
+    this->fd = fd;
+    this->start = start;
+    this->end = end;
+    this->exact = exact;
+    syncPos = start;
+    endPos = start;
+    failed = false;
+    bufferStart = 0;
+  }
+
+  /// Returns a pointer to len bytes of the file from byte position pos on, or null if the file ends before that.
+  /// Reads INPUT_HEADER_READ_SIZE bytes at a time; the pointer is valid until the next call.
+  const char * headerRange::read(uint64_t pos, size_t len){
+    if (pos >= bufferStart && pos + len <= bufferStart + buffer.size()){
+      return buffer.data() + (pos - bufferStart);
+    }
+    size_t want = (len > INPUT_HEADER_READ_SIZE) ? len : INPUT_HEADER_READ_SIZE;
+    buffer.resize(want);
+    size_t got = 0;
+    while (got < want){
+      ssize_t r = pread(fd, &buffer[got], want - got, pos + got);
+      if (r < 0 && errno == EINTR){continue;}
+      if (r <= 0){break;}
+      got += r;
+    }
+    buffer.resize(got);
+    bufferStart = pos;
+    if (got < len){return 0;}
+    return buffer.data();
+  }
+
+  /// A part of the file scanned by one thread during parallelHeader.
+  struct headerScan{
+    Input * input;
+    uint64_t start;
+    uint64_t end;
+    headerRange * range;
+  };
+
+  void Input::headerThread(void * arg){
+    headerScan * scan = (headerScan *)arg;
+    scan->range = scan->input->scanRange(scan->start, scan->end, false);
+  }
+
+  /// Generates the header from the data between byte positions start and end of the input file.
+  /// Large files are split into parts that are parsed by scanRange on a thread each, resyncing on the
+  /// first container boundary in their part. The parts are then merged into myMeta in file order
+  /// through mergeRange. A part that did not start where the previous one ended, because its resync
+  /// landed on something that only looked like a boundary, is parsed again from the right position.
+  /// Returns false if nothing could be parsed.
+  bool Input::parallelHeader(uint64_t start, uint64_t end){
+    if (end <= start){return false;}
+    uint64_t threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > INPUT_HEADER_THREADS){threads = INPUT_HEADER_THREADS;}
+    if (threads > (end - start) / (INPUT_HEADER_RANGE_MIN)){threads = (end - start) / (INPUT_HEADER_RANGE_MIN);}
+    if (!threads){threads = 1;}
+    std::vector<headerScan> scans(threads);
+    for (unsigned int i = 0; i < threads; ++i){
+      scans[i].input = this;
+      scans[i].start = start + (end - start) * i / threads;
+      scans[i].end = start + (end - start) * (i + 1) / threads;
+      scans[i].range = 0;
+    }
+    //The first part starts at a known boundary and is parsed on this thread, while the others resync
+    std::vector<tthread::thread *> workers;
+    for (unsigned int i = 1; i < threads; ++i){
+      workers.push_back(new tthread::thread(headerThread, &scans[i]));
+    }
+    scans[0].range = scanRange(start, scans[0].end, true);
+    for (unsigned int i = 0; i < workers.size(); ++i){
+      workers[i]->join();
+      delete workers[i];
+    }
+    if (threads > 1){
+      INFO_MSG("Scanned %llu bytes for the header in %llu parts", end - start, threads);
+    }
+    bool parsed = false;
+    bool stopped = false;
+    uint64_t expected = start;
+    for (unsigned int i = 0; i < threads; ++i){
+      headerRange * range = scans[i].range;
+      if (stopped || expected >= scans[i].end){
+        //Stopped at invalid data, or the previous part ran past this one entirely
+        delete range;
+        continue;
+      }
+      if (!range || range->syncPos != expected){
+        if (range){
+          INFO_MSG("Header part %u resynced @ %llu instead of %llu; parsing it again", i, range->syncPos, expected);
+        }
+        delete range;
+        range = scanRange(expected, scans[i].end, true);
+        if (!range){
+          stopped = true;
+          continue;
+        }
+      }
+      if (!mergeRange(*range) || range->failed){
+        WARN_MSG("Stopping header generation at invalid data @ %llu", range->endPos);
+        stopped = true;
+      }
+      parsed = true;
+      expected = range->endPos;
+      delete range;
+    }
+    return parsed;
+  }
+
   void Input::parseHeader(){
     DEBUG_MSG(DLVL_DONTEVEN,"Parsing the header");
     selectedTracks.clear();
@@ -475,9 +959,6 @@ namespace Mist {
       }
       trackSpec << it->first;
       DEBUG_MSG(DLVL_VERYHIGH, "Trackspec now %s", trackSpec.str().c_str());
-      for (std::deque<DTSC::Key>::iterator it2 = it->second.keys.begin(); it2 != it->second.keys.end(); it2++){
-        keyTimes[it->first].insert(it2->getTime());
-      }
     }
     trackSelect(trackSpec.str());
     
@@ -488,34 +969,17 @@ namespace Mist {
         break;
       }
     }
+    unpagedTracks.clear();
     if (hasKeySizes){
+      //Splitting every track into pages walks all of its keys; only do so for the tracks that get viewed, see loadPages.
       for (std::map<unsigned int, DTSC::Track>::iterator it = myMeta.tracks.begin(); it != myMeta.tracks.end(); it++){
-        bool newData = true;
-        for (int i = 0; i < it->second.keys.size(); i++){
-          if (newData){
-            //i+1 because keys are 1-indexed
-            nProxy.pagesByTrack[it->first][i + 1].firstTime = it->second.keys[i].getTime();
-            newData = false;
-          }
-          DTSCPageData & dPage = nProxy.pagesByTrack[it->first].rbegin()->second;
-          dPage.keyNum++;
-          if (it->second.keys.size() <= i || it->second.keySizes.size() <= i){
-            FAIL_MSG("Corrupt header - deleting for regeneration and aborting");
-            std::string headerFile = config->getString("input");
-            headerFile += ".dtsh";
-            remove(headerFile.c_str());
-            return;
-          }
-          dPage.partNum += it->second.keys[i].getParts();
-          dPage.dataSize += it->second.keySizes[i];
-          if ((dPage.dataSize > FLIP_DATA_PAGE_SIZE || it->second.keys[i].getTime() - dPage.firstTime > FLIP_TARGET_DURATION) && it->second.keys[i].getTime() - dPage.firstTime > FLIP_MIN_DURATION) {
-            newData = true;
-          }
-        }
+        unpagedTracks.insert(it->first);
       }
+      return;
     }else{
     std::map<int, DTSCPageData> curData;
     std::map<int, booking> bookKeeping;
+    std::map<int, unsigned long long> flipSizes;
     
     seek(0);
     getNext();
@@ -527,6 +991,8 @@ namespace Mist {
         continue;
       }
       if (!bookKeeping.count(tid)){
+        unsigned long long pageSize;
+        negotiationProxy::pageSizing(myMeta.tracks[tid], pageSize, flipSizes[tid]);
         bookKeeping[tid].first = 1;
         bookKeeping[tid].curPart = 0;
         bookKeeping[tid].curKey = 0;
@@ -547,7 +1013,7 @@ namespace Mist {
         return;
       }
       if (myMeta.tracks[tid].keys[bookKeeping[tid].curKey].getParts() + 1 == curData[tid].partNum){
-        if ((curData[tid].dataSize > FLIP_DATA_PAGE_SIZE || myMeta.tracks[tid].keys[bookKeeping[tid].curKey].getTime() - curData[tid].firstTime > FLIP_TARGET_DURATION) && myMeta.tracks[tid].keys[bookKeeping[tid].curKey].getTime() - curData[tid].firstTime > FLIP_MIN_DURATION) {
+        if ((curData[tid].dataSize > flipSizes[tid] || myMeta.tracks[tid].keys[bookKeeping[tid].curKey].getTime() - curData[tid].firstTime > FLIP_TARGET_DURATION) && myMeta.tracks[tid].keys[bookKeeping[tid].curKey].getTime() - curData[tid].firstTime > FLIP_MIN_DURATION) {
           nProxy.pagesByTrack[tid][bookKeeping[tid].first] = curData[tid];
           bookKeeping[tid].first += curData[tid].keyNum;
           curData[tid].keyNum = 0;
@@ -583,6 +1049,24 @@ namespace Mist {
   }
   
   
+  /// Splits track into pages from its header key sizes, if parseHeader left that for its first use.
+  /// Returns false if the track has no pages.
+  bool Input::loadPages(unsigned int track){
+    if (unpagedTracks.count(track)){
+      unpagedTracks.erase(track);
+      if (!myMeta.tracks.count(track) || !negotiationProxy::pagesFromKeys(myMeta.tracks[track], nProxy.pagesByTrack[track])){
+        FAIL_MSG("Corrupt header - deleting for regeneration and aborting");
+        std::string headerFile = config->getString("input");
+        headerFile += ".dtsh";
+        remove(headerFile.c_str());
+        nProxy.pagesByTrack.erase(track);
+        return false;
+      }
+      DEBUG_MSG(DLVL_MEDIUM, "Track %u (%s) split into %lu pages", track, myMeta.tracks[track].codec.c_str(), nProxy.pagesByTrack[track].size());
+    }
+    return nProxy.pagesByTrack.count(track) && nProxy.pagesByTrack[track].size();
+  }
+
   bool Input::bufferFrame(unsigned int track, unsigned int keyNum){
     VERYHIGH_MSG("Buffering stream %s, track %u, key %u", streamName.c_str(), track, keyNum);
     if (keyNum > myMeta.tracks[track].keys.size()){
@@ -593,6 +1077,7 @@ namespace Mist {
     if (keyNum < 1) {
       keyNum = 1;
     }
+    loadPages(track);
     if (nProxy.isBuffered(track, keyNum)) {
       //get corresponding page number
       int pageNumber = 0;
@@ -604,6 +1089,7 @@ namespace Mist {
         }
       }
       pageCounter[track][pageNumber] = 15;
+      stepPages[track].insert(pageNumber);
       VERYHIGH_MSG("Track %u, key %u is already buffered in page %d. Cancelling bufferFrame", track, keyNum, pageNumber); 
       return true;
     }
@@ -650,14 +1136,50 @@ namespace Mist {
     bufferTimer = Util::bootMS() - bufferTimer;
     DEBUG_MSG(DLVL_DEVEL, "Done buffering page %d (%llu packets, %llu bytes, %llu-%llums) for track %d (%s) in %llums", keyNum, packCounter, byteCounter, myMeta.tracks[track].keys[keyNum - 1].getTime(), stopTime, track, myMeta.tracks[track].codec.c_str(), bufferTimer);
     pageCounter[track][keyNum] = 15;
+    stepPages[track].insert(keyNum);
     return true;
   }
   
+  /// Buffers the pages following the pages viewers are currently on, so VoD playback does not wait on page boundaries.
+  /// Buffering is done on the serve loop, as the inputs' seek/getNext state is not thread-safe.
+  /// Also marks pages that all viewers of a track have already passed for early release.
+  void Input::bufferAhead(){
+    for (std::map<unsigned int, std::set<unsigned int> >::iterator it = viewerKeys.begin(); it != viewerKeys.end() && config->is_active; ++it){
+      unsigned int track = it->first;
+      if (!it->second.size() || !nProxy.pagesByTrack.count(track) || !nProxy.pagesByTrack[track].size()){continue;}
+      std::map<unsigned long, DTSCPageData> & pages = nProxy.pagesByTrack[track];
+      unsigned int ahead = pagesAhead[track];
+      if (!ahead){ahead = pagesAhead[track] = 1;}
+      for (std::set<unsigned int>::iterator kIt = it->second.begin(); kIt != it->second.end(); ++kIt){
+        std::map<unsigned long, DTSCPageData>::iterator pIt = pages.upper_bound(*kIt);
+        for (unsigned int i = 0; i < ahead && pIt != pages.end() && config->is_active; ++i, ++pIt){
+          bufferFrame(track, pIt->first);
+        }
+      }
+      //Pages before the page the slowest viewer is on are unlikely to be needed again soon.
+      std::map<unsigned long, DTSCPageData>::iterator slowest = pages.upper_bound(*(it->second.begin()));
+      if (slowest != pages.begin()){--slowest;}
+      for (std::map<unsigned int, unsigned int>::iterator cIt = pageCounter[track].begin(); cIt != pageCounter[track].end() && cIt->first < slowest->first; ++cIt){
+        if (cIt->second > 2){cIt->second = 2;}
+      }
+    }
+    viewerKeys.clear();
+  }
+
   bool Input::atKeyFrame(){
     static std::map<int, unsigned long long> lastSeen;
-    //not in keyTimes? We're not at a keyframe.
-    unsigned int c = keyTimes[thisPacket.getTrackId()].count(thisPacket.getTime());
-    if (!c){
+    //not a key time in the header? We're not at a keyframe.
+    DTSC::PackedList<DTSC::Key> & keys = myMeta.tracks[thisPacket.getTrackId()].keys;
+    unsigned int lo = 0, hi = keys.size();
+    while (lo < hi){
+      unsigned int mid = lo + (hi - lo) / 2;
+      if (keys[mid].getTime() < thisPacket.getTime()){
+        lo = mid + 1;
+      }else{
+        hi = mid;
+      }
+    }
+    if (lo == keys.size() || keys[lo].getTime() != thisPacket.getTime()){
       return false;
     }
     //skip double times
@@ -687,15 +1209,15 @@ namespace Mist {
   }
 
   bool Input::readExistingHeader(){
-    DTSC::File tmpdtsh(config->getString("input") + ".dtsh");
-    if (!tmpdtsh){
+    //Decode straight into myMeta from the mapped file, instead of reading it into a DTSC::File and copying the result.
+    if (!myMeta.fromFile(config->getString("input") + ".dtsh")){
       return false;
     }
-    if (tmpdtsh.getMeta().version != DTSH_VERSION){
-      INFO_MSG("Updating wrong version header file from version %llu to %llu", tmpdtsh.getMeta().version, DTSH_VERSION);
+    if (myMeta.version != DTSH_VERSION){
+      INFO_MSG("Updating wrong version header file from version %llu to %llu", myMeta.version, DTSH_VERSION);
+      myMeta = DTSC::Meta();
       return false;
     }
-    myMeta = tmpdtsh.getMeta();
     return true;
   }
 
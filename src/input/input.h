@@ -1,5 +1,6 @@
 #include <set>
 #include <map>
+#include <vector>
 #include <cstdlib>
 #include <mist/config.h>
 #include <mist/json.h>
@@ -16,6 +17,25 @@ namespace Mist {
     int curPart;
   };
 
+  /// A byte range of a VoD file, scanned by a thread of its own while generating the header.
+  /// Inputs derive from this to hold what they found in the range, until it is merged into the header.
+  class headerRange {
+    public:
+      headerRange(int fd, uint64_t start, uint64_t end, bool exact);
+      virtual ~headerRange(){}
+      const char * read(uint64_t pos, size_t len);
+      uint64_t start;///< Byte position the range starts at; unless exact is set, this need not be a container boundary.
+      uint64_t end;///< Parsing stops at the first container boundary at or after this byte position.
+      bool exact;///< Whether start is known to be a container boundary, so parsing may start there without resyncing.
+      uint64_t syncPos;///< Byte position of the first container boundary found, where parsing started.
+      uint64_t endPos;///< Byte position right after the last data parsed.
+      bool failed;///< Whether parsing stopped at invalid data, rather than at the end of the range or file.
+    private:
+      int fd;
+      std::string buffer;///< Data read from the file, starting at bufferStart.
+      uint64_t bufferStart;
+  };
+
   class Input : public InOutBase {
     public:
       Input(Util::Config * cfg);
@@ -25,6 +45,9 @@ namespace Mist {
       virtual ~Input() {};
 
       virtual bool needsLock(){return true;}
+
+      typedef Input * (*factory)(Util::Config * cfg);
+      static factory create;///< Creates another instance of this input type, for streams hosted by a shared process.
     protected:
       static void callbackWrapper(char * data, size_t len, unsigned int id);
       virtual bool checkArguments() = 0;
@@ -49,12 +72,28 @@ namespace Mist {
       virtual void userCallback(char * data, size_t len, unsigned int id);
       virtual void convert();
       virtual void serve();
+      void serveStart();
+      void serveStep();
+      void serveStop();
+      void serveShared();
+      bool hostStream(JSON::Value & args);
+      void makeCurrent();
+      void unloadPage(unsigned int track, unsigned int page);
+      std::string dataPageName(unsigned int track, unsigned int page);
+      bool loadHeader();
+      bool headerOnly();
       virtual void stream();
       virtual std::string streamMainLoop();
       bool isAlwaysOn();
 
       virtual void parseHeader();
+      bool parallelHeader(uint64_t start, uint64_t end);
+      static void headerThread(void * arg);
+      virtual headerRange * scanRange(uint64_t start, uint64_t end, bool exact){return 0;}
+      virtual bool mergeRange(headerRange & range){return false;}
       bool bufferFrame(unsigned int track, unsigned int keyNum);
+      bool loadPages(unsigned int track);
+      void bufferAhead();
 
       unsigned int packTime;///Media-timestamp of the last packet.
       int lastActive;///Timestamp of the last time we received or sent something.
@@ -67,15 +106,26 @@ namespace Mist {
 
       JSON::Value capa;
       
-      std::map<int,std::set<int> > keyTimes;
+      std::set<unsigned int> unpagedTracks;///< Tracks whose pages are split from their header key sizes on first use.
 
       //Create server for user pages
       IPC::sharedServer userPage;
       IPC::sharedPage streamStatus;
 
       std::map<unsigned int, std::map<unsigned int, unsigned int> > pageCounter;
+      std::map<unsigned int, std::set<unsigned int> > stepPages;///< Per track, the pages requested or buffered during this serve loop iteration.
+      std::map<unsigned int, std::set<unsigned int> > viewerKeys;///< Per track, the keys viewers requested during this serve loop iteration.
+      std::map<unsigned int, unsigned int> pagesAhead;///< Per track, how many pages to buffer ahead of each viewer.
+      uint64_t pageHits;///< Viewer requests that found their page loaded, since the last page accounting update.
+      uint64_t pageMisses;///< Viewer requests that needed their page loaded first, since the last page accounting update.
+      std::map<unsigned int, std::set<unsigned int> > acctInUse;///< Per track, the pages last reported in use to the page accounting.
+      uint64_t evictGen;///< Eviction generation of the page accounting last checked for pages to unload.
 
       static Input * singleton;
+
+      Util::Config * instanceConfig;///< The config of this instance; InOutBase::config points here while it is in use.
+      IPC::semaphore hostedLock;///< SEM_INPUT for a stream hosted by a shared process, held instead of by an angel process.
+      char * hostedNames;///< Names of the streams hosted by this process, shared with the angel process for cleanup.
   };
 
 }
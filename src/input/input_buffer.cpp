@@ -1,4 +1,5 @@
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
 #include <iostream>
@@ -7,6 +8,7 @@
 #include <cstdlib>
 #include <cstdio>
 #include <string>
+#include <sstream>
 #include <mist/stream.h>
 #include <mist/defines.h>
 #include <mist/bitfields.h>
@@ -17,9 +19,13 @@
 #define TIMEOUTMULTIPLIER 2
 #endif
 
+///Amount of serve loop iterations a spilled page stays buffered after the last viewer needed it.
+#ifndef SPILL_COLD_LOOPS
+#define SPILL_COLD_LOOPS 10
+#endif
+
 namespace Mist {
   inputBuffer::inputBuffer(Util::Config * cfg) : Input(cfg) {
-    liveMeta = 0;
     capa["name"] = "Buffer";
     JSON::Value option;
     option["arg"] = "integer";
@@ -49,8 +55,33 @@ namespace Mist {
     capa["optional"]["resume"]["select"][1u][0u] = "1";
     capa["optional"]["resume"]["select"][1u][1u] = "Enabled";
     capa["optional"]["resume"]["default"] = 0LL;
+
+    option["arg"] = "string";
+    option["long"] = "spill";
+    option["short"] = "D";
+    option["help"] = "Directory to spill the part of the DVR buffer outside the in-memory window to (disabled if empty)";
+    option["value"][0u] = "";
+    config->addOption("spillDir", option);
+    capa["optional"]["spill"]["name"] = "DVR spill directory";
+    capa["optional"]["spill"]["help"] = "If set, buffered data older than the in-memory window is moved to files in this directory instead of being kept in memory, and loaded back when viewers seek into it. This allows buffer times far larger than the available memory.";
+    capa["optional"]["spill"]["option"] = "--spill";
+    capa["optional"]["spill"]["type"] = "str";
+    capa["optional"]["spill"]["default"] = "";
+
+    option["arg"] = "integer";
+    option["long"] = "hot";
+    option["short"] = "H";
+    option["help"] = "When spilling, the part of the DVR buffer in ms that is kept in memory";
+    option["value"][0u] = 60000LL;
+    config->addOption("hotTime", option);
+    capa["optional"]["hot"]["name"] = "In-memory buffer time (ms)";
+    capa["optional"]["hot"]["help"] = "When a DVR spill directory is set, the most recent part of the buffer that is kept in memory, in milliseconds. Ignored otherwise.";
+    capa["optional"]["hot"]["option"] = "--hot";
+    capa["optional"]["hot"]["type"] = "uint";
+    capa["optional"]["hot"]["default"] = 60000LL;
     option.null();
 
+    capa["optional"].removeMember("shared");//live buffers always run in a process of their own
     capa["source_match"] = "push://*";
     capa["non-provider"] = true;//Indicates we don't provide data, only collect it
     capa["priority"] = 9ll;
@@ -64,6 +95,7 @@ namespace Mist {
     cutTime = 0;
     hasPush = false;
     resumeMode = false;
+    hotTime = 60000;
   }
 
   inputBuffer::~inputBuffer() {
@@ -76,19 +108,17 @@ namespace Mist {
           continue;
       }
         //First detect all entries on metaPage
-        for (int i = 0; i < 8192; i += 8) {
-          char * tmpOffset = nProxy.metaPages[it->first].mapped + i;
-          if (Bit::btohl(tmpOffset) == 0 && Bit::btohl(tmpOffset+4) == 0) {
-            continue;
-          }
-          unsigned long keyNum = Bit::btohl(tmpOffset);
+        std::map<unsigned long, unsigned long> entries;
+        trackIndex(nProxy.metaPages[it->first]).getAll(entries);
+        for (std::map<unsigned long, unsigned long>::iterator eIt = entries.begin(); eIt != entries.end(); ++eIt) {
+          unsigned long keyNum = eIt->first;
 
           //Add an entry into bufferLocations[tNum] for the pages we haven't handled yet.
           if (!locations.count(keyNum)) {
             locations[keyNum].curOffset = 0;
           }
           locations[keyNum].pageNum = keyNum;
-          locations[keyNum].keyNum = Bit::btohl(tmpOffset+4);
+          locations[keyNum].keyNum = eIt->second;
         }
         for (std::map<unsigned long, DTSCPageData>::iterator it2 = locations.begin(); it2 != locations.end(); it2++) {
           char thisPageName[NAME_BUFFER_SIZE];
@@ -98,10 +128,9 @@ namespace Mist {
         }
       }
     }
-    if (liveMeta){
-      liveMeta->unlink();
-      delete liveMeta;
-      liveMeta = 0;
+    if (liveMetaPage.mapped){
+      liveMetaPage.master = true;
+      liveMetaPage.close();
     }
   }
 
@@ -124,8 +153,12 @@ namespace Mist {
         memset(tmp.mapped, 0xFF, size);
       }
     }
-    //Delete the live stream semaphore, if any.
-    if (liveMeta){liveMeta->unlink();}
+    {
+      //Delete the live stream lock, if any.
+      snprintf(pageName, NAME_BUFFER_SIZE, SHM_STREAM_LOCK, streamName.c_str());
+      IPC::sharedPage erasePage(pageName, IPC::sharedMutex::size(), false, false);
+      erasePage.master = true;
+    }
     {
       //Delete the stream index metapage.
       snprintf(pageName, NAME_BUFFER_SIZE, SHM_STREAM_INDEX, streamName.c_str());
@@ -144,14 +177,10 @@ namespace Mist {
       IPC::sharedPage indexPage(pageName, SHM_TRACK_INDEX_SIZE, false, false);
       indexPage.master = true;
       if (indexPage.mapped){
-        char * mappedPointer = indexPage.mapped;
-        for (int j = 0; j < 8192; j += 8) {
-          char * tmpOffset = mappedPointer + j;
-          if (Bit::btohl(tmpOffset) == 0 && Bit::btohl(tmpOffset+4) == 0){
-            continue;
-          }
-          unsigned long keyNum = Bit::btohl(tmpOffset);
-          snprintf(pageName, NAME_BUFFER_SIZE, SHM_TRACK_DATA, streamName.c_str(), i, keyNum);
+        std::map<unsigned long, unsigned long> entries;
+        trackIndex(indexPage).getAll(entries);
+        for (std::map<unsigned long, unsigned long>::iterator eIt = entries.begin(); eIt != entries.end(); ++eIt) {
+          snprintf(pageName, NAME_BUFFER_SIZE, SHM_TRACK_DATA, streamName.c_str(), i, eIt->first);
           IPC::sharedPage erasePage(pageName, 1024, false, false);
           erasePage.master = true;
         }
@@ -192,12 +221,14 @@ namespace Mist {
     myMeta.bufferWindow = lastms - firstms;
     myMeta.vod = false;
     myMeta.live = true;
-    if (!liveMeta){
-      static char liveSemName[NAME_BUFFER_SIZE];
-      snprintf(liveSemName, NAME_BUFFER_SIZE, SEM_LIVE, streamName.c_str());
-      liveMeta = new IPC::semaphore(liveSemName, O_CREAT | O_RDWR, ACCESSPERMS, 1);
+    if (!liveMetaPage.mapped){
+      char liveLockName[NAME_BUFFER_SIZE];
+      snprintf(liveLockName, NAME_BUFFER_SIZE, SHM_STREAM_LOCK, streamName.c_str());
+      liveMetaPage.init(liveLockName, IPC::sharedMutex::size(), true);
+      liveMetaPage.master = false;
+      liveMeta.init(liveMetaPage.mapped, true);
     }
-    liveMeta->wait();
+    bool locked = liveMeta.lock();
 
     if (!nProxy.metaPages.count(0) || !nProxy.metaPages[0].mapped) {
       char pageName[NAME_BUFFER_SIZE];
@@ -207,7 +238,9 @@ namespace Mist {
     }
     myMeta.writeTo(nProxy.metaPages[0].mapped);
     memset(nProxy.metaPages[0].mapped + myMeta.getSendLen(), 0, (nProxy.metaPages[0].len > myMeta.getSendLen() ? std::min(nProxy.metaPages[0].len - myMeta.getSendLen(), 4ll) : 0));
-    liveMeta->post();
+    if (locked){
+      liveMeta.unlock();
+    }
   }
 
   ///Checks if removing a key from this track is allowed/safe, and if so, removes it.
@@ -249,6 +282,14 @@ namespace Mist {
     }
     //Alright, everything looks good, let's delete the key and possibly also fragment
     Trk.removeFirstKey();
+    //Spilled pages are always older than the buffered ones; drop them once no key on them is left
+    while (spillLocations.count(tid) && spillLocations[tid].size()){
+      std::map<unsigned long, DTSCPageData>::iterator spillIt = spillLocations[tid].begin();
+      if (Trk.keys.size() && Trk.keys[0].getNumber() < spillIt->first + spillIt->second.keyNum && config->is_active){
+        break;
+      }
+      dropSpilledPage(tid, spillIt->first);
+    }
     //if there is more than one page buffered for this track...
     if (bufferLocations[tid].size() > 1) {
       //Check if the first key starts on the second page or higher
@@ -273,6 +314,7 @@ namespace Mist {
   }
 
   void inputBuffer::eraseTrackDataPages(unsigned long tid){
+    eraseSpill(tid);
     if (!bufferLocations.count(tid)){
       return;
     }
@@ -288,9 +330,197 @@ namespace Mist {
     nProxy.metaPages.erase(tid);
   }
 
+  ///Returns the name of the file the given track spills its pages to.
+  std::string inputBuffer::spillFileName(unsigned long tid){
+    std::stringstream name;
+    name << spillDir << "/" << streamName << "@" << tid << ".dtsc";
+    return name.str();
+  }
+
+  ///Appends a data page to the spill file of its track and removes it from memory.
+  ///The keys on the page stay in the metadata, so viewers can still seek to them.
+  ///Returns false if the page was kept in memory.
+  bool inputBuffer::spillPage(unsigned long tid, unsigned long pageNum){
+    DTSCPageData pageData = bufferLocations[tid][pageNum];
+    if (!pageData.curOffset){
+      return false;
+    }
+    if (!spillFiles.count(tid)){
+      std::string fileName = spillFileName(tid);
+      int fd = open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+      if (fd == -1){
+        FAIL_MSG("Could not open spill file %s: %s; keeping the whole buffer in memory", fileName.c_str(), strerror(errno));
+        spillDir.clear();
+        return false;
+      }
+      spillFiles[tid] = fd;
+    }
+    char pageName[NAME_BUFFER_SIZE];
+    snprintf(pageName, NAME_BUFFER_SIZE, SHM_TRACK_DATA, streamName.c_str(), tid, pageNum);
+    IPC::sharedPage page(pageName, 20971520, false, false);
+    if (!page.mapped){
+      WARN_MSG("Could not open page %s for spilling", pageName);
+      return false;
+    }
+    int fd = spillFiles[tid];
+    off_t fileOffset = lseek(fd, 0, SEEK_END);
+    unsigned long long written = 0;
+    while (fileOffset != (off_t)-1 && written < pageData.curOffset){
+      ssize_t ret = pwrite(fd, page.mapped + written, pageData.curOffset - written, fileOffset + written);
+      if (ret < 0 && errno == EINTR){
+        continue;
+      }
+      if (ret <= 0){
+        WARN_MSG("Could not spill page %s to disk: %s", pageName, strerror(errno));
+        if (ftruncate(fd, fileOffset)){}
+        return false;
+      }
+      written += ret;
+    }
+    if (fileOffset == (off_t)-1){
+      return false;
+    }
+    HIGH_MSG("Spilling track %lu, keys %lu-%lu to disk", tid, pageNum, pageNum + pageData.keyNum - 1);
+    DTSCPageData & spilled = spillLocations[tid][pageNum];
+    spilled = pageData;
+    spilled.dataSize = pageData.curOffset;
+    spilled.curOffset = fileOffset;
+    bufferRemove(tid, pageNum);
+    if (nProxy.curPageNum.count(tid) && nProxy.curPageNum[tid] == pageNum){
+      nProxy.curPageNum.erase(tid);
+      nProxy.curPage.erase(tid);
+    }
+    //Viewers that have the page mapped keep their mapping, the name goes away
+    page.master = true;
+    bufferLocations[tid].erase(pageNum);
+    return true;
+  }
+
+  ///Buffers a spilled page again, and lists it in the track index so viewers can load it.
+  ///If the page is already buffered, postpones its unloading instead.
+  bool inputBuffer::loadSpilledPage(unsigned long tid, unsigned long pageNum){
+    if (coldPages[tid].count(pageNum)){
+      coldPages[tid][pageNum] = SPILL_COLD_LOOPS;
+      return true;
+    }
+    if (!spillFiles.count(tid) || !spillLocations[tid].count(pageNum)){
+      return false;
+    }
+    DTSCPageData & pageData = spillLocations[tid][pageNum];
+    char pageName[NAME_BUFFER_SIZE];
+    snprintf(pageName, NAME_BUFFER_SIZE, SHM_TRACK_DATA, streamName.c_str(), tid, pageNum);
+    //Four extra zero bytes mark the end of the data
+    IPC::sharedPage page(pageName, pageData.dataSize + 4, true);
+    if (!page.mapped){
+      FAIL_MSG("Could not create page %s to load spilled data into", pageName);
+      return false;
+    }
+    unsigned long long done = 0;
+    while (done < pageData.dataSize){
+      ssize_t ret = pread(spillFiles[tid], page.mapped + done, pageData.dataSize - done, pageData.curOffset + done);
+      if (ret < 0 && errno == EINTR){
+        continue;
+      }
+      if (ret <= 0){
+        FAIL_MSG("Could not read spilled page %s back from disk: %s", pageName, ret ? strerror(errno) : "unexpected end of file");
+        return false;
+      }
+      done += ret;
+    }
+    if (!nProxy.metaPages.count(tid) || !trackIndex(nProxy.metaPages[tid]).insert(pageNum, pageData.keyNum)){
+      FAIL_MSG("Could not list spilled page %s in the track index", pageName);
+      return false;
+    }
+    HIGH_MSG("Loaded spilled track %lu, keys %lu-%lu back into memory", tid, pageNum, pageNum + pageData.keyNum - 1);
+    page.master = false;
+    pageAccount().add(pageName, page.len, false);
+    coldPages[tid][pageNum] = SPILL_COLD_LOOPS;
+    return true;
+  }
+
+  ///Buffers the spilled pages a viewer of a track needs: the one it is on and the one it will request next.
+  ///\param keyNum The key number from the user page, which only holds its lower 16 bits.
+  void inputBuffer::loadSpilledKeys(unsigned long tid, unsigned long keyNum){
+    DTSC::Track & Trk = myMeta.tracks[tid];
+    if (!Trk.keys.size()){
+      return;
+    }
+    //Find the buffered key matching the lower 16 bits
+    unsigned long lastKey = Trk.keys.rbegin()->getNumber();
+    unsigned long current = (lastKey & ~0xFFFFul) | (keyNum & 0xFFFF);
+    if (current > lastKey){
+      if (current < 0x10000){
+        return;
+      }
+      current -= 0x10000;
+    }
+    std::map<unsigned long, DTSCPageData> & spilled = spillLocations[tid];
+    for (unsigned long key = current; key <= current + 1; ++key){
+      if (key < Trk.keys[0].getNumber()){
+        continue;
+      }
+      std::map<unsigned long, DTSCPageData>::iterator pIt = spilled.upper_bound(key);
+      if (pIt == spilled.begin()){
+        continue;
+      }
+      --pIt;
+      if (key < pIt->first + pIt->second.keyNum){
+        loadSpilledPage(tid, pIt->first);
+      }
+    }
+  }
+
+  ///Removes a spilled page that was buffered again from memory. It stays available on disk.
+  void inputBuffer::unloadColdPage(unsigned long tid, unsigned long pageNum){
+    if (!coldPages.count(tid) || !coldPages[tid].count(pageNum)){
+      return;
+    }
+    HIGH_MSG("Unloading spilled track %lu page %lu from memory", tid, pageNum);
+    bufferRemove(tid, pageNum);
+    char pageName[NAME_BUFFER_SIZE];
+    snprintf(pageName, NAME_BUFFER_SIZE, SHM_TRACK_DATA, streamName.c_str(), tid, pageNum);
+    IPC::sharedPage erasePage(pageName, 20971520, false, false);
+    erasePage.master = true;
+    coldPages[tid].erase(pageNum);
+  }
+
+  ///Forgets a spilled page that left the buffer, and releases its disk space.
+  void inputBuffer::dropSpilledPage(unsigned long tid, unsigned long pageNum){
+    unloadColdPage(tid, pageNum);
+    if (!spillLocations[tid].count(pageNum)){
+      return;
+    }
+#ifdef FALLOC_FL_PUNCH_HOLE
+    DTSCPageData & pageData = spillLocations[tid][pageNum];
+    if (spillFiles.count(tid)){
+      //The file keeps growing at the end, punching holes keeps the disk usage bounded by the buffer time
+      fallocate(spillFiles[tid], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pageData.curOffset, pageData.dataSize);
+    }
+#endif
+    spillLocations[tid].erase(pageNum);
+  }
+
+  ///Removes all spilled data of a track, from memory as well as from disk.
+  void inputBuffer::eraseSpill(unsigned long tid){
+    while (coldPages.count(tid) && coldPages[tid].size()){
+      unloadColdPage(tid, coldPages[tid].begin()->first);
+    }
+    coldPages.erase(tid);
+    spillLocations.erase(tid);
+    if (spillFiles.count(tid)){
+      close(spillFiles[tid]);
+      spillFiles.erase(tid);
+      unlink(spillFileName(tid).c_str());
+    }
+  }
+
   void inputBuffer::finish() {
     Input::finish();
     updateMeta();
+    while (spillFiles.size()){
+      eraseSpill(spillFiles.begin()->first);
+    }
+    spillLocations.clear();
     if (bufferLocations.size()){
       std::set<unsigned long> toErase;
       for (std::map<unsigned long, std::map<unsigned long, DTSCPageData> >::iterator it = bufferLocations.begin(); it != bufferLocations.end(); it++){
@@ -341,6 +571,7 @@ namespace Mist {
             WARN_MSG("Erasing %s inactive track %u (%s/%s) because it was inactive for 5+ seconds and contains data (%us - %us), while active tracks are (%us - %us), which is more than %us seconds apart.", streamName.c_str(), it->first, it->second.type.c_str(), it->second.codec.c_str(), it->second.firstms / 1000, it->second.lastms / 1000, compareFirst / 1000, compareLast / 1000, bufferTime / 1000);
           }
           lastUpdated.erase(tid);
+          eraseSpill(tid);
           /// \todo Consider replacing with eraseTrackDataPages(it->first)?
           while (bufferLocations[tid].size()){
             char thisPageName[NAME_BUFFER_SIZE];
@@ -394,6 +625,34 @@ namespace Mist {
         }
       }
     }
+    //Unload spilled pages that were buffered again, once viewers no longer need them
+    for (std::map<unsigned long, std::map<unsigned long, unsigned int> >::iterator it = coldPages.begin(); it != coldPages.end(); it++) {
+      std::set<unsigned long> expired;
+      for (std::map<unsigned long, unsigned int>::iterator pIt = it->second.begin(); pIt != it->second.end(); pIt++) {
+        if (!pIt->second || !--(pIt->second)) {
+          expired.insert(pIt->first);
+        }
+      }
+      for (std::set<unsigned long>::iterator eIt = expired.begin(); eIt != expired.end(); ++eIt) {
+        unloadColdPage(it->first, *eIt);
+      }
+    }
+    //Move whole pages that left the in-memory window to disk, never touching the page currently being written
+    if (spillDir.size() && config->is_active) {
+      for (std::map<unsigned int, DTSC::Track>::iterator it = myMeta.tracks.begin(); it != myMeta.tracks.end(); it++) {
+        std::map<unsigned long, DTSCPageData> & locations = bufferLocations[it->first];
+        while (locations.size() > 1) {
+          //A page ends where the next one starts
+          unsigned long long pageEnd = (++locations.begin())->second.firstTime;
+          if (!pageEnd || pageEnd + hotTime > it->second.lastms) {
+            break;
+          }
+          if (!spillPage(it->first, locations.begin()->first)) {
+            break;
+          }
+        }
+      }
+    }
     updateMeta();
     if (config->is_active){
       if (streamStatus){streamStatus.mapped[0] = hasPush ? STRMSTAT_READY : STRMSTAT_WAIT;}
@@ -631,6 +890,11 @@ namespace Mist {
           updateTrackMeta(value);
           hasPush = true;
         }
+        continue;
+      }
+      //A viewer of a track that has spilled pages, make sure the pages it needs are buffered
+      if (spillLocations.count(value) && spillLocations[value].size()) {
+        loadSpilledKeys(value, userConn.getKeynum(index));
       }
     }
   }
@@ -638,25 +902,26 @@ namespace Mist {
   void inputBuffer::updateTrackMeta(unsigned long tNum) {
     //Store a reference for easier access
     std::map<unsigned long, DTSCPageData> & locations = bufferLocations[tNum];
-    char * mappedPointer = nProxy.metaPages[tNum].mapped;
-    if (!mappedPointer){return;}
+    if (!nProxy.metaPages[tNum].mapped){return;}
     VERYHIGH_MSG("Updating meta for track %lu, %lu pages", tNum, locations.size());
 
     //First detect all entries on metaPage
-    for (int i = 0; i < 8192; i += 8) {
-      char * tmpOffset = mappedPointer + i;
-      if (Bit::btohl(tmpOffset) == 0 && Bit::btohl(tmpOffset+4) == 0) {
+    std::map<unsigned long, unsigned long> entries;
+    trackIndex(nProxy.metaPages[tNum]).getAll(entries);
+    for (std::map<unsigned long, unsigned long>::iterator eIt = entries.begin(); eIt != entries.end(); ++eIt) {
+      unsigned long keyNum = eIt->first;
+      //Spilled pages that were buffered again are already parsed
+      if (spillLocations.count(tNum) && spillLocations[tNum].count(keyNum)) {
         continue;
       }
-      unsigned long keyNum = Bit::btohl(tmpOffset);
 
       //Add an entry into bufferLocations[tNum] for the pages we haven't handled yet.
       if (!locations.count(keyNum)) {
         locations[keyNum].curOffset = 0;
-        VERYHIGH_MSG("Page %d detected, with %d keys", keyNum, Bit::btohl(tmpOffset+4));
+        VERYHIGH_MSG("Page %lu detected, with %lu keys", keyNum, eIt->second);
       }
       locations[keyNum].pageNum = keyNum;
-      locations[keyNum].keyNum = Bit::btohl(tmpOffset+4);
+      locations[keyNum].keyNum = eIt->second;
     }
     //Since the map is ordered by keynumber, this loop updates the metadata for each page from oldest to newest
     for (std::map<unsigned long, DTSCPageData>::iterator pageIt = locations.begin(); pageIt != locations.end(); pageIt++) {
@@ -722,20 +987,14 @@ namespace Mist {
   }
 
   bool inputBuffer::preRun() {
-    std::string strName = config->getString("streamname");
-    Util::sanitizeName(strName);
-    strName = strName.substr(0, (strName.find_first_of("+ ")));
-    IPC::sharedPage serverCfg(SHM_CONF, DEFAULT_CONF_PAGE_SIZE, false, false); ///< Contains server configuration and capabilities
-    IPC::semaphore configLock(SEM_CONF, O_CREAT | O_RDWR, ACCESSPERMS, 1);
-    configLock.wait();
-    DTSC::Scan streamCfg = DTSC::Scan(serverCfg.mapped, serverCfg.len).getMember("streams").getMember(strName);
+    JSON::Value streamCfg = Util::getStreamConfig(config->getString("streamname"));
     long long tmpNum;
 
     //if stream is configured and setting is present, use it, always
-    if (streamCfg && streamCfg.getMember("DVR")) {
-      tmpNum = streamCfg.getMember("DVR").asInt();
+    if (streamCfg.isMember("DVR")) {
+      tmpNum = streamCfg["DVR"].asInt();
     } else {
-      if (streamCfg) {
+      if (!streamCfg.isNull()) {
         //otherwise, if stream is configured use the default
         tmpNum = config->getOption("bufferTime", true)[0u].asInt();
       } else {
@@ -753,10 +1012,10 @@ namespace Mist {
     }
 
     //if stream is configured and setting is present, use it, always
-    if (streamCfg && streamCfg.getMember("resume")) {
-      tmpNum = streamCfg.getMember("resume").asInt();
+    if (streamCfg.isMember("resume")) {
+      tmpNum = streamCfg["resume"].asInt();
     } else {
-      if (streamCfg) {
+      if (!streamCfg.isNull()) {
         //otherwise, if stream is configured use the default
         tmpNum = config->getOption("resume", true)[0u].asInt();
       } else {
@@ -770,8 +1029,50 @@ namespace Mist {
       resumeMode = tmpNum;
     }
 
-    configLock.post();
-    configLock.close();
+    //if stream is configured and setting is present, use it, always
+    std::string tmpStr;
+    if (streamCfg.isMember("spill")) {
+      tmpStr = streamCfg["spill"].asStringRef();
+    } else {
+      if (!streamCfg.isNull()) {
+        //otherwise, if stream is configured use the default
+        tmpStr = config->getOption("spillDir", true)[0u].asStringRef();
+      } else {
+        //if not, use the commandline argument
+        tmpStr = config->getString("spillDir");
+      }
+    }
+    //if the new value is different, print a message and apply it
+    if (spillDir != tmpStr) {
+      if (spillLocations.size()){
+        WARN_MSG("Not changing the DVR spill directory to '%s' while data is spilled to '%s'", tmpStr.c_str(), spillDir.c_str());
+      }else{
+        INFO_MSG("Setting DVR spill directory from '%s' to '%s'", spillDir.c_str(), tmpStr.c_str());
+        spillDir = tmpStr;
+      }
+    }
+
+    //if stream is configured and setting is present, use it, always
+    if (streamCfg.isMember("hot")) {
+      tmpNum = streamCfg["hot"].asInt();
+    } else {
+      if (!streamCfg.isNull()) {
+        //otherwise, if stream is configured use the default
+        tmpNum = config->getOption("hotTime", true)[0u].asInt();
+      } else {
+        //if not, use the commandline argument
+        tmpNum = config->getOption("hotTime").asInt();
+      }
+    }
+    if (tmpNum < 1000) {
+      tmpNum = 1000;
+    }
+    //if the new value is different, print a message and apply it
+    if (hotTime != tmpNum) {
+      DEBUG_MSG(DLVL_DEVEL, "Setting hotTime from %u to new value of %lli", hotTime, tmpNum);
+      hotTime = tmpNum;
+    }
+
     return true;
   }
 
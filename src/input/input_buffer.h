@@ -13,7 +13,10 @@ namespace Mist {
       unsigned int cutTime;
       bool hasPush;
       bool resumeMode;
-      IPC::semaphore * liveMeta;
+      unsigned int hotTime;///< When spilling, how many ms of each track are kept in memory.
+      std::string spillDir;///< Directory to spill pages leaving the in-memory window to; spilling is disabled when empty.
+      IPC::sharedPage liveMetaPage;
+      IPC::sharedMutex liveMeta;
     protected:
       //Private Functions
       bool preRun();
@@ -29,6 +32,13 @@ namespace Mist {
       bool removeKey(unsigned int tid);
       void removeUnused();
       void eraseTrackDataPages(unsigned long tid);
+      std::string spillFileName(unsigned long tid);
+      bool spillPage(unsigned long tid, unsigned long pageNum);
+      bool loadSpilledPage(unsigned long tid, unsigned long pageNum);
+      void loadSpilledKeys(unsigned long tid, unsigned long keyNum);
+      void unloadColdPage(unsigned long tid, unsigned long pageNum);
+      void dropSpilledPage(unsigned long tid, unsigned long pageNum);
+      void eraseSpill(unsigned long tid);
       void finish();
       void userCallback(char * data, size_t len, unsigned int id);
       std::set<unsigned long> negotiatingTracks;
@@ -38,6 +48,11 @@ namespace Mist {
       ///Maps trackid to a pagenum->pageData map
       std::map<unsigned long, std::map<unsigned long, DTSCPageData> > bufferLocations;
       std::map<unsigned long, char *> pushLocation;
+      ///Maps trackid to a pagenum->pageData map of the pages spilled to disk, with curOffset holding their offset in the spill file
+      std::map<unsigned long, std::map<unsigned long, DTSCPageData> > spillLocations;
+      std::map<unsigned long, int> spillFiles;///< Per track, the file descriptor of its spill file.
+      ///Maps trackid to the spilled pages that are buffered again, with the amount of serve loop iterations left before they are unloaded
+      std::map<unsigned long, std::map<unsigned long, unsigned int> > coldPages;
       inputBuffer * singleton;
       //This is used for an ugly fix to prevent metadata from disappearing in some cases.
       std::map<unsigned long, std::string> initData;
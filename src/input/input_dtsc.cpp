@@ -125,6 +125,7 @@ namespace Mist {
             std::string dataPacket = srcConn.Received().remove(8+rSize);
             DTSC::Packet metaPack(dataPacket.data(), dataPacket.size());
             myMeta.reinit(metaPack);
+            srcMeta = myMeta;
             for (std::map<unsigned int, DTSC::Track>::iterator it = myMeta.tracks.begin(); it != myMeta.tracks.end(); it++){
               continueNegotiate(it->first, true);
             }
@@ -226,6 +227,20 @@ namespace Mist {
     return true;
   }
 
+  /// Replaces srcMeta with the given full header, copies the tracks in it that myMeta does not have yet
+  /// into newTracks, and lists the IDs of all tracks in it in allTracks.
+  /// The source only sends full headers when its tracks change; in between, it sends "meta_delta" commands
+  /// that are applied to srcMeta. The key and part tables in myMeta are rebuilt from the packets themselves.
+  void inputDTSC::newTracksFromHeader(DTSC::Packet & header, std::map<unsigned int, DTSC::Track> & newTracks, std::set<unsigned int> & allTracks){
+    srcMeta.reinit(header);
+    for (std::map<unsigned int, DTSC::Track>::iterator it = srcMeta.tracks.begin(); it != srcMeta.tracks.end(); it++){
+      allTracks.insert(it->first);
+      if (!myMeta.tracks.count(it->first)){
+        newTracks[it->first] = it->second;
+      }
+    }
+  }
+
   void inputDTSC::getNext(bool smart) {
     if (!needsLock()){
       thisPacket.reInit(srcConn);
@@ -238,26 +253,19 @@ namespace Mist {
             //Read next packet
             thisPacket.reInit(srcConn);
             if (thisPacket.getVersion() == DTSC::DTSC_HEAD){
-              DTSC::Meta newMeta;
-              newMeta.reinit(thisPacket);
-              //Detect new tracks
-              std::set<unsigned int> newTracks;
-              for (std::map<unsigned int, DTSC::Track>::iterator it = newMeta.tracks.begin(); it != newMeta.tracks.end(); it++){
-                if (!myMeta.tracks.count(it->first)){
-                  newTracks.insert(it->first);
-                }
-              }
-
-              for (std::set<unsigned int>::iterator it = newTracks.begin(); it != newTracks.end(); it++){
-                INFO_MSG("Reset: adding track %d", *it);
-                myMeta.tracks[*it] = newMeta.tracks[*it];
-                continueNegotiate(*it, true);
+              std::map<unsigned int, DTSC::Track> newTracks;
+              std::set<unsigned int> allTracks;
+              newTracksFromHeader(thisPacket, newTracks, allTracks);
+              for (std::map<unsigned int, DTSC::Track>::iterator it = newTracks.begin(); it != newTracks.end(); it++){
+                INFO_MSG("Reset: adding track %d", it->first);
+                myMeta.tracks[it->first] = it->second;
+                continueNegotiate(it->first, true);
               }
 
               //Detect removed tracks
               std::set<unsigned int> deletedTracks;
               for (std::map<unsigned int, DTSC::Track>::iterator it = myMeta.tracks.begin(); it != myMeta.tracks.end(); it++){
-                if (!newMeta.tracks.count(it->first)){
+                if (!allTracks.count(it->first)){
                   deletedTracks.insert(it->first);
                 }
               }
@@ -270,24 +278,23 @@ namespace Mist {
             }else{
               myMeta = DTSC::Meta();
             }
+          }else if (cmd == "meta_delta"){
+            if (!srcMeta.applyDelta(thisPacket)){
+              WARN_MSG("Metadata delta for unknown tracks of stream %s; ignoring it until the next full header", streamName.c_str());
+            }
+            thisPacket.reInit(srcConn);//read the next packet before continuing
           }else{
             thisPacket.reInit(srcConn);//read the next packet before continuing
           }
           continue;//parse the next packet before returning
         }else if (thisPacket.getVersion() == DTSC::DTSC_HEAD){
-          DTSC::Meta newMeta;
-          newMeta.reinit(thisPacket);
-          std::set<unsigned int> newTracks;
-          for (std::map<unsigned int, DTSC::Track>::iterator it = newMeta.tracks.begin(); it != newMeta.tracks.end(); it++){
-            if (!myMeta.tracks.count(it->first)){
-              newTracks.insert(it->first);
-            }
-          }
-
-          for (std::set<unsigned int>::iterator it = newTracks.begin(); it != newTracks.end(); it++){
-            INFO_MSG("New header: adding track %d (%s)", *it, newMeta.tracks[*it].type.c_str());
-            myMeta.tracks[*it] = newMeta.tracks[*it];
-            continueNegotiate(*it, true);
+          std::map<unsigned int, DTSC::Track> newTracks;
+          std::set<unsigned int> allTracks;
+          newTracksFromHeader(thisPacket, newTracks, allTracks);
+          for (std::map<unsigned int, DTSC::Track>::iterator it = newTracks.begin(); it != newTracks.end(); it++){
+            INFO_MSG("New header: adding track %d (%s)", it->first, it->second.type.c_str());
+            myMeta.tracks[it->first] = it->second;
+            continueNegotiate(it->first, true);
           }
           thisPacket.reInit(srcConn);//read the next packet before continuing
           continue;//parse the next packet before returning
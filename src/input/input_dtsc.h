@@ -17,8 +17,10 @@ namespace Mist {
       void getNext(bool smart = true);
       void seek(int seekTime);
       void trackSelect(std::string trackSpec);
+      void newTracksFromHeader(DTSC::Packet & header, std::map<unsigned int, DTSC::Track> & newTracks, std::set<unsigned int> & allTracks);
 
       DTSC::File inFile;
+      DTSC::Meta srcMeta;///< The metadata of the stream source, kept current with its "meta_delta" commands.
 
       Socket::Connection srcConn;
   };
@@ -11,6 +11,7 @@
 #include <mist/util.h>
 #include <mist/stream.h>
 #include <mist/defines.h>
+#include <mist/bitfields.h>
 
 #include "input_flv.h"
 
@@ -79,26 +80,110 @@ namespace Mist {
   bool inputFLV::readHeader() {
     if (!inFile){return false;}
     //Create header file from FLV data
-    Util::fseek(inFile, 13, SEEK_SET);
-    AMF::Object amf_storage;
-    long long int lastBytePos = 13;
+    struct stat statData;
+    if (fstat(fileno(inFile), &statData) == -1){return false;}
+    amfStorage = AMF::Object();
+    lastBytePos = 13;
     uint64_t bench = Util::getMicros();
-    while (!feof(inFile) && !FLV::Parse_Error){
-      if (tmpTag.FileLoader(inFile)){
-        tmpTag.toMeta(myMeta, amf_storage);
-        if (!tmpTag.getDataLen()){continue;}
-        if (tmpTag.needsInitData() && tmpTag.isInitData()){continue;}
-        myMeta.update(tmpTag.tagTime(), tmpTag.offset(), tmpTag.getTrackID(), tmpTag.getDataLen(), lastBytePos, tmpTag.isKeyframe);
-        lastBytePos = Util::ftell(inFile);
+    parallelHeader(13, statData.st_size);
+    bench = Util::getMicros(bench);
+    INFO_MSG("Header generated in %llu ms: %s, %s", bench/1000, myMeta.vod?"VoD":"NOVoD", myMeta.live?"Live":"NOLive");
+    myMeta.toFile(config->getString("input") + ".dtsh");
+    return true;
+  }
+
+  /// Returns true if an FLV tag header is at pos, with a matching previous tag size after the tag,
+  /// followed by either another tag header or the end of the file.
+  static bool isTagStart(headerRange & range, uint64_t pos){
+    const char * header = range.read(pos, 11);
+    if (!header || (header[0] != 0x08 && header[0] != 0x09 && header[0] != 0x12) || header[8] || header[9] || header[10]){
+      return false;
+    }
+    uint32_t size = Bit::btoh24(header + 1);
+    const char * prevSize = range.read(pos + 11 + size, 4);
+    if (!prevSize || Bit::btohl(prevSize) != size + 11){
+      return false;
+    }
+    const char * next = range.read(pos + 15 + size, 11);
+    if (!next){return true;}
+    return (next[0] == 0x08 || next[0] == 0x09 || next[0] == 0x12) && !next[8] && !next[9] && !next[10];
+  }
+
+  /// Finds all tags starting between start and end. Unless exact is set, parsing starts at the first tag found from start on.
+  /// Only the position, timing and size of media tags is kept; tags that may change track metadata are kept whole.
+  headerRange * inputFLV::scanRange(uint64_t start, uint64_t end, bool exact){
+    flvRange * range = new flvRange(fileno(inFile), start, end, exact);
+    uint64_t pos = start;
+    if (!exact){
+      while (pos < end && !isTagStart(*range, pos)){++pos;}
+    }
+    range->syncPos = pos;
+    FLV::Tag tag;
+    char lastAudio = 0;
+    bool audioSeen = false;
+    bool videoSeen = false;
+    while (pos < end){
+      const char * header = range->read(pos, 11);
+      if (!header){break;}
+      if (header[0] > 0x12){
+        range->failed = true;
+        break;
+      }
+      unsigned int len = Bit::btoh24(header + 1) + 15;
+      const char * tagData = range->read(pos, len);
+      if (!tagData){break;}
+      unsigned int loaded = 0;
+      while (!tag.MemLoader((char *)tagData, len, loaded) && loaded < len){}
+      flvTagInfo info;
+      info.bpos = pos;
+      info.len = len;
+      info.time = tag.tagTime();
+      info.offset = tag.offset();
+      info.size = tag.getDataLen();
+      info.trackId = tag.getTrackID();
+      info.keyframe = tag.isKeyframe;
+      bool initData = tag.needsInitData() && tag.isInitData();
+      info.media = info.size && !initData;
+      //Only the first video tag, audio tags of a new type, init data and script tags may change track metadata
+      info.meta = initData || tagData[0] == 0x12;
+      if (tagData[0] == 0x08 && (!audioSeen || tagData[11] != lastAudio)){
+        info.meta = true;
+        audioSeen = true;
+        lastAudio = tagData[11];
+      }
+      if (tagData[0] == 0x09 && !videoSeen){
+        info.meta = true;
+        videoSeen = true;
       }
+      if (info.meta){
+        range->metaTags.push_back(std::string(tagData, len));
+      }
+      if (info.media || info.meta){
+        range->tags.push_back(info);
+      }
+      pos += len;
     }
-    bench = Util::getMicros(bench);
-    INFO_MSG("Header generated in %llu ms: @%lld, %s, %s", bench/1000, lastBytePos, myMeta.vod?"VoD":"NOVoD", myMeta.live?"Live":"NOLive");
-    if (FLV::Parse_Error){
-      FLV::Parse_Error = false;
-      ERROR_MSG("Stopping at FLV parse error @%lld: %s", lastBytePos, FLV::Error_Str.c_str());
+    range->endPos = pos;
+    return range;
+  }
+
+  /// Adds the tags found in a range to the header, in file order, applying metadata tags to the tracks as they come.
+  bool inputFLV::mergeRange(headerRange & range){
+    flvRange & flv = static_cast<flvRange &>(range);
+    std::deque<std::string>::iterator metaTag = flv.metaTags.begin();
+    for (std::deque<flvTagInfo>::iterator it = flv.tags.begin(); it != flv.tags.end(); ++it){
+      if (it->meta){
+        unsigned int loaded = 0;
+        while (!tmpTag.MemLoader((char *)metaTag->data(), metaTag->size(), loaded) && loaded < metaTag->size()){}
+        tmpTag.toMeta(myMeta, amfStorage);
+        ++metaTag;
+      }
+      if (it->media){
+        //Packets start where the previous one ended, so seeking to them also reads the init data and metadata in between
+        myMeta.update(it->time, it->offset, it->trackId, it->size, lastBytePos, it->keyframe);
+        lastBytePos = it->bpos + it->len;
+      }
     }
-    myMeta.toFile(config->getString("input") + ".dtsh");
     return true;
   }
   
@@ -1,8 +1,31 @@
 #include "input.h"
 #include <mist/dtsc.h>
 #include <mist/flv_tag.h>
+#include <mist/amf.h>
+#include <deque>
 
 namespace Mist {
+  /// A tag found while generating the header of an FLV file.
+  struct flvTagInfo{
+    uint64_t bpos;
+    uint32_t len;///< Size of the whole tag.
+    uint32_t time;
+    int32_t offset;
+    uint32_t size;///< Size of the media data in the tag.
+    uint8_t trackId;
+    bool keyframe;
+    bool media;///< Whether the tag holds data, rather than being empty or holding init data.
+    bool meta;///< Whether the tag may change track metadata; its full data is then in metaTags.
+  };
+
+  /// Tags found in a byte range of an FLV file.
+  class flvRange : public headerRange {
+    public:
+      flvRange(int fd, uint64_t start, uint64_t end, bool exact) : headerRange(fd, start, end, exact){}
+      std::deque<flvTagInfo> tags;
+      std::deque<std::string> metaTags;///< Complete tags for all entries in tags with meta set, in order.
+  };
+
   class inputFLV : public Input {
     public:
       inputFLV(Util::Config * cfg);
@@ -15,7 +38,11 @@ namespace Mist {
       void seek(int seekTime);
       void trackSelect(std::string trackSpec);
       bool keepRunning();
+      headerRange * scanRange(uint64_t start, uint64_t end, bool exact);
+      bool mergeRange(headerRange & range);
       FLV::Tag tmpTag;
+      AMF::Object amfStorage;///< The onMetaData contents, while generating the header.
+      uint64_t lastBytePos;///< End of the last tag with data, while generating the header.
       uint64_t lastModTime;
       FILE * inFile;
   };
@@ -1,6 +1,7 @@
 #include "input_h264.h"
 #include <mist/h264.h>
 #include <mist/mp4_generic.h>
+#include <mist/nal.h>
 
 namespace Mist{
   InputH264::InputH264(Util::Config *cfg) : Input(cfg){
@@ -14,6 +15,8 @@ namespace Mist{
     frameCount = 0;
     startTime = Util::bootMS();
     inputProcess = 0;
+    nalStart = 0;
+    scanPos = 0;
   }
 
   bool InputH264::preRun(){
@@ -48,7 +51,8 @@ namespace Mist{
     }else{
       myConn = Socket::Connection(fileno(stdout), fileno(stdin));
     }
-    myConn.Received().splitter.assign("\000\000\001", 3);
+    //Received data is not split on start codes: getNext finds them with the vectorized nalu::scanAnnexB
+    myConn.Received().splitter.clear();
     myMeta.vod = false;
     myMeta.live = true;
     myMeta.tracks[1].type = "video";
@@ -69,27 +73,43 @@ namespace Mist{
 
   void InputH264::getNext(bool smart){
     do{
-      if (!myConn.spool()){
-        Util::sleep(25);
-        ++waitsSinceData;
-        if (waitsSinceData > 5000 / 25 && (waitsSinceData % 40) == 0){
-          WARN_MSG("No H264 data received for > 5s, killing source process");
-          Util::Procs::Stop(inputProcess);
+      //The NAL unit being collected starts at nalStart; scanning resumes at scanPos
+      const char * code = nalu::scanAnnexB(nalBuffer.data() + scanPos, nalBuffer.size() - scanPos);
+      if (!code){
+        //The last two bytes may be the start of a start code that is not complete yet
+        scanPos = std::max(nalStart, nalBuffer.size() > 2 ? nalBuffer.size() - 2 : 0);
+        if (nalStart){
+          nalBuffer.erase(0, nalStart);
+          scanPos -= nalStart;
+          nalStart = 0;
+        }
+        if (!myConn.spool()){
+          Util::sleep(25);
+          ++waitsSinceData;
+          if (waitsSinceData > 5000 / 25 && (waitsSinceData % 40) == 0){
+            WARN_MSG("No H264 data received for > 5s, killing source process");
+            Util::Procs::Stop(inputProcess);
+          }
+          continue;
+        }
+        waitsSinceData = 0;
+        while (myConn.Received().size()){
+          nalBuffer.append(myConn.Received().get());
+          myConn.Received().get().clear();
         }
         continue;
       }
-      waitsSinceData = 0;
-      uint32_t bytesToRead = myConn.Received().bytesToSplit();
-      if (!bytesToRead){continue;}
-      std::string NAL = myConn.Received().remove(bytesToRead);
-      uint32_t nalSize = NAL.size() - 3;
-      while (nalSize && NAL.data()[nalSize - 1] == 0){--nalSize;}
+      const char * nalData = nalBuffer.data() + nalStart;
+      uint32_t nalSize = code - nalData;
+      nalStart = scanPos = (code - nalBuffer.data()) + 3;
+      //Drops the leading zero of four byte start codes, and any trailing zeroes
+      while (nalSize && nalData[nalSize - 1] == 0){--nalSize;}
       if (!nalSize){continue;}
-      uint8_t nalType = NAL.data()[0] & 0x1F;
+      uint8_t nalType = nalData[0] & 0x1F;
       INSANE_MSG("NAL unit, type %u, size %lu", nalType, nalSize);
       if (nalType == 7 || nalType == 8){
-        if (nalType == 7){spsInfo = NAL.substr(0, nalSize);}
-        if (nalType == 8){ppsInfo = NAL.substr(0, nalSize);}
+        if (nalType == 7){spsInfo.assign(nalData, nalSize);}
+        if (nalType == 8){ppsInfo.assign(nalData, nalSize);}
         if (!myMeta.tracks[1].init.size() && spsInfo.size() && ppsInfo.size()){
           h264::sequenceParameterSet sps(spsInfo.data(), spsInfo.size());
           h264::SPSMeta spsChar = sps.getCharacteristics();
@@ -115,8 +135,8 @@ namespace Mist{
       if (myMeta.tracks[1].init.size()){
         uint64_t ts = Util::bootMS() - startTime;
         if (myMeta.tracks[1].fpks){ts = frameCount * (1000000 / myMeta.tracks[1].fpks);}
-        thisPacket.genericFill(ts, 0, 1, 0, 0, 0, h264::isKeyframe(NAL.data(), nalSize));
-        thisPacket.appendNal(NAL.data(), nalSize);
+        thisPacket.genericFill(ts, 0, 1, 0, 0, 0, h264::isKeyframe(nalData, nalSize));
+        thisPacket.appendNal(nalData, nalSize);
         ++frameCount;
         return;
       }
@@ -26,6 +26,9 @@ namespace Mist{
     uint64_t startTime;
     pid_t inputProcess;
     uint32_t waitsSinceData;
+    std::string nalBuffer;///< Received Annex B data that is not parsed yet.
+    size_t nalStart;///< Position in nalBuffer of the NAL unit being collected, right after its start code.
+    size_t scanPos;///< Position in nalBuffer to continue scanning for the next start code from.
   };
 }
 
@@ -5,6 +5,7 @@
 #include <cstdlib>
 #include <cstdio>
 #include <string>
+#include <sys/stat.h>
 #include <mist/stream.h>
 #include <mist/flv_tag.h>
 #include <mist/defines.h>
@@ -78,11 +79,9 @@ namespace Mist {
     myMeta.tracks[1].channels = 2 - ( header[3] >> 7);
 
 
-    getNext();
-    while (thisPacket){
-      myMeta.update(thisPacket);
-      getNext();
-    }
+    struct stat statData;
+    if (fstat(fileno(inFile), &statData) == -1){return false;}
+    parallelHeader(filePos, statData.st_size);
 
     fseek(inFile, 0, SEEK_SET);
     timestamp = 0;
@@ -90,6 +89,79 @@ namespace Mist {
     return true;
   }
   
+  /// Returns the size of the MP3 frame starting with the given 4-byte header, or 0 if it is not a valid frame header.
+  /// Sets duration to the duration of the frame, counted in whole milliseconds like getNext does.
+  static size_t frameSize(const char * header, unsigned int & duration){
+    if (header[0] != 0xFF || (header[1] & 0xE0) != 0xE0 || !(header[1] & 0x06)){return 0;}
+    if (!(header[2] & 0xF0) || (header[2] & 0xF0) == 0xF0 || (header[2] & 0x0C) == 0x0C){return 0;}
+    int mpegVersion = 1 - ((header[1] >> 3) & 0x01);
+    int mpegLayer = 3 - ((header[1] >> 1) & 0x03);
+    int sampleRate = sampleRates[mpegVersion][((header[2] >> 2) & 0x03)] * 1000;
+    int bitRate = bitRates[mpegVersion][mpegLayer][((header[2] >> 4) & 0x0F)] * 1000;
+    duration = (sampleCounts[mpegVersion][mpegLayer] / (sampleRate / 1000));
+    if (mpegLayer == 0){
+      return (12 * ((double)bitRate / sampleRate) + ((header[2] >> 1) & 0x01)) * 4;
+    }
+    return 144 * ((double)bitRate / sampleRate) + ((header[2] >> 1) & 0x01);
+  }
+
+  /// Returns the position of the first frame from pos on that is followed by a similar frame or the end of the file,
+  /// or limit if there is none before it.
+  static uint64_t findFrame(headerRange & range, uint64_t pos, uint64_t limit){
+    for (; pos < limit; ++pos){
+      const char * header = range.read(pos, 4);
+      if (!header){return limit;}
+      unsigned int duration;
+      size_t size = frameSize(header, duration);
+      if (!size){continue;}
+      char version = header[1];
+      char rate = header[2] & 0x0C;
+      const char * next = range.read(pos + size, 4);
+      if (!next || (next[1] == version && (next[2] & 0x0C) == rate && frameSize(next, duration))){
+        return pos;
+      }
+    }
+    return limit;
+  }
+
+  /// Finds all frames starting between start and end. Unless exact is set, parsing starts at the first frame found from start on.
+  /// Like getNext, anything between frames is skipped.
+  headerRange * inputMP3::scanRange(uint64_t start, uint64_t end, bool exact){
+    mp3Range * range = new mp3Range(fileno(inFile), start, end, exact);
+    uint64_t pos = start;
+    if (!exact){pos = findFrame(*range, pos, end);}
+    range->syncPos = pos;
+    while (pos < end){
+      const char * header = range->read(pos, 4);
+      if (!header){break;}
+      unsigned int duration = 0;
+      size_t size = frameSize(header, duration);
+      if (!size){
+        pos = findFrame(*range, pos + 1, end);
+        continue;
+      }
+      mp3Frame frame;
+      frame.bpos = pos;
+      frame.time = range->duration;
+      frame.size = size;
+      range->frames.push_back(frame);
+      range->duration += duration;
+      pos += size;
+    }
+    range->endPos = pos;
+    return range;
+  }
+
+  /// Adds the frames found in a range to the header, continuing the timestamps from the previous range.
+  bool inputMP3::mergeRange(headerRange & range){
+    mp3Range & mp3 = static_cast<mp3Range &>(range);
+    for (std::deque<mp3Frame>::iterator it = mp3.frames.begin(); it != mp3.frames.end(); ++it){
+      myMeta.update((long long)timestamp + it->time, 0, 1, it->size, it->bpos, false);
+    }
+    timestamp += mp3.duration;
+    return true;
+  }
+
   void inputMP3::getNext(bool smart) {
     thisPacket.null();
     static char packHeader[3000];
@@ -168,7 +240,7 @@ namespace Mist {
   }
 
   void inputMP3::seek(int seekTime) {
-    std::deque<DTSC::Key> & keys = myMeta.tracks[1].keys;
+    DTSC::PackedList<DTSC::Key> & keys = myMeta.tracks[1].keys;
     size_t seekPos = keys[0].getBpos();
     for (unsigned int i = 0; i < keys.size(); i++){
       if (keys[i].getTime() > seekTime){
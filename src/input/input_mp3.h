@@ -11,6 +11,21 @@ namespace Mist {
                                         {{0, 32, 48, 56,  64,  80,  96, 112, 128, 144, 160, 176, 192, 224, 256, -1},
                                          {0,  8, 16, 24,  32,  40,  48,  56,  64,  80,  96, 112, 128, 144, 160, -1},
                                          {0,  8, 16, 24,  32,  40,  48,  56,  64,  80,  96, 112, 128, 144, 160, -1}}};
+  /// A frame found while generating the header of an MP3 file.
+  struct mp3Frame{
+    uint64_t bpos;
+    uint64_t time;///< Time of the frame, relative to the start of its range.
+    uint32_t size;
+  };
+
+  /// Frames found in a byte range of an MP3 file.
+  class mp3Range : public headerRange {
+    public:
+      mp3Range(int fd, uint64_t start, uint64_t end, bool exact) : headerRange(fd, start, end, exact), duration(0){}
+      std::deque<mp3Frame> frames;
+      uint64_t duration;///< Summed duration of all frames in the range.
+  };
+
   class inputMP3 : public Input {
     public:
       inputMP3(Util::Config * cfg);
@@ -22,6 +37,8 @@ namespace Mist {
       void getNext(bool smart = true);
       void seek(int seekTime);
       void trackSelect(std::string trackSpec);
+      headerRange * scanRange(uint64_t start, uint64_t end, bool exact);
+      bool mergeRange(headerRange & range);
       double timestamp;
 
       FILE * inFile;
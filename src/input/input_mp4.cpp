@@ -0,0 +1,400 @@
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <algorithm>
+#include <sys/types.h>//for stat
+#include <sys/stat.h>//for stat
+#include <unistd.h>//for stat, pread
+#include <mist/util.h>
+#include <mist/stream.h>
+#include <mist/defines.h>
+#include <mist/timing.h>
+
+#include "input_mp4.h"
+
+/// Largest amount of bytes read from the file at once when reading consecutive samples.
+#define MP4_READ_MAX (4 * 1024 * 1024)
+/// Largest gap between two samples of a track that is read over instead of starting a new read.
+#define MP4_READ_GAP (64 * 1024)
+
+namespace Mist {
+  static bool sampleTimeLess(uint64_t seekTime, const mp4Sample & sample){
+    return seekTime < sample.time;
+  }
+
+  mp4TrackHeader::mp4TrackHeader(){
+    trackId = 0;
+    width = 0;
+    height = 0;
+    rate = 0;
+    channels = 0;
+    size = 0;
+    curSample = 0;
+    readStart = 0;
+  }
+
+  /// Reads the codec information and expands the sample table of a single trak box.
+  /// Returns false if the track is not supported or its sample table is unusable.
+  bool mp4TrackHeader::read(MP4::TRAK & trak){
+    trackId = trak.getChild<MP4::TKHD>().getTrackID();
+    MP4::MDIA mdia = trak.getChild<MP4::MDIA>();
+    uint32_t timeScale = mdia.getChild<MP4::MDHD>().getTimeScale();
+    std::string handler = mdia.getChild<MP4::HDLR>().getHandlerType();
+    MP4::STBL stbl = mdia.getChild<MP4::MINF>().getChild<MP4::STBL>();
+    if (!timeScale || !stbl){
+      WARN_MSG("Track %u has no time scale or sample table, ignoring it", trackId);
+      return false;
+    }
+
+    MP4::STSD stsd = stbl.getChild<MP4::STSD>();
+    MP4::Box entry(stsd.getEntry(0).asBox(), false);
+    if (handler == "vide" && (entry.isType("avc1") || entry.isType("h264"))){
+      MP4::VisualSampleEntry & vEntry = (MP4::VisualSampleEntry &)entry;
+      type = "video";
+      codec = "H264";
+      width = vEntry.getWidth();
+      height = vEntry.getHeight();
+      MP4::Box avcc(vEntry.getCLAP().asBox(), false);
+      if (avcc.isType("avcC")){init = std::string(avcc.payload(), avcc.payloadSize());}
+      if (init.size() < 5 || (init[4] & 0x03) != 0x03){
+        WARN_MSG("Track %u: only H264 with 4-byte NAL unit sizes is supported, ignoring it", trackId);
+        return false;
+      }
+    }else if (handler == "soun" && entry.isType("mp4a")){
+      MP4::AudioSampleEntry & aEntry = (MP4::AudioSampleEntry &)entry;
+      type = "audio";
+      rate = aEntry.getSampleRate();
+      channels = aEntry.getChannelCount();
+      size = aEntry.getSampleSize();
+      MP4::Box esds(aEntry.getCodecBox().asBox(), false);
+      if (!esds.isType("esds")){
+        WARN_MSG("Track %u: audio without esds box, ignoring it", trackId);
+        return false;
+      }
+      codec = ((MP4::ESDS &)esds).getCodec();
+      if (codec == "AAC"){init = ((MP4::ESDS &)esds).getInitData();}
+      if (codec != "AAC" && codec != "MP3"){
+        WARN_MSG("Track %u: unsupported audio codec, ignoring it", trackId);
+        return false;
+      }
+    }else{
+      INFO_MSG("Track %u: unsupported %s track (%s), ignoring it", trackId, handler.c_str(), entry.getType().c_str());
+      return false;
+    }
+
+    MP4::STSZ stsz = stbl.getChild<MP4::STSZ>();
+    MP4::STSC stsc = stbl.getChild<MP4::STSC>();
+    MP4::STTS stts = stbl.getChild<MP4::STTS>();
+    uint32_t sampleCount = stsz.getSampleCount();
+    uint32_t fixedSize = stsz.getSampleSize();
+    uint32_t stscCount = stsc.getEntryCount();
+    if (!sampleCount || !stscCount){
+      WARN_MSG("Track %u has no samples in its sample table (fragmented files are not supported), ignoring it", trackId);
+      return false;
+    }
+    samples.resize(sampleCount);
+
+    //Sizes and byte positions, from the chunk offsets and the sample-to-chunk table
+    MP4::STCO stco = stbl.getChild<MP4::STCO>();
+    MP4::CO64 co64 = stbl.getChild<MP4::CO64>();
+    bool useCo64 = !stco;
+    uint32_t chunkCount = useCo64 ? co64.getEntryCount() : stco.getEntryCount();
+    uint32_t sampleNo = 0;
+    uint32_t stscIndex = 0;
+    MP4::STSCEntry stscEntry = stsc.getSTSCEntry(0);
+    for (uint32_t chunk = 1; chunk <= chunkCount && sampleNo < sampleCount; ++chunk){
+      while (stscIndex + 1 < stscCount && stsc.getSTSCEntry(stscIndex + 1).firstChunk <= chunk){
+        stscEntry = stsc.getSTSCEntry(++stscIndex);
+      }
+      uint64_t pos = useCo64 ? co64.getChunkOffset(chunk - 1) : stco.getChunkOffset(chunk - 1);
+      for (uint32_t i = 0; i < stscEntry.samplesPerChunk && sampleNo < sampleCount; ++i){
+        mp4Sample & sample = samples[sampleNo++];
+        sample.size = fixedSize ? fixedSize : stsz.getEntrySize(sampleNo - 1);
+        sample.bpos = pos;
+        pos += sample.size;
+      }
+    }
+    if (sampleNo < sampleCount){
+      WARN_MSG("Track %u: chunk table covers only %u of %u samples", trackId, sampleNo, sampleCount);
+      samples.resize(sampleNo);
+      sampleCount = sampleNo;
+    }
+
+    //Decode times from the time-to-sample table
+    sampleNo = 0;
+    uint64_t ticks = 0;
+    uint32_t sttsCount = stts.getEntryCount();
+    for (uint32_t i = 0; i < sttsCount && sampleNo < sampleCount; ++i){
+      MP4::STTSEntry sttsEntry = stts.getSTTSEntry(i);
+      for (uint32_t j = 0; j < sttsEntry.sampleCount && sampleNo < sampleCount; ++j){
+        samples[sampleNo].time = ticks * 1000 / timeScale;
+        samples[sampleNo].offset = 0;
+        samples[sampleNo].keyframe = false;
+        ++sampleNo;
+        ticks += sttsEntry.sampleDelta;
+      }
+    }
+    if (sampleNo < sampleCount){
+      WARN_MSG("Track %u: time table covers only %u of %u samples", trackId, sampleNo, sampleCount);
+      samples.resize(sampleNo);
+      sampleCount = sampleNo;
+    }
+
+    //Composition offsets, if any
+    MP4::CTTS ctts = stbl.getChild<MP4::CTTS>();
+    if (ctts){
+      sampleNo = 0;
+      uint32_t cttsCount = ctts.getEntryCount();
+      for (uint32_t i = 0; i < cttsCount && sampleNo < sampleCount; ++i){
+        MP4::CTTSEntry cttsEntry = ctts.getCTTSEntry(i);
+        int32_t offset = 0;
+        if (cttsEntry.sampleOffset > 0){offset = (int64_t)cttsEntry.sampleOffset * 1000 / timeScale;}
+        for (uint32_t j = 0; j < cttsEntry.sampleCount && sampleNo < sampleCount; ++j){
+          samples[sampleNo++].offset = offset;
+        }
+      }
+    }
+
+    //Keyframes; audio never has them, video without a sync sample table only has keyframes
+    if (type == "video"){
+      MP4::STSS stss = stbl.getChild<MP4::STSS>();
+      if (stss){
+        uint32_t stssCount = stss.getEntryCount();
+        for (uint32_t i = 0; i < stssCount; ++i){
+          uint32_t keyNo = stss.getSampleNumber(i);
+          if (keyNo && keyNo <= sampleCount){samples[keyNo - 1].keyframe = true;}
+        }
+      }else{
+        for (uint32_t i = 0; i < sampleCount; ++i){samples[i].keyframe = true;}
+      }
+      //playback has to start on a keyframe
+      samples[0].keyframe = true;
+    }
+    return true;
+  }
+
+  /// Returns a pointer to the data of the given sample, or null on read errors.
+  /// Samples are read from the file with positional reads, so the file position of the input is not disturbed.
+  /// Following samples are read along in the same system call, as long as they are close together in the file.
+  const char * mp4TrackHeader::getSample(int fd, unsigned int index){
+    const mp4Sample & sample = samples[index];
+    if (sample.bpos >= readStart && sample.bpos + sample.size <= readStart + readBuffer.size()){
+      return readBuffer.data() + (sample.bpos - readStart);
+    }
+    uint64_t start = sample.bpos;
+    uint64_t end = sample.bpos + sample.size;
+    for (unsigned int i = index + 1; i < samples.size(); ++i){
+      const mp4Sample & next = samples[i];
+      if (next.bpos < end || next.bpos - end > MP4_READ_GAP || next.bpos + next.size - start > MP4_READ_MAX){break;}
+      end = next.bpos + next.size;
+    }
+    readBuffer.resize(end - start);
+    uint64_t done = 0;
+    while (done < end - start){
+      ssize_t r = pread(fd, (char *)readBuffer.data() + done, end - start - done, start + done);
+      if (r <= 0){
+        if (r == -1 && errno == EINTR){continue;}
+        FAIL_MSG("Could not read sample %u of track %u (%llu bytes @ %llu): %s", index, trackId, end - start, start, r ? strerror(errno) : "end of file");
+        readBuffer.clear();
+        return 0;
+      }
+      done += r;
+    }
+    readStart = start;
+    return readBuffer.data();
+  }
+
+  /// Returns the index of the sample to start playback from for the given time:
+  /// the last sample at or before it, moved back to the preceding keyframe for video.
+  unsigned int mp4TrackHeader::findSample(uint64_t seekTime) const{
+    std::vector<mp4Sample>::const_iterator it = std::upper_bound(samples.begin(), samples.end(), seekTime, sampleTimeLess);
+    unsigned int index = (it == samples.begin()) ? 0 : (it - samples.begin()) - 1;
+    if (type == "video"){
+      while (index && !samples[index].keyframe){--index;}
+    }
+    return index;
+  }
+
+  inputMP4::inputMP4(Util::Config * cfg) : Input(cfg) {
+    capa["name"] = "MP4";
+    capa["desc"] = "Enables MP4 Input";
+    capa["source_match"].append("/*.mp4");
+    capa["source_match"].append("/*.m4v");
+    capa["source_match"].append("/*.m4a");
+    capa["source_match"].append("/*.mov");
+    capa["priority"] = 9ll;
+    capa["codecs"][0u][0u].append("H264");
+    capa["codecs"][0u][1u].append("AAC");
+    capa["codecs"][0u][1u].append("MP3");
+    inFile = 0;
+    lastModTime = 0;
+  }
+
+  bool inputMP4::checkArguments() {
+    if (config->getString("input") == "-") {
+      std::cerr << "Input from stdin not yet supported" << std::endl;
+      return false;
+    }
+    if (!config->getString("streamname").size()){
+      if (config->getString("output") == "-") {
+        std::cerr << "Output to stdout not yet supported" << std::endl;
+        return false;
+      }
+    }else{
+      if (config->getString("output") != "-") {
+        std::cerr << "File output in player mode not supported" << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// Opens the file and reads the sample tables from its moov box.
+  /// This is needed even when a DTSH header exists, as the byte positions of all samples are only in the moov box.
+  bool inputMP4::preRun() {
+    inFile = fopen(config->getString("input").c_str(), "r");
+    if (!inFile) {
+      return false;
+    }
+    struct stat statData;
+    lastModTime = 0;
+    if (stat(config->getString("input").c_str(), &statData) != -1){
+      lastModTime = statData.st_mtime;
+    }
+    return readMoov();
+  }
+
+  /// Finds the moov box among the top-level boxes and reads the sample tables of all supported tracks in it.
+  bool inputMP4::readMoov(){
+    uint64_t bench = Util::getMicros();
+    Util::fseek(inFile, 0, SEEK_SET);
+    MP4::Box moovBox;
+    while (!feof(inFile)){
+      std::string boxType = MP4::readBoxType(inFile);
+      if (boxType == "erro"){break;}
+      if (boxType == "moov"){
+        if (!moovBox.read(inFile)){
+          FAIL_MSG("Could not read moov box of %s", config->getString("input").c_str());
+          return false;
+        }
+        break;
+      }
+      if (!MP4::skipBox(inFile)){break;}
+    }
+    if (!moovBox.isType("moov")){
+      FAIL_MSG("No moov box found in %s", config->getString("input").c_str());
+      return false;
+    }
+    std::deque<MP4::TRAK> traks = ((MP4::MOOV &)moovBox).getChildren<MP4::TRAK>();
+    for (std::deque<MP4::TRAK>::iterator it = traks.begin(); it != traks.end(); ++it){
+      mp4TrackHeader header;
+      if (header.read(*it)){headers[header.trackId] = header;}
+    }
+    bench = Util::getMicros(bench);
+    INFO_MSG("Sample tables of %lu tracks read in %llu ms", headers.size(), bench / 1000);
+    if (!headers.size()){
+      FAIL_MSG("No supported tracks in %s", config->getString("input").c_str());
+      return false;
+    }
+    return true;
+  }
+
+  /// Overrides the default keepRunning function to shut down
+  /// if the file disappears or changes, by polling the file's mtime.
+  /// If neither applies, calls the original function.
+  bool inputMP4::keepRunning(){
+    struct stat statData;
+    if (stat(config->getString("input").c_str(), &statData) == -1){
+      INFO_MSG("Shutting down because input file disappeared");
+      return false;
+    }
+    if (lastModTime != statData.st_mtime){
+      INFO_MSG("Shutting down because input file changed");
+      return false;
+    }
+    return Input::keepRunning();
+  }
+
+  /// Generates the header straight from the sample tables, without reading any media data.
+  bool inputMP4::readHeader() {
+    if (!inFile){return false;}
+    for (std::map<unsigned int, mp4TrackHeader>::iterator it = headers.begin(); it != headers.end(); ++it){
+      mp4TrackHeader & header = it->second;
+      DTSC::Track & trk = myMeta.tracks[it->first];
+      trk.trackID = it->first;
+      trk.type = header.type;
+      trk.codec = header.codec;
+      trk.init = header.init;
+      if (header.type == "video"){
+        trk.width = header.width;
+        trk.height = header.height;
+        if (header.samples.size() > 1 && header.samples.back().time){
+          trk.fpks = (uint64_t)(header.samples.size() - 1) * 1000000 / header.samples.back().time;
+        }
+      }else{
+        trk.rate = header.rate;
+        trk.channels = header.channels;
+        trk.size = header.size;
+      }
+      for (std::vector<mp4Sample>::iterator sIt = header.samples.begin(); sIt != header.samples.end(); ++sIt){
+        myMeta.update(sIt->time, sIt->offset, it->first, sIt->size, sIt->bpos, sIt->keyframe);
+      }
+    }
+    myMeta.vod = true;
+    myMeta.live = false;
+    myMeta.toFile(config->getString("input") + ".dtsh");
+    return true;
+  }
+
+  void inputMP4::getNext(bool smart) {
+    unsigned int nextTrack = 0;
+    uint64_t nextTime = 0;
+    for (std::set<unsigned long>::iterator it = selectedTracks.begin(); it != selectedTracks.end(); it++){
+      if (!headers.count(*it)){continue;}
+      mp4TrackHeader & header = headers[*it];
+      if (header.curSample >= header.samples.size()){continue;}
+      if (!nextTrack || header.samples[header.curSample].time < nextTime){
+        nextTrack = *it;
+        nextTime = header.samples[header.curSample].time;
+      }
+    }
+    if (!nextTrack){
+      thisPacket.null();
+      return;
+    }
+    mp4TrackHeader & header = headers[nextTrack];
+    const mp4Sample & sample = header.samples[header.curSample];
+    const char * data = header.getSample(fileno(inFile), header.curSample);
+    if (!data){
+      thisPacket.null();
+      return;
+    }
+    thisPacket.genericFill(sample.time, sample.offset, nextTrack, data, sample.size, sample.bpos, sample.keyframe);
+    ++header.curSample;
+  }
+
+  void inputMP4::seek(int seekTime) {
+    for (std::set<unsigned long>::iterator it = selectedTracks.begin(); it != selectedTracks.end(); it++){
+      if (!headers.count(*it)){continue;}
+      headers[*it].curSample = headers[*it].findSample(seekTime);
+    }
+  }
+
+  void inputMP4::trackSelect(std::string trackSpec) {
+    selectedTracks.clear();
+    size_t index;
+    while (trackSpec != "") {
+      index = trackSpec.find(' ');
+      selectedTracks.insert(atoi(trackSpec.substr(0, index).c_str()));
+      if (index != std::string::npos) {
+        trackSpec.erase(0, index + 1);
+      } else {
+        trackSpec = "";
+      }
+    }
+  }
+}
+
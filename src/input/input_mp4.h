@@ -0,0 +1,61 @@
+#include "input.h"
+#include <mist/dtsc.h>
+#include <mist/mp4.h>
+#include <mist/mp4_generic.h>
+#include <vector>
+
+namespace Mist {
+  /// A single sample of an MP4 track, as found through the track's sample table.
+  struct mp4Sample{
+    uint64_t bpos;///< Byte position of the sample in the file.
+    uint64_t time;///< Decode time in milliseconds.
+    int32_t offset;///< Composition offset in milliseconds.
+    uint32_t size;///< Size of the sample in bytes.
+    bool keyframe;
+  };
+
+  /// Sample table and read state of a single MP4 track.
+  class mp4TrackHeader{
+    public:
+      mp4TrackHeader();
+      bool read(MP4::TRAK & trak);
+      const char * getSample(int fd, unsigned int index);
+      unsigned int findSample(uint64_t seekTime) const;
+      uint32_t trackId;
+      std::string type;
+      std::string codec;
+      std::string init;
+      uint32_t width;
+      uint32_t height;
+      uint32_t rate;
+      uint32_t channels;
+      uint32_t size;
+      std::vector<mp4Sample> samples;
+      unsigned int curSample;///< Index of the next sample getNext will return.
+    private:
+      std::string readBuffer;///< Data of one or more consecutive samples, read at once.
+      uint64_t readStart;///< Byte position in the file of the start of readBuffer.
+  };
+
+  class inputMP4 : public Input {
+    public:
+      inputMP4(Util::Config * cfg);
+    protected:
+      //Private Functions
+      bool checkArguments();
+      bool preRun();
+      bool readHeader();
+      void getNext(bool smart = true);
+      void seek(int seekTime);
+      void trackSelect(std::string trackSpec);
+      bool keepRunning();
+      bool readMoov();
+
+      FILE * inFile;
+      uint64_t lastModTime;
+      std::map<unsigned int, mp4TrackHeader> headers;///< Sample tables of all supported tracks, by track ID.
+  };
+}
+
+typedef Mist::inputMP4 mistIn;
+
@@ -5,6 +5,8 @@
 #include <cstdlib>
 #include <cstdio>
 #include <string>
+#include <algorithm>
+#include <sys/stat.h>
 #include <mist/stream.h>
 #include <mist/ogg.h>
 #include <mist/defines.h>
@@ -16,28 +18,6 @@
 
 namespace Mist {
 
-  JSON::Value segment::toJSON(OGG::oggCodec myCodec){
-    JSON::Value retval;
-    retval["time"] = (long long int)time;
-    retval["trackid"] = (long long int)tid;
-    std::string tmpString = "";
-    for (unsigned int i = 0; i < parts.size(); i++){
-      tmpString += parts[i];
-    }
-    retval["data"] = tmpString;
-//    INFO_MSG("Setting bpos for packet on track %llu, time %llu, to %llu", tid, time, bytepos);
-    retval["bpos"] = (long long int)bytepos;
-    if (myCodec == OGG::THEORA){
-      if (!theora::isHeader(tmpString.data(), tmpString.size())){
-        theora::header tmpHeader((char*)tmpString.data(), tmpString.size());
-        if (tmpHeader.getFTYPE() == 0){
-          retval["keyframe"] = 1LL;
-        }
-      }
-    }
-    return retval;
-  }
-
 /*
   unsigned long oggTrack::getBlockSize(unsigned int vModeIndex){ //WTF!!?
     return blockSize[vModes[vModeIndex].blockFlag];
@@ -51,6 +31,15 @@ namespace Mist {
     capa["codecs"][0u][0u].append("theora");
     capa["codecs"][0u][1u].append("vorbis");
     capa["codecs"][0u][1u].append("opus");
+    inFile = 0;
+    reader = 0;
+    readPos = 0;
+    readEnd = true;
+  }
+
+  inputOGG::~inputOGG(){
+    delete reader;
+    if (inFile){fclose(inFile);}
   }
 
   bool inputOGG::checkArguments(){
@@ -67,7 +56,9 @@ namespace Mist {
     if (!inFile){
       return false;
     }
-    return true;
+    reader = new headerRange(fileno(inFile), 0, 0, true);
+    //Playback needs the codec details of every track, also when the header is read from a DTSH file
+    return readTrackHeaders();
   }
 
   ///\todo check if all trackID (tid) instances are replaced with bitstream serial numbers
@@ -123,7 +114,9 @@ namespace Mist {
     }
   }
 
-  bool inputOGG::readHeader(){
+  /// Parses the Ogg headers of all tracks at the start of the file, filling oggTracks and the track metadata.
+  bool inputOGG::readTrackHeaders(){
+    oggTracks.clear();
     OGG::Page myPage;
     fseek(inFile, 0, SEEK_SET);
     while (myPage.read(inFile)){ //assumes all headers are sent before any data
@@ -217,164 +210,308 @@ namespace Mist {
         oggTracks[tid].parsedHeaders = true;
       }
     }
+    return true;
+  }
 
+  bool inputOGG::readHeader(){
+    //Start from scratch: an outdated DTSH file may have been loaded already
+    myMeta.tracks.clear();
+    if (!readTrackHeaders()){return false;}
+    struct stat statData;
+    if (fstat(fileno(inFile), &statData) == -1){return false;}
+    headerTracks.clear();
+    parallelHeader(0, statData.st_size);
     for (std::map<long unsigned int, OGG::oggTrack>::iterator it = oggTracks.begin(); it != oggTracks.end(); it++){
-      fseek(inFile, 0, SEEK_SET);
-      INFO_MSG("Finding first data for track %lu", it->first);
-      position tmp = seekFirstData(it->first);
-      if (tmp.trackID){
-        currentPositions.insert(tmp);
-      } else {
+      mergeTrack(it->first, true);
+      if (!headerTracks[it->first].started){
         INFO_MSG("missing track: %lu", it->first);
       }
     }
-    getNext();
-    while (thisPacket){
-      myMeta.update(thisPacket);
-      getNext();
-    }
+    headerTracks.clear();
 
     myMeta.toFile(config->getString("input") + ".dtsh");
     return true;
   }
 
-  position inputOGG::seekFirstData(long long unsigned int tid){
-    fseek(inFile, 0, SEEK_SET);
-    position res;
-    res.time = 0;
-    res.trackID = tid;
-    res.segmentNo = 0;
-    bool readSuccesfull = true;
-    bool quitloop = false;
-    while (!quitloop){
-      quitloop = true;
-      res.bytepos = ftell(inFile);
-      readSuccesfull = oggTracks[tid].myPage.read(inFile);
-      if (!readSuccesfull){
-        quitloop = true; //break :(
+  static inline uint32_t getLE32(const char * p){
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+  }
+
+  static inline uint64_t getLE64(const char * p){
+    return getLE32(p) | ((uint64_t)getLE32(p + 4) << 32);
+  }
+
+  /// Returns the size of the Ogg page at pos, or 0 if there is no page header there.
+  static uint64_t pageSize(headerRange & range, uint64_t pos){
+    const char * header = range.read(pos, 27);
+    if (!header || memcmp(header, "OggS", 4)){return 0;}
+    unsigned int segCount = header[26];
+    const char * table = range.read(pos + 27, segCount);
+    if (!table){return 0;}
+    uint64_t size = 27 + segCount;
+    for (unsigned int i = 0; i < segCount; ++i){
+      size += table[i];
+    }
+    return size;
+  }
+
+  /// Returns true if an Ogg page starts at pos, followed by either another page or the end of the file.
+  static bool isPageStart(headerRange & range, uint64_t pos){
+    const char * header = range.read(pos, 27);
+    if (!header || memcmp(header, "OggS", 4) || header[4] || (header[5] & 0xF8)){return false;}
+    uint64_t size = pageSize(range, pos);
+    if (!size){return false;}
+    const char * next = range.read(pos + size, 4);
+    return !next || !memcmp(next, "OggS", 4);
+  }
+
+  /// Fills info with the Ogg page at bpos, of which the data starts at page. Unless keepData is set, only the size and first bytes of every segment are kept.
+  static void parsePage(const char * page, uint64_t bpos, oggPageInfo & info, bool keepData){
+    info.bpos = bpos;
+    info.headerType = page[5];
+    info.granule = getLE64(page + 6);
+    info.serial = getLE32(page + 14);
+    std::deque<unsigned int> sizes = OGG::decodeXiphSize((char *)page + 27, page[26]);
+    const char * payload = page + 27 + page[26];
+    uint32_t offset = 0;
+    info.segments.resize(sizes.size());
+    for (unsigned int i = 0; i < sizes.size(); ++i){
+      info.segments[i].size = sizes[i];
+      info.segments[i].offset = offset;
+      memset(info.segments[i].lead, 0, 8);
+      memcpy(info.segments[i].lead, payload + offset, std::min(sizes[i], 8u));
+      offset += sizes[i];
+    }
+    if (keepData){
+      info.data.assign(payload, offset);
+    }
+  }
+
+  /// Finds all pages of known tracks starting between start and end. Unless exact is set, parsing starts at the first page found from start on.
+  /// Of every segment, only the size and first bytes are kept: enough to time the packets and find keyframes.
+  headerRange * inputOGG::scanRange(uint64_t start, uint64_t end, bool exact){
+    oggRange * range = new oggRange(fileno(inFile), start, end, exact);
+    uint64_t pos = start;
+    if (!exact){
+      while (pos < end && !isPageStart(*range, pos)){++pos;}
+    }
+    range->syncPos = pos;
+    while (pos < end){
+      const char * header = range->read(pos, 27);
+      if (!header){break;}
+      if (memcmp(header, "OggS", 4)){
+        range->failed = true;
         break;
       }
-      if (oggTracks[tid].myPage.getBitstreamSerialNumber() != tid){
-        quitloop = false;
-        continue;
+      uint64_t size = pageSize(*range, pos);
+      const char * page = size ? range->read(pos, size) : 0;
+      if (!page){break;}
+      pos += size;
+      if (!oggTracks.count(getLE32(page + 14))){continue;}
+      range->pages.push_back(oggPageInfo());
+      parsePage(page, pos - size, range->pages.back(), false);
+    }
+    range->endPos = pos;
+    return range;
+  }
+
+  /// Queues the pages found in a range per track, and turns as many of them into packets as possible.
+  bool inputOGG::mergeRange(headerRange & range){
+    oggRange & ogg = static_cast<oggRange &>(range);
+    for (std::deque<oggPageInfo>::iterator it = ogg.pages.begin(); it != ogg.pages.end(); ++it){
+      headerTracks[it->serial].pages.push_back(*it);
+    }
+    for (std::map<long unsigned int, oggTrackReader>::iterator it = headerTracks.begin(); it != headerTracks.end(); ++it){
+      mergeTrack(it->first, false);
+    }
+    return true;
+  }
+
+  /// Turns the queued pages of a track into packets in the header.
+  /// Stops when a packet needs pages that are not queued yet, unless flush is set because no more pages will follow.
+  void inputOGG::mergeTrack(long unsigned int tid, bool flush){
+    oggTrackReader & trk = headerTracks[tid];
+    oggPacketInfo pkt;
+    while (!trk.ended && nextPacket(tid, trk, flush, pkt)){
+      myMeta.update(pkt.time, 0, tid, pkt.size, pkt.bpos, pkt.keyframe);
+    }
+  }
+
+  /// Makes the next packet of a track out of its queued pages, timed and positioned the same way for the header and for playback.
+  /// Returns false when the packet needs pages that are not queued yet, unless flush is set because no more pages will follow.
+  bool inputOGG::nextPacket(long unsigned int tid, oggTrackReader & trk, bool flush, oggPacketInfo & pkt){
+    OGG::oggTrack & oggTrk = oggTracks[tid];
+    //Data starts at the first plain page that does not hold a header
+    while (!trk.started && trk.pages.size()){
+      oggPageInfo & page = trk.pages.front();
+      if (page.headerType == OGG::Plain && page.segments.size()){
+        oggSegmentInfo & seg = page.segments[0];
+        bool isHeader = false;
+        if (oggTrk.codec == OGG::OPUS){isHeader = !memcmp(seg.lead, "Op", 2);}
+        if (oggTrk.codec == OGG::VORBIS){isHeader = vorbis::isHeader(seg.lead, seg.size);}
+        if (oggTrk.codec == OGG::THEORA){isHeader = theora::isHeader(seg.lead, seg.size);}
+        if (!isHeader){
+          trk.started = true;
+          break;
+        }
       }
-      if (oggTracks[tid].myPage.getHeaderType() != OGG::Plain){
-        quitloop = false;
-        continue;
+      trk.pages.pop_front();
+    }
+    if (!trk.started || !trk.pages.size()){return false;}
+    oggPageInfo & page = trk.pages.front();
+    unsigned int segNo = trk.segment;
+    bool lastOnPage = (segNo + 1 >= page.segments.size());
+    bool fullPacket = false;
+    bool lastCompleteSegment = false;
+    unsigned int nextPage = 1;
+    if (lastOnPage){
+      //The packet may continue on the next pages of this track
+      while (nextPage < trk.pages.size() && trk.pages[nextPage].headerType == OGG::Continued && trk.pages[nextPage].segments.size() == 1){
+        ++nextPage;
       }
-      if (oggTracks[tid].codec == OGG::OPUS){
-        if (std::string(oggTracks[tid].myPage.getSegment(0), 2) == "Op"){
-          quitloop = false;
-        }
+      if (nextPage < trk.pages.size()){
+        fullPacket = true;
+        lastCompleteSegment = (trk.pages[nextPage].headerType != OGG::Continued);
+      }else if (!flush){
+        return false;
       }
-      if (oggTracks[tid].codec == OGG::VORBIS){
-        vorbis::header tmpHead((char*)oggTracks[tid].myPage.getSegment(0), oggTracks[tid].myPage.getSegmentLen(0));
-        if (tmpHead.isHeader()){
-          quitloop = false;
-        }
+    }else{
+      fullPacket = true;
+      if ((oggTrk.codec == OGG::THEORA || oggTrk.codec == OGG::VORBIS) && page.granule != 0xFFFFFFFFFFFFFFFFull && segNo + 2 == page.segments.size()){
+        if (trk.pages.size() < 2 && !flush){return false;}
+        lastCompleteSegment = (trk.pages.size() > 1 && trk.pages[1].headerType == OGG::Continued);
       }
-      if (oggTracks[tid].codec == OGG::THEORA){
-        theora::header tmpHead((char*)oggTracks[tid].myPage.getSegment(0), oggTracks[tid].myPage.getSegmentLen(0));
-        if (tmpHead.isHeader()){
-          quitloop = false;
+    }
+    //Size, first bytes and, if the pages hold their payload, data of the whole packet
+    oggSegmentInfo packet;
+    packet.size = 0;
+    memset(packet.lead, 0, 8);
+    unsigned int leadLen = 0;
+    pkt.data.clear();
+    oggSegmentInfo * first = (segNo < page.segments.size()) ? &page.segments[segNo] : 0;
+    unsigned int partEnd = 1;
+    if (lastOnPage){
+      partEnd = (fullPacket && trk.pages[nextPage].headerType == OGG::Continued) ? nextPage + 1 : nextPage;
+    }
+    for (unsigned int i = 0; i < partEnd; ++i){
+      oggSegmentInfo * part = first;
+      if (i){
+        part = trk.pages[i].segments.size() ? &trk.pages[i].segments[0] : 0;
+      }
+      if (!part){continue;}
+      unsigned int leadPart = std::min(8 - leadLen, part->size);
+      memcpy(packet.lead + leadLen, part->lead, leadPart);
+      leadLen += leadPart;
+      packet.size += part->size;
+      if (trk.pages[i].data.size()){
+        pkt.data.append(trk.pages[i].data, part->offset, part->size);
+      }
+    }
+
+    long long unsigned int packTime = trk.time;
+    bool keyframe = false;
+    if (oggTrk.codec == OGG::VORBIS){
+      unsigned long blockSize = 0;
+      Utils::bitstreamLSBF bits;
+      if (first){bits.append(first->lead, std::min(first->size, 8u));}
+      if (!bits.get(1)){
+        unsigned long vModeIndex = bits.get(vorbis::ilog(oggTrk.vModes.size() - 1));
+        if (vModeIndex < oggTrk.vModes.size()){
+          blockSize = oggTrk.blockSize[oggTrk.vModes[vModeIndex].blockFlag];
         }
+      }else{
+        DEBUG_MSG(DLVL_WARN, "Packet type != 0");
+      }
+      trk.time += oggTrk.msPerFrame * (blockSize / oggTrk.channels);
+    }else if (oggTrk.codec == OGG::THEORA){
+      if (lastCompleteSegment && page.granule != 0xFFFFFFFFFFFFFFFFull){
+        long long unsigned int parseGranuleUpper = page.granule >> oggTrk.KFGShift;
+        long long unsigned int parseGranuleLower = (page.granule & ((1 << oggTrk.KFGShift) - 1));
+        packTime = oggTrk.msPerFrame * (parseGranuleUpper + parseGranuleLower - 1);
+        trk.time = packTime;
       }
-    }// while ( oggTracks[tid].myPage.getHeaderType() != OGG::Plain && readSuccesfull && oggTracks[tid].myPage.getBitstreamSerialNumber() != tid);
-    INFO_MSG("seek first bytepos: %llu tid: %llu oggTracks[tid].myPage.getHeaderType(): %d ", res.bytepos, tid, oggTracks[tid].myPage.getHeaderType());
-    if (!readSuccesfull){
-      res.trackID = 0;
+      trk.time += oggTrk.msPerFrame;
+      keyframe = !theora::isHeader(packet.lead, packet.size) && !((packet.lead[0] >> 6) & 0x01);
+    }else if (oggTrk.codec == OGG::OPUS){
+      trk.time += Opus::Opus_getDuration(first ? first->lead : packet.lead);
     }
-    return res;
+    pkt.time = packTime;
+    pkt.bpos = page.bpos + segNo;
+    pkt.size = packet.size;
+    pkt.keyframe = keyframe;
+
+    if (!fullPacket){
+      //Nothing follows this packet, so the track ends here
+      trk.pages.clear();
+      trk.ended = true;
+      return true;
+    }
+    if (lastOnPage){
+      trk.pages.erase(trk.pages.begin(), trk.pages.begin() + nextPage);
+      trk.segment = (trk.pages.front().headerType == OGG::Continued) ? 1 : 0;
+    }else{
+      trk.segment = segNo + 1;
+    }
+    return true;
   }
 
-  void inputOGG::getNext(bool smart){
-    if (!currentPositions.size()){
-      thisPacket.null();
-      return;
+  /// Reads the page at readPos and queues it for its track, if that track is being played.
+  /// Returns false at the end of the file or at invalid data.
+  bool inputOGG::readPage(){
+    const char * header = reader->read(readPos, 27);
+    if (!header){return false;}
+    if (memcmp(header, "OggS", 4)){
+      WARN_MSG("No Ogg page @ %llu, stopping", (long long unsigned)readPos);
+      return false;
     }
-    bool lastCompleteSegment = false;
-    position curPos = *currentPositions.begin();
-    currentPositions.erase(currentPositions.begin());
-    segment thisSegment;
-    thisSegment.tid = curPos.trackID;
-    thisSegment.time = curPos.time;
-    thisSegment.bytepos = curPos.bytepos + curPos.segmentNo;
-    unsigned int oldSegNo = curPos.segmentNo;
-    fseek(inFile, curPos.bytepos, SEEK_SET);
-    OGG::Page curPage;
-    curPage.read(inFile);
-    thisSegment.parts.push_back(std::string(curPage.getSegment(curPos.segmentNo), curPage.getSegmentLen(curPos.segmentNo)));
-    bool readFullPacket = false;
-    if (curPos.segmentNo == curPage.getAllSegments().size() - 1){
-      OGG::Page tmpPage;
-      unsigned int bPos;
-      while (!readFullPacket){
-        bPos = ftell(inFile);//<-- :(
-        if (!tmpPage.read(inFile)){
-          break;
+    uint64_t size = pageSize(*reader, readPos);
+    const char * page = size ? reader->read(readPos, size) : 0;
+    if (!page){return false;}
+    uint64_t bpos = readPos;
+    readPos += size;
+    std::map<long unsigned int, oggTrackReader>::iterator it = readTracks.find(getLE32(page + 14));
+    if (it == readTracks.end() || it->second.ended || bpos < it->second.startPage){return true;}
+    it->second.pages.push_back(oggPageInfo());
+    parsePage(page, bpos, it->second.pages.back(), true);
+    return true;
+  }
+
+  /// Plays the selected tracks in a single forward pass through the file, reading it in large blocks.
+  /// Returns the earliest packet, as soon as every track that did not end yet has one ready.
+  void inputOGG::getNext(bool smart){
+    while (true){
+      std::map<long unsigned int, oggTrackReader>::iterator best = readTracks.end();
+      bool waiting = false;
+      for (std::map<long unsigned int, oggTrackReader>::iterator it = readTracks.begin(); it != readTracks.end(); ++it){
+        oggTrackReader & trk = it->second;
+        if (!trk.packets.size() && !trk.ended){
+          oggPacketInfo pkt;
+          if (nextPacket(it->first, trk, readEnd, pkt)){
+            trk.packets.push_back(pkt);
+          }else if (readEnd){
+            trk.ended = true;
+          }
         }
-        if (tmpPage.getBitstreamSerialNumber() != thisSegment.tid){
+        if (!trk.packets.size()){
+          if (!trk.ended){waiting = true;}
           continue;
         }
-        curPos.bytepos = bPos;
-        curPos.segmentNo = 0;
-        if (tmpPage.getHeaderType() == OGG::Continued){
-          thisSegment.parts.push_back(std::string(tmpPage.getSegment(0), tmpPage.getSegmentLen(0)));
-          curPos.segmentNo = 1;
-          if (tmpPage.getAllSegments().size() == 1){
-            continue;
-          }
-        } else {
-          lastCompleteSegment = true; //if this segment ends on the page, use granule to sync video time
+        if (best == readTracks.end() || trk.packets.front().time < best->second.packets.front().time){
+          best = it;
         }
-        readFullPacket = true;
       }
-    } else {
-      curPos.segmentNo++;
-     
-     // if (oggTracks[thisSegment.tid].codec == OGG::THEORA && curPage.getGranulePosition() != (0xFFFFFFFFFFFFFFFFull) && curPos.segmentNo == curPage.getAllSegments().size() - 1){ //if the next segment is the last one on the page, the (theora) granule should be used to sync the time for the current segment
-      if ((oggTracks[thisSegment.tid].codec == OGG::THEORA ||oggTracks[thisSegment.tid].codec == OGG::VORBIS)&& curPage.getGranulePosition() != (0xFFFFFFFFFFFFFFFFull) && curPos.segmentNo == curPage.getAllSegments().size() - 1){ //if the next segment is the last one on the page, the (theora) granule should be used to sync the time for the current segment
-        OGG::Page tmpPage;
-        while (tmpPage.read(inFile) && tmpPage.getBitstreamSerialNumber() != thisSegment.tid){}
-        if ((tmpPage.getBitstreamSerialNumber() == thisSegment.tid) && tmpPage.getHeaderType() == OGG::Continued){
-          lastCompleteSegment = true; //this segment should be used to sync time using granule
-        }
-      }
-      readFullPacket = true;
-    }
-    std::string tmpStr = thisSegment.toJSON(oggTracks[thisSegment.tid].codec).toNetPacked();
-    thisPacket.reInit(tmpStr.data(), tmpStr.size());
-
-    if (oggTracks[thisSegment.tid].codec == OGG::VORBIS){
-      unsigned long blockSize = 0;
-      Utils::bitstreamLSBF packet;
-      packet.append((char*)curPage.getSegment(oldSegNo), curPage.getSegmentLen(oldSegNo));
-      if (!packet.get(1)){
-        //Read index first
-        unsigned long vModeIndex = packet.get(vorbis::ilog(oggTracks[thisSegment.tid].vModes.size() - 1));
-        blockSize= oggTracks[thisSegment.tid].blockSize[oggTracks[thisSegment.tid].vModes[vModeIndex].blockFlag]; //almost readable.        
-      } else {
-        DEBUG_MSG(DLVL_WARN, "Packet type != 0");
-      }
-      curPos.time += oggTracks[thisSegment.tid].msPerFrame * (blockSize / oggTracks[thisSegment.tid].channels);    
-    } else if (oggTracks[thisSegment.tid].codec == OGG::THEORA){
-      if (lastCompleteSegment == true && curPage.getGranulePosition() != (0xFFFFFFFFFFFFFFFFull)){ //this segment should be used to sync time using granule
-        long long unsigned int parseGranuleUpper = curPage.getGranulePosition() >> oggTracks[thisSegment.tid].KFGShift ;
-        long long unsigned int parseGranuleLower(curPage.getGranulePosition() & ((1 << oggTracks[thisSegment.tid].KFGShift) - 1));
-        thisSegment.time = oggTracks[thisSegment.tid].msPerFrame * (parseGranuleUpper + parseGranuleLower - 1);
-        curPos.time = thisSegment.time;
-        std::string tmpStr = thisSegment.toJSON(oggTracks[thisSegment.tid].codec).toNetPacked();
-        thisPacket.reInit(tmpStr.data(), tmpStr.size());
-        //  INFO_MSG("thisTime: %d", thisPacket.getTime());
+      if (waiting){
+        if (!readPage()){readEnd = true;}
+        continue;
       }
-      curPos.time += oggTracks[thisSegment.tid].msPerFrame;
-    } else if (oggTracks[thisSegment.tid].codec == OGG::OPUS){
-      if (thisSegment.parts.size()){
-        curPos.time += Opus::Opus_getDuration(thisSegment.parts.front().data());
+      if (best == readTracks.end()){
+        thisPacket.null();
+        return;
       }
-    }
-    if (readFullPacket){
-      currentPositions.insert(curPos);
+      oggPacketInfo & pkt = best->second.packets.front();
+      thisPacket.genericFill(pkt.time, 0, best->first, pkt.data.data(), pkt.data.size(), pkt.bpos, pkt.keyframe);
+      best->second.packets.pop_front();
+      return;
     }
   }//getnext()
 
@@ -399,57 +536,49 @@ namespace Mist {
     return 0;
   }
 
-  #ifndef _GNU_SOURCE  
-    void * memrchr(const void *s, int c, size_t n){      
-      const unsigned char *cp;
-      if (n != 0) {
-        cp = (unsigned char *)s + n;
-        do {
-          if (*(--cp) == (unsigned char)c)
-            return((void *)cp);
-        } while (--n != 0);
+  /// Finds the page of track tid that holds byte position bpos of a key in its header.
+  /// Key positions are the page start plus the segment number the key starts at, which always lies within the page header,
+  /// so only the few hundred bytes before bpos can hold the page start.
+  bool inputOGG::findPage(long unsigned int tid, uint64_t bpos, uint64_t & pagePos){
+    for (pagePos = (bpos > 254) ? bpos - 254 : 0; pagePos <= bpos; ++pagePos){
+      const char * header = reader->read(pagePos, 27);
+      if (!header){return false;}
+      if (getLE32(header + 14) == tid && 27u + (unsigned char)header[26] > bpos - pagePos && isPageStart(*reader, pagePos)){
+        return true;
       }
-      return((void *)0);
-    }  
-  #endif 
+    }
+    return false;
+  }
 
   void inputOGG::seek(int seekTime){
-    currentPositions.clear();
+    readTracks.clear();
+    readEnd = false;
+    readPos = 0xFFFFFFFFFFFFFFFFull;
     DEBUG_MSG(DLVL_MEDIUM, "Seeking to %dms", seekTime);
 
     //for every track
     for (std::set<unsigned long>::iterator it = selectedTracks.begin(); it != selectedTracks.end(); it++){
+      if (!myMeta.tracks[*it].keys.size() || !oggTracks.count(*it)){continue;}
       //find first keyframe before keyframe with ms > seektime
-      position tmpPos;
-      tmpPos.trackID = *it;
-      tmpPos.time = myMeta.tracks[*it].keys.begin()->getTime();
-      tmpPos.bytepos = myMeta.tracks[*it].keys.begin()->getBpos();
-      for (std::deque<DTSC::Key>::iterator ot = myMeta.tracks[*it].keys.begin(); ot != myMeta.tracks[*it].keys.end(); ot++){
+      DTSC::PackedList<DTSC::Key>::iterator key = myMeta.tracks[*it].keys.begin();
+      for (DTSC::PackedList<DTSC::Key>::iterator ot = myMeta.tracks[*it].keys.begin(); ot != myMeta.tracks[*it].keys.end(); ot++){
         if (ot->getTime() > seekTime){
           break;
-        } else {
-          tmpPos.time = ot->getTime();
-          tmpPos.bytepos = ot->getBpos();
         }
+        key = ot;
       }
-      INFO_MSG("Found %dms for track %lu at %llu bytepos %llu", seekTime, *it, tmpPos.time, tmpPos.bytepos);
-      int backChrs=std::min(280ull, tmpPos.bytepos - 1);
-      fseek(inFile, tmpPos.bytepos - backChrs, SEEK_SET);
-      char buffer[300];
-      fread(buffer, 300, 1, inFile);
-      char * loc = buffer + backChrs + 2; //start at tmpPos.bytepos+2
-      while (loc && !(loc[0] == 'O' && loc[1] == 'g' && loc[2] == 'g' && loc[3] == 'S')){
-        loc = (char *)memrchr(buffer, 'O',  (loc-buffer) -1 );//seek reverse
-      }
-      if (!loc){
-        INFO_MSG("Unable to find a page boundary starting @ %llu, track %lu", tmpPos.bytepos, *it);        
+      uint64_t pagePos = 0;
+      if (!findPage(*it, key->getBpos(), pagePos)){
+        INFO_MSG("Unable to find a page boundary starting @ %llu, track %lu", key->getBpos(), *it);
         continue;
       }
-      tmpPos.segmentNo = backChrs - (loc - buffer);
-      tmpPos.bytepos -= tmpPos.segmentNo;
-      INFO_MSG("Track %lu, segment %llu found at bytepos %llu", *it, tmpPos.segmentNo, tmpPos.bytepos);
-
-      currentPositions.insert(tmpPos);
+      oggTrackReader & trk = readTracks[*it];
+      trk.started = true;
+      trk.segment = key->getBpos() - pagePos;
+      trk.time = key->getTime();
+      trk.startPage = pagePos;
+      readPos = std::min(readPos, pagePos);
+      MEDIUM_MSG("Track %lu, key @ %llums, segment %u found at bytepos %llu", *it, key->getTime(), trk.segment, (long long unsigned)pagePos);
     }
   }
 
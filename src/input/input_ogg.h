@@ -9,38 +9,6 @@ namespace Mist {
     unsigned int len;
   };
 
-  class segment {
-    public:
-      segment() : time(0), tid(0), bytepos(0), keyframe(0){}
-      bool operator < (const segment & rhs) const {
-        return time < rhs.time || (time == rhs.time && tid < rhs.tid);
-      }
-      std::vector<std::string> parts;
-      unsigned long long int time;
-      unsigned long long int tid;
-      long long unsigned int bytepos;
-      bool keyframe;
-      JSON::Value toJSON(OGG::oggCodec myCodec);
-  };
-
-  struct position {
-    bool operator < (const position & rhs) const {
-      if (time < rhs.time){
-        return true;
-      } else {
-        if (time == rhs.time){
-          if (trackID < rhs.trackID){
-            return true;
-          }
-        }
-      }
-      return false;
-    }
-    long unsigned int trackID;
-    long long unsigned int time;
-    long long unsigned int bytepos;
-    long long unsigned int segmentNo;
-  };
 /*
   class oggTrack {
     public:
@@ -65,24 +33,80 @@ namespace Mist {
       unsigned long getBlockSize(unsigned int vModeIndex);
   };*/
 
+  /// A packet, or the part of one, in an Ogg page: its size and first bytes.
+  struct oggSegmentInfo{
+    uint32_t size;
+    uint32_t offset;///< Position of the segment in the payload of the page.
+    char lead[8];
+  };
+
+  /// An Ogg page found while generating the header or reading for playback.
+  struct oggPageInfo{
+    uint64_t bpos;
+    uint64_t granule;
+    uint32_t serial;
+    char headerType;
+    std::vector<oggSegmentInfo> segments;
+    std::string data;///< Payload of the page; only kept when reading for playback.
+  };
+
+  /// A packet made from the pages of a track.
+  struct oggPacketInfo{
+    long long unsigned int time;
+    uint64_t bpos;///< Byte position of the page the packet starts on, plus the segment number it starts at.
+    uint32_t size;
+    bool keyframe;
+    std::string data;///< Data of the packet; only filled when its pages hold their payload.
+  };
+
+  /// Pages found in a byte range of an Ogg file.
+  class oggRange : public headerRange {
+    public:
+      oggRange(int fd, uint64_t start, uint64_t end, bool exact) : headerRange(fd, start, end, exact){}
+      std::deque<oggPageInfo> pages;
+  };
+
+  /// Per track state while turning Ogg pages into packets, both for the header and for playback.
+  struct oggTrackReader{
+    oggTrackReader() : started(false), ended(false), segment(0), time(0), startPage(0){}
+    std::deque<oggPageInfo> pages;///< Pages not fully turned into packets yet; the first one holds the next packet.
+    std::deque<oggPacketInfo> packets;///< Packets ready for playback, in order.
+    bool started;///< Whether the first data page was found.
+    bool ended;///< Whether the last packet of the track was made.
+    unsigned int segment;///< Segment of the first page the next packet starts at.
+    long long unsigned int time;///< Time of the next packet.
+    uint64_t startPage;///< Byte position of the first page to use; earlier pages are skipped.
+  };
+
   class inputOGG : public Input {
     public:
       inputOGG(Util::Config * cfg);
+      ~inputOGG();
     protected:
       //Private Functions
       bool checkArguments();
       bool preRun();
       bool readHeader();
-      position seekFirstData(long long unsigned int tid);      
       void getNext(bool smart = true);
       void seek(int seekTime);
       void trackSelect(std::string trackSpec);
 
+      headerRange * scanRange(uint64_t start, uint64_t end, bool exact);
+      bool mergeRange(headerRange & range);
+      void mergeTrack(long unsigned int tid, bool flush);
+      bool nextPacket(long unsigned int tid, oggTrackReader & trk, bool flush, oggPacketInfo & pkt);
+      bool readPage();
+      bool findPage(long unsigned int tid, uint64_t bpos, uint64_t & pagePos);
+
+      bool readTrackHeaders();
       void parseBeginOfStream(OGG::Page & bosPage);
-      std::set<position> currentPositions;
       FILE * inFile;
+      headerRange * reader;///< Reads the file in large blocks during playback.
+      uint64_t readPos;///< Byte position of the next page to read during playback.
+      bool readEnd;///< Whether playback reached the end of the file.
       std::map<long unsigned int, OGG::oggTrack> oggTracks;//this remembers all metadata for every track
-      std::set<segment> sortedSegments;//probably not needing this
+      std::map<long unsigned int, oggTrackReader> headerTracks;///< Per track, pages waiting to be turned into packets while generating the header.
+      std::map<long unsigned int, oggTrackReader> readTracks;///< Per selected track, pages and packets waiting to be played.
       long long unsigned int calcGranuleTime(unsigned long tid, long long unsigned int granule);
       long long unsigned int calcSegmentDuration(unsigned long tid , std::string & segment);
 
@@ -0,0 +1,388 @@
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <sys/types.h>//for stat
+#include <sys/stat.h>//for stat
+#include <sys/socket.h>
+#include <unistd.h>//for stat
+#include <poll.h>
+#include <mist/util.h>
+#include <mist/stream.h>
+#include <mist/defines.h>
+#include <mist/procs.h>
+#include <mist/timing.h>
+
+#include "input_ts.h"
+
+/// Amount of TS packets read from a file or pipe at once.
+#define TS_READ_PACKETS 1024
+/// Maximum amount of UDP datagrams received per system call.
+#define TS_UDP_BATCH 64
+/// Size of the receive buffer for a single UDP datagram; room for 48 TS packets, enough for jumbo frames.
+#define TS_UDP_SIZE (188 * 48)
+/// Packets a live track may queue up before packets are buffered without waiting for the other tracks.
+#define TS_LIVE_QUEUE 100
+/// Milliseconds to wait for all tracks of a live source to be initialized.
+#define TS_HEADER_TIMEOUT 10000
+/// Milliseconds without data after which a live source is considered gone.
+#define TS_LIVE_TIMEOUT 10000
+
+namespace Mist {
+  inputTS::inputTS(Util::Config * cfg) : Input(cfg) {
+    capa["name"] = "TS";
+    capa["desc"] = "Enables MPEG2-TS input, from files, standard input, a process (ts-exec:) or UDP unicast/multicast (tsudp://[address]:port[/interface])";
+    capa["source_match"].append("/*.ts");
+    capa["source_match"].append("ts-exec:*");
+    capa["source_match"].append("tsudp://*");
+    //May be set to always-on mode
+    capa["always_match"].append("ts-exec:*");
+    capa["always_match"].append("tsudp://*");
+    capa["priority"] = 9ll;
+    capa["codecs"][0u][0u].append("H264");
+    capa["codecs"][0u][1u].append("AAC");
+    capa["codecs"][0u][1u].append("MP3");
+    inFile = 0;
+    lastModTime = 0;
+    readPos = 0;
+    fileEnded = false;
+    readFill = 0;
+    inFd = -1;
+    inputProcess = 0;
+  }
+
+  /// Files are served as VoD, all other sources are live.
+  bool inputTS::needsLock(){
+    std::string input = config->getString("input");
+    return input != "-" && input.substr(0, 8) != "ts-exec:" && input.substr(0, 8) != "tsudp://";
+  }
+
+  bool inputTS::checkArguments() {
+    if (!needsLock()){return true;}
+    if (!config->getString("streamname").size()){
+      if (config->getString("output") == "-") {
+        std::cerr << "Output to stdout not yet supported" << std::endl;
+        return false;
+      }
+    }else{
+      if (config->getString("output") != "-") {
+        std::cerr << "File output in player mode not supported" << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// Opens the input file in VoD mode, and reads up to the first PMT so seeking works without reading the whole file.
+  bool inputTS::preRun() {
+    if (!needsLock()){return true;}
+    inFile = fopen(config->getString("input").c_str(), "r");
+    if (!inFile) {
+      return false;
+    }
+    struct stat statData;
+    lastModTime = 0;
+    if (stat(config->getString("input").c_str(), &statData) != -1){
+      lastModTime = statData.st_mtime;
+    }
+    readBuffer.resize(TS_READ_PACKETS * 188);
+    for (unsigned int i = 0; i < 16 && !tsStream.getActiveTracks().size(); ++i){
+      if (!readBlock()){break;}
+    }
+    seek(0);
+    return true;
+  }
+
+  /// Overrides the default keepRunning function to shut down
+  /// if the file disappears or changes, by polling the file's mtime.
+  /// If neither applies, calls the original function.
+  bool inputTS::keepRunning(){
+    struct stat statData;
+    if (stat(config->getString("input").c_str(), &statData) == -1){
+      INFO_MSG("Shutting down because input file disappeared");
+      return false;
+    }
+    if (lastModTime != statData.st_mtime){
+      INFO_MSG("Shutting down because input file changed");
+      return false;
+    }
+    return Input::keepRunning();
+  }
+
+  bool inputTS::needHeader(){
+    if (!needsLock()){return false;}
+    return Input::needHeader();
+  }
+
+  /// Generates the header by demultiplexing the whole file once.
+  bool inputTS::readHeader() {
+    if (!inFile){return false;}
+    selectedTracks.clear();
+    tsStream.setTrackFilter(selectedTracks);
+    seek(0);
+    uint64_t bench = Util::getMicros();
+    DTSC::Packet headerPack;
+    bool reading = true;
+    while (reading){
+      reading = readBlock();
+      if (!reading){tsStream.finish();}
+      tsStream.getEarliestPacket(headerPack);
+      while (headerPack){
+        if (!myMeta.tracks.count(headerPack.getTrackId())){tsStream.initializeMetadata(myMeta);}
+        if (myMeta.tracks.count(headerPack.getTrackId())){myMeta.update(headerPack);}
+        tsStream.getEarliestPacket(headerPack);
+      }
+    }
+    bench = Util::getMicros(bench);
+    INFO_MSG("Header generated in %llu ms: %lu tracks, %llu bytes", bench/1000, myMeta.tracks.size(), readPos);
+    if (!myMeta.tracks.size()){
+      FAIL_MSG("No supported tracks found in %s", config->getString("input").c_str());
+      return false;
+    }
+    myMeta.toFile(config->getString("input") + ".dtsh");
+    return true;
+  }
+
+  /// Reads and demultiplexes the next block of TS packets from the input file.
+  /// Returns false at the end of the file.
+  bool inputTS::readBlock(){
+    size_t readSize = fread((char *)readBuffer.data(), 1, readBuffer.size(), inFile);
+    if (!readSize){return false;}
+    uint64_t used = tsStream.parseBlock(readBuffer.data(), readSize, readPos);
+    if (!used){return false;}
+    readPos += used;
+    //a partial TS packet is read again with the next block
+    if (used < readSize){Util::fseek(inFile, readPos, SEEK_SET);}
+    return true;
+  }
+
+  void inputTS::getNext(bool smart) {
+    while (true){
+      if (tsStream.hasPacketOnEachTrack() || (fileEnded && tsStream.hasPacket())){
+        tsStream.getEarliestPacket(thisPacket);
+        if (!myMeta.tracks.count(thisPacket.getTrackId())){continue;}
+        return;
+      }
+      if (fileEnded){
+        thisPacket.null();
+        return;
+      }
+      if (!readBlock()){
+        tsStream.finish();
+        fileEnded = true;
+      }
+    }
+  }
+
+  /// Seeks to the earliest keyframe position at or before seekTime over all selected tracks.
+  void inputTS::seek(int seekTime) {
+    uint64_t seekPos = 0xFFFFFFFFFFFFFFFFull;
+    uint64_t keyTime = 0;
+    for (std::set<unsigned long>::iterator it = selectedTracks.begin(); it != selectedTracks.end(); it++){
+      if (!myMeta.tracks.count(*it) || !myMeta.tracks[*it].keys.size()){continue;}
+      DTSC::Track & trk = myMeta.tracks[*it];
+      uint64_t trackPos = trk.keys[0].getBpos();
+      uint64_t trackTime = trk.keys[0].getTime();
+      for (unsigned int i = 0; i < trk.keys.size(); i++){
+        if (trk.keys[i].getTime() > seekTime){break;}
+        trackPos = trk.keys[i].getBpos();
+        trackTime = trk.keys[i].getTime();
+      }
+      if (trackPos < seekPos){
+        seekPos = trackPos;
+        keyTime = trackTime;
+      }
+    }
+    if (seekPos == 0xFFFFFFFFFFFFFFFFull){seekPos = 0;}
+    Util::fseek(inFile, seekPos, SEEK_SET);
+    readPos = seekPos;
+    fileEnded = false;
+    tsStream.clear(keyTime);
+  }
+
+  void inputTS::trackSelect(std::string trackSpec) {
+    selectedTracks.clear();
+    size_t index;
+    while (trackSpec != "") {
+      index = trackSpec.find(' ');
+      selectedTracks.insert(atoi(trackSpec.substr(0, index).c_str()));
+      if (index != std::string::npos) {
+        trackSpec.erase(0, index + 1);
+      } else {
+        trackSpec = "";
+      }
+    }
+    tsStream.setTrackFilter(selectedTracks);
+  }
+
+  /// Opens the live source: standard input, the output of a ts-exec: process, or a tsudp:// socket.
+  bool inputTS::openStreamSource(){
+    std::string source = config->getString("input");
+    readBuffer.resize(TS_READ_PACKETS * 188);
+    readFill = 0;
+    if (source == "-"){
+      inFd = fileno(stdin);
+      return true;
+    }
+    if (source.substr(0, 8) == "ts-exec:"){
+      std::deque<std::string> args;
+      std::string cmd = source.substr(8);
+      size_t index;
+      while (cmd != ""){
+        index = cmd.find(' ');
+        if (index){args.push_back(cmd.substr(0, index));}
+        if (index == std::string::npos){break;}
+        cmd.erase(0, index + 1);
+      }
+      //Only standard output is read: standard input is /dev/null, and messages go to our own standard error
+      int fout = -1, ferr = fileno(stderr);
+      inputProcess = Util::Procs::StartPiped(args, 0, &fout, &ferr);
+      if (!inputProcess){
+        FAIL_MSG("Could not start %s", source.c_str());
+        return false;
+      }
+      inFd = fout;
+      return true;
+    }
+    if (source.substr(0, 8) == "tsudp://"){
+      //tsudp://[address]:port[/interface,interface,...]
+      std::string host = source.substr(8);
+      std::string iface;
+      size_t index = host.find('/');
+      if (index != std::string::npos){
+        iface = host.substr(index + 1);
+        host.erase(index);
+      }
+      index = host.rfind(':');
+      if (index == std::string::npos){
+        FAIL_MSG("No port given in %s", source.c_str());
+        return false;
+      }
+      int port = atoi(host.substr(index + 1).c_str());
+      host.erase(index);
+      if (!udpCon.bind(port, host, iface)){
+        FAIL_MSG("Could not bind to UDP %s:%d", host.c_str(), port);
+        return false;
+      }
+      //a large kernel buffer absorbs bursts while we are busy buffering
+      int bufSize = 8 * 1024 * 1024;
+      setsockopt(udpCon.getSock(), SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(bufSize));
+      udpBuffer.resize(TS_UDP_BATCH * TS_UDP_SIZE);
+      return true;
+    }
+    FAIL_MSG("Unsupported live TS source: %s", source.c_str());
+    return false;
+  }
+
+  void inputTS::closeStreamSource(){
+    if (inputProcess){
+      Util::Procs::Stop(inputProcess);
+      inputProcess = 0;
+    }
+    if (inFd != -1 && inFd != fileno(stdin)){close(inFd);}
+    inFd = -1;
+    udpCon.close();
+  }
+
+  /// Reads and demultiplexes the live source for the initial metadata.
+  /// Waits until all tracks in the PMT are initialized, or TS_HEADER_TIMEOUT ms have passed.
+  void inputTS::parseStreamHeader(){
+    uint64_t startTime = Util::bootMS();
+    while (config->is_active && !tsStream.isReady() && Util::bootMS() - startTime < TS_HEADER_TIMEOUT){
+      if (!readLive()){break;}
+      nProxy.userClient.keepAlive();
+    }
+    tsStream.initializeMetadata(myMeta);
+    myMeta.live = true;
+    myMeta.vod = false;
+  }
+
+  /// Reads whatever the live source has available and demultiplexes it.
+  /// UDP datagrams are received in batches with a single system call where the platform supports it.
+  /// Returns false when a pipe source has ended; a socket source never ends, it may only go quiet.
+  bool inputTS::readLive(){
+    if (inFd != -1){
+      ssize_t readSize = read(inFd, (char *)readBuffer.data() + readFill, readBuffer.size() - readFill);
+      if (readSize <= 0){
+        if (readSize == -1 && errno == EINTR){return true;}
+        return false;
+      }
+      uint64_t len = readFill + readSize;
+      uint64_t used = tsStream.parseBlock(readBuffer.data(), len);
+      readFill = len - used;
+      if (readFill){memmove((char *)readBuffer.data(), readBuffer.data() + used, readFill);}
+      lastActive = Util::bootSecs();
+      return true;
+    }
+    struct pollfd pfd;
+    pfd.fd = udpCon.getSock();
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 100) < 1){return true;}
+#ifdef __linux__
+    struct mmsghdr msgs[TS_UDP_BATCH];
+    struct iovec iovs[TS_UDP_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (unsigned int i = 0; i < TS_UDP_BATCH; ++i){
+      iovs[i].iov_base = (char *)udpBuffer.data() + i * TS_UDP_SIZE;
+      iovs[i].iov_len = TS_UDP_SIZE;
+      msgs[i].msg_hdr.msg_iov = iovs + i;
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int count = recvmmsg(udpCon.getSock(), msgs, TS_UDP_BATCH, MSG_DONTWAIT, 0);
+    for (int i = 0; i < count; ++i){
+      tsStream.parseBlock(udpBuffer.data() + i * TS_UDP_SIZE, msgs[i].msg_len);
+    }
+    if (count > 0){lastActive = Util::bootSecs();}
+#else
+    for (unsigned int i = 0; i < TS_UDP_BATCH && udpCon.Receive(); ++i){
+      tsStream.parseBlock(udpCon.data, udpCon.data_len);
+      lastActive = Util::bootSecs();
+    }
+#endif
+    return true;
+  }
+
+  /// Buffers the demultiplexed packets in timestamp order.
+  /// Packets are only buffered once every track has one, unless a track is TS_LIVE_QUEUE packets ahead or flush is set.
+  /// Tracks that are not initialized yet are initialized as their first packet comes out; packets before that are dropped.
+  void inputTS::bufferReady(bool flush){
+    while (config->is_active){
+      if (!flush && !tsStream.hasPacketOnEachTrack()){
+        bool overflow = false;
+        for (std::map<unsigned int, DTSC::Track>::iterator it = myMeta.tracks.begin(); it != myMeta.tracks.end(); ++it){
+          if (tsStream.packetCount(it->first) > TS_LIVE_QUEUE){
+            overflow = true;
+            break;
+          }
+        }
+        if (!overflow){return;}
+      }
+      tsStream.getEarliestPacket(thisPacket);
+      if (!thisPacket){return;}
+      if (!myMeta.tracks.count(thisPacket.getTrackId())){
+        tsStream.initializeMetadata(myMeta);
+        if (!myMeta.tracks.count(thisPacket.getTrackId())){continue;}
+      }
+      nProxy.bufferLivePacket(thisPacket, myMeta);
+    }
+  }
+
+  std::string inputTS::streamMainLoop(){
+    lastActive = Util::bootSecs();
+    while (config->is_active && nProxy.userClient.isAlive()){
+      if (!readLive()){
+        tsStream.finish();
+        bufferReady(true);
+        return "end of input";
+      }
+      if ((Util::bootSecs() - lastActive) * 1000 > TS_LIVE_TIMEOUT){return "no data received";}
+      bufferReady(false);
+      nProxy.userClient.keepAlive();
+    }
+    if (!config->is_active){return "received deactivate signal";}
+    return "buffer shutdown";
+  }
+}
+
@@ -0,0 +1,45 @@
+#include "input.h"
+#include <mist/dtsc.h>
+#include <mist/ts_stream.h>
+#include <mist/socket.h>
+
+namespace Mist {
+  /// MPEG-TS input, reading TS files (VoD) or live TS from stdin, a process or UDP (multicast).
+  class inputTS : public Input {
+    public:
+      inputTS(Util::Config * cfg);
+      bool needsLock();
+    protected:
+      //Private Functions
+      bool checkArguments();
+      bool preRun();
+      bool needHeader();
+      bool readHeader();
+      void getNext(bool smart = true);
+      void seek(int seekTime);
+      void trackSelect(std::string trackSpec);
+      bool keepRunning();
+      bool openStreamSource();
+      void closeStreamSource();
+      void parseStreamHeader();
+      std::string streamMainLoop();
+      bool readBlock();
+      bool readLive();
+      void bufferReady(bool flush);
+
+      TS::Stream tsStream;///< Demultiplexer for the incoming TS data.
+      FILE * inFile;///< The TS file, in VoD mode.
+      uint64_t lastModTime;
+      uint64_t readPos;///< Byte position in inFile of the next block to read.
+      bool fileEnded;///< Whether inFile was read to the end since the last seek.
+      std::string readBuffer;///< Block of TS packets read from a file or pipe, reused for every read.
+      uint64_t readFill;///< Bytes of a partial TS packet left at the start of readBuffer, for pipes.
+      int inFd;///< Pipe to read live TS data from, or -1.
+      pid_t inputProcess;///< Process writing to inFd, if started by us.
+      Socket::UDPConnection udpCon;///< Socket to receive live TS data from, if inFd is -1.
+      std::string udpBuffer;///< Receive buffers for a batch of UDP datagrams.
+  };
+}
+
+typedef Mist::inputTS mistIn;
+
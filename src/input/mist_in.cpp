@@ -1,6 +1,11 @@
 #include INPUTTYPE 
 
+Mist::Input * createInput(Util::Config * cfg){
+  return new mistIn(cfg);
+}
+
 int main(int argc, char * argv[]) {
+  Mist::Input::create = createInput;
   Util::Config conf(argv[0]);
   mistIn conv(&conf);
   return conv.boot(argc, argv);
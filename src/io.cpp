@@ -8,6 +8,13 @@
 
 namespace Mist {
   Util::Config * InOutBase::config = NULL;
+
+  ///Returns the handle of this process to the server-wide data page accounting.
+  IPC::pageAccounting & pageAccount(){
+    static IPC::pageAccounting accounting;
+    return accounting;
+  }
+
   ///Opens a shared memory page for the stream metadata.
   ///
   ///Assumes myMeta contains the metadata to write.
@@ -29,6 +36,205 @@ namespace Mist {
 
   }
 
+  ///Offset of the first entry on a track index page: 16 header bytes, followed by the mutex.
+  static unsigned long trackIndexStart(){
+    return 16 + ((IPC::sharedMutex::size() + 7) / 8) * 8;
+  }
+
+  ///Wraps the given (mapped) track index page. Does not modify the page.
+  trackIndex::trackIndex(IPC::sharedPage & page){
+    data = page.mapped;
+    capacity = 0;
+    if (data && page.len > (long long)trackIndexStart()){
+      capacity = (page.len - trackIndexStart()) / 8;
+    }
+  }
+
+  ///Initializes an empty index. Should only be called by the process that created the page.
+  void trackIndex::init(){
+    if (!data){return;}
+    memset(data, 0, 16);
+    IPC::sharedMutex(data + 16, true);
+  }
+
+  ///Returns true if the page is mapped and initialized.
+  trackIndex::operator bool() const{
+    return capacity && IPC::sharedMutex(data + 16);
+  }
+
+  ///Returns the amount of pages in the index.
+  unsigned long trackIndex::count() const{
+    if (!*this){return 0;}
+    return std::min((unsigned long)((volatile uint32_t *)data)[1], capacity);
+  }
+
+  ///Returns the highest page number in the index, or 0 if it is empty.
+  unsigned long trackIndex::highest() const{
+    if (!*this){return 0;}
+    return ((volatile uint32_t *)data)[2];
+  }
+
+  ///Returns the position of the first entry with a page number of at least pageNum.
+  unsigned long trackIndex::lowerBound(unsigned long pageNum, unsigned long cnt) const{
+    char * entries = data + trackIndexStart();
+    unsigned long lo = 0, hi = cnt;
+    while (lo < hi){
+      unsigned long mid = (lo + hi) / 2;
+      if (Bit::btohl(entries + mid * 8) < pageNum){
+        lo = mid + 1;
+      }else{
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  ///Returns the number of the page holding the given key, or 0 if it is not buffered.
+  unsigned long trackIndex::pageForKey(unsigned long keyNum) const{
+    if (!*this){return 0;}
+    volatile uint32_t * version = (volatile uint32_t *)data;
+    char * entries = data + trackIndexStart();
+    unsigned long result = 0;
+    for (unsigned int attempt = 0; attempt < 100; ++attempt){
+      uint32_t startVer = *version;
+      if (startVer & 1){
+        Util::sleep(1);
+        continue;
+      }
+      __sync_synchronize();
+      //Find the last page starting at or before this key
+      unsigned long pos = lowerBound(keyNum + 1, count());
+      result = 0;
+      if (pos){
+        unsigned long pageNum = Bit::btohl(entries + (pos - 1) * 8);
+        unsigned long keyAmount = Bit::btohl(entries + (pos - 1) * 8 + 4);
+        if (keyAmount && (pageNum ? pageNum : 1) + keyAmount > keyNum){result = pageNum;}
+      }
+      __sync_synchronize();
+      if (*version == startVer){break;}
+    }
+    return result;
+  }
+
+  ///Returns the number of the page following the given page, or 0 if there is none (yet).
+  unsigned long trackIndex::nextPage(unsigned long pageNum) const{
+    if (!*this){return 0;}
+    volatile uint32_t * version = (volatile uint32_t *)data;
+    char * entries = data + trackIndexStart();
+    unsigned long result = 0;
+    for (unsigned int attempt = 0; attempt < 100; ++attempt){
+      uint32_t startVer = *version;
+      if (startVer & 1){
+        Util::sleep(1);
+        continue;
+      }
+      __sync_synchronize();
+      unsigned long cnt = count();
+      unsigned long pos = lowerBound(pageNum + 1, cnt);
+      result = (pos < cnt) ? Bit::btohl(entries + pos * 8) : 0;
+      __sync_synchronize();
+      if (*version == startVer){break;}
+    }
+    return result;
+  }
+
+  ///Fills the given map with all page numbers and their key amounts.
+  void trackIndex::getAll(std::map<unsigned long, unsigned long> & entries) const{
+    entries.clear();
+    if (!*this){return;}
+    volatile uint32_t * version = (volatile uint32_t *)data;
+    char * list = data + trackIndexStart();
+    for (unsigned int attempt = 0; attempt < 100; ++attempt){
+      uint32_t startVer = *version;
+      if (startVer & 1){
+        Util::sleep(1);
+        continue;
+      }
+      __sync_synchronize();
+      entries.clear();
+      unsigned long cnt = count();
+      for (unsigned long i = 0; i < cnt; ++i){
+        entries[Bit::btohl(list + i * 8)] = Bit::btohl(list + i * 8 + 4);
+      }
+      __sync_synchronize();
+      if (*version == startVer){break;}
+    }
+  }
+
+  ///Marks the start of a change; readers will retry until endWrite is called.
+  void trackIndex::beginWrite(){
+    volatile uint32_t * version = (volatile uint32_t *)data;
+    //An odd version here means a writer crashed halfway; its lock was already recovered
+    if (*version & 1){++(*version);}
+    ++(*version);
+    __sync_synchronize();
+  }
+
+  ///Marks the end of a change.
+  void trackIndex::endWrite(){
+    __sync_synchronize();
+    ++(*(volatile uint32_t *)data);
+  }
+
+  ///Adds a page to the index, or updates its key amount if it is already present.
+  ///Returns false if the index is full or not initialized.
+  bool trackIndex::insert(unsigned long pageNum, unsigned long keyAmount){
+    if (!*this){return false;}
+    IPC::sharedMutex indexLock(data + 16);
+    IPC::sharedMutexGuard guard(indexLock);
+    char * entries = data + trackIndexStart();
+    unsigned long cnt = count();
+    unsigned long pos = lowerBound(pageNum, cnt);
+    if (pos < cnt && Bit::btohl(entries + pos * 8) == pageNum){
+      beginWrite();
+      Bit::htobl(entries + pos * 8 + 4, keyAmount);
+      endWrite();
+      return true;
+    }
+    if (cnt >= capacity){return false;}
+    beginWrite();
+    memmove(entries + (pos + 1) * 8, entries + pos * 8, (cnt - pos) * 8);
+    Bit::htobl(entries + pos * 8, pageNum);
+    Bit::htobl(entries + pos * 8 + 4, keyAmount);
+    ((volatile uint32_t *)data)[1] = cnt + 1;
+    if (pageNum > highest()){((volatile uint32_t *)data)[2] = pageNum;}
+    endWrite();
+    return true;
+  }
+
+  ///Updates the key amount of a page in the index. Returns false if the page is not in the index.
+  bool trackIndex::setKeys(unsigned long pageNum, unsigned long keyAmount){
+    if (!*this){return false;}
+    IPC::sharedMutex indexLock(data + 16);
+    IPC::sharedMutexGuard guard(indexLock);
+    char * entries = data + trackIndexStart();
+    unsigned long cnt = count();
+    unsigned long pos = lowerBound(pageNum, cnt);
+    if (pos >= cnt || Bit::btohl(entries + pos * 8) != pageNum){return false;}
+    beginWrite();
+    Bit::htobl(entries + pos * 8 + 4, keyAmount);
+    endWrite();
+    return true;
+  }
+
+  ///Removes a page from the index. Returns false if the page is not in the index.
+  bool trackIndex::remove(unsigned long pageNum){
+    if (!*this){return false;}
+    IPC::sharedMutex indexLock(data + 16);
+    IPC::sharedMutexGuard guard(indexLock);
+    char * entries = data + trackIndexStart();
+    unsigned long cnt = count();
+    unsigned long pos = lowerBound(pageNum, cnt);
+    if (pos >= cnt || Bit::btohl(entries + pos * 8) != pageNum){return false;}
+    beginWrite();
+    memmove(entries + pos * 8, entries + (pos + 1) * 8, (cnt - pos - 1) * 8);
+    --cnt;
+    ((volatile uint32_t *)data)[1] = cnt;
+    ((volatile uint32_t *)data)[2] = cnt ? Bit::btohl(entries + (cnt - 1) * 8) : 0;
+    endWrite();
+    return true;
+  }
+
   void negotiationProxy::clear(){
     pagesByTrack.clear();
     trackOffset.clear();
@@ -131,6 +337,8 @@ namespace Mist {
     curPage[tid].init(pageName, pageSize, true);
     //Make sure the data page is not destroyed when we are done buffering it later on.
     curPage[tid].master = false;
+    //Live pages are only ever removed by the buffer; VoD pages can be loaded again when evicted
+    pageAccount().add(pageName, pageSize, !myMeta.live);
     //Store the pagenumber of the currently buffer page
     curPageNum[tid] = pageNumber;
 
@@ -143,17 +351,7 @@ namespace Mist {
     if (myMeta.live){
       //Register this page on the meta page
       //NOTE: It is important that this only happens if the stream is live....
-      bool inserted = false;
-      for (int i = 0; i < 1024; i++) {
-        char * tmpOffset = metaPages[tid].mapped + (i * 8);
-        if ((Bit::btohl(tmpOffset) == 0 && Bit::btohl(tmpOffset+4) == 0)) {
-          Bit::htobl(tmpOffset, curPageNum[tid]);
-          Bit::htobl(tmpOffset+4, 1000);
-          inserted = true;
-          break;
-        }
-      }
-      if (!inserted){
+      if (!trackIndex(metaPages[tid]).insert(curPageNum[tid], 1000)){
         FAIL_MSG("Could not insert page in track index. Aborting.");
         curPage[tid].master = true;//set this page for instant-deletion when we're done with it
         return false;
@@ -177,18 +375,13 @@ namespace Mist {
     unsigned long mapTid = nProxy.trackMap[tid];
 
     DEBUG_MSG(DLVL_HIGH, "Removing page %lu on track %lu~>%lu from the corresponding metaPage", pageNumber, tid, mapTid);
-    int i = 0;
-    for (; i < 1024; i++) {
-      char * tmpOffset = nProxy.metaPages[tid].mapped + (i * 8);
-      if (Bit::btohl(tmpOffset) == pageNumber) {
-        Bit::htobl(tmpOffset, 0);
-        Bit::htobl(tmpOffset+4, 0);
-        break;
-      }
-    }
-    if (i == 1024){
+    if (!trackIndex(nProxy.metaPages[tid]).remove(pageNumber)){
       ERROR_MSG("Could not erase page %lu for track %lu->%lu stream %s from track index!", pageNumber, tid, mapTid, streamName.c_str());
     }
+    char pageId[NAME_BUFFER_SIZE];
+    snprintf(pageId, NAME_BUFFER_SIZE, SHM_TRACK_DATA, streamName.c_str(), mapTid, pageNumber);
+    std::string pageName(pageId);
+    pageAccount().remove(pageName);
 
     if (!nProxy.pagesByTrack.count(tid)){
       // If there is no pagesByTrack entry, the pages are managed in local code and not through io.cpp (e.g.: MistInBuffer)
@@ -200,9 +393,6 @@ namespace Mist {
       return;
     }
     //Open the correct page
-    char pageId[NAME_BUFFER_SIZE];
-    snprintf(pageId, NAME_BUFFER_SIZE, SHM_TRACK_DATA, streamName.c_str(), mapTid, pageNumber);
-    std::string pageName(pageId);
     IPC::sharedPage toErase;
 #ifdef __CYGWIN__
     toErase.init(pageName, 26 * 1024 * 1024, false);
@@ -236,19 +426,7 @@ namespace Mist {
       ///\return 0 if the page has not been mapped yet
       return 0;
     }
-    //Loop over the index page
-    int len = metaPages[tid].len / 8;
-    for (int i = 0; i < len; ++i) {
-      char * tmpOffset = metaPages[tid].mapped + (i * 8);
-      unsigned int keyAmount = Bit::btohl(tmpOffset+4);
-      if (keyAmount == 0){continue;}
-      //Check whether the key is on this page
-      unsigned int pageNum = Bit::btohl(tmpOffset);
-      if (pageNum <= keyNum && keyNum < pageNum + keyAmount) {
-        return pageNum;
-      }
-    }
-    return 0;
+    return trackIndex(metaPages[tid]).pageForKey(keyNum);
   }
 
   ///Buffers the next packet on the currently opened page
@@ -325,36 +503,20 @@ namespace Mist {
       return;
     }
 
-    //Keep track of registering the page on the track's index page
+    //Register the page on the track's index page
+    trackIndex index(metaPages[tid]);
     bool inserted = false;
-    int lowest = 0;
-    for (int i = 0; i < 1024; i++) {
-      char * tmpOffset = metaPages[tid].mapped + (i * 8);
-      int keyNum = Bit::btohl(tmpOffset);
-      int keyAmount = Bit::btohl(tmpOffset+4);
-      if (!inserted){
-        if (myMeta.live){
-          if(keyNum == curPageNum[tid] && keyAmount == 1000){
-            Bit::htobl(tmpOffset+4, pagesByTrack[tid][curPageNum[tid]].keyNum);
-            inserted = true;
-          }
-        }else{
-          //in case of vod, insert at the first "empty" spot
-          if(keyNum == 0){
-            Bit::htobl(tmpOffset, curPageNum[tid]);
-            Bit::htobl(tmpOffset+4, pagesByTrack[tid][curPageNum[tid]].keyNum);
-            inserted = true;
-          }
-        }
-      }
-      keyNum = Bit::btohl(tmpOffset);
-      if (!keyNum) continue;
-      if (!lowest || keyNum < lowest){
-        lowest = keyNum;
-      }
+    if (myMeta.live){
+      //Live pages were registered as being written in bufferStart
+      inserted = index.setKeys(curPageNum[tid], pagesByTrack[tid][curPageNum[tid]].keyNum);
+    }else{
+      inserted = index.insert(curPageNum[tid], pagesByTrack[tid][curPageNum[tid]].keyNum);
     }
 
 #if defined(__CYGWIN__) || defined(_WIN32)
+    std::map<unsigned long, unsigned long> entries;
+    index.getAll(entries);
+    int lowest = entries.size() ? entries.begin()->first : 0;
     static int wipedAlready = 0;
     if (lowest && lowest > wipedAlready + 1){
       for (int curr = wipedAlready + 1; curr < lowest; ++curr){
@@ -426,6 +588,64 @@ namespace Mist {
     }
   }
 
+  ///Determines how large data pages for the given track should be, from its bit rate and keyframe interval.
+  ///Pages are sized to hold FLIP_TARGET_DURATION worth of data, plus room for the keyframe interval that is
+  ///in progress when the flip is due, within MIN_DATA_PAGE_SIZE and MAX_DATA_PAGE_SIZE.
+  ///Tracks without a known bit rate use DEFAULT_DATA_PAGE_SIZE and FLIP_DATA_PAGE_SIZE.
+  ///\param trk The track to size pages for.
+  ///\param pageSize Set to the size of new data pages.
+  ///\param flipSize Set to the amount of data after which the next keyframe starts a new page.
+  void negotiationProxy::pageSizing(DTSC::Track & trk, unsigned long long & pageSize, unsigned long long & flipSize){
+    long long rate = std::max(trk.bps, trk.max_bps);
+    if (rate <= 0){
+      pageSize = DEFAULT_DATA_PAGE_SIZE;
+      flipSize = FLIP_DATA_PAGE_SIZE;
+      return;
+    }
+    //Tracks without regular keyframes are split every 5 seconds, see bufferSinglePacket
+    unsigned long long keyInterval = 5000;
+    if (trk.keys.size() > 1){
+      keyInterval = (trk.keys.rbegin()->getTime() - trk.keys.begin()->getTime()) / (trk.keys.size() - 1);
+      if (keyInterval < 1000){keyInterval = 1000;}
+    }
+    //Three keyframe intervals of headroom, to deal with bit rate peaks.
+    unsigned long long headroom = std::max((unsigned long long)rate * keyInterval * 3 / 1000, (unsigned long long)(MIN_DATA_PAGE_SIZE / 2));
+    flipSize = (unsigned long long)rate * FLIP_TARGET_DURATION / 1000;
+    if (flipSize + headroom > MAX_DATA_PAGE_SIZE){
+      flipSize = (headroom * 2 < MAX_DATA_PAGE_SIZE) ? (MAX_DATA_PAGE_SIZE - headroom) : (MAX_DATA_PAGE_SIZE / 2);
+    }
+    pageSize = flipSize + headroom;
+    if (pageSize < MIN_DATA_PAGE_SIZE){pageSize = MIN_DATA_PAGE_SIZE;}
+    if (pageSize > MAX_DATA_PAGE_SIZE){pageSize = MAX_DATA_PAGE_SIZE;}
+    //Round up to a multiple of 64KiB
+    pageSize = (pageSize + 65535) & ~65535ull;
+  }
+
+  /// Splits the keys of a VoD track over data pages the way its input buffers them, using the key sizes in its header.
+  /// Pages are stored by the number of their first key; keys are 1-indexed.
+  /// Returns false if the header lacks key sizes for some keys.
+  bool negotiationProxy::pagesFromKeys(DTSC::Track & trk, std::map<unsigned long, DTSCPageData> & pages){
+    unsigned long long pageSize, flipSize;
+    pageSizing(trk, pageSize, flipSize);
+    bool newData = true;
+    for (int i = 0; i < trk.keys.size(); i++){
+      if (newData){
+        //i+1 because keys are 1-indexed
+        pages[i + 1].firstTime = trk.keys[i].getTime();
+        newData = false;
+      }
+      DTSCPageData & dPage = pages.rbegin()->second;
+      dPage.keyNum++;
+      if (trk.keySizes.size() <= i){return false;}
+      dPage.partNum += trk.keys[i].getParts();
+      dPage.dataSize += trk.keySizes[i];
+      if ((dPage.dataSize > flipSize || trk.keys[i].getTime() - dPage.firstTime > FLIP_TARGET_DURATION) && trk.keys[i].getTime() - dPage.firstTime > FLIP_MIN_DURATION) {
+        newData = true;
+      }
+    }
+    return true;
+  }
+
   void negotiationProxy::bufferSinglePacket(const DTSC::Packet & packet, DTSC::Meta & myMeta){
     //Store the trackid for easier access
     unsigned long tid = packet.getTrackId();
@@ -457,21 +677,23 @@ namespace Mist {
     //Determine if we need to open the next page
     int nextPageNum = -1;
     if (isKeyframe && trackState[tid] == FILL_ACC) {
+      unsigned long long pageSize, flipSize;
+      pageSizing(myMeta.tracks[tid], pageSize, flipSize);
       //If there is no page, create it
       if (!pagesByTrack.count(tid) || pagesByTrack[tid].size() == 0) {
         nextPageNum = 1;
-        pagesByTrack[tid][1].dataSize = DEFAULT_DATA_PAGE_SIZE;//Initialize op 25mb
+        pagesByTrack[tid][1].dataSize = pageSize;
         pagesByTrack[tid][1].pageNum = 1;
         pagesByTrack[tid][1].firstTime = packet.getTime();
       }
       //Take the last allocated page
       std::map<unsigned long, DTSCPageData>::reverse_iterator tmpIt = pagesByTrack[tid].rbegin();
-      //Compare on 8 mb boundary
-      if (tmpIt->second.curOffset > FLIP_DATA_PAGE_SIZE || packet.getTime() - tmpIt->second.firstTime > FLIP_TARGET_DURATION) { 
+      //Flip on the size boundary for this track, when the page is running out of room or when it covers enough time
+      if (tmpIt->second.curOffset > flipSize || tmpIt->second.dataSize - tmpIt->second.curOffset < pageSize - flipSize || packet.getTime() - tmpIt->second.firstTime > FLIP_TARGET_DURATION) {
         //Create the book keeping data for the new page
         nextPageNum = tmpIt->second.pageNum + tmpIt->second.keyNum;
-        HIGH_MSG("We should go to next page now, transition from %lu to %d", tmpIt->second.pageNum, nextPageNum);
-        pagesByTrack[tid][nextPageNum].dataSize = DEFAULT_DATA_PAGE_SIZE;
+        HIGH_MSG("We should go to next page now, transition from %lu to %d (%llu bytes)", tmpIt->second.pageNum, nextPageNum, pageSize);
+        pagesByTrack[tid][nextPageNum].dataSize = pageSize;
         pagesByTrack[tid][nextPageNum].pageNum = nextPageNum;
         pagesByTrack[tid][nextPageNum].firstTime = packet.getTime();
       }
@@ -543,6 +765,7 @@ namespace Mist {
       char pageName[NAME_BUFFER_SIZE];
       snprintf(pageName, NAME_BUFFER_SIZE, SHM_TRACK_INDEX, streamName.c_str(), tid);
       metaPages[tid].init(pageName, SHM_TRACK_INDEX_SIZE, true);
+      trackIndex(metaPages[tid]).init();
       metaPages[tid].master = false;
       return;
     }
@@ -615,6 +838,7 @@ namespace Mist {
 
         snprintf(pageName, NAME_BUFFER_SIZE, SHM_TRACK_INDEX, streamName.c_str(), finalTid);
         metaPages[tid].init(pageName, SHM_TRACK_INDEX_SIZE, true);
+        trackIndex(metaPages[tid]).init();
         metaPages[tid].master = false;
         Bit::htobl(tmp + offset, finalTid | 0xC0000000);
         Bit::htobs(tmp + offset + 4, firstPage);
@@ -704,6 +928,7 @@ namespace Mist {
           char pageName[NAME_BUFFER_SIZE];
           snprintf(pageName, NAME_BUFFER_SIZE, SHM_TRACK_INDEX, streamName.c_str(), finalTid);
           metaPages[tid].init(pageName, SHM_TRACK_INDEX_SIZE, true);
+          trackIndex(metaPages[tid]).init();
           metaPages[tid].master = false;
           break;
         }
@@ -25,6 +25,38 @@ namespace Mist {
     unsigned long lastKeyTime;///<The last key time encountered on this track.
   };
 
+  ///\brief Accessor for the index page of a track (SHM_TRACK_INDEX).
+  ///
+  ///The page starts with a header holding a version counter, the amount of entries, the highest page number
+  ///and a sharedMutex. It is followed by 8-byte entries sorted by page number: the number of the first key
+  ///on a data page (4 bytes) and the amount of keys on it (4 bytes), both big-endian.
+  ///A key amount of 1000 means the page is still being written.
+  ///
+  ///Writers serialize through the mutex and bump the version around every change, so readers can
+  ///binary search without locking and retry when they raced with a writer.
+  class trackIndex {
+    public:
+      trackIndex(IPC::sharedPage & page);
+      void init();
+      operator bool() const;
+      unsigned long count() const;
+      unsigned long highest() const;
+      unsigned long pageForKey(unsigned long keyNum) const;
+      unsigned long nextPage(unsigned long pageNum) const;
+      void getAll(std::map<unsigned long, unsigned long> & entries) const;
+      bool insert(unsigned long pageNum, unsigned long keyAmount);
+      bool setKeys(unsigned long pageNum, unsigned long keyAmount);
+      bool remove(unsigned long pageNum);
+    private:
+      unsigned long lowerBound(unsigned long pageNum, unsigned long cnt) const;
+      void beginWrite();
+      void endWrite();
+      char * data;///< Start of the mapped index page.
+      unsigned long capacity;///< The maximum amount of entries fitting on the page.
+  };
+
+  IPC::pageAccounting & pageAccount();
+
   class negotiationProxy {
     public:
       negotiationProxy();
@@ -36,6 +68,8 @@ namespace Mist {
       void bufferSinglePacket(const DTSC::Packet & packet, DTSC::Meta & myMeta);
       bool isBuffered(unsigned long tid, unsigned long keyNum);
       unsigned long bufferedOnPage(unsigned long tid, unsigned long keyNum);
+      static void pageSizing(DTSC::Track & trk, unsigned long long & pageSize, unsigned long long & flipSize);
+      static bool pagesFromKeys(DTSC::Track & trk, std::map<unsigned long, DTSCPageData> & pages);
 
 
 
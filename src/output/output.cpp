@@ -1,10 +1,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <semaphore.h>
 #include <iterator> //std::distance
+#include <algorithm> //std::find
 
 #include <mist/bitfields.h>
 #include <mist/stream.h>
@@ -25,6 +27,17 @@ namespace Mist{
     return Bit::btohll(mapped + offset + 12);
   }
 
+  /// Returns true if the page is not mapped, or was unlinked since it was opened.
+  /// An unlinked page may have been recreated under the same name, e.g. by a restarted buffer.
+  static bool pageStale(IPC::sharedPage & page){
+    if (!page.mapped){return true;}
+#if !defined(__CYGWIN__) && !defined(_WIN32)
+    struct stat pageStat;
+    if (fstat(page.handle, &pageStat) || !pageStat.st_nlink){return true;}
+#endif
+    return false;
+  }
+
   void Output::init(Util::Config * cfg){
     capa["optional"]["debug"]["name"] = "debug";
     capa["optional"]["debug"]["help"] = "The debug level at which messages need to be printed.";
@@ -64,6 +77,8 @@ namespace Mist{
     isBlocking = false;
     needsLookAhead = 0;
     lastStats = 0;
+    lastCacheSweep = 0;
+    lastStaleCheck = 0;
     maxSkipAhead = 7500;
     realTime = 1000;
     lastRecv = Util::epoch();
@@ -93,28 +108,33 @@ namespace Mist{
     if (!nProxy.userClient.isAlive() || (isPushing() && myMeta.tracks.size())){
       return;
     }
+    //a restarted buffer recreates the metadata and lock pages; check for that at most once per second
+    uint64_t now = Util::bootSecs();
+    bool checkStale = (now != lastStaleCheck);
+    lastStaleCheck = now;
+    if (!nProxy.metaPages[0].mapped || (checkStale && pageStale(nProxy.metaPages[0]))){
+      char pageId[NAME_BUFFER_SIZE];
+      snprintf(pageId, NAME_BUFFER_SIZE, SHM_STREAM_INDEX, streamName.c_str());
+      nProxy.metaPages[0].init(pageId, DEFAULT_STRM_PAGE_SIZE, false, false);
+    }
     //read metadata from page to myMeta variable
     if (nProxy.metaPages[0].mapped){
-      IPC::semaphore * liveSem = 0;
+      bool locked = false;
       if (!myMeta.vod){
-        static char liveSemName[NAME_BUFFER_SIZE];
-        snprintf(liveSemName, NAME_BUFFER_SIZE, SEM_LIVE, streamName.c_str());
-        liveSem = new IPC::semaphore(liveSemName, O_RDWR, ACCESSPERMS, 1, !myMeta.live);
-        if (*liveSem){
-          liveSem->wait();
-        }else{
-          delete liveSem;
-          liveSem = 0;
+        if (!liveLockPage.mapped || (checkStale && pageStale(liveLockPage))){
+          char liveLockName[NAME_BUFFER_SIZE];
+          snprintf(liveLockName, NAME_BUFFER_SIZE, SHM_STREAM_LOCK, streamName.c_str());
+          liveLockPage.init(liveLockName, IPC::sharedMutex::size(), false, myMeta.live);
+          liveLock.init(liveLockPage.mapped);
         }
+        locked = liveLock.lock();
       }
       DTSC::Packet tmpMeta(nProxy.metaPages[0].mapped, nProxy.metaPages[0].len, true);
       if (tmpMeta.getVersion()){
         myMeta.reinit(tmpMeta);
       }
-      if (liveSem){
-        liveSem->post();
-        delete liveSem;
-        liveSem = 0;
+      if (locked){
+        liveLock.unlock();
       }
     }
   }
@@ -218,6 +238,7 @@ namespace Mist{
     char pageId[NAME_BUFFER_SIZE];
     snprintf(pageId, NAME_BUFFER_SIZE, SHM_STREAM_INDEX, streamName.c_str());
     nProxy.metaPages.clear();
+    liveLockPage.close();
     nProxy.metaPages[0].init(pageId, DEFAULT_STRM_PAGE_SIZE);
     if (!nProxy.metaPages[0].mapped){
       FAIL_MSG("Could not connect to data for %s", streamName.c_str());
@@ -377,7 +398,7 @@ namespace Mist{
     }
     unsigned int keyNo = trk.keys.begin()->getNumber();
     unsigned int partCount = 0;
-    std::deque<DTSC::Key>::iterator it;
+    DTSC::PackedList<DTSC::Key>::iterator it;
     for (it = trk.keys.begin(); it != trk.keys.end() && it->getTime() <= timeStamp; it++){
       keyNo = it->getNumber();
       partCount += it->getParts();
@@ -396,17 +417,9 @@ namespace Mist{
       nProxy.metaPages[trackId].init(id, SHM_TRACK_INDEX_SIZE);
     }
     if (!nProxy.metaPages[trackId].mapped){return -1;}
-    int len = nProxy.metaPages[trackId].len / 8;
-    for (int i = 0; i < len; i++){
-      char * tmpOffset = nProxy.metaPages[trackId].mapped + (i * 8);
-      long amountKey = Bit::btohl(tmpOffset+4);
-      if (amountKey == 0){continue;}
-      long tmpKey = Bit::btohl(tmpOffset);
-      if (tmpKey <= keyNum && ((tmpKey?tmpKey:1) + amountKey) > keyNum){
-        return tmpKey;
-      }
-    }
-    return -1;
+    if (keyNum < 0){return -1;}
+    unsigned long pageNum = trackIndex(nProxy.metaPages[trackId]).pageForKey(keyNum);
+    return pageNum ? (int)pageNum : -1;
   }
 
   /// Gets the highest page number available for the given trackId.
@@ -417,16 +430,8 @@ namespace Mist{
       nProxy.metaPages[trackId].init(id, SHM_TRACK_INDEX_SIZE);
     }
     if (!nProxy.metaPages[trackId].mapped){return -1;}
-    int len = nProxy.metaPages[trackId].len / 8;
-    int highest = -1;
-    for (int i = 0; i < len; i++){
-      char * tmpOffset = nProxy.metaPages[trackId].mapped + (i * 8);
-      long amountKey = Bit::btohl(tmpOffset+4);
-      if (amountKey == 0){continue;}
-      long tmpKey = Bit::btohl(tmpOffset);
-      if (tmpKey > highest){highest = tmpKey;}
-    }
-    return highest;
+    unsigned long highest = trackIndex(nProxy.metaPages[trackId]).highest();
+    return highest ? (int)highest : -1;
   }
  
   /// Loads the page for the given trackId and keyNum into memory.
@@ -492,7 +497,13 @@ namespace Mist{
     }
     char id[NAME_BUFFER_SIZE];
     snprintf(id, NAME_BUFFER_SIZE, SHM_TRACK_DATA, streamName.c_str(), trackId, pageNum);
-    nProxy.curPage[trackId].init(id, DEFAULT_DATA_PAGE_SIZE);
+    //Keep the page we're leaving mapped, and reuse an earlier mapping of the new one if we still have it.
+    if (nProxy.curPage.count(trackId) && nProxy.curPage[trackId].mapped){
+      cachePage(nProxy.curPage[trackId]);
+    }
+    if (!takeCachedPage(id, nProxy.curPage[trackId])){
+      nProxy.curPage[trackId].init(id, DEFAULT_DATA_PAGE_SIZE);
+    }
     if (!(nProxy.curPage[trackId].mapped)){
       FAIL_MSG("Initializing page %s failed", nProxy.curPage[trackId].name.c_str());
       currKeyOpen.erase(trackId);
@@ -502,6 +513,86 @@ namespace Mist{
     VERYHIGH_MSG("Page %s loaded for %s", id, streamName.c_str());
   }
 
+  /// Moves the mapping of the given page into the page cache, leaving the page itself empty.
+  /// Live pages are unmapped instead: the buffer removes them as it goes, and a mapping would keep their memory in use.
+  /// Unmaps the least recently used cached page if the cache grows beyond DATA_PAGE_CACHE_SIZE,
+  /// and, at most once per second, all cached pages that were removed since.
+  void Output::cachePage(IPC::sharedPage & page){
+    if (!page.mapped){return;}
+    uint64_t now = Util::bootSecs();
+    if (now != lastCacheSweep){
+      lastCacheSweep = now;
+      dropStalePages();
+    }
+    std::string name = page.name;
+    if (myMeta.live || pageCache.count(name)){
+      page.close();
+      return;
+    }
+    pageCache[name].swap(page);
+    pageCacheOrder.push_back(name);
+    while (pageCacheOrder.size() > DATA_PAGE_CACHE_SIZE){
+      pageCache.erase(pageCacheOrder.front());
+      pageCacheOrder.pop_front();
+    }
+  }
+
+  /// Moves the cached mapping of the page with the given name into page, if there is one.
+  /// A cached mapping of a page that was removed since is dropped instead, as the page may have been recreated.
+  /// Returns true if page now holds the cached mapping.
+  bool Output::takeCachedPage(const std::string & name, IPC::sharedPage & page){
+    if (!pageCache.count(name)){return false;}
+    std::deque<std::string>::iterator it = std::find(pageCacheOrder.begin(), pageCacheOrder.end(), name);
+    if (it != pageCacheOrder.end()){pageCacheOrder.erase(it);}
+    if (pageStale(pageCache[name])){
+      pageCache.erase(name);
+      return false;
+    }
+    page.close();
+    page.swap(pageCache[name]);
+    pageCache.erase(name);
+    return true;
+  }
+
+  /// Unmaps all cached pages that have since been removed by the buffer or input, so they do not keep their memory in use.
+  void Output::dropStalePages(){
+    std::deque<std::string>::iterator it = pageCacheOrder.begin();
+    while (it != pageCacheOrder.end()){
+      if (pageStale(pageCache[*it])){
+        pageCache.erase(*it);
+        it = pageCacheOrder.erase(it);
+      }else{
+        ++it;
+      }
+    }
+  }
+
+  /// Maps the page following the currently loaded page of the given track into the page cache,
+  /// and asks the kernel to start paging it in, so the switch to it does not stall.
+  /// Only does anything once per loaded page, and only once the next page exists. Live pages are never prefetched.
+  void Output::prefetchNextPage(long unsigned int trackId){
+    if (myMeta.live || !currKeyOpen.count(trackId) || !nProxy.metaPages.count(trackId)){return;}
+    unsigned long curNum = currKeyOpen[trackId];
+    if (prefetchedFrom.count(trackId) && prefetchedFrom[trackId] == curNum){return;}
+    unsigned long nextNum = trackIndex(nProxy.metaPages[trackId]).nextPage(curNum);
+    if (!nextNum){return;}
+    prefetchedFrom[trackId] = curNum;
+    char id[NAME_BUFFER_SIZE];
+    snprintf(id, NAME_BUFFER_SIZE, SHM_TRACK_DATA, streamName.c_str(), trackId, nextNum);
+    if (!pageCache.count(id)){
+      IPC::sharedPage nextPage(id, DEFAULT_DATA_PAGE_SIZE, false, false);
+      if (!nextPage.mapped){return;}
+      cachePage(nextPage);
+    }
+#if !defined(__CYGWIN__) && !defined(_WIN32)
+    IPC::sharedPage & cached = pageCache[id];
+    if (cached.mapped){
+      madvise(cached.mapped, cached.len, MADV_WILLNEED);
+    }
+#endif
+    VERYHIGH_MSG("Prefetched page %s", id);
+  }
+
   ///Return the current time of the media buffer, or 0 if no buffer available.
   uint64_t Output::currentTime(){
     if (!buffer.size()){return 0;}
@@ -647,7 +738,7 @@ namespace Mist{
       //cancel if there are no keys in the main track
       if (!myMeta.tracks.count(mainTrack) || !myMeta.tracks[mainTrack].keys.size()){return;}
       //seek to the newest keyframe, unless that is <5s, then seek to the oldest keyframe
-      for (std::deque<DTSC::Key>::reverse_iterator it = myMeta.tracks[mainTrack].keys.rbegin(); it != myMeta.tracks[mainTrack].keys.rend(); ++it){
+      for (DTSC::PackedList<DTSC::Key>::reverse_iterator it = myMeta.tracks[mainTrack].keys.rbegin(); it != myMeta.tracks[mainTrack].keys.rend(); ++it){
         seekPos = it->getTime();
         if (seekPos < 5000){continue;}//if we're near the start, skip back
         bool good = true;
@@ -1004,6 +1095,10 @@ namespace Mist{
     atLivePoint = false;
     //we assume the next packet is the next on this same page
     nxt.offset += thisPacket.getDataLen();
+    //close to the end of the page: make sure the next one is mapped and being paged in
+    if (nxt.offset > (nProxy.curPage[nxt.tid].len / 4) * 3){
+      prefetchNextPage(nxt.tid);
+    }
     if (nxt.offset < nProxy.curPage[nxt.tid].len){
       unsigned long long nextTime = getDTSCTime(nProxy.curPage[nxt.tid].mapped, nxt.offset);
       if (nextTime){
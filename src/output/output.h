@@ -2,6 +2,7 @@
 #include <set>
 #include <cstdlib>
 #include <map>
+#include <deque>
 #include <mist/config.h>
 #include <mist/json.h>
 #include <mist/flv_tag.h>
@@ -79,6 +80,14 @@ namespace Mist {
       void loadPageForKey(long unsigned int trackId, long long int keyNum);
       int pageNumForKey(long unsigned int trackId, long long int keyNum);
       int pageNumMax(long unsigned int trackId);
+      void cachePage(IPC::sharedPage & page);
+      bool takeCachedPage(const std::string & name, IPC::sharedPage & page);
+      void prefetchNextPage(long unsigned int trackId);
+      void dropStalePages();
+      std::map<std::string, IPC::sharedPage> pageCache;///< Recently used data pages, kept mapped for reuse.
+      std::deque<std::string> pageCacheOrder;///< Names of the pages in pageCache, least recently used first.
+      uint64_t lastCacheSweep;///< Time in seconds since boot of the last dropStalePages call.
+      std::map<unsigned long, unsigned long> prefetchedFrom;///< Per track, the page that last triggered a prefetch of its successor.
       unsigned int lastStats;///<Time of last sending of stats.
       long long unsigned int firstTime;///< Time of first packet after last seek. Used for real-time sending.
       std::map<unsigned long, unsigned long> nxtKeyNum;///< Contains the number of the next key, for page seeking purposes.
@@ -93,6 +102,9 @@ namespace Mist {
       virtual bool hasSessionIDs(){return false;}
 
       IPC::sharedClient statsPage;///< Shared memory used for statistics reporting.
+      IPC::sharedPage liveLockPage;///< Shared memory holding liveLock.
+      IPC::sharedMutex liveLock;///< Lock held by the buffer while it rewrites the live stream metadata.
+      uint64_t lastStaleCheck;///< Time in seconds since boot updateMeta last checked for a restarted buffer.
       bool isBlocking;///< If true, indicates that myConn is blocking.
       uint32_t crc;///< Checksum, if any, for usage in the stats.
       unsigned int getKeyForTime(long unsigned int trackId, long long timeStamp);
@@ -0,0 +1,389 @@
+#include "output_dtsc_file.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <mist/defines.h>
+#include <mist/util.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace Mist {
+  recordWriter::recordWriter(){
+    fd = -1;
+    thread = 0;
+    bufferCount = 0;
+    stopping = false;
+    error = false;
+    current = 0;
+    currentLen = 0;
+    pos = 0;
+    lastPos = 0;
+    lastLen = 0;
+  }
+
+  recordWriter::~recordWriter(){
+    if (thread){close();}
+    if (current){free(current);}
+    while (freeBuffers.size()){
+      free(freeBuffers.front());
+      freeBuffers.pop_front();
+    }
+  }
+
+  /// Creates or truncates the file and starts the writer thread.
+  /// \param meta The header to start from, holding the tracks to record without any data.
+  bool recordWriter::open(const std::string & file, const DTSC::Meta & meta){
+    if (!Util::createPathFor(file)){
+      ERROR_MSG("Cannot create file %s: could not create parent folder", file.c_str());
+      return false;
+    }
+    fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    if (fd == -1){
+      ERROR_MSG("Failed to open file %s: %s", file.c_str(), strerror(errno));
+      return false;
+    }
+    fileName = file;
+    header = meta;
+    current = getBuffer();
+    if (!current){
+      ::close(fd);
+      fd = -1;
+      return false;
+    }
+    thread = new tthread::thread(writerThread, this);
+    return true;
+  }
+
+  /// Returns true once a write failed; everything written afterwards is discarded.
+  bool recordWriter::failed(){
+    tthread::lock_guard<tthread::mutex> guard(lock);
+    return error;
+  }
+
+  /// Returns an empty buffer, allocating one while fewer than RECORD_BUFFER_COUNT exist,
+  /// and waiting for the writer thread to finish one otherwise.
+  char * recordWriter::getBuffer(){
+    tthread::lock_guard<tthread::mutex> guard(lock);
+    while (!freeBuffers.size() && bufferCount >= RECORD_BUFFER_COUNT){cond.wait(lock);}
+    if (freeBuffers.size()){
+      char * buffer = freeBuffers.front();
+      freeBuffers.pop_front();
+      return buffer;
+    }
+    //Aligned to the page size, so the kernel copies whole pages out of it
+    void * buffer = 0;
+    if (posix_memalign(&buffer, 4096, RECORD_BUFFER_SIZE)){
+      ERROR_MSG("Could not allocate a recording buffer");
+      return 0;
+    }
+    ++bufferCount;
+    return (char *)buffer;
+  }
+
+  void recordWriter::submit(recordJob & job){
+    tthread::lock_guard<tthread::mutex> guard(lock);
+    jobs.push_back(recordJob());
+    jobs.back().data = job.data;
+    jobs.back().len = job.len;
+    jobs.back().pos = job.pos;
+    jobs.back().tracks.swap(job.tracks);
+    jobs.back().packets.swap(job.packets);
+    cond.notify_all();
+  }
+
+  /// Adds a track to the recording; it is in the header from the next packet on.
+  void recordWriter::addTrack(const DTSC::Track & track){
+    currentTracks.push_back(track);
+  }
+
+  /// Appends a packet to the recording, and notes it for the header.
+  void recordWriter::writePacket(const DTSC::Packet & pack){
+    recordPacket rec;
+    char * data = 0;
+    unsigned int dataLen = 0;
+    pack.getString("data", data, dataLen);
+    rec.time = pack.getTime();
+    rec.offset = pack.hasMember("offset") ? pack.getInt("offset") : 0;
+    rec.tid = pack.getTrackId();
+    rec.dataLen = dataLen;
+    rec.sendLen = pack.getDataLen();
+    rec.bpos = written();
+    rec.keyframe = pack.hasMember("keyframe");
+    write(pack.getData(), pack.getDataLen());
+    currentPackets.push_back(rec);
+  }
+
+  /// Appends data to the file. Only blocks if the writer thread is RECORD_BUFFER_COUNT buffers behind.
+  void recordWriter::write(const char * data, size_t len){
+    while (len && current){
+      size_t chunk = std::min(len, (size_t)(RECORD_BUFFER_SIZE) - currentLen);
+      memcpy(current + currentLen, data, chunk);
+      currentLen += chunk;
+      data += chunk;
+      len -= chunk;
+      if (currentLen == RECORD_BUFFER_SIZE){flush(false);}
+    }
+  }
+
+  /// Hands all data appended so far to the writer thread, followed by an update of the header file if header is set.
+  /// The header file is only updated once all data before it was written, so it never describes data that is not in the file.
+  void recordWriter::flush(bool header){
+    if (!current){return;}
+    if (currentLen){
+      recordJob job;
+      job.data = current;
+      job.len = currentLen;
+      job.pos = pos;
+      job.tracks.swap(currentTracks);
+      job.packets.swap(currentPackets);
+      submit(job);
+      pos += currentLen;
+      currentLen = 0;
+      current = getBuffer();
+    }
+    if (header){
+      recordJob job;
+      job.data = 0;
+      job.len = 0;
+      job.pos = pos;
+      job.tracks.swap(currentTracks);
+      submit(job);
+    }
+  }
+
+  /// Writes out everything and the final header, then stops the writer thread and closes the file.
+  void recordWriter::close(){
+    if (!thread){return;}
+    flush(false);
+    {
+      tthread::lock_guard<tthread::mutex> guard(lock);
+      stopping = true;
+      cond.notify_all();
+    }
+    thread->join();
+    delete thread;
+    thread = 0;
+    //The writer thread is done with the header, so the final one is written from here
+    for (std::deque<DTSC::Track>::iterator it = currentTracks.begin(); it != currentTracks.end(); ++it){
+      header.tracks[it->trackID] = *it;
+    }
+    currentTracks.clear();
+    if (!writeHeader(true)){
+      tthread::lock_guard<tthread::mutex> guard(lock);
+      error = true;
+    }
+    if (::close(fd)){
+      ERROR_MSG("Could not close %s: %s", fileName.c_str(), strerror(errno));
+    }
+    fd = -1;
+  }
+
+  void recordWriter::writerThread(void * arg){
+    ((recordWriter *)arg)->writeJobs();
+  }
+
+  /// Writes all submitted jobs in order, until stopped and out of jobs.
+  void recordWriter::writeJobs(){
+    while (true){
+      recordJob job;
+      {
+        tthread::lock_guard<tthread::mutex> guard(lock);
+        while (!jobs.size() && !stopping){cond.wait(lock);}
+        if (!jobs.size()){return;}
+        job = jobs.front();
+        jobs.pop_front();
+      }
+      for (std::deque<DTSC::Track>::iterator it = job.tracks.begin(); it != job.tracks.end(); ++it){
+        header.tracks[it->trackID] = *it;
+      }
+      bool success = (job.data ? writeData(job) : writeHeader(false));
+      for (std::deque<recordPacket>::iterator it = job.packets.begin(); it != job.packets.end() && success; ++it){
+        header.update(it->time, it->offset, it->tid, it->dataLen, it->bpos, it->keyframe, it->sendLen);
+      }
+      tthread::lock_guard<tthread::mutex> guard(lock);
+      if (!success){error = true;}
+      if (job.data){freeBuffers.push_back(job.data);}
+      cond.notify_all();
+    }
+  }
+
+  /// Writes a buffer to the file. Writeback of the buffer starts right away; once the previous buffer is on disk,
+  /// that is dropped from the page cache, so that many recordings at once do not fill memory with dirty pages.
+  bool recordWriter::writeData(const recordJob & job){
+    if (failed()){return false;}
+    size_t done = 0;
+    while (done < job.len){
+      ssize_t ret = pwrite(fd, job.data + done, job.len - done, job.pos + done);
+      if (ret < 0){
+        if (errno == EINTR){continue;}
+        ERROR_MSG("Could not write to %s: %s", fileName.c_str(), strerror(errno));
+        return false;
+      }
+      done += ret;
+    }
+#ifdef SYNC_FILE_RANGE_WRITE
+    sync_file_range(fd, job.pos, job.len, SYNC_FILE_RANGE_WRITE);
+    if (lastLen){
+      sync_file_range(fd, lastPos, lastLen, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+      posix_fadvise(fd, lastPos, lastLen, POSIX_FADV_DONTNEED);
+    }
+    lastPos = job.pos;
+    lastLen = job.len;
+#endif
+    return true;
+  }
+
+  /// Brings the header file up to date with the data written so far.
+  /// While the tracks stay the same, only the changes since the previous call are appended to it, as a "meta_delta"
+  /// command that readers apply on top of the header. Otherwise, or if compact is set, the header file is replaced
+  /// by a single full header, through a temporary file so readers never see a partially written header.
+  bool recordWriter::writeHeader(bool compact){
+    if (failed()){return false;}
+    std::string headerName = fileName + ".dtsh";
+    if (!compact && !headerSync.needsFull(header)){
+      std::string delta = headerSync.delta(header);
+      int headerFd = ::open(headerName.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+      //A single write, so readers see either nothing or a command that is complete so far
+      bool success = (headerFd != -1 && ::write(headerFd, delta.data(), delta.size()) == (ssize_t)delta.size());
+      if (headerFd != -1){success &= !::close(headerFd);}
+      if (!success){
+        ERROR_MSG("Could not append to %s: %s", headerName.c_str(), strerror(errno));
+        return false;
+      }
+      headerSync.sent(header);
+      return true;
+    }
+    std::string packed = header.toJSON().toNetPacked();
+    std::string tmpName = headerName + ".tmp";
+    FILE * headerFile = fopen(tmpName.c_str(), "w");
+    if (!headerFile){
+      ERROR_MSG("Could not create %s: %s", tmpName.c_str(), strerror(errno));
+      return false;
+    }
+    bool success = (fwrite(packed.data(), packed.size(), 1, headerFile) == 1);
+    success &= !fclose(headerFile);
+    if (!success || rename(tmpName.c_str(), headerName.c_str())){
+      ERROR_MSG("Could not write %s: %s", headerName.c_str(), strerror(errno));
+      unlink(tmpName.c_str());
+      return false;
+    }
+    headerSync.sent(header);
+    return true;
+  }
+
+  OutDTSCFile::OutDTSCFile(Socket::Connection & conn) : Output(conn){
+    streamName = config->getString("streamname");
+    parseData = true;
+    wantRequest = false;
+    realTime = 0;
+    nextHeader = 0;
+    initialize();
+    std::string tracks = config->getString("tracks");
+    if (tracks.size()){
+      selectedTracks.clear();
+      unsigned int currTrack = 0;
+      //loop over tracks, add any found track IDs to selectedTracks
+      for (unsigned int i = 0; i < tracks.size(); ++i){
+        if (tracks[i] >= '0' && tracks[i] <= '9'){
+          currTrack = currTrack*10 + (tracks[i] - '0');
+        }else{
+          if (currTrack > 0){
+            selectedTracks.insert(currTrack);
+          }
+          currTrack = 0;
+        }
+      }
+      if (currTrack > 0){
+        selectedTracks.insert(currTrack);
+      }
+    }
+  }
+
+  OutDTSCFile::~OutDTSCFile(){
+    onFinish();
+  }
+
+  void OutDTSCFile::init(Util::Config * cfg){
+    Output::init(cfg);
+    capa["name"] = "DTSCFile";
+    capa["desc"] = "Records a stream to a DTSC file, with a header file that is kept up to date while recording.";
+    capa["deps"] = "";
+    capa["required"]["streamname"]["name"] = "Stream";
+    capa["required"]["streamname"]["help"] = "What streamname to record.";
+    capa["required"]["streamname"]["type"] = "str";
+    capa["required"]["streamname"]["option"] = "--stream";
+    capa["required"]["streamname"]["short"] = "s";
+    capa["required"]["target"]["name"] = "Target";
+    capa["required"]["target"]["help"] = "The DTSC file to record to; .dtsc is appended if missing.";
+    capa["required"]["target"]["type"] = "str";
+    capa["required"]["target"]["option"] = "--target";
+    capa["required"]["target"]["short"] = "O";
+    capa["optional"]["tracks"]["name"] = "Tracks";
+    capa["optional"]["tracks"]["help"] = "The track IDs of the stream that this connector will record separated by spaces";
+    capa["optional"]["tracks"]["type"] = "str";
+    capa["optional"]["tracks"]["option"] = "--tracks";
+    capa["optional"]["tracks"]["short"] = "t";
+    capa["optional"]["tracks"]["default"] = "";
+    capa["codecs"][0u][0u].append("*");
+    cfg->addBasicConnectorOptions(capa);
+    config = cfg;
+  }
+
+  /// Opens the recording, with a header holding the selected tracks without any data.
+  void OutDTSCFile::sendHeader(){
+    std::string target = config->getString("target");
+    if (target.size() < 5 || target.substr(target.size() - 5) != ".dtsc"){
+      target += ".dtsc";
+    }
+    DTSC::Meta recMeta = myMeta;
+    recMeta.reset();
+    for (std::map<unsigned int, DTSC::Track>::iterator it = recMeta.tracks.begin(); it != recMeta.tracks.end();){
+      if (selectedTracks.count(it->first)){
+        recTracks.insert(it->first);
+        ++it;
+      }else{
+        recMeta.tracks.erase(it++);
+      }
+    }
+    if (!writer.open(target, recMeta)){
+      onFail();
+      return;
+    }
+    INFO_MSG("Recording %lu tracks of %s to %s", (unsigned long)recMeta.tracks.size(), streamName.c_str(), target.c_str());
+    sentHeader = true;
+  }
+
+  /// Appends the packet to the recording, and has the writer thread update the header file every RECORD_HEADER_INTERVAL milliseconds.
+  void OutDTSCFile::sendNext(){
+    if (!writer.isOpen()){return;}
+    if (writer.failed()){
+      FAIL_MSG("Stopping the recording of %s, as writing to disk failed", streamName.c_str());
+      onFinish();
+      onFail();
+      return;
+    }
+    unsigned long tid = thisPacket.getTrackId();
+    if (!recTracks.count(tid) && myMeta.tracks.count(tid)){
+      DTSC::Track newTrack = myMeta.tracks[tid];
+      newTrack.reset();
+      writer.addTrack(newTrack);
+      recTracks.insert(tid);
+    }
+    writer.writePacket(thisPacket);
+    if (Util::bootMS() >= nextHeader){
+      writer.flush(true);
+      nextHeader = Util::bootMS() + RECORD_HEADER_INTERVAL;
+    }
+  }
+
+  /// Writes out the rest of the recording and its final header.
+  bool OutDTSCFile::onFinish(){
+    if (writer.isOpen()){
+      uint64_t bytes = writer.written();
+      writer.close();
+      INFO_MSG("Recorded %llu bytes of %s", (unsigned long long)bytes, streamName.c_str());
+    }
+    return false;
+  }
+}
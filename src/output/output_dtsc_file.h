@@ -0,0 +1,94 @@
+#include "output.h"
+#include <deque>
+#include <mist/tinythread.h>
+
+/// Recording to DTSC files: the size of the buffers handed to the writer thread, the most buffers in use at once,
+/// and the milliseconds between updates of the header file to describe the data written so far.
+#define RECORD_BUFFER_SIZE 4 * 1024 * 1024
+#define RECORD_BUFFER_COUNT 8
+#define RECORD_HEADER_INTERVAL 5000
+
+namespace Mist {
+  /// What the header needs to know about a recorded packet.
+  struct recordPacket{
+    uint64_t time;
+    int64_t offset;
+    unsigned long tid;
+    uint32_t dataLen;///< Size of the media data.
+    uint32_t sendLen;///< Size of the whole DTSC packet.
+    uint64_t bpos;///< Byte position of the packet in the recording.
+    bool keyframe;
+  };
+
+  /// Data or a header, written by the writer thread in the order they were submitted.
+  struct recordJob{
+    char * data;///< A buffer of RECORD_BUFFER_SIZE bytes, or 0 to write the header file.
+    size_t len;
+    uint64_t pos;
+    std::deque<DTSC::Track> tracks;///< Tracks to add to the header before the packets.
+    std::deque<recordPacket> packets;///< Packets that end in this buffer, to add to the header once it is written.
+  };
+
+  /// Writes to a file from a thread of its own, so that slow disks never block the caller.
+  /// Data is gathered in aligned buffers of RECORD_BUFFER_SIZE bytes; the caller only waits once all buffers are in use.
+  /// The header describing the written data is kept, serialized and stored by the writer thread as well,
+  /// so the caller only hands over a few bytes per packet. While recording, the header file grows by what changed;
+  /// it is written out in full once more when the recording is closed.
+  class recordWriter{
+    public:
+      recordWriter();
+      ~recordWriter();
+      bool open(const std::string & file, const DTSC::Meta & meta);
+      void addTrack(const DTSC::Track & track);
+      void writePacket(const DTSC::Packet & pack);
+      void flush(bool header);
+      void close();
+      bool isOpen(){return thread != 0;}
+      bool failed();
+      uint64_t written(){return pos + currentLen;}
+    private:
+      static void writerThread(void * arg);
+      void writeJobs();
+      bool writeData(const recordJob & job);
+      bool writeHeader(bool compact);
+      void write(const char * data, size_t len);
+      void submit(recordJob & job);
+      char * getBuffer();
+      std::string fileName;
+      int fd;
+      DTSC::Meta header;///< Header of the data written so far; only used by the writer thread once it runs.
+      DTSC::MetaSync headerSync;///< What of header is in the header file already.
+      uint64_t lastPos;///< Byte position of the last buffer written by the writer thread.
+      size_t lastLen;
+      tthread::thread * thread;
+      tthread::mutex lock;///< Guards everything below.
+      tthread::condition_variable cond;
+      std::deque<recordJob> jobs;
+      std::deque<char *> freeBuffers;
+      unsigned int bufferCount;///< Buffers allocated so far.
+      bool stopping;
+      bool error;
+      char * current;///< Buffer being filled by the caller, not shared with the writer thread.
+      size_t currentLen;
+      std::deque<DTSC::Track> currentTracks;///< Tracks added since current was last handed over.
+      std::deque<recordPacket> currentPackets;///< Packets ending in current.
+      uint64_t pos;///< Byte position in the file where current starts.
+  };
+
+  class OutDTSCFile : public Output{
+    public:
+      OutDTSCFile(Socket::Connection & conn);
+      ~OutDTSCFile();
+      static void init(Util::Config * cfg);
+      static bool listenMode(){return false;}
+      void sendHeader();
+      void sendNext();
+      bool onFinish();
+    private:
+      recordWriter writer;
+      std::set<unsigned long> recTracks;///< Tracks the recording has so far.
+      uint64_t nextHeader;///< Time at which to update the header file, in milliseconds since boot.
+  };
+}
+
+typedef Mist::OutDTSCFile mistOut;
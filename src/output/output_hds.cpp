@@ -56,7 +56,7 @@ namespace Mist {
     int i = 0;
     int j = 0;
     if (myMeta.tracks[tid].fragments.size()){
-      std::deque<DTSC::Fragment>::iterator fragIt = myMeta.tracks[tid].fragments.begin();
+      DTSC::PackedList<DTSC::Fragment>::iterator fragIt = myMeta.tracks[tid].fragments.begin();
       unsigned int firstTime = myMeta.tracks[tid].getKey(fragIt->getNumber()).getTime();
       while (fragIt != myMeta.tracks[tid].fragments.end()){
         if (myMeta.vod || fragIt->getDuration() > 0){
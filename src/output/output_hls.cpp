@@ -61,7 +61,7 @@ namespace Mist {
     std::deque<std::string> lines;
     std::deque<uint16_t> durs;
     uint32_t total_dur = 0;
-    for (std::deque<DTSC::Fragment>::iterator it = myMeta.tracks[tid].fragments.begin(); it != myMeta.tracks[tid].fragments.end(); it++) {
+    for (DTSC::PackedList<DTSC::Fragment>::iterator it = myMeta.tracks[tid].fragments.begin(); it != myMeta.tracks[tid].fragments.end(); it++) {
       long long int starttime = myMeta.tracks[tid].getKey(it->getNumber()).getTime();
       long long duration = it->getDuration();
       if (duration <= 0){
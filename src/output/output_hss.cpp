@@ -116,7 +116,7 @@ namespace Mist {
         seekable = canSeekms(seekTime);
         if (seekable == 0){
           // iff the fragment in question is available, check if the next is available too
-          for (std::deque<DTSC::Key>::iterator it = myMeta.tracks[tid].keys.begin(); it != myMeta.tracks[tid].keys.end(); it++){
+          for (DTSC::PackedList<DTSC::Key>::iterator it = myMeta.tracks[tid].keys.begin(); it != myMeta.tracks[tid].keys.end(); it++){
             if (it->getTime() >= seekTime){
               if ((it + 1) == myMeta.tracks[tid].keys.end()){
                 seekable = 1;
@@ -148,7 +148,7 @@ namespace Mist {
     }
     seek(seekTime);
     ///\todo Rewrite to fragments
-    for (std::deque<DTSC::Key>::iterator it2 = myMeta.tracks[tid].keys.begin(); it2 != myMeta.tracks[tid].keys.end(); it2++) {
+    for (DTSC::PackedList<DTSC::Key>::iterator it2 = myMeta.tracks[tid].keys.begin(); it2 != myMeta.tracks[tid].keys.end(); it2++) {
       if (it2->getTime() > seekTime){
         playUntil = it2->getTime();
         break;
@@ -162,10 +162,10 @@ namespace Mist {
 
     int partOffset = 0;
     DTSC::Key keyObj;
-    for (std::deque<DTSC::Key>::iterator it = myMeta.tracks[tid].keys.begin(); it != myMeta.tracks[tid].keys.end(); it++) {
+    for (DTSC::PackedList<DTSC::Key>::iterator it = myMeta.tracks[tid].keys.begin(); it != myMeta.tracks[tid].keys.end(); it++) {
       if (it->getTime() >= seekTime) {
         keyObj = (*it);
-        std::deque<DTSC::Key>::iterator nextIt = it;
+        DTSC::PackedList<DTSC::Key>::iterator nextIt = it;
         nextIt++;
         if (nextIt == myMeta.tracks[tid].keys.end()) {
           if (myMeta.live) {
@@ -375,7 +375,7 @@ namespace Mist {
         index++;
       }
       if ((*audioIters.begin())->second.keys.size()) {
-        for (std::deque<DTSC::Key>::iterator it = (*audioIters.begin())->second.keys.begin(); it != (((*audioIters.begin())->second.keys.end()) - 1); it++) {
+        for (DTSC::PackedList<DTSC::Key>::iterator it = (*audioIters.begin())->second.keys.begin(); it != (((*audioIters.begin())->second.keys.end()) - 1); it++) {
           Result << "<c ";
           if (it == (*audioIters.begin())->second.keys.begin()) {
             Result << "t=\"" << it->getTime() * 10000 << "\" ";
@@ -421,7 +421,7 @@ namespace Mist {
         index++;
       }
       if ((*videoIters.begin())->second.keys.size()) {
-        for (std::deque<DTSC::Key>::iterator it = (*videoIters.begin())->second.keys.begin(); it != (((*videoIters.begin())->second.keys.end()) - 1); it++) {
+        for (DTSC::PackedList<DTSC::Key>::iterator it = (*videoIters.begin())->second.keys.begin(); it != (((*videoIters.begin())->second.keys.end()) - 1); it++) {
           Result << "<c ";
           if (it == (*videoIters.begin())->second.keys.begin()) {
             Result << "t=\"" << it->getTime() * 10000 << "\" ";
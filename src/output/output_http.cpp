@@ -291,35 +291,16 @@ namespace Mist {
     //taken from CheckProtocols (controller_connectors.cpp)
     char * argarr[20];
     for (int i=0; i<20; i++){argarr[i] = 0;}
-    int id = -1;
     
-    IPC::semaphore configLock(SEM_CONF, O_CREAT | O_RDWR, ACCESSPERMS, 1);
-    configLock.wait();
-    IPC::sharedPage serverCfg(SHM_CONF, DEFAULT_CONF_PAGE_SIZE);
-    DTSC::Scan prots = DTSC::Scan(serverCfg.mapped, serverCfg.len).getMember("config").getMember("protocols");
-    unsigned int prots_ctr = prots.getSize();
-    
-    for (unsigned int i=0; i < prots_ctr; ++i){
-      if (prots.getIndice(i).getMember("connector").asString() == connector) {
-        id =  i;
-        break;    //pick the first protocol in the list that matches the connector 
-      }
-    }
-    if (id == -1) {
-      connector = connector + ".exe";
-      for (unsigned int i=0; i < prots_ctr; ++i){
-        if (prots.getIndice(i).getMember("connector").asString() == connector) {
-          id =  i;
-          break;    //pick the first protocol in the list that matches the connector 
-        }
-      }
-      if (id == -1) {
-        connector = connector.substr(0, connector.size() - 4);
+    //pick the first protocol in the list that matches the connector
+    JSON::Value p = Util::getConfigEntry(CONF_INDEX_PROTOCOL, connector);
+    if (p.isNull()){
+      p = Util::getConfigEntry(CONF_INDEX_PROTOCOL, connector + ".exe");
+      if (p.isNull()){
         DEBUG_MSG(DLVL_ERROR, "No connector found for: %s", connector.c_str());
-        configLock.post();
-        configLock.close();
         return;
       }
+      connector = connector + ".exe";
     }
     
     DEBUG_MSG(DLVL_HIGH, "Connector found: %s", connector.c_str());
@@ -331,10 +312,7 @@ namespace Mist {
     
     int argnum = 0;
     argarr[argnum++] = (char*)tmparg.c_str();
-    JSON::Value p = prots.getIndice(id).asJSON();
-    JSON::Value pipedCapa = DTSC::Scan(serverCfg.mapped, serverCfg.len).getMember("capabilities").getMember("connectors").getMember(connector).asJSON();
-    configLock.post();
-    configLock.close();
+    JSON::Value pipedCapa = Util::getConfigEntry(CONF_INDEX_CONNECTOR, connector);
     argarr[argnum++] = (char*)"--ip";
     argarr[argnum++] = (char*)(temphost.c_str());
     argarr[argnum++] = (char*)"--stream";
@@ -28,7 +28,7 @@ namespace Mist {
   uint64_t OutProgressiveMP4::estimateFileSize() {
     uint64_t retVal = 0;
     for (std::set<unsigned long>::iterator it = selectedTracks.begin(); it != selectedTracks.end(); it++) {
-      for (std::deque<unsigned long>::iterator keyIt = myMeta.tracks[*it].keySizes.begin(); keyIt != myMeta.tracks[*it].keySizes.end(); keyIt++) {
+      for (DTSC::PackedList<DTSC::KeySize>::iterator keyIt = myMeta.tracks[*it].keySizes.begin(); keyIt != myMeta.tracks[*it].keySizes.end(); keyIt++) {
         retVal += *keyIt;
       }
     }
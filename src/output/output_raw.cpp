@@ -24,6 +24,7 @@ namespace Mist {
       }
     }
     parseData = true;
+    lastMetaSync = 0;
     seek(config->getInteger("seek"));
   }
   
@@ -58,11 +59,17 @@ namespace Mist {
   }
   
   void OutRaw::sendNext(){
+    //Live metadata keeps growing: send what changed, at most once per second
+    if (myMeta.live && Util::bootSecs() != lastMetaSync){
+      metaSync.send(myMeta, myConn);
+      lastMetaSync = Util::bootSecs();
+    }
     myConn.SendNow(thisPacket.getData(), thisPacket.getDataLen());
   }
 
   void OutRaw::sendHeader(){
-    myMeta.send(myConn);
+    metaSync.send(myMeta, myConn);
+    lastMetaSync = Util::bootSecs();
     sentHeader = true;
   }
 
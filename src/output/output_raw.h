@@ -9,6 +9,9 @@ namespace Mist {
       static void init(Util::Config * cfg);
       void sendNext();
       void sendHeader();
+    private:
+      DTSC::MetaSync metaSync;///< Sends the header in full once, and as deltas after that.
+      uint64_t lastMetaSync;///< Util::bootSecs() of the last header (update) sent.
   };
 }
 
@@ -7,9 +7,14 @@
 #include <sys/stat.h>
 #include <cstring>
 #include <cstdlib>
+#include <sstream>
 
 namespace Mist {
   OutRTMP::OutRTMP(Socket::Connection & conn) : Output(conn) {
+    if (!listenMode()){
+      initPush();
+      return;
+    }
     setBlocking(true);
     while (!conn.Received().available(1537) && conn.connected() && config->is_active) {
       conn.spool();
@@ -36,6 +41,31 @@ namespace Mist {
   }
 
   bool OutRTMP::onFinish(){
+    if (pushTargets.size()){
+      //Give the targets a few seconds to receive what is still queued for them; those still setting up have no media to wait for
+      uint64_t deadline = Util::bootMS() + 5000;
+      bool pending = true;
+      while (pending && Util::bootMS() < deadline){
+        servicePush();
+        pending = false;
+        for (std::deque<pushTarget>::iterator it = pushTargets.begin(); it != pushTargets.end(); ++it){
+          if (it->state >= PUSH_SYNC && (it->direct.size() || it->msgOffset || (it->state == PUSH_LIVE && it->msgNum < pushQueueStart + pushQueue.size()))){
+            pending = true;
+          }
+        }
+        if (pending){Util::sleep(10);}
+      }
+      for (std::deque<pushTarget>::iterator it = pushTargets.begin(); it != pushTargets.end(); ++it){
+        if (it->conn){
+          INFO_MSG("Stopped pushing %s to %s", streamName.c_str(), it->name.c_str());
+          it->conn.close();
+        }
+        it->state = PUSH_IDLE;
+      }
+      pushTargets.clear();
+      myConn.close();
+      return false;
+    }
     MEDIUM_MSG("Finishing stream %s, %s", streamName.c_str(), myConn?"while connected":"already disconnected");
     if (myConn){
       myConn.SendNow(RTMPStream::SendUSR(1, 1)); //send UCM StreamEOF (1), stream 1
@@ -147,6 +177,8 @@ namespace Mist {
     capa["methods"][0u]["priority"] = 7ll;
     capa["methods"][0u]["player_url"] = "/flashplayer.swf";
     cfg->addConnectorOptions(1935, capa);
+    cfg->addOption("streamname", JSON::fromString("{\"arg\":\"string\",\"short\":\"s\",\"long\":\"stream\",\"help\":\"The name of the stream to push out.\"}"));
+    cfg->addOption("target", JSON::fromString("{\"arg\":\"string\",\"short\":\"T\",\"long\":\"target\",\"help\":\"RTMP URL to push the stream to instead of listening, as rtmp://host[:port]/app/streamkey. May be given multiple times.\"}"));
     config = cfg;
   }
   
@@ -173,6 +205,19 @@ namespace Mist {
     }
 
 
+    //When pushing, nothing is chunked until a target receives the media
+    if (pushTargets.size()){
+      syncTargets();
+      bool anyLive = false;
+      for (std::deque<pushTarget>::iterator it = pushTargets.begin(); it != pushTargets.end(); ++it){
+        if (it->state == PUSH_LIVE){anyLive = true;}
+      }
+      if (!anyLive){
+        servicePush();
+        return;
+      }
+    }
+
     char rtmpheader[] ={0, //byte 0 = cs_id | ch_type
                          0, 0, 0, //bytes 1-3 = timestamp
                          0, 0, 0, //bytes 4-6 = length
@@ -346,54 +391,76 @@ namespace Mist {
       rtmpheader[3] = timestamp & 0xff;
     }
     
-    //send the header
-    myConn.setBlocking(true);
-    myConn.SendNow(rtmpheader, header_len);
+    //the header
+    chunked.assign(rtmpheader, header_len);
     //set the header's first byte to the "continue" type chunk, for later use
     rtmpheader[0] = 0xC4;
 
-    //sent actual data - never send more than chunk_snd_max at a time
+    //actual data - never more than chunk_snd_max at a time
     //interleave blocks of max chunk_snd_max bytes with 0xC4 bytes to indicate continue
     unsigned int len_sent = 0;
     unsigned int steps = 0;
     while (len_sent < data_len){
       unsigned int to_send = std::min(data_len - len_sent, RTMPStream::chunk_snd_max);
       if (!len_sent){
-        myConn.SendNow(dataheader, dheader_len);
+        chunked.append(dataheader, dheader_len);
         to_send -= dheader_len;
         len_sent += dheader_len;
       }
-      myConn.SendNow(tmpData+len_sent-dheader_len, to_send);
+      chunked.append(tmpData+len_sent-dheader_len, to_send);
       len_sent += to_send;
       if (len_sent < data_len){
-        myConn.SendNow(rtmpheader, 1);
+        chunked.append(rtmpheader, 1);
         ++steps;
       }
     }
-    myConn.setBlocking(false);
     //update the sent data counter
     RTMPStream::snd_cnt += header_len + data_len + steps;
+    if (!pushTargets.size()){
+      myConn.SendNow(chunked);
+      return;
+    }
+    //The message is chunked once; all live targets are sent these same bytes from the queue
+    pushQueue.push_back(std::string());
+    pushQueue.back().swap(chunked);
+    pushBytes += pushQueue.back().size();
+    servicePush();
   }
 
-  void OutRTMP::sendHeader(){
+  /// Appends the chunked metadata and codec init data of the selected tracks to out.
+  void OutRTMP::appendInitData(std::string & out){
     FLV::Tag tag;
     tag.DTSCMetaInit(myMeta, selectedTracks);
     if (tag.len){
-      myConn.SendNow(RTMPStream::SendMedia(tag));
+      out += RTMPStream::SendMedia(tag);
     }
 
     for (std::set<long unsigned int>::iterator it = selectedTracks.begin(); it != selectedTracks.end(); it++){
       if (myMeta.tracks[*it].type == "video"){
         if (tag.DTSCVideoInit(myMeta.tracks[*it])){
-          myConn.SendNow(RTMPStream::SendMedia(tag));
+          out += RTMPStream::SendMedia(tag);
         }
       }
       if (myMeta.tracks[*it].type == "audio"){
         if (tag.DTSCAudioInit(myMeta.tracks[*it])){
-          myConn.SendNow(RTMPStream::SendMedia(tag));
+          out += RTMPStream::SendMedia(tag);
         }
       }
     }
+  }
+
+  void OutRTMP::sendHeader(){
+    if (pushTargets.size()){
+      //Targets get the init data when they join the shared media, so make them join again
+      for (std::deque<pushTarget>::iterator it = pushTargets.begin(); it != pushTargets.end(); ++it){
+        if (it->state == PUSH_LIVE){it->state = PUSH_SYNC;}
+      }
+      sentHeader = true;
+      return;
+    }
+    std::string init;
+    appendInitData(init);
+    myConn.SendNow(init);
     sentHeader = true;
   }
 
@@ -988,5 +1055,304 @@ namespace Mist {
       }
     }
   }
-}
 
+  /// Keeps the push targets going while no media is being sent, as this is called every iteration of the main loop.
+  void OutRTMP::stats(bool force){
+    if (pushTargets.size()){servicePush();}
+    Output::stats(force);
+  }
+
+  /// Sets up publishing the stream to every --target URL, instead of serving a client on the connection.
+  /// The URL path is split at its last slash into the application name and the stream key.
+  void OutRTMP::initPush(){
+    jsonForEach(config->getOption("target", true), it){
+      pushTarget tgt;
+      tgt.url = HTTP::URL(it->asString());
+      size_t slash = tgt.url.path.rfind('/');
+      if (tgt.url.protocol != "rtmp" || !tgt.url.host.size() || slash == std::string::npos){
+        FAIL_MSG("Ignoring target %s: not of the form rtmp://host[:port]/app/streamkey", it->asString().c_str());
+        continue;
+      }
+      tgt.app = tgt.url.path.substr(0, slash);
+      tgt.streamKey = tgt.url.path.substr(slash + 1);
+      if (tgt.url.args.size()){tgt.streamKey += "?" + tgt.url.args;}
+      std::stringstream name;
+      name << "rtmp://" << tgt.url.host << ":" << tgt.url.getPort() << "/" << tgt.app;
+      tgt.name = name.str();
+      tgt.state = PUSH_IDLE;
+      tgt.msgNum = 0;
+      tgt.msgOffset = 0;
+      tgt.bytePos = 0;
+      tgt.recChunkMax = 128;
+      tgt.streamId = 0;
+      tgt.retryAt = 0;
+      tgt.setupStart = 0;
+      tgt.failures = 0;
+      //resolved here, before any media is being sent; connectTarget only resolves again if this failed
+      if (!Socket::resolveTCP(tgt.url.host, tgt.url.getPort(), tgt.addrs)){
+        WARN_MSG("Could not resolve %s yet", tgt.name.c_str());
+      }
+      pushTargets.push_back(tgt);
+    }
+    if (!pushTargets.size()){
+      FAIL_MSG("No valid targets to push to");
+      myConn.close();
+      return;
+    }
+    pushQueueStart = 0;
+    pushBytes = 0;
+    //the first packet sent sets the offset, so the targets get timestamps starting at zero
+    rtmpOffset = 0xFFFFFFFFFFFFFFFFull;
+    RTMPStream::chunk_snd_max = 65536; //64KiB
+    streamName = config->getString("streamname");
+    parseData = true;
+    wantRequest = false;
+    initialize();
+  }
+
+  /// Swaps the chunk stream state of the target with the one in RTMPStream, which the chunk functions work on.
+  /// Called in pairs, around packing or parsing chunks for this target only.
+  void OutRTMP::swapChunkState(pushTarget & tgt){
+    RTMPStream::lastsend.swap(tgt.lastSend);
+    RTMPStream::lastrecv.swap(tgt.lastRecv);
+    std::swap(RTMPStream::chunk_rec_max, tgt.recChunkMax);
+  }
+
+  /// Queues an AMF0 command for the target. Must be called with the chunk state of the target swapped in.
+  void OutRTMP::sendTargetCommand(pushTarget & tgt, AMF::Object & amfCmd, int streamId){
+    HIGH_MSG("Sending to %s: %s", tgt.name.c_str(), amfCmd.Print().c_str());
+    tgt.direct += RTMPStream::SendChunk(3, 20, streamId, amfCmd.Pack());
+  }
+
+  /// Disconnects the target and schedules a reconnect, waiting twice as long after every failure in a row.
+  /// If no connection was made, the next attempt goes to the next address of the host.
+  void OutRTMP::dropTarget(pushTarget & tgt, const std::string & reason){
+    ++tgt.failures;
+    if (tgt.state < PUSH_HANDSHAKE && tgt.addrs.size()){
+      tgt.addrs.push_back(tgt.addrs.front());
+      tgt.addrs.pop_front();
+    }
+    uint64_t wait = std::min((uint64_t)PUSH_RETRY_MAX, (uint64_t)1000 << std::min(tgt.failures - 1, 5u));
+    WARN_MSG("Pushing %s to %s failed (%s); retrying in %llu ms", streamName.c_str(), tgt.name.c_str(), reason.c_str(), (unsigned long long)wait);
+    tgt.conn.close();
+    tgt.state = PUSH_IDLE;
+    tgt.direct.clear();
+    tgt.msgOffset = 0;
+    tgt.retryAt = Util::bootMS() + wait;
+  }
+
+  /// Starts connecting to the target without waiting for it, and queues C0 and C1 for the plain handshake without digest.
+  /// servicePush sends them once the connect has finished.
+  void OutRTMP::connectTarget(pushTarget & tgt){
+    MEDIUM_MSG("Connecting to %s", tgt.name.c_str());
+    if (!tgt.addrs.size() && !Socket::resolveTCP(tgt.url.host, tgt.url.getPort(), tgt.addrs)){
+      dropTarget(tgt, "could not resolve host");
+      return;
+    }
+    int s = Socket::connectStart(tgt.addrs.front());
+    if (s < 0){
+      dropTarget(tgt, "could not connect");
+      return;
+    }
+    tgt.conn = Socket::Connection(s);
+    tgt.setupStart = Util::bootMS();
+    tgt.lastSend.clear();
+    tgt.lastRecv.clear();
+    tgt.recChunkMax = 128;
+    tgt.streamId = 0;
+    tgt.msgOffset = 0;
+    tgt.direct.assign(1, (char)3);//C0: version 3
+    tgt.direct.append(8, (char)0);//C1: time zero, zero
+    for (unsigned int i = 8; i < 1536; ++i){
+      tgt.direct += FILLER_DATA[i % sizeof(FILLER_DATA)];
+    }
+    tgt.state = PUSH_CONNECTING;
+  }
+
+  /// Handles everything received from the target so far, moving it along from handshake to publishing.
+  void OutRTMP::parseTarget(pushTarget & tgt){
+    swapChunkState(tgt);
+    if (tgt.state == PUSH_HANDSHAKE && tgt.conn.Received().available(3073)){
+      //S0, S1 and S2; C2 echoes S1
+      std::string handshake = tgt.conn.Received().remove(3073);
+      tgt.direct.append(handshake.data() + 1, 1536);
+      tgt.direct += RTMPStream::SendCTL(1, RTMPStream::chunk_snd_max); //send chunk size max (msg 1)
+      AMF::Object amfCmd("container", AMF::AMF0_DDV_CONTAINER);
+      amfCmd.addContent(AMF::Object("", "connect"));
+      amfCmd.addContent(AMF::Object("", (double)1)); //transaction ID
+      amfCmd.addContent(AMF::Object("")); //command object
+      amfCmd.getContentP(2)->addContent(AMF::Object("app", tgt.app));
+      amfCmd.getContentP(2)->addContent(AMF::Object("type", "nonprivate"));
+      amfCmd.getContentP(2)->addContent(AMF::Object("flashVer", "FMLE/3.0 (compatible; MistServer)"));
+      amfCmd.getContentP(2)->addContent(AMF::Object("tcUrl", tgt.name));
+      sendTargetCommand(tgt, amfCmd, 0);
+      tgt.state = PUSH_CONNECT;
+    }
+    RTMPStream::Chunk next;
+    while (tgt.state > PUSH_HANDSHAKE && next.Parse(tgt.conn.Received())){
+      switch (next.msg_type_id){
+        case 1: //set chunk size
+          if (next.data.size() >= 4){RTMPStream::chunk_rec_max = ntohl(*(int *)next.data.c_str());}
+          break;
+        case 4: //user control message - answer pings, so the target does not time out
+          if (next.data.size() >= 6 && next.data[0] == 0 && next.data[1] == 6){
+            tgt.direct += RTMPStream::SendUSR(7, ntohl(*(int *)(next.data.c_str() + 2)));
+          }
+          break;
+        case 20:{//AMF0 command message
+          AMF::Object amfData = AMF::parse(next.data);
+          HIGH_MSG("Received from %s: %s", tgt.name.c_str(), amfData.Print().c_str());
+          std::string cmd = amfData.getContentP(0) ? amfData.getContentP(0)->StrValue() : "";
+          double txn = amfData.getContentP(1) ? amfData.getContentP(1)->NumValue() : 0;
+          //errors for releaseStream and FCPublish are not fatal, as not all servers know them
+          if (cmd == "_error" && txn != 2 && txn != 3){
+            dropTarget(tgt, "command refused");
+            break;
+          }
+          if (cmd == "_result" && txn == 1 && tgt.state == PUSH_CONNECT){
+            AMF::Object amfCmd("container", AMF::AMF0_DDV_CONTAINER);
+            amfCmd.addContent(AMF::Object("", "releaseStream"));
+            amfCmd.addContent(AMF::Object("", (double)2));
+            amfCmd.addContent(AMF::Object("", (double)0, AMF::AMF0_NULL));
+            amfCmd.addContent(AMF::Object("", tgt.streamKey));
+            sendTargetCommand(tgt, amfCmd, 0);
+            amfCmd = AMF::Object("container", AMF::AMF0_DDV_CONTAINER);
+            amfCmd.addContent(AMF::Object("", "FCPublish"));
+            amfCmd.addContent(AMF::Object("", (double)3));
+            amfCmd.addContent(AMF::Object("", (double)0, AMF::AMF0_NULL));
+            amfCmd.addContent(AMF::Object("", tgt.streamKey));
+            sendTargetCommand(tgt, amfCmd, 0);
+            amfCmd = AMF::Object("container", AMF::AMF0_DDV_CONTAINER);
+            amfCmd.addContent(AMF::Object("", "createStream"));
+            amfCmd.addContent(AMF::Object("", (double)4));
+            amfCmd.addContent(AMF::Object("", (double)0, AMF::AMF0_NULL));
+            sendTargetCommand(tgt, amfCmd, 0);
+            tgt.state = PUSH_CREATE;
+          }
+          if (cmd == "_result" && txn == 4 && tgt.state == PUSH_CREATE){
+            tgt.streamId = amfData.getContentP(3) ? amfData.getContentP(3)->NumValue() : 1;
+            //the shared media messages are chunked for stream 1, which is what a fresh connection gets
+            if (tgt.streamId != 1){
+              WARN_MSG("%s created stream %g instead of 1; it may not accept the media", tgt.name.c_str(), tgt.streamId);
+            }
+            AMF::Object amfCmd("container", AMF::AMF0_DDV_CONTAINER);
+            amfCmd.addContent(AMF::Object("", "publish"));
+            amfCmd.addContent(AMF::Object("", (double)5));
+            amfCmd.addContent(AMF::Object("", (double)0, AMF::AMF0_NULL));
+            amfCmd.addContent(AMF::Object("", tgt.streamKey));
+            amfCmd.addContent(AMF::Object("", "live"));
+            sendTargetCommand(tgt, amfCmd, tgt.streamId);
+            tgt.state = PUSH_PUBLISH;
+          }
+          if (cmd == "onStatus"){
+            AMF::Object * info = amfData.getContentP(3);
+            std::string level = (info && info->getContentP("level")) ? info->getContentP("level")->StrValue() : "";
+            std::string code = (info && info->getContentP("code")) ? info->getContentP("code")->StrValue() : "";
+            if (level == "error"){
+              dropTarget(tgt, code);
+              break;
+            }
+            if (code == "NetStream.Publish.Start" && tgt.state == PUSH_PUBLISH){
+              INFO_MSG("Publishing %s to %s", streamName.c_str(), tgt.name.c_str());
+              tgt.state = PUSH_SYNC;
+              tgt.failures = 0;
+            }
+          }
+          break;
+        }
+        default: //acknowledgements, window sizes and bandwidth limits need no action
+          break;
+      }
+    }
+    swapChunkState(tgt);
+  }
+
+  /// Lets targets waiting in PUSH_SYNC join the shared media, if the current packet is a point to start from:
+  /// a keyframe of the main track, or any packet of it if that is not a video track.
+  /// Joining targets first get init data of their own, after which the next shared message has a full header,
+  /// so that it decodes the same for targets that just joined as for those that were already receiving.
+  void OutRTMP::syncTargets(){
+    unsigned long mainTrack = getMainSelectedTrack();
+    if (thisPacket.getTrackId() != mainTrack){return;}
+    if (myMeta.tracks[mainTrack].type == "video" && !thisPacket.getFlag("keyframe")){return;}
+    bool joined = false;
+    for (std::deque<pushTarget>::iterator it = pushTargets.begin(); it != pushTargets.end(); ++it){
+      pushTarget & tgt = *it;
+      if (tgt.state != PUSH_SYNC || tgt.msgOffset){continue;}
+      swapChunkState(tgt);
+      //what the target last got on the media chunk stream is not known here, so start with a full header
+      RTMPStream::lastsend.erase(4);
+      appendInitData(tgt.direct);
+      swapChunkState(tgt);
+      tgt.state = PUSH_LIVE;
+      tgt.msgNum = pushQueueStart + pushQueue.size();
+      tgt.bytePos = pushBytes;
+      joined = true;
+    }
+    if (joined){RTMPStream::lastsend.erase(4);}
+  }
+
+  /// Connects, reads from and writes to all targets without blocking, then drops the shared messages all live targets have.
+  /// Data for a single target goes out in between shared messages, and a target that falls more than PUSH_BACKLOG_MAX
+  /// bytes behind is disconnected, so one slow target never holds back the others.
+  void OutRTMP::servicePush(){
+    uint64_t now = Util::bootMS();
+    uint64_t queueEnd = pushQueueStart + pushQueue.size();
+    uint64_t minMsg = queueEnd;
+    for (std::deque<pushTarget>::iterator it = pushTargets.begin(); it != pushTargets.end(); ++it){
+      pushTarget & tgt = *it;
+      if (tgt.state == PUSH_IDLE){
+        if (now < tgt.retryAt){continue;}
+        connectTarget(tgt);
+        if (tgt.state == PUSH_IDLE){continue;}
+      }
+      if (tgt.state < PUSH_SYNC && now > tgt.setupStart + PUSH_SETUP_TIMEOUT){
+        dropTarget(tgt, tgt.state == PUSH_CONNECTING ? "connect timed out" : "no answer");
+        continue;
+      }
+      if (tgt.state == PUSH_CONNECTING){
+        int err = Socket::connectResult(tgt.conn.getSocket());
+        if (err == EINPROGRESS){continue;}
+        if (err){
+          dropTarget(tgt, strerror(err));
+          continue;
+        }
+        tgt.state = PUSH_HANDSHAKE;
+      }
+      tgt.conn.spool();
+      parseTarget(tgt);
+      if (tgt.state == PUSH_IDLE){continue;}
+      while (tgt.conn){
+        if (!tgt.msgOffset && tgt.direct.size()){
+          unsigned int sent = tgt.conn.SendSome(tgt.direct.data(), tgt.direct.size());
+          if (!sent){break;}
+          tgt.direct.erase(0, sent);
+          continue;
+        }
+        //a target that stopped being live still finishes the message it was in the middle of
+        if ((tgt.state != PUSH_LIVE && !tgt.msgOffset) || tgt.msgNum >= queueEnd){break;}
+        std::string & msg = pushQueue[tgt.msgNum - pushQueueStart];
+        unsigned int sent = tgt.conn.SendSome(msg.data() + tgt.msgOffset, msg.size() - tgt.msgOffset);
+        if (!sent){break;}
+        tgt.msgOffset += sent;
+        tgt.bytePos += sent;
+        if (tgt.msgOffset < msg.size()){continue;}
+        ++tgt.msgNum;
+        tgt.msgOffset = 0;
+      }
+      if (!tgt.conn){
+        dropTarget(tgt, "connection lost");
+        continue;
+      }
+      if (tgt.state == PUSH_LIVE && pushBytes - tgt.bytePos > PUSH_BACKLOG_MAX){
+        dropTarget(tgt, "too far behind");
+        continue;
+      }
+      if ((tgt.state == PUSH_LIVE || tgt.msgOffset) && tgt.msgNum < minMsg){minMsg = tgt.msgNum;}
+    }
+    while (pushQueueStart < minMsg){
+      pushQueue.pop_front();
+      ++pushQueueStart;
+    }
+  }
+}
@@ -2,18 +2,61 @@
 #include <mist/flv_tag.h>
 #include <mist/amf.h>
 #include <mist/rtmpchunks.h>
+#include <mist/http_parser.h>
+#include <deque>
 
+/// Pushing to RTMP targets: the most bytes of shared media a target may fall behind before it is disconnected,
+/// the longest wait in milliseconds before reconnecting a target that failed,
+/// and how long in milliseconds a target may take from connecting to publishing.
+#define PUSH_BACKLOG_MAX 16 * 1024 * 1024
+#define PUSH_RETRY_MAX 30000
+#define PUSH_SETUP_TIMEOUT 10000
 
 namespace Mist {
+  /// States of a push target, in the order they are passed through.
+  enum pushState{
+    PUSH_IDLE,///< Not connected; reconnects at retryAt.
+    PUSH_CONNECTING,///< TCP connect started, waiting for the socket to become writable.
+    PUSH_HANDSHAKE,///< C0 and C1 sent, waiting for S0, S1 and S2.
+    PUSH_CONNECT,///< connect sent, waiting for its result.
+    PUSH_CREATE,///< createStream sent, waiting for the stream ID.
+    PUSH_PUBLISH,///< publish sent, waiting for NetStream.Publish.Start.
+    PUSH_SYNC,///< Publishing, waiting for a keyframe to join the shared media.
+    PUSH_LIVE///< Receiving the shared media.
+  };
+
+  /// An outgoing RTMP connection that the stream is published to.
+  struct pushTarget{
+    HTTP::URL url;
+    std::deque<std::string> addrs;///< Resolved addresses of the host, the one to connect to next in front.
+    std::string app;
+    std::string streamKey;
+    std::string name;///< rtmp://host:port/app: the tcUrl, also used in messages as it leaves out the stream key.
+    Socket::Connection conn;
+    pushState state;
+    std::string direct;///< Data for this target only, sent in between shared media messages.
+    uint64_t msgNum;///< Number of the next shared media message to send.
+    size_t msgOffset;///< Bytes already sent of that message.
+    uint64_t bytePos;///< Bytes of shared media sent so far, counted like pushBytes.
+    std::map<unsigned int, RTMPStream::Chunk> lastSend;///< Chunk stream state, swapped into RTMPStream while in use.
+    std::map<unsigned int, RTMPStream::Chunk> lastRecv;
+    unsigned int recChunkMax;
+    double streamId;
+    uint64_t retryAt;
+    uint64_t setupStart;///< When the current connection attempt was started.
+    unsigned int failures;
+  };
 
  class OutRTMP : public Output {
     public:
       OutRTMP(Socket::Connection & conn);
       static void init(Util::Config * cfg);
+      static bool listenMode(){return !config->getString("target").size();}
       void onRequest();
       void sendNext();
       void sendHeader();
       bool onFinish();
+      void stats(bool force = false);
     protected:
       uint64_t rtmpOffset;
       void parseVars(std::string data);
@@ -21,6 +64,21 @@ namespace Mist {
       void parseChunk(Socket::Buffer & inputBuffer);
       void parseAMFCommand(AMF::Object & amfData, int messageType, int streamId);
       void sendCommand(AMF::Object & amfReply, int messageType, int streamId);
+      void appendInitData(std::string & out);
+      //Pushing to RTMP targets
+      std::deque<pushTarget> pushTargets;
+      std::deque<std::string> pushQueue;///< Chunked media messages not yet sent to all live targets.
+      uint64_t pushQueueStart;///< Number of the first message in pushQueue.
+      uint64_t pushBytes;///< Bytes of shared media chunked so far.
+      std::string chunked;
+      void initPush();
+      void servicePush();
+      void syncTargets();
+      void connectTarget(pushTarget & tgt);
+      void parseTarget(pushTarget & tgt);
+      void sendTargetCommand(pushTarget & tgt, AMF::Object & amfCmd, int streamId);
+      void dropTarget(pushTarget & tgt, const std::string & reason);
+      void swapChunkState(pushTarget & tgt);
   };
 }
 
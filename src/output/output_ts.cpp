@@ -1,6 +1,13 @@
 #include "output_ts.h"
 #include <mist/http_parser.h>
 #include <mist/defines.h>
+#include <mist/timing.h>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <netinet/in.h>
+#include <time.h>
+#include <unistd.h>
 
 namespace Mist {
   OutTS::OutTS(Socket::Connection & conn) : TSOutput(conn){
@@ -28,14 +35,24 @@ namespace Mist {
         selectedTracks.insert(currTrack);
       }
     }
+    udpUnscheduled = 0;
+    udpBuildingLen = 0;
+    tsBytes = 0;
+    clockSet = false;
+    if (!listenMode()){initUDP();}
   }
   
-  OutTS::~OutTS() {}
+  OutTS::~OutTS(){
+    while (udpTargets.size()){
+      delete udpTargets.front();
+      udpTargets.pop_front();
+    }
+  }
   
   void OutTS::init(Util::Config * cfg){
     Output::init(cfg);
     capa["name"] = "TS";
-    capa["desc"] = "Enables the raw MPEG Transport Stream protocol over TCP.";
+    capa["desc"] = "Enables the raw MPEG Transport Stream protocol over TCP, or over UDP (multicast) to the given targets.";
     capa["deps"] = "";
     capa["required"]["streamname"]["name"] = "Stream";
     capa["required"]["streamname"]["help"] = "What streamname to serve. For multiple streams, add this protocol multiple times using different ports.";
@@ -52,10 +69,175 @@ namespace Mist {
     capa["codecs"][0u][1u].append("AAC");
     capa["codecs"][0u][1u].append("MP3");
     cfg->addConnectorOptions(8888, capa);
+    cfg->addOption("target", JSON::fromString("{\"arg\":\"string\",\"short\":\"T\",\"long\":\"target\",\"help\":\"UDP address to send the stream to instead of listening, as udp://host:port, optionally with ?ttl=N for multicast. May be given multiple times.\"}"));
     config = cfg;
   }
 
+  /// Opens a UDP socket for every --target, and leaves the pacing to the PCR instead of the real time playback speed.
+  void OutTS::initUDP(){
+    jsonForEach(config->getOption("target", true), it){
+      HTTP::URL target(it->asString());
+      if (target.protocol != "udp" || !target.host.size() || !target.port.size()){
+        FAIL_MSG("Ignoring target %s: not of the form udp://host:port", it->asString().c_str());
+        continue;
+      }
+      Socket::UDPConnection * udp = new Socket::UDPConnection();
+      udp->SetDestination(target.host, target.getPort());
+      if (target.args.size()){
+        std::map<std::string, std::string> args;
+        HTTP::parseVars(target.args, args);
+        if (args.count("ttl")){
+          //only the option matching the address family of the socket is accepted
+          int ttl = atoi(args["ttl"].c_str());
+          setsockopt(udp->getSock(), IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+          setsockopt(udp->getSock(), IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl));
+        }
+      }
+      INFO_MSG("Sending %s to %s:%s", streamName.c_str(), target.host.c_str(), target.port.c_str());
+      udpTargets.push_back(udp);
+    }
+    if (!udpTargets.size()){
+      FAIL_MSG("No valid targets to send to");
+      myConn.close();
+      return;
+    }
+    realTime = 0;
+    jitterStart = Util::bootMS();
+    jitterCount = 0;
+    jitterSum = 0;
+    jitterMax = 0;
+  }
+
+  /// Returns the monotonic clock time in microseconds.
+  static uint64_t monotonicMicros(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return ((uint64_t)t.tv_sec) * 1000000 + t.tv_nsec / 1000;
+  }
+
+  /// Sleeps until the monotonic clock reaches micros, or until interrupted.
+  static void waitUntil(uint64_t micros){
+#ifdef TIMER_ABSTIME
+    struct timespec t;
+    t.tv_sec = micros / 1000000;
+    t.tv_nsec = (micros % 1000000) * 1000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, 0);
+#else
+    uint64_t now = monotonicMicros();
+    if (micros > now){usleep(micros - now);}
+#endif
+  }
+
+  void OutTS::sendNext(){
+    //Only video tracks carry a PCR; without one, the times of the main track pace the output instead
+    if (udpTargets.size() && thisPacket.getTrackId() == getMainSelectedTrack() && myMeta.tracks[thisPacket.getTrackId()].type != "video"){
+      addClock(tsBytes, thisPacket.getTime() * 1000);
+    }
+    TSOutput::sendNext();
+  }
+
   void OutTS::sendTS(const char * tsData, unsigned int len){
-    myConn.SendNow(tsData, len);
+    if (!udpTargets.size()){
+      myConn.SendNow(tsData, len);
+      return;
+    }
+    //adaptation field with a PCR
+    if ((tsData[3] & 0x20) && tsData[4] && (tsData[5] & 0x10)){
+      TS::Packet pcrPack;
+      pcrPack.FromPointer(tsData);
+      addClock(tsBytes, pcrPack.getPCR() / 27);
+    }
+    if (!udpBuildingLen){udpBuilding.bytePos = tsBytes;}
+    memcpy(udpBuilding.data + udpBuildingLen, tsData, len);
+    udpBuildingLen += len;
+    tsBytes += len;
+    if (udpBuildingLen == sizeof(udpBuilding.data)){
+      udpBuilding.sendAt = 0;
+      udpQueue.push_back(udpBuilding);
+      ++udpUnscheduled;
+      udpBuildingLen = 0;
+    }
+  }
+
+  /// Schedules the datagrams since the previous clock point evenly over the stream time since then,
+  /// so that the rate follows the PCR, and sends everything that is scheduled.
+  void OutTS::addClock(uint64_t bytePos, uint64_t micros){
+    uint64_t now = monotonicMicros();
+    if (!clockSet || micros < clockTime || micros > clockTime + UDP_CLOCK_GAP_MAX * 1000){
+      if (clockSet){
+        INFO_MSG("Clock of %s jumped from %llu to %llu ms; restarting pacing", streamName.c_str(), (unsigned long long)(clockTime / 1000), (unsigned long long)(micros / 1000));
+      }
+      clockOffset = (int64_t)now - (int64_t)micros;
+      for (std::deque<tsDatagram>::iterator it = udpQueue.end() - udpUnscheduled; it != udpQueue.end(); ++it){
+        it->sendAt = now;
+      }
+    }else{
+      //when behind by more than the largest clock step, catch up rather than sending everything as fast as possible
+      if (clockOffset + (int64_t)micros + UDP_CLOCK_GAP_MAX * 1000 < (int64_t)now){
+        WARN_MSG("Sending %s fell behind by %lld ms; restarting pacing", streamName.c_str(), (long long)(((int64_t)now - clockOffset - (int64_t)micros) / 1000));
+        clockOffset = (int64_t)now - (int64_t)micros;
+      }
+      uint64_t bytes = bytePos - clockPos;
+      for (std::deque<tsDatagram>::iterator it = udpQueue.end() - udpUnscheduled; it != udpQueue.end(); ++it){
+        uint64_t at = clockTime;
+        if (bytes && it->bytePos > clockPos){at += (micros - clockTime) * (it->bytePos - clockPos) / bytes;}
+        it->sendAt = clockOffset + at;
+      }
+    }
+    udpUnscheduled = 0;
+    clockSet = true;
+    clockPos = bytePos;
+    clockTime = micros;
+    sendDue();
+  }
+
+  /// Sends all scheduled datagrams, each batch when its first datagram is due.
+  /// A batch holds the datagrams due within UDP_PACE_SLACK microseconds, sent with one call per target.
+  void OutTS::sendDue(){
+    while (udpQueue.size() > udpUnscheduled && config->is_active){
+      waitUntil(udpQueue.front().sendAt);
+      uint64_t now = monotonicMicros();
+      const char * batch[UDP_BATCH_MAX];
+      size_t count = 0;
+      while (count < UDP_BATCH_MAX && count < udpQueue.size() - udpUnscheduled && udpQueue[count].sendAt <= now + UDP_PACE_SLACK){
+        int64_t late = (int64_t)now - (int64_t)udpQueue[count].sendAt;
+        jitterSum += (late < 0 ? -late : late);
+        if (late > jitterMax){jitterMax = late;}
+        batch[count] = udpQueue[count].data;
+        ++count;
+      }
+      if (!count){continue;}//woken up early
+      for (std::deque<Socket::UDPConnection *>::iterator it = udpTargets.begin(); it != udpTargets.end(); ++it){
+        (*it)->SendBatch(batch, sizeof(udpBuilding.data), count);
+      }
+      udpQueue.erase(udpQueue.begin(), udpQueue.begin() + count);
+      jitterCount += count;
+    }
+    if (Util::bootMS() >= jitterStart + UDP_JITTER_INTERVAL){
+      if (jitterCount){
+        INFO_MSG("Sent %llu datagrams of %s to %lu targets; send time off by %llu us on average, at most %lld us late", (unsigned long long)jitterCount, streamName.c_str(), (unsigned long)udpTargets.size(), (unsigned long long)(jitterSum / jitterCount), (long long)jitterMax);
+      }
+      jitterStart = Util::bootMS();
+      jitterCount = 0;
+      jitterSum = 0;
+      jitterMax = 0;
+    }
+  }
+
+  /// Sends what is left, the last datagram possibly holding fewer than UDP_TS_PACKETS packets.
+  bool OutTS::onFinish(){
+    if (!udpTargets.size()){return TSOutput::onFinish();}
+    if (udpUnscheduled){
+      addClock(tsBytes, clockTime);
+    }
+    sendDue();
+    if (udpBuildingLen){
+      for (std::deque<Socket::UDPConnection *>::iterator it = udpTargets.begin(); it != udpTargets.end(); ++it){
+        (*it)->SendNow(udpBuilding.data, udpBuildingLen);
+      }
+      udpBuildingLen = 0;
+    }
+    myConn.close();
+    return false;
   }
 }
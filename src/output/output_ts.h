@@ -1,12 +1,50 @@
 #include "output_ts_base.h"
+#include <deque>
+
+/// Sending TS over UDP: the TS packets in every datagram, the most datagrams handed to the kernel at once,
+/// how many microseconds early a datagram may go out along with a batch, and the milliseconds between jitter reports.
+#define UDP_TS_PACKETS 7
+#define UDP_BATCH_MAX 32
+#define UDP_PACE_SLACK 1000
+#define UDP_JITTER_INTERVAL 60000
+/// Clock steps backwards or larger than this many milliseconds restart the pacing instead of being followed.
+#define UDP_CLOCK_GAP_MAX 2000
 
 namespace Mist {
+  /// A datagram of UDP_TS_PACKETS TS packets, with the time it is due.
+  struct tsDatagram{
+    char data[188 * UDP_TS_PACKETS];
+    uint64_t bytePos;///< Position of the first byte in the TS output.
+    uint64_t sendAt;///< Monotonic clock time in microseconds, 0 until the next clock point is known.
+  };
+
   class OutTS : public TSOutput{
     public:
       OutTS(Socket::Connection & conn);
       ~OutTS();
       static void init(Util::Config * cfg);
-      void sendTS(const char * tsData, unsigned int len=188);       
+      static bool listenMode(){return !config->getString("target").size();}
+      void sendNext();
+      void sendTS(const char * tsData, unsigned int len=188);
+      bool onFinish();
+    private:
+      void initUDP();
+      void addClock(uint64_t bytePos, uint64_t micros);
+      void sendDue();
+      std::deque<Socket::UDPConnection *> udpTargets;
+      std::deque<tsDatagram> udpQueue;///< Complete datagrams, of which the last udpUnscheduled are not scheduled yet.
+      size_t udpUnscheduled;
+      tsDatagram udpBuilding;///< Datagram being filled.
+      size_t udpBuildingLen;
+      uint64_t tsBytes;///< Bytes of TS output so far.
+      bool clockSet;
+      uint64_t clockPos;///< Byte position of the last clock point.
+      uint64_t clockTime;///< Stream time of the last clock point, in microseconds.
+      int64_t clockOffset;///< Monotonic clock time minus stream time, in microseconds.
+      uint64_t jitterStart;
+      uint64_t jitterCount;
+      uint64_t jitterSum;
+      int64_t jitterMax;
   };
 }
 
@@ -0,0 +1,139 @@
+/// \file util_nal.cpp
+/// Benchmark for Annex B start code scanning and conversion.
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <mist/config.h>
+#include <mist/defines.h>
+#include <mist/nal.h>
+#include <mist/timing.h>
+#include <string>
+
+/// Fills data with about size bytes of Annex B data: NAL units of random size and contents, with emulation prevention
+/// so that the only start codes are the ones between units. Returns the amount of units.
+static unsigned long generate(std::string & data, unsigned long size){
+  unsigned long units = 0;
+  srand(1);
+  while (data.size() < size){
+    data.append((units % 8) ? "\000\000\001" : "\000\000\000\001", (units % 8) ? 3 : 4);
+    unsigned long unitSize = 100 + rand() % 200000;
+    data += (char)(0x01 + rand() % 0x7F);
+    unsigned int zeros = 0;
+    for (unsigned long i = 1; i < unitSize; ++i){
+      char c = (rand() % 4) ? (char)(rand() % 256) : 0;
+      if (zeros >= 2 && (unsigned char)c <= 3){
+        data += (char)0x03;
+        zeros = 0;
+      }
+      data += c;
+      zeros = c ? 0 : zeros + 1;
+    }
+    if (zeros){data += (char)0x80;}
+    ++units;
+  }
+  return units;
+}
+
+/// Counts the start codes in data, the way NAL units are split by the TS input.
+static unsigned long countUnits(nalu::annexBScanner scanner, const std::string & data){
+  const char * end = data.data() + data.size();
+  unsigned long count = 0;
+  const char * nal = scanner(data.data(), data.size());
+  while (nal){
+    ++count;
+    nal += 3;
+    nal = scanner(nal, end - nal);
+  }
+  return count;
+}
+
+static void report(const std::string & name, unsigned long long bytes, unsigned long long micros, unsigned long long baseMicros){
+  std::cout << std::setw(22) << std::left << name << std::right << std::fixed << std::setprecision(2);
+  std::cout << std::setw(8) << (double)bytes / (micros ? micros : 1) / 1000.0 << " GB/s";
+  if (baseMicros){std::cout << std::setw(8) << (double)baseMicros / (micros ? micros : 1) << "x";}
+  std::cout << std::endl;
+}
+
+int main(int argc, char **argv){
+  Util::Config conf(argv[0]);
+  JSON::Value opt;
+  opt["long"] = "size";
+  opt["short"] = "s";
+  opt["arg"] = "num";
+  opt["default"] = 64ll;
+  opt["help"] = "Megabytes of test data to generate (default 64)";
+  conf.addOption("size", opt);
+  opt.null();
+  opt["long"] = "rounds";
+  opt["short"] = "r";
+  opt["arg"] = "num";
+  opt["default"] = 10ll;
+  opt["help"] = "Times to process the test data per benchmark (default 10)";
+  conf.addOption("rounds", opt);
+  conf.parseArgs(argc, argv);
+
+  unsigned long rounds = conf.getInteger("rounds");
+  if (!rounds){rounds = 1;}
+  std::string data;
+  unsigned long units = generate(data, conf.getInteger("size") * 1024 * 1024);
+  std::cout << "Test data: " << data.size() << " bytes, " << units << " NAL units" << std::endl;
+  unsigned long long bytes = (unsigned long long)data.size() * rounds;
+
+  //Start code scanning; the scalar scanner is the original implementation
+  const char * names[] = {"scalar", "sse2", "avx2"};
+  unsigned long long baseMicros = 0;
+  for (unsigned int i = 0; i < 3; ++i){
+    nalu::annexBScanner scanner = nalu::getAnnexBScanner(names[i]);
+    if (!scanner){
+      std::cout << std::setw(22) << std::left << (std::string("scan ") + names[i]) << "not supported by this CPU" << std::endl;
+      continue;
+    }
+    unsigned long long micros = Util::getMicros();
+    for (unsigned long r = 0; r < rounds; ++r){
+      unsigned long found = countUnits(scanner, data);
+      if (found != units){
+        FAIL_MSG("The %s scanner found %lu NAL units instead of %lu", names[i], found, units);
+        return 1;
+      }
+    }
+    micros = Util::getMicros(micros);
+    if (!baseMicros){baseMicros = micros;}
+    report(std::string("scan ") + names[i], bytes, micros, baseMicros);
+  }
+
+  //Conversion to size prefixed NAL units, into a separate buffer and in place
+  std::string converted;
+  char * result = (char *)malloc(data.size() + data.size() / 3);
+  unsigned long resultSize = 0;
+  unsigned long long micros = Util::getMicros();
+  for (unsigned long r = 0; r < rounds; ++r){
+    resultSize = nalu::fromAnnexB(data.data(), data.size(), result);
+  }
+  micros = Util::getMicros(micros);
+  report("fromAnnexB (copy)", bytes, micros, 0);
+  micros = Util::getMicros();
+  for (unsigned long r = 0; r < rounds; ++r){
+    converted = data;
+    nalu::fromAnnexB(converted);
+  }
+  micros = Util::getMicros(micros);
+  report("fromAnnexB (in place)", bytes, micros, 0);
+  if (converted.size() != resultSize || memcmp(converted.data(), result, resultSize)){
+    FAIL_MSG("In place conversion differs from the copying conversion");
+    free(result);
+    return 1;
+  }
+  free(result);
+
+  //Conversion back to Annex B, in place
+  micros = Util::getMicros();
+  for (unsigned long r = 0; r < rounds; ++r){
+    nalu::toAnnexB(&converted[0], converted.size());
+    nalu::fromAnnexB(converted);
+  }
+  micros = Util::getMicros(micros);
+  report("toAnnexB + fromAnnexB", (unsigned long long)converted.size() * rounds, micros, 0);
+  return 0;
+}
@@ -0,0 +1,194 @@
+/// \file util_reinterleave.cpp
+/// Rewrites a DTSC file so that the data of each track for one data page is stored contiguously.
+/// DTSC files are interleaved by arrival order, while a VoD input buffers a page of one track at a time;
+/// after rewriting, buffering a page is a single sequential read instead of one that skips over all other tracks.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <mist/bitfields.h>
+#include <mist/config.h>
+#include <mist/defines.h>
+#include <mist/dtsc.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include "../io.h"
+
+/// A data packet in the source file.
+struct packetPos{
+  uint64_t bpos;
+  uint32_t size;
+};
+
+/// The packets of one track for one data page, written to the output as one block.
+struct pageBlock{
+  bool operator < (const pageBlock & rhs) const{
+    return firstTime < rhs.firstTime || (firstTime == rhs.firstTime && trackId < rhs.trackId);
+  }
+  uint64_t firstTime;
+  unsigned long trackId;
+  unsigned long first;///< Index of the first packet of the block in the packets of its track.
+  unsigned long count;
+};
+
+/// Returns the size of the smallest padding packet.
+static uint64_t paddingOverhead(){
+  JSON::Value pad;
+  pad["cmd"] = "pad";
+  pad["data"] = "";
+  return 8 + pad.toPacked().size();
+}
+
+/// Writes a command packet of exactly len bytes to out, which readers skip. len must be at least paddingOverhead().
+static bool writePadding(FILE * out, uint64_t len){
+  JSON::Value pad;
+  pad["cmd"] = "pad";
+  pad["data"] = std::string(len - paddingOverhead(), '\000');
+  std::string packed = pad.toPacked();
+  char sSize[4];
+  Bit::htobl(sSize, packed.size());
+  return fwrite(DTSC::Magic_Command, 4, 1, out) == 1 && fwrite(sSize, 4, 1, out) == 1 && fwrite(packed.data(), packed.size(), 1, out) == 1;
+}
+
+int main(int argc, char **argv){
+  Util::Config conf(argv[0]);
+  JSON::Value opt;
+  opt["arg_num"] = 1ll;
+  opt["arg"] = "string";
+  opt["help"] = "DTSC file to read; its header is read from the file itself or from its .dtsh file";
+  conf.addOption("input", opt);
+  opt.null();
+  opt["arg_num"] = 2ll;
+  opt["arg"] = "string";
+  opt["help"] = "DTSC file to write, along with its .dtsh file";
+  conf.addOption("output", opt);
+  opt.null();
+  opt["long"] = "align";
+  opt["short"] = "a";
+  opt["arg"] = "num";
+  opt["default"] = 4096ll;
+  opt["help"] = "Byte alignment of the start of every page block, 0 or 1 for none (default 4096)";
+  conf.addOption("align", opt);
+  conf.parseArgs(argc, argv);
+
+  std::string inName = conf.getString("input");
+  std::string outName = conf.getString("output");
+  uint64_t align = conf.getInteger("align");
+  if (!inName.size() || !outName.size()){
+    FAIL_MSG("Usage: %s INPUT.dtsc OUTPUT.dtsc", argv[0]);
+    return 1;
+  }
+  if (inName == outName){
+    FAIL_MSG("Cannot rewrite %s in place; write to another file and move it over the original", inName.c_str());
+    return 1;
+  }
+
+  //Find all packets and rebuild the header from them, so that the key sizes and byte positions are known to match the file
+  DTSC::File inFile(inName);
+  if (!inFile || !inFile.getMeta().tracks.size()){
+    FAIL_MSG("Cannot read %s, or it has no header", inName.c_str());
+    return 1;
+  }
+  DTSC::Meta scanMeta = inFile.getMeta();
+  scanMeta.reset();
+  std::map<unsigned long, std::vector<packetPos> > packets;
+  inFile.parseNext();
+  while (inFile.getPacket()){
+    DTSC::Packet & pack = inFile.getPacket();
+    if ((pack.getVersion() == DTSC::DTSC_V1 || pack.getVersion() == DTSC::DTSC_V2) && scanMeta.tracks.count(pack.getTrackId())){
+      packetPos pos;
+      pos.bpos = inFile.getLastReadPos();
+      pos.size = pack.getDataLen();
+      packets[pack.getTrackId()].push_back(pos);
+      scanMeta.updatePosOverride(pack, pos.bpos);
+    }
+    inFile.parseNext();
+  }
+
+  //Split every track over data pages the same way the input does, one block per page
+  std::vector<pageBlock> blocks;
+  for (std::map<unsigned int, DTSC::Track>::iterator it = scanMeta.tracks.begin(); it != scanMeta.tracks.end(); ++it){
+    std::vector<packetPos> & trkPackets = packets[it->first];
+    if (it->second.parts.size() != trkPackets.size()){
+      FAIL_MSG("Track %u has %lu parts for %lu packets; cannot map packets to pages", it->first, (unsigned long)it->second.parts.size(), (unsigned long)trkPackets.size());
+      return 1;
+    }
+    std::map<unsigned long, Mist::DTSCPageData> pages;
+    if (!Mist::negotiationProxy::pagesFromKeys(it->second, pages)){
+      FAIL_MSG("Track %u is missing key sizes", it->first);
+      return 1;
+    }
+    unsigned long part = 0;
+    for (std::map<unsigned long, Mist::DTSCPageData>::iterator pIt = pages.begin(); pIt != pages.end(); ++pIt){
+      pageBlock block;
+      block.firstTime = pIt->second.firstTime;
+      block.trackId = it->first;
+      block.first = part;
+      block.count = pIt->second.partNum;
+      part += block.count;
+      blocks.push_back(block);
+    }
+  }
+  std::sort(blocks.begin(), blocks.end());
+
+  int inFd = open(inName.c_str(), O_RDONLY);
+  struct stat inStat;
+  if (inFd == -1 || fstat(inFd, &inStat)){
+    FAIL_MSG("Cannot open %s: %s", inName.c_str(), strerror(errno));
+    return 1;
+  }
+  const char * mapped = (const char *)mmap(0, inStat.st_size, PROT_READ, MAP_PRIVATE, inFd, 0);
+  close(inFd);
+  if (mapped == MAP_FAILED){
+    FAIL_MSG("Cannot map %s: %s", inName.c_str(), strerror(errno));
+    return 1;
+  }
+  FILE * outFile = fopen(outName.c_str(), "wb");
+  if (!outFile){
+    FAIL_MSG("Cannot create %s: %s", outName.c_str(), strerror(errno));
+    return 1;
+  }
+
+  //Write the blocks in order of time, padding to the alignment in between, and build the header for the new positions
+  DTSC::Meta newMeta = inFile.getMeta();
+  newMeta.reset();
+  uint64_t bpos = 0;
+  uint64_t padded = 0;
+  uint64_t minPad = paddingOverhead();
+  for (std::vector<pageBlock>::iterator it = blocks.begin(); it != blocks.end(); ++it){
+    if (bpos && align > 1 && bpos % align){
+      uint64_t padLen = align - bpos % align;
+      while (padLen < minPad){padLen += align;}
+      if (!writePadding(outFile, padLen)){
+        FAIL_MSG("Could not write to %s: %s", outName.c_str(), strerror(errno));
+        return 1;
+      }
+      bpos += padLen;
+      padded += padLen;
+    }
+    std::vector<packetPos> & trkPackets = packets[it->trackId];
+    for (unsigned long i = it->first; i < it->first + it->count && i < trkPackets.size(); ++i){
+      DTSC::Packet pack(mapped + trkPackets[i].bpos, trkPackets[i].size, true);
+      if (fwrite(mapped + trkPackets[i].bpos, trkPackets[i].size, 1, outFile) != 1){
+        FAIL_MSG("Could not write to %s: %s", outName.c_str(), strerror(errno));
+        return 1;
+      }
+      newMeta.updatePosOverride(pack, bpos);
+      bpos += trkPackets[i].size;
+    }
+  }
+  fclose(outFile);
+  munmap((void *)mapped, inStat.st_size);
+
+  std::ofstream headerFile((outName + ".dtsh").c_str());
+  headerFile << newMeta.toJSON().toNetPacked();
+  headerFile.close();
+  INFO_MSG("Wrote %lu page blocks of %lu tracks to %s: %llu bytes, of which %llu padding", (unsigned long)blocks.size(), (unsigned long)newMeta.tracks.size(), outName.c_str(), (unsigned long long)bpos, (unsigned long long)padded);
+  return 0;
+}